@@ -566,7 +566,7 @@ static AssemblyLine* parseInstruction(const char* text, uint64_t address,
   TypedAsmValue operand;
   const char* p = NULL;
   
-  if (opcode == PUSH_INSTRUCTION) {
+  if (instructionHasAddressOperand(opcode)) {
     p = parseAddress(text, start, &operand, parseError);
     if (*parseError) {
       free((void*)instructionName);
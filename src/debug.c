@@ -56,11 +56,14 @@ Debugger createDebugger(UnlambdaVM vm, uint32_t maxBreakpoints) {
   dbg->statusCode = 0;
   dbg->statusMsg = OK_MSG;
 
+  setVmBreakpointLists(vm, dbg->persistentBreakpoints,
+		       dbg->temporaryBreakpoints);
   return dbg;
 }
 
 void destroyDebugger(Debugger dbg) {
   clearDebuggerStatus(dbg);
+  setVmBreakpointLists(dbg->vm, NULL, NULL);
   destroyBreakpointList(dbg->temporaryBreakpoints);
   destroyBreakpointList(dbg->persistentBreakpoints);
   free((void*)dbg);
@@ -338,10 +341,10 @@ static int executeModifyAddressStackCmd(Debugger dbg, DebugCommand cmd) {
 
   uint64_t* top = (uint64_t*)(topOfStack(s) - 8);
   top[-cmd->args.modifyAddrStack.depth] = cmd->args.modifyAddrStack.address;
-  logAddressStack(getVmLogger(dbg->vm), s,
-		  vmmAddressForPtr(getVmMemory(dbg->vm),
-				   getVmmHeapStart(getVmMemory(dbg->vm))),
-		  getVmSymbolTable(dbg->vm));
+  LOG_ADDRESS_STACK(getVmLogger(dbg->vm), s,
+		    vmmAddressForPtr(getVmMemory(dbg->vm),
+				     getVmmHeapStart(getVmMemory(dbg->vm))),
+		    getVmSymbolTable(dbg->vm));
   return 0;
 }
 
@@ -357,10 +360,10 @@ static int executePushAddressStackCmd(Debugger dbg, DebugCommand cmd) {
     return -1;
   }
 
-  logAddressStack(getVmLogger(dbg->vm), s,
-		  vmmAddressForPtr(getVmMemory(dbg->vm),
-				   getVmmHeapStart(getVmMemory(dbg->vm))),
-		  getVmSymbolTable(dbg->vm));
+  LOG_ADDRESS_STACK(getVmLogger(dbg->vm), s,
+		    vmmAddressForPtr(getVmMemory(dbg->vm),
+				     getVmmHeapStart(getVmMemory(dbg->vm))),
+		    getVmSymbolTable(dbg->vm));
   return 0;
 }
 
@@ -375,10 +378,10 @@ static int executePopAddressStackCmd(Debugger dbg, DebugCommand cmd) {
     return -1;
   }
 
-  logAddressStack(getVmLogger(dbg->vm), s,
-		  vmmAddressForPtr(getVmMemory(dbg->vm),
-				   getVmmHeapStart(getVmMemory(dbg->vm))),
-		  getVmSymbolTable(dbg->vm));
+  LOG_ADDRESS_STACK(getVmLogger(dbg->vm), s,
+		    vmmAddressForPtr(getVmMemory(dbg->vm),
+				     getVmmHeapStart(getVmMemory(dbg->vm))),
+		    getVmSymbolTable(dbg->vm));
   return 0;
 }
 
@@ -426,10 +429,10 @@ static int executeModifyCallStackCmd(Debugger dbg, DebugCommand cmd) {
   top[1 - 2 * cmd->args.modifyCallStack.depth] =
     cmd->args.modifyCallStack.returnAddress;
 
-  logCallStack(getVmLogger(dbg->vm), s,
-	       vmmAddressForPtr(getVmMemory(dbg->vm),
-				getVmmHeapStart(getVmMemory(dbg->vm))),
-	       getVmSymbolTable(dbg->vm));
+  LOG_CALL_STACK(getVmLogger(dbg->vm), s,
+		 vmmAddressForPtr(getVmMemory(dbg->vm),
+				  getVmmHeapStart(getVmMemory(dbg->vm))),
+		 getVmSymbolTable(dbg->vm));
   return 0;
 }
 
@@ -447,10 +450,10 @@ static int executePushCallStackCmd(Debugger dbg, DebugCommand cmd) {
     return -1;
   }
 
-  logCallStack(getVmLogger(dbg->vm), s,
-	       vmmAddressForPtr(getVmMemory(dbg->vm),
-				getVmmHeapStart(getVmMemory(dbg->vm))),
-	       getVmSymbolTable(dbg->vm));
+  LOG_CALL_STACK(getVmLogger(dbg->vm), s,
+		 vmmAddressForPtr(getVmMemory(dbg->vm),
+				  getVmmHeapStart(getVmMemory(dbg->vm))),
+		 getVmSymbolTable(dbg->vm));
   return 0;
 }
 
@@ -476,10 +479,10 @@ static int executePopCallStackCmd(Debugger dbg, DebugCommand cmd) {
     return -1;
   }
 
-  logCallStack(getVmLogger(dbg->vm), s,
-	       vmmAddressForPtr(getVmMemory(dbg->vm),
-				getVmmHeapStart(getVmMemory(dbg->vm))),
-	       getVmSymbolTable(dbg->vm));
+  LOG_CALL_STACK(getVmLogger(dbg->vm), s,
+		 vmmAddressForPtr(getVmMemory(dbg->vm),
+				  getVmmHeapStart(getVmMemory(dbg->vm))),
+		 getVmSymbolTable(dbg->vm));
   return 0;
 }
 
@@ -507,9 +510,9 @@ static int executeAddBreakpointCmd(Debugger dbg, DebugCommand cmd) {
     return -1;
   }
 
-  logMessage(getVmLogger(dbg->vm), LogInstructions,
-	     "Add persistent breakpoint: %" PRIu64,
-	     cmd->args.addBreakpoint.address);
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	    "Add persistent breakpoint: %" PRIu64,
+	    cmd->args.addBreakpoint.address);
   return 0;
 }
 
@@ -522,9 +525,9 @@ static int executeRemoveBreakpointCmd(Debugger dbg, DebugCommand cmd) {
     setDebuggerStatus(dbg, DebuggerCommandExecutionError, msg);
     return -1;
   }
-  logMessage(getVmLogger(dbg->vm), LogInstructions,
-	     "Remove persistent breakpoint: %" PRIu64,
-	     cmd->args.removeBreakpoint.address);
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	    "Remove persistent breakpoint: %" PRIu64,
+	    cmd->args.removeBreakpoint.address);
   return 0;
 }
 
@@ -542,8 +545,8 @@ static int executeRunProgramCmd(Debugger dbg, DebugCommand cmd) {
   setDebuggerStatus(dbg, DebuggerResumeExecution, "Resume execution");
   dbg->breakOnNext = 0;
 
-  logMessage(getVmLogger(dbg->vm), LogInstructions,
-	     "Resume execution at %" PRIu64, cmd->args.run.address);
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	    "Resume execution at %" PRIu64, cmd->args.run.address);
   return 0;
 }
 
@@ -564,14 +567,14 @@ static int executeRunUntilReturnCmd(Debugger dbg, DebugCommand cmd) {
     setDebuggerStatus(dbg, DebuggerCommandExecutionError, msg);
     return -1;
   }
-  logMessage(getVmLogger(dbg->vm), LogInstructions,
-	     "Add temporary breakpoint at %" PRIu64, *pReturn);
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	    "Add temporary breakpoint at %" PRIu64, *pReturn);
   
   setDebuggerStatus(dbg, DebuggerResumeExecution, "Resume execution");
   dbg->breakOnNext = 0;
 
-  logMessage(getVmLogger(dbg->vm), LogInstructions,
-	     "Resume execution at %" PRIu64, getVmPC(dbg->vm));
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	    "Resume execution at %" PRIu64, getVmPC(dbg->vm));
   return 0;
 }
 
@@ -596,14 +599,14 @@ static int executeSingleStepOverCmd(Debugger dbg, DebugCommand cmd) {
   pc += instructionSize(*pcp);
   if (isValidVmmAddress(getVmMemory(dbg->vm), pc)) {
     addBreakpointToList(dbg->temporaryBreakpoints, pc);
-    logMessage(getVmLogger(dbg->vm), LogInstructions,
-	       "Add temporary breakpoint at %" PRIu64, pc);
+    LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	      "Add temporary breakpoint at %" PRIu64, pc);
   }
   
   setDebuggerStatus(dbg, DebuggerResumeExecution, "Resume execution");
   dbg->breakOnNext = 0;
-  logMessage(getVmLogger(dbg->vm), LogInstructions,
-	     "Resume execution at %" PRIu64, getVmPC(dbg->vm));
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions,
+	    "Resume execution at %" PRIu64, getVmPC(dbg->vm));
   return 0;
 }
 
@@ -616,7 +619,7 @@ static void performHeapDump(FILE* out, VmMemory memory) {
 
     fprintf(out, "%21" PRIu64 " %21" PRIu64 " %1s ",
 	    vmmAddressForPtr(memory, (uint8_t*)p), getVmmBlockSize(p),
-	    vmmBlockIsMarked(p) ? "X" : " ");
+	    vmmBlockIsMarked(memory, p) ? "X" : " ");
 
     if (blockType == VmmFreeBlockType) {
       fprintf(out, "FREE next=%" PRIu64 "\n", ((FreeBlock*)p)->next);
@@ -626,10 +629,14 @@ static void performHeapDump(FILE* out, VmMemory memory) {
 	fprintf(out, "STATE (as=%" PRIu32 ", cs=%" PRIu32 ")\n",
 		((VmStateBlock*)p)->addressStackSize,
 		((VmStateBlock*)p)->callStackSize);
+    } else if (blockType == VmmSlabBlockType) {
+      fprintf(out, "SLAB (cells=%" PRIu32 ", size=%" PRIu32 ")\n",
+	      ((VmmSlab*)p)->numCells, ((VmmSlab*)p)->cellSize);
     } else {
       fprintf(out, "**UNKNOWN (type=%" PRIu32 ")\n", (uint32_t)blockType);
     }
     
+    ++blockCount;
     p = nextHeapBlockInVmm(memory, p);
   }
 
@@ -640,8 +647,8 @@ static void performHeapDump(FILE* out, VmMemory memory) {
   
 static int executeHeapDumpCmd(Debugger dbg, DebugCommand cmd) {
   if (cmd->args.heapDump.filename) {
-    logMessage(getVmLogger(dbg->vm), LogInstructions, "Dump heap to %s",
-	       cmd->args.heapDump.filename);
+    LOG_TRACE(getVmLogger(dbg->vm), LogInstructions, "Dump heap to %s",
+	      cmd->args.heapDump.filename);
     FILE* out = fopen(cmd->args.heapDump.filename, "w");
     if (!out) {
       char msg[200];
@@ -654,7 +661,7 @@ static int executeHeapDumpCmd(Debugger dbg, DebugCommand cmd) {
     fclose(out);
     return 0;
   } else {
-    logMessage(getVmLogger(dbg->vm), LogInstructions, "Dump heap to stdout");
+    LOG_TRACE(getVmLogger(dbg->vm), LogInstructions, "Dump heap to stdout");
     performHeapDump(stdout, getVmMemory(dbg->vm));
     return 0;
   }
@@ -662,7 +669,7 @@ static int executeHeapDumpCmd(Debugger dbg, DebugCommand cmd) {
 
 static int executeQuitVmCmd(Debugger dbg, DebugCommand cmd) {
   setDebuggerStatus(dbg, DebuggerQuitVm, "Quit VM");
-  logMessage(getVmLogger(dbg->vm), LogInstructions, "Quit VM");
+  LOG_TRACE(getVmLogger(dbg->vm), LogInstructions, "Quit VM");
   return 0;
 }
 
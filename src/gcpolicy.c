@@ -0,0 +1,248 @@
+#include "gcpolicy.h"
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct GcPolicyImpl_ {
+  /** Fraction of the heap the live blocks should take up after a
+   *  collection
+   */
+  double targetLiveFraction;
+
+  /** Percentage of time the program may spend in collections before the
+   *  policy grows the heap
+   */
+  double maxGcTimePercent;
+
+  /** Percentage of time spent in collections, averaged over the last few
+   *  measurement windows
+   */
+  double gcTimePercent;
+
+  /** Time spent in collections and in total since the current window
+   *  started, in microseconds.  A window lasts for as many collections
+   *  as it takes to span GC_TIME_WINDOW_USEC, so a few collections in
+   *  quick succession, like the ones right after the program starts,
+   *  don't count as a program that does nothing but collect.
+   */
+  double windowGcUsec;
+  double windowUsec;
+
+  /** Number of windows measured */
+  uint64_t numWindows;
+
+  /** Bytes the program may allocate before the next collection */
+  uint64_t allocationBudget;
+
+  /** Live bytes the last collection found */
+  uint64_t bytesLive;
+
+  /** Number of collections recorded */
+  uint64_t numCollections;
+
+  /** Most bytes in use on the heap when a collection started, since the
+   *  free memory last went back to the system
+   */
+  uint64_t highWaterMark;
+
+  /** When the collection in progress started, or resumed if it was
+   *  suspended
+   */
+  struct timespec gcStart;
+
+  /** Time the collection in progress ran before it was last suspended,
+   *  in microseconds
+   */
+  double gcUsec;
+
+  /** When the last collection ended, or when the policy was created */
+  struct timespec lastGcEnd;
+} GcPolicyImpl;
+
+#ifndef __cplusplus
+const double DEFAULT_GC_TARGET_LIVE_FRACTION = 0.5;
+const double DEFAULT_GC_MAX_TIME_PERCENT = 10.0;
+const uint64_t MIN_GC_ALLOCATION_BUDGET = 256 * 1024;
+const uint64_t MIN_GC_RELEASE_SIZE = 4 * 1024 * 1024;
+#endif
+
+/** Shortest time the policy measures the share of time spent in
+ *  collections over, in microseconds
+ */
+static const double GC_TIME_WINDOW_USEC = 10000.0;
+
+static int isValidTargetLiveFraction(double fraction);
+static int isValidMaxGcTimePercent(double percent);
+static double usecBetween(const struct timespec* start,
+			  const struct timespec* end);
+
+GcPolicy createGcPolicy(double targetLiveFraction, double maxGcTimePercent) {
+  if (!isValidTargetLiveFraction(targetLiveFraction)
+        || !isValidMaxGcTimePercent(maxGcTimePercent)) {
+    return NULL;
+  }
+
+  GcPolicy policy = (GcPolicy)malloc(sizeof(GcPolicyImpl));
+  if (!policy) {
+    return NULL;
+  }
+
+  policy->targetLiveFraction = targetLiveFraction;
+  policy->maxGcTimePercent = maxGcTimePercent;
+  policy->gcTimePercent = 0.0;
+  policy->windowGcUsec = 0.0;
+  policy->windowUsec = 0.0;
+  policy->numWindows = 0;
+  policy->allocationBudget = UINT64_MAX;
+  policy->bytesLive = 0;
+  policy->numCollections = 0;
+  policy->highWaterMark = 0;
+  clock_gettime(CLOCK_MONOTONIC, &policy->lastGcEnd);
+  policy->gcStart = policy->lastGcEnd;
+  policy->gcUsec = 0.0;
+  return policy;
+}
+
+void destroyGcPolicy(GcPolicy policy) {
+  free((void*)policy);
+}
+
+double gcPolicyTargetLiveFraction(GcPolicy policy) {
+  return policy->targetLiveFraction;
+}
+
+int setGcPolicyTargetLiveFraction(GcPolicy policy, double fraction) {
+  if (!isValidTargetLiveFraction(fraction)) {
+    return -1;
+  }
+  policy->targetLiveFraction = fraction;
+  return 0;
+}
+
+double gcPolicyMaxGcTimePercent(GcPolicy policy) {
+  return policy->maxGcTimePercent;
+}
+
+int setGcPolicyMaxGcTimePercent(GcPolicy policy, double percent) {
+  if (!isValidMaxGcTimePercent(percent)) {
+    return -1;
+  }
+  policy->maxGcTimePercent = percent;
+  return 0;
+}
+
+uint64_t gcPolicyAllocationBudget(GcPolicy policy) {
+  return policy->allocationBudget;
+}
+
+uint64_t gcPolicyBytesLive(GcPolicy policy) {
+  return policy->bytesLive;
+}
+
+double gcPolicyGcTimePercent(GcPolicy policy) {
+  return policy->gcTimePercent;
+}
+
+uint64_t gcPolicyNumCollections(GcPolicy policy) {
+  return policy->numCollections;
+}
+
+int gcPolicyShouldCollect(GcPolicy policy, uint64_t bytesAllocated) {
+  return bytesAllocated >= policy->allocationBudget;
+}
+
+uint64_t gcPolicyHighWaterMark(GcPolicy policy) {
+  return policy->highWaterMark;
+}
+
+int gcPolicyShouldReleaseMemory(GcPolicy policy, uint64_t bytesInUse) {
+  return (bytesInUse <= policy->highWaterMark / 2)
+           && ((policy->highWaterMark - bytesInUse) >= MIN_GC_RELEASE_SIZE);
+}
+
+void resetGcPolicyHighWaterMark(GcPolicy policy, uint64_t bytesInUse) {
+  policy->highWaterMark = bytesInUse;
+}
+
+void startGcPolicyCollection(GcPolicy policy, uint64_t bytesInUse) {
+  if (bytesInUse > policy->highWaterMark) {
+    policy->highWaterMark = bytesInUse;
+  }
+  policy->gcUsec = 0.0;
+  clock_gettime(CLOCK_MONOTONIC, &policy->gcStart);
+}
+
+void suspendGcPolicyCollection(GcPolicy policy) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  policy->gcUsec += usecBetween(&policy->gcStart, &now);
+}
+
+void resumeGcPolicyCollection(GcPolicy policy) {
+  clock_gettime(CLOCK_MONOTONIC, &policy->gcStart);
+}
+
+uint64_t finishGcPolicyCollection(GcPolicy policy, uint64_t heapSize,
+				  uint64_t bytesLive) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  const double gcUsec = policy->gcUsec + usecBetween(&policy->gcStart, &now);
+  const double elapsedUsec = usecBetween(&policy->lastGcEnd, &now);
+  policy->lastGcEnd = now;
+  return recordGcPolicyCollection(policy, heapSize, bytesLive, gcUsec,
+				  elapsedUsec);
+}
+
+uint64_t recordGcPolicyCollection(GcPolicy policy, uint64_t heapSize,
+				  uint64_t bytesLive, double gcUsec,
+				  double elapsedUsec) {
+  policy->windowGcUsec += gcUsec;
+  policy->windowUsec += elapsedUsec;
+  if (policy->windowUsec >= GC_TIME_WINDOW_USEC) {
+    double percent = 100.0 * policy->windowGcUsec / policy->windowUsec;
+    if (percent > 100.0) {
+      percent = 100.0;
+    }
+
+    /** Average over the last few windows, so one slow collection doesn't
+     *  double the heap
+     */
+    policy->gcTimePercent = policy->numWindows
+                              ? (policy->gcTimePercent + percent) / 2.0
+                              : percent;
+    policy->windowGcUsec = 0.0;
+    policy->windowUsec = 0.0;
+    ++policy->numWindows;
+  }
+
+  policy->bytesLive = bytesLive;
+  ++policy->numCollections;
+
+  double targetSize = (double)bytesLive / policy->targetLiveFraction;
+  if ((policy->gcTimePercent > policy->maxGcTimePercent)
+        && (targetSize < 2.0 * (double)heapSize)) {
+    targetSize = 2.0 * (double)heapSize;
+  }
+
+  const uint64_t heapTarget = (targetSize >= (double)UINT64_MAX)
+                                ? UINT64_MAX : (uint64_t)targetSize;
+  policy->allocationBudget = heapTarget - bytesLive;
+  if (policy->allocationBudget < MIN_GC_ALLOCATION_BUDGET) {
+    policy->allocationBudget = MIN_GC_ALLOCATION_BUDGET;
+  }
+  return heapTarget;
+}
+
+static int isValidTargetLiveFraction(double fraction) {
+  return (fraction > 0.0) && (fraction < 1.0);
+}
+
+static int isValidMaxGcTimePercent(double percent) {
+  return (percent > 0.0) && (percent <= 100.0);
+}
+
+static double usecBetween(const struct timespec* start,
+			  const struct timespec* end) {
+  return (end->tv_sec - start->tv_sec) * 1e6
+           + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
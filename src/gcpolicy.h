@@ -0,0 +1,231 @@
+#ifndef __GCPOLICY_H__
+#define __GCPOLICY_H__
+
+#include <stdint.h>
+
+/** Decides when the VM runs a full collection and how big the heap
+ *  should be afterwards
+ *
+ *  The policy aims to keep the blocks that survive a collection at a
+ *  target fraction of the heap.  After each collection, it computes the
+ *  heap size that would put the live bytes at that fraction and turns
+ *  the difference into an allocation budget: the next collection runs
+ *  once the program has allocated that many bytes, even if the heap
+ *  still has room.  A heap smaller than the target size should grow to
+ *  it, so a program with a lot of live data doesn't collect after every
+ *  few allocations, while a heap that grew for data that has since died
+ *  gets collected before the program spreads new blocks over all of it.
+ *
+ *  The policy also tracks the share of time spent in collections.  When
+ *  it exceeds the cap, the policy asks for twice the heap, so the
+ *  collections come half as often.
+ *
+ *  Finally, the policy keeps a high-water mark of the heap in use when
+ *  collections start.  When a collection leaves less than half of it in
+ *  use, the free memory goes back to the system, so a program that
+ *  needed a big heap for a while doesn't hold on to it forever.
+ */
+typedef struct GcPolicyImpl_* GcPolicy;
+
+/** Default fraction of the heap the live blocks should take up after a
+ *  collection
+ */
+#ifdef __cplusplus
+const double DEFAULT_GC_TARGET_LIVE_FRACTION = 0.5;
+#else
+const double DEFAULT_GC_TARGET_LIVE_FRACTION;
+#endif
+
+/** Default cap on the percentage of time spent in collections */
+#ifdef __cplusplus
+const double DEFAULT_GC_MAX_TIME_PERCENT = 10.0;
+#else
+const double DEFAULT_GC_MAX_TIME_PERCENT;
+#endif
+
+/** Smallest allocation budget the policy gives the program, in bytes, so
+ *  a heap with almost nothing live isn't collected constantly
+ */
+#ifdef __cplusplus
+const uint64_t MIN_GC_ALLOCATION_BUDGET = 256 * 1024;
+#else
+const uint64_t MIN_GC_ALLOCATION_BUDGET;
+#endif
+
+/** Smallest drop below the high-water mark, in bytes, that makes the
+ *  policy return free memory to the system
+ */
+#ifdef __cplusplus
+const uint64_t MIN_GC_RELEASE_SIZE = 4 * 1024 * 1024;
+#else
+const uint64_t MIN_GC_RELEASE_SIZE;
+#endif
+
+/** Create a new GC policy
+ *
+ *  Until the first collection, the policy doesn't ask for collections
+ *  or growth, so the VM collects when an allocation fails.
+ *
+ *  Arguments:
+ *    targetLiveFraction   Fraction of the heap the live blocks should
+ *                           take up after a collection.  Must be greater
+ *                           than 0 and less than 1.
+ *    maxGcTimePercent     Percentage of time the program may spend in
+ *                           collections before the policy grows the heap
+ *                           to collect less often.  Must be greater than
+ *                           0 and at most 100.
+ *
+ *  Returns:
+ *    A new policy, or NULL if either argument is out of range or there
+ *    isn't enough memory for the policy.
+ */
+GcPolicy createGcPolicy(double targetLiveFraction, double maxGcTimePercent);
+
+/** Destroy a GC policy and free the memory allocated to it */
+void destroyGcPolicy(GcPolicy policy);
+
+/** Returns the fraction of the heap the live blocks should take up after
+ *  a collection
+ */
+double gcPolicyTargetLiveFraction(GcPolicy policy);
+
+/** Set the fraction of the heap the live blocks should take up after a
+ *  collection
+ *
+ *  Returns 0 if successful or -1 if "fraction" is not greater than 0 and
+ *  less than 1, in which case the policy doesn't change.  Takes effect
+ *  at the next collection.
+ */
+int setGcPolicyTargetLiveFraction(GcPolicy policy, double fraction);
+
+/** Returns the percentage of time the program may spend in collections
+ *  before the policy grows the heap
+ */
+double gcPolicyMaxGcTimePercent(GcPolicy policy);
+
+/** Set the percentage of time the program may spend in collections
+ *  before the policy grows the heap
+ *
+ *  Returns 0 if successful or -1 if "percent" is not greater than 0 and
+ *  at most 100, in which case the policy doesn't change.
+ */
+int setGcPolicyMaxGcTimePercent(GcPolicy policy, double percent);
+
+/** Returns the number of bytes the program may allocate after a
+ *  collection before the policy asks for the next one, or UINT64_MAX
+ *  before the first collection
+ */
+uint64_t gcPolicyAllocationBudget(GcPolicy policy);
+
+/** Returns the number of live bytes the last collection found */
+uint64_t gcPolicyBytesLive(GcPolicy policy);
+
+/** Returns the percentage of time spent in collections, averaged over
+ *  the last few collections
+ *
+ *  The policy measures it over windows of at least 10 milliseconds,
+ *  however many collections that takes, and averages the windows.  It is
+ *  0 until the first window ends.
+ */
+double gcPolicyGcTimePercent(GcPolicy policy);
+
+/** Returns the number of collections the policy has seen */
+uint64_t gcPolicyNumCollections(GcPolicy policy);
+
+/** Returns nonzero if the program has allocated enough since the last
+ *  collection to run the next one
+ *
+ *  Arguments:
+ *    policy           The policy
+ *    bytesAllocated   Number of bytes allocated since the last collection
+ *                       started, less what minor collections freed
+ */
+int gcPolicyShouldCollect(GcPolicy policy, uint64_t bytesAllocated);
+
+/** Returns the most bytes in use on the heap when a collection started
+ *  since the policy was created or the free memory last went back to the
+ *  system
+ */
+uint64_t gcPolicyHighWaterMark(GcPolicy policy);
+
+/** Returns nonzero if the heap in use after a collection has dropped far
+ *  enough below the high-water mark to return the free memory to the
+ *  system
+ *
+ *  That is, if at most half of the high-water mark and at least
+ *  MIN_GC_RELEASE_SIZE less than it is still in use.
+ *
+ *  Arguments:
+ *    policy       The policy
+ *    bytesInUse   Number of bytes in use on the heap, which is the size
+ *                   of the heap less the bytes free
+ */
+int gcPolicyShouldReleaseMemory(GcPolicy policy, uint64_t bytesInUse);
+
+/** Note that the free memory went back to the system, and start a new
+ *  high-water mark at "bytesInUse"
+ */
+void resetGcPolicyHighWaterMark(GcPolicy policy, uint64_t bytesInUse);
+
+/** Note the start of a full collection, for the time it takes and the
+ *  high-water mark
+ *
+ *  An incremental or concurrent collection starts once, when its cycle
+ *  starts, and is suspended while the program runs between its slices.
+ *
+ *  Arguments:
+ *    policy       The policy
+ *    bytesInUse   Number of bytes in use on the heap
+ */
+void startGcPolicyCollection(GcPolicy policy, uint64_t bytesInUse);
+
+/** Note that the collection in progress stopped to let the program run.
+ *  The time until resumeGcPolicyCollection() doesn't count as time spent
+ *  in the collection.
+ */
+void suspendGcPolicyCollection(GcPolicy policy);
+
+/** Note that the collection suspendGcPolicyCollection() suspended is
+ *  running again
+ */
+void resumeGcPolicyCollection(GcPolicy policy);
+
+/** Note the end of the full collection startGcPolicyCollection() started
+ *
+ *  Measures the time the collection took, leaving out the time it was
+ *  suspended, and the time since the end of the one before, then calls
+ *  recordGcPolicyCollection().  The collection must not be suspended.
+ *
+ *  Arguments:
+ *    policy      The policy
+ *    heapSize    Size of the heap, in bytes
+ *    bytesLive   Number of bytes in the blocks the collection kept
+ *
+ *  Returns:
+ *    The size the heap should grow to, which is no larger than "heapSize"
+ *    if it doesn't need to grow.
+ */
+uint64_t finishGcPolicyCollection(GcPolicy policy, uint64_t heapSize,
+				  uint64_t bytesLive);
+
+/** Record the outcome of a full collection and compute the allocation
+ *  budget until the next one
+ *
+ *  Arguments:
+ *    policy        The policy
+ *    heapSize      Size of the heap, in bytes
+ *    bytesLive     Number of bytes in the blocks the collection kept
+ *    gcUsec        How long the collection took, in microseconds
+ *    elapsedUsec   Time since the end of the previous collection, or since
+ *                    the policy was created for the first one, including
+ *                    "gcUsec", in microseconds
+ *
+ *  Returns:
+ *    The size the heap should grow to, which is no larger than "heapSize"
+ *    if it doesn't need to grow.
+ */
+uint64_t recordGcPolicyCollection(GcPolicy policy, uint64_t heapSize,
+				  uint64_t bytesLive, double gcUsec,
+				  double elapsedUsec);
+
+#endif
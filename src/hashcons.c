@@ -0,0 +1,122 @@
+#include "hashcons.h"
+#include <stdlib.h>
+
+typedef struct HashConsEntry_ {
+  /** Addresses the function was created from */
+  uint64_t u;
+  uint64_t v;
+
+  /** Address of the function, or 0 if the slot is empty */
+  uint64_t address;
+
+  /** Instruction that created the function */
+  uint64_t instruction;
+} HashConsEntry;
+
+typedef struct HashConsTableImpl_ {
+  /** The slots.  There are always a power of two of them. */
+  HashConsEntry* slots;
+
+  /** Number of slots - 1, which maps a hash code to its slot */
+  uint32_t mask;
+
+  /** Number of slots that aren't empty */
+  uint32_t numFunctions;
+} HashConsTableImpl;
+
+#ifndef __cplusplus
+const uint32_t DEFAULT_HASH_CONS_TABLE_SIZE = 16384;
+#endif
+
+static HashConsEntry* slotFor(HashConsTable table, uint8_t instruction,
+			      uint64_t u, uint64_t v);
+
+HashConsTable createHashConsTable(uint32_t numSlots) {
+  if (!numSlots || (numSlots > 0x80000000)) {
+    return NULL;
+  }
+
+  HashConsTable table = (HashConsTable)malloc(sizeof(HashConsTableImpl));
+  if (!table) {
+    return NULL;
+  }
+
+  uint32_t size = 1;
+  while (size < numSlots) {
+    size <<= 1;
+  }
+
+  table->slots = (HashConsEntry*)calloc(size, sizeof(HashConsEntry));
+  if (!table->slots) {
+    free((void*)table);
+    return NULL;
+  }
+  table->mask = size - 1;
+  table->numFunctions = 0;
+  return table;
+}
+
+void destroyHashConsTable(HashConsTable table) {
+  if (table) {
+    free((void*)table->slots);
+  }
+  free((void*)table);
+}
+
+uint32_t hashConsTableNumSlots(HashConsTable table) {
+  return table->mask + 1;
+}
+
+uint32_t hashConsTableSize(HashConsTable table) {
+  return table->numFunctions;
+}
+
+uint64_t findInHashConsTable(HashConsTable table, uint8_t instruction,
+			     uint64_t u, uint64_t v) {
+  const HashConsEntry* const slot = slotFor(table, instruction, u, v);
+  return ((slot->u == u) && (slot->v == v)
+	    && (slot->instruction == instruction)) ? slot->address : 0;
+}
+
+void addToHashConsTable(HashConsTable table, uint8_t instruction, uint64_t u,
+			uint64_t v, uint64_t address) {
+  HashConsEntry* const slot = slotFor(table, instruction, u, v);
+  if (!slot->address) {
+    ++table->numFunctions;
+  }
+  slot->u = u;
+  slot->v = v;
+  slot->address = address;
+  slot->instruction = instruction;
+}
+
+void pruneHashConsTable(HashConsTable table, uint64_t low, uint64_t high,
+			HashConsLivenessTest isLive, void* context) {
+  HashConsEntry* const end = table->slots + table->mask + 1;
+  for (HashConsEntry* slot = table->slots; slot < end; ++slot) {
+    if (slot->address && (slot->address >= low) && (slot->address < high)
+	  && !isLive(slot->address, context)) {
+      slot->address = 0;
+      --table->numFunctions;
+    }
+  }
+}
+
+void clearHashConsTable(HashConsTable table) {
+  HashConsEntry* const end = table->slots + table->mask + 1;
+  for (HashConsEntry* slot = table->slots; slot < end; ++slot) {
+    slot->address = 0;
+  }
+  table->numFunctions = 0;
+}
+
+/** Find the one slot the function "instruction" creates from "u" and
+ *  "v" can go in
+ */
+static HashConsEntry* slotFor(HashConsTable table, uint8_t instruction,
+			      uint64_t u, uint64_t v) {
+  uint64_t h = (u * 0x9E3779B97F4A7C15ULL)
+                 ^ ((v + instruction) * 0xC2B2AE3D27D4EB4FULL);
+  h ^= h >> 32;
+  return table->slots + (h & table->mask);
+}
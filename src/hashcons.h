@@ -0,0 +1,94 @@
+#ifndef __HASHCONS_H__
+#define __HASHCONS_H__
+
+#include <stdint.h>
+
+/** Maps the instruction that creates a function and the addresses it
+ *  creates the function from to the address of a function it already
+ *  created from them
+ *
+ *  Functions never change after they are created, so two functions the
+ *  same instruction creates from the same addresses are interchangeable,
+ *  and the VM can hand out the one it already has instead of allocating
+ *  another.  The table doesn't keep the functions it holds alive.  When
+ *  the garbage collector finds that a function is unreachable, it prunes
+ *  the function from the table with pruneHashConsTable() before freeing
+ *  it, so the table never refers to a free block or a block the memory
+ *  reused for something else.
+ *
+ *  The table is a cache with a fixed number of slots, and each function
+ *  has exactly one slot it can go in, so adding a function evicts the one
+ *  in its slot.  Functions made from the same addresses are usually made
+ *  close together in time, so the cache finds most of them anyway, and
+ *  its size doesn't grow with the heap.  That keeps pruning it cheap
+ *  enough to do on every collection of the nursery.
+ */
+typedef struct HashConsTableImpl_* HashConsTable;
+
+/** Default number of slots in a table */
+#ifdef __cplusplus
+const uint32_t DEFAULT_HASH_CONS_TABLE_SIZE = 16384;
+#else
+const uint32_t DEFAULT_HASH_CONS_TABLE_SIZE;
+#endif
+
+/** Decides whether the block at "address" is still live when
+ *  pruneHashConsTable() prunes the table
+ */
+typedef int (*HashConsLivenessTest)(uint64_t address, void* context);
+
+/** Create a new, empty table
+ *
+ *  Arguments:
+ *    numSlots   Number of slots in the table, which is rounded up to the
+ *                 next power of two.  Must be greater than zero.
+ *
+ *  Returns:
+ *    A new table, or NULL if "numSlots" is zero or there isn't enough
+ *    memory for the table.
+ */
+HashConsTable createHashConsTable(uint32_t numSlots);
+
+/** Destroy a table and free the memory allocated to it */
+void destroyHashConsTable(HashConsTable table);
+
+/** Returns the number of slots in the table */
+uint32_t hashConsTableNumSlots(HashConsTable table);
+
+/** Returns the number of functions in the table */
+uint32_t hashConsTableSize(HashConsTable table);
+
+/** Find the function an instruction created from the given addresses
+ *
+ *  Arguments:
+ *    table        The table
+ *    instruction  Instruction that creates the function, such as
+ *                   MKK_INSTRUCTION
+ *    u            First address the instruction creates the function
+ *                   from.  That is the address on top of the address
+ *                   stack.
+ *    v            Second address the instruction creates the function
+ *                   from, or 0 if it only takes one
+ *
+ *  Returns:
+ *    The address of the function, or 0 if the table doesn't have one.
+ */
+uint64_t findInHashConsTable(HashConsTable table, uint8_t instruction,
+			     uint64_t u, uint64_t v);
+
+/** Add the function at "address" to the table, evicting the function in
+ *  the slot it goes in
+ */
+void addToHashConsTable(HashConsTable table, uint8_t instruction, uint64_t u,
+			uint64_t v, uint64_t address);
+
+/** Remove the functions at addresses in [low, high) that "isLive" says
+ *  aren't live anymore.  The functions at other addresses stay.
+ */
+void pruneHashConsTable(HashConsTable table, uint64_t low, uint64_t high,
+			HashConsLivenessTest isLive, void* context);
+
+/** Remove all the functions from the table */
+void clearHashConsTable(HashConsTable table);
+
+#endif
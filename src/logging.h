@@ -23,6 +23,36 @@ void logAddressStack(Logger logger, Stack addressStack,
 void logCallStack(Logger logger, Stack callStack,
 		  uint64_t heapStart, SymbolTable symtab);
 
+/** Tracing hooks
+ *
+ *  The VM, its memory and the debugger log individual instructions, stack
+ *  contents, newly-constructed code blocks and the details of garbage
+ *  collection (the LogInstructions, LogStacks, LogCodeBlocks, LogGC1 and
+ *  LogGC2 modules) through these macros instead of calling the logging
+ *  functions directly.  When UNLAMBDA_NO_INSTRUMENTATION is defined, as it
+ *  is for libunlambda_fast, the macros expand to nothing, so neither the
+ *  hooks nor the computation of their arguments cost anything at run time.
+ */
+#ifdef UNLAMBDA_NO_INSTRUMENTATION
+
+#define TRACING_IS_ENABLED(LOGGER, MODULE) 0
+#define LOG_TRACE(LOGGER, MODULE, ...) ((void)0)
+#define LOG_ADDRESS_STACK(LOGGER, STACK, HEAP_START, SYMTAB) ((void)0)
+#define LOG_CALL_STACK(LOGGER, STACK, HEAP_START, SYMTAB) ((void)0)
+
+#else
+
+#define TRACING_IS_ENABLED(LOGGER, MODULE)				\
+  loggingModuleIsEnabled(LOGGER, MODULE)
+#define LOG_TRACE(LOGGER, MODULE, ...)					\
+  logMessage(LOGGER, MODULE, __VA_ARGS__)
+#define LOG_ADDRESS_STACK(LOGGER, STACK, HEAP_START, SYMTAB)		\
+  logAddressStack(LOGGER, STACK, HEAP_START, SYMTAB)
+#define LOG_CALL_STACK(LOGGER, STACK, HEAP_START, SYMTAB)		\
+  logCallStack(LOGGER, STACK, HEAP_START, SYMTAB)
+
+#endif
+
 
 /** Constants that identify modules */
 
@@ -247,6 +247,19 @@ int setStack(Stack s, const uint8_t* data, uint64_t size) {
   return 0;
 }
 
+int setStackTop(Stack s, uint8_t* top) {
+  clearStackStatus(s);
+
+  if ((top < s->data) || (top > s->end)) {
+    setStackStatus(s, StackInvalidArgumentError,
+		   "\"top\" is outside the stack");
+    return -1;
+  }
+
+  s->top = top;
+  return 0;
+}
+
 int getStackStatus(Stack s) {
   return s->statusCode;
 }
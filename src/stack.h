@@ -154,6 +154,24 @@ void clearStack(Stack s);
  */
 int setStack(Stack s, const uint8_t* data, uint64_t size);
 
+/** Move the top of the stack to "top" without copying any data
+ *
+ *  Used by code that reads and writes the stack's memory directly, such
+ *  as the VM's threaded interpreter, to publish the new stack top once
+ *  it is done.  "top" must lie between bottomOfStack(s) and
+ *  bottomOfStack(s) + stackAllocated(s), inclusive.
+ *
+ *  Arguments:
+ *    s      The stack
+ *    top    The new top of the stack
+ *
+ *  Returns
+ *    0 if successful, or nonzero if "top" lies outside the memory
+ *    allocated to the stack.  Use getStackStatus() or getStackStatusMsg()
+ *    to obtain a specific error code or message describing the failure.
+ */
+int setStackTop(Stack s, uint8_t* top);
+
 /** Return an error code for the last stack operation.
  * 
  *  Will be zero if no error occurred
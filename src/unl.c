@@ -14,6 +14,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef struct VmCmdLineArgs_ {
   /** Name of executable to load */
@@ -66,6 +69,76 @@ typedef struct VmCmdLineArgs_ {
    */
   int printResultOnExit;
 
+  /** Whether the VM executes primitives with intrinsics (1) or just
+   *  with VM instructions (0)
+   */
+  int intrinsicsEnabled;
+
+  /** Whether to print how many instructions the intrinsics replaced and
+   *  how long the program ran when the VM exits
+   */
+  int showIntrinsicStats;
+
+  /** Whether to print the process' resident set size and the memory the
+   *  VM returned to the system when the program exits (1) or not (0)
+   */
+  int showMemoryStats;
+
+  /** Whether to print statistics on the collections when the program
+   *  exits (1) or not (0)
+   */
+  int showGcStats;
+
+  /** Whether to compile the program to machine code as it runs (1) or
+   *  just interpret it (0)
+   */
+  int jitEnabled;
+
+  /** Number of times the JIT compiler waits for code on the heap to be
+   *  called before it compiles it
+   */
+  uint32_t jitHotClosureThreshold;
+
+  /** Whether the function creation instructions share the functions
+   *  they already created from the same addresses (1) or always create
+   *  new ones (0)
+   */
+  int hashCons;
+
+  /** Collector the VM uses for full collections (VmGcMarkSweep,
+   *  VmGcCompacting, VmGcIncremental or VmGcConcurrent)
+   */
+  int gcMode;
+
+  /** Longest time the incremental collector marks the heap for before it
+   *  lets the program run again, in microseconds
+   */
+  uint64_t gcSliceBudget;
+
+  /** Number of threads that mark and sweep the heap in a full collection */
+  uint32_t gcThreads;
+
+  /** Whether full collections leave the sweep to the allocator (1) or
+   *  sweep the whole heap themselves (0)
+   */
+  int lazySweep;
+
+  /** Whether to ask the kernel to back the heap with huge pages (1) or
+   *  not (0)
+   */
+  int hugePages;
+
+  /** Fraction of the heap the blocks that survive a full collection
+   *  should take up.  The VM grows the heap to reach it and collects
+   *  early when the heap is bigger.
+   */
+  double gcTargetLiveFraction;
+
+  /** Percentage of time the VM may spend in full collections before it
+   *  grows the heap to collect less often
+   */
+  double gcMaxTimePercent;
+
   /** Whether to show the usage message (1) or execute the program (0) */
   int showHelp;
 } VmCmdLineArgs;
@@ -108,6 +181,100 @@ static const char* readDebugCommand() {
 
 static const uint32_t MAX_BREAKPOINTS = 65536;
 
+static double secondsSince(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec)
+           + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Print the intrinsic counts and the time spent running the program.
+ *
+ *  Every intrinsic saves the dispatches for all but one of the
+ *  instructions it replaces, so comparing the run time against a run
+ *  with --no-intrinsics shows what those dispatches cost.
+ */
+static void printIntrinsicStats(UnlambdaVM vm, int intrinsicsEnabled,
+				double runTime) {
+  VmIntrinsicStats stats;
+  getVmIntrinsicStats(vm, &stats);
+
+  fprintf(stdout, "Intrinsics %s: %" PRIu64 " executed, %" PRIu64
+	  " instructions replaced, %" PRIu64 " dispatches saved\n",
+	  intrinsicsEnabled ? "enabled" : "disabled",
+	  stats.intrinsicsExecuted, stats.instructionsReplaced,
+	  stats.instructionsReplaced - stats.intrinsicsExecuted);
+  fprintf(stdout, "Run time: %.3f seconds\n", runTime);
+}
+
+/** Return the process' resident set size in kilobytes, or 0 if the
+ *  system doesn't say
+ */
+static uint64_t residentSetSizeInKb() {
+  FILE* statm = fopen("/proc/self/statm", "r");
+  unsigned long long totalPages = 0;
+  unsigned long long residentPages = 0;
+  int numRead = 0;
+
+  if (statm) {
+    numRead = fscanf(statm, "%llu %llu", &totalPages, &residentPages);
+    fclose(statm);
+  }
+  return (numRead == 2)
+           ? (uint64_t)residentPages * (uint64_t)sysconf(_SC_PAGESIZE) / 1024
+           : 0;
+}
+
+static void printGcStats(UnlambdaVM vm) {
+  VmmGcStats stats;
+  getVmmGcStats(getVmMemory(vm), &stats);
+
+  fprintf(stdout, "GC: %" PRIu64 " full collections, %" PRIu64
+	  " nursery collections\n", stats.numCollections,
+	  stats.numNurseryCollections);
+  fprintf(stdout, "  Time: %.3f ms clearing marks, %.3f ms marking, %.3f ms "
+	  "sweeping\n", stats.clearUsec / 1000.0, stats.markUsec / 1000.0,
+	  stats.sweepUsec / 1000.0);
+  fprintf(stdout, "  Reclaimed %" PRIu64 " bytes.  The last full collection "
+	  "kept %" PRIu64 " blocks\n", stats.bytesReclaimed, stats.blocksKept);
+  fprintf(stdout, "  Free blocks: %" PRIu64 ", largest %" PRIu64
+	  " bytes, fragmentation %.1f%%\n", stats.numFreeBlocks,
+	  stats.largestFreeBlock, 100.0 * stats.fragmentation);
+  fprintf(stdout, "  Pauses: %" PRIu64 ", %.3f ms in total, longest %.3f "
+	  "ms\n", stats.numPauses, stats.totalPauseUsec / 1000.0,
+	  stats.maxPauseUsec / 1000.0);
+  for (int i = 0; i < VMM_GC_PAUSE_HISTOGRAM_SIZE; ++i) {
+    if (stats.pauseHistogram[i]) {
+      const uint64_t low = i ? (uint64_t)1 << i : 0;
+      if (i < (VMM_GC_PAUSE_HISTOGRAM_SIZE - 1)) {
+	fprintf(stdout, "    %10" PRIu64 " - %10" PRIu64 " us: %" PRIu64 "\n",
+		low, (uint64_t)1 << (i + 1), stats.pauseHistogram[i]);
+      } else {
+	fprintf(stdout, "    %10" PRIu64 " us or more:    %" PRIu64 "\n", low,
+		stats.pauseHistogram[i]);
+      }
+    }
+  }
+
+  VmHashConsStats hashConsStats;
+  getVmHashConsStats(vm, &hashConsStats);
+  if (hashConsStats.lookups) {
+    fprintf(stdout, "  Shared %" PRIu64 " of %" PRIu64 " functions.  %"
+	    PRIu64 " functions in the table\n", hashConsStats.hits,
+	    hashConsStats.lookups, hashConsStats.tableSize);
+  }
+}
+
+static void printMemoryStats(UnlambdaVM vm) {
+  struct rusage usage;
+  const uint64_t peakRss =
+    getrusage(RUSAGE_SELF, &usage) ? 0 : (uint64_t)usage.ru_maxrss;
+
+  fprintf(stdout, "Memory: peak RSS %" PRIu64 " KB, RSS at exit %" PRIu64
+	  " KB, %" PRIu64 " KB returned to the system\n", peakRss,
+	  residentSetSizeInKb(), vmmBytesReleased(getVmMemory(vm)) / 1024);
+}
+
 /** TODO: Break this up */
 static int mainLoop(VmCmdLineArgs* args) {
 
@@ -136,10 +303,11 @@ static int mainLoop(VmCmdLineArgs* args) {
   assert((logFile && logger) || (!logFile && !logger));
 
   /** Create the VM and its debugger */
-  UnlambdaVM vm = createUnlambdaVM(args->maxCallStackSize,
-				   args->maxAddressStackSize,
-				   args->initialVmSize,
-				   args->maxVmSize);
+  UnlambdaVM vm = createUnlambdaVMWithGc(args->maxCallStackSize,
+					 args->maxAddressStackSize,
+					 args->initialVmSize,
+					 args->maxVmSize,
+					 args->gcMode);
   if (!vm) {
     fprintf(stderr, "Failed to create the VM.  Exiting.");
     if (logger) {
@@ -151,6 +319,25 @@ static int mainLoop(VmCmdLineArgs* args) {
   if (logger) {
     setVmLogger(vm, logger);
   }
+  setVmIntrinsicsEnabled(vm, args->intrinsicsEnabled);
+  setVmGcSliceBudget(vm, args->gcSliceBudget);
+  setVmmGcThreads(getVmMemory(vm), args->gcThreads);
+  setVmmLazySweep(getVmMemory(vm), args->lazySweep);
+  if (args->hugePages && setVmmHugePages(getVmMemory(vm), 1)) {
+    fprintf(stderr, "WARNING: %s.  The heap will use ordinary pages.\n",
+	    getVmmStatusMsg(getVmMemory(vm)));
+  }
+  setGcPolicyTargetLiveFraction(getVmGcPolicy(vm), args->gcTargetLiveFraction);
+  setGcPolicyMaxGcTimePercent(getVmGcPolicy(vm), args->gcMaxTimePercent);
+  if (args->jitEnabled && enableVmJit(vm, args->jitHotClosureThreshold)) {
+    fprintf(stderr, "WARNING: %s.  The VM will interpret the program.\n",
+	    getVmStatusMsg(vm));
+  }
+  if (args->hashCons
+        && enableVmHashConsing(vm, DEFAULT_HASH_CONS_TABLE_SIZE)) {
+    fprintf(stderr, "WARNING: %s.  The VM will not share functions.\n",
+	    getVmStatusMsg(vm));
+  }
 
   Debugger dbg = createDebugger(vm, MAX_BREAKPOINTS);
   if (!dbg) {
@@ -163,6 +350,17 @@ static int mainLoop(VmCmdLineArgs* args) {
     return -1;
   }
   
+  /** Add the breakpoints from the command line */
+  BreakpointList breakpoints = getDebuggerPersistentBreakpoints(dbg);
+  for (const uint64_t* p = (const uint64_t*)startOfArray(args->breakpoints);
+       p < (const uint64_t*)endOfArray(args->breakpoints);
+       ++p) {
+    if (addBreakpointToList(breakpoints, *p)) {
+      fprintf(stderr, "WARNING: Could not add breakpoint at %" PRIu64
+	      " (%s)\n", *p, getBreakpointListStatusMsg(breakpoints));
+    }
+  }
+
   /** Load the program */
   const char* errorMessage = NULL;
   if (loadProgramIntoVm(vm, args->executableFilePath, args->loadSymbols)) {
@@ -180,11 +378,21 @@ static int mainLoop(VmCmdLineArgs* args) {
   int enterDebugger = args->startInDebugger;
   VmMemory memory = getVmMemory(vm);
   int resultCode = 0;
+  double runTime = 0.0;
 
   while (shouldRun) {
+    /** Run until the VM reaches a breakpoint or stops, unless coming
+     *  out of the debugger.  Then execute just one instruction and check
+     *  for breakpoints again, since the debugger may be single-stepping.
+     */
+    uint64_t maxInstructions = 0;
+
     if (enterDebugger || shouldBreakExecution(dbg)) {
       int shouldDebug = 1;
 
+      maxInstructions = 1;
+      enterDebugger = 0;
+
       while (shouldDebug) {
 	if (isValidVmmAddress(memory, getVmPC(vm))) {
 	  disassembleVmCode(ptrToVmPC(vm), ptrToVmMemory(memory),
@@ -234,7 +442,13 @@ static int mainLoop(VmCmdLineArgs* args) {
     }
     
     if (shouldRun) {
-      if (stepVm(vm)) {
+      struct timespec runStart;
+      clock_gettime(CLOCK_MONOTONIC, &runStart);
+
+      const int stopped = runVmUntil(vm, maxInstructions, VmStopAtBreakpoint);
+      runTime += secondsSince(&runStart);
+
+      if (stopped) {
 	int status = getVmStatus(vm);
 	if (status == VmHalted) {
 	  fprintf(stdout, "VM halted.");
@@ -269,6 +483,16 @@ static int mainLoop(VmCmdLineArgs* args) {
     }
   }
 
+  if (args->showIntrinsicStats) {
+    printIntrinsicStats(vm, args->intrinsicsEnabled, runTime);
+  }
+  if (args->showMemoryStats) {
+    printMemoryStats(vm);
+  }
+  if (args->showGcStats) {
+    printGcStats(vm);
+  }
+
   destroyDebugger(dbg);
   destroyUnlambdaVM(vm);
   if (logger) {
@@ -355,6 +579,8 @@ static int parseCmdLineArgs(int argc, char** argv, VmCmdLineArgs* args) {
   static const uint64_t DEFAULT_MAX_VM_SIZE = DEFAULT_INITIAL_VM_SIZE;
   static const uint32_t DEFAULT_MAX_CALL_STACK_SIZE = 1024 * 1024;
   static const uint32_t DEFAULT_MAX_ADDRESS_STACK_SIZE = 1024 * 1024;
+  static const uint32_t DEFAULT_JIT_HOT_CLOSURE_THRESHOLD = 64;
+  static const uint64_t DEFAULT_GC_SLICE_BUDGET = 500;
 
 
   /** Initialize command-line arguments */
@@ -372,6 +598,20 @@ static int parseCmdLineArgs(int argc, char** argv, VmCmdLineArgs* args) {
   args->debugOnHalt = 0;
   args->quitOnFatalError = 0;
   args->printResultOnExit = 0;
+  args->intrinsicsEnabled = 1;
+  args->showIntrinsicStats = 0;
+  args->showMemoryStats = 0;
+  args->showGcStats = 0;
+  args->jitEnabled = 0;
+  args->jitHotClosureThreshold = DEFAULT_JIT_HOT_CLOSURE_THRESHOLD;
+  args->hashCons = 0;
+  args->gcMode = VmGcMarkSweep;
+  args->gcSliceBudget = DEFAULT_GC_SLICE_BUDGET;
+  args->gcThreads = 1;
+  args->lazySweep = 0;
+  args->hugePages = 0;
+  args->gcTargetLiveFraction = DEFAULT_GC_TARGET_LIVE_FRACTION;
+  args->gcMaxTimePercent = DEFAULT_GC_MAX_TIME_PERCENT;
   args->showHelp = 0;
 
   /** Parse the command line arguments and update args */
@@ -454,6 +694,87 @@ static int parseCmdLineArgs(int argc, char** argv, VmCmdLineArgs* args) {
       args->quitOnFatalError = 1;
     } else if (!strcmp(argName, "--print-result")) {
       args->printResultOnExit = 1;
+    } else if (!strcmp(argName, "--no-intrinsics")) {
+      args->intrinsicsEnabled = 0;
+    } else if (!strcmp(argName, "--intrinsic-stats")) {
+      args->showIntrinsicStats = 1;
+    } else if (!strcmp(argName, "--memory-stats")) {
+      args->showMemoryStats = 1;
+    } else if (!strcmp(argName, "--gc-stats")) {
+      args->showGcStats = 1;
+    } else if (!strcmp(argName, "--jit")) {
+      args->jitEnabled = 1;
+    } else if (!strcmp(argName, "--jit-threshold")) {
+      uint64_t threshold = nextCmdLineArgAsUInt64(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+      CHECK_FOR_INVALID_ARG(argName);
+      if (threshold > 0xFFFFFFFF) {
+	fprintf(stderr, "ERROR: Invalid value for %s (Maximum threshold "
+		"is 4294967295)\n", argName);
+	destroyCmdLineArgParser(parser);
+	return -1;
+      }
+      args->jitHotClosureThreshold = threshold;
+    } else if (!strcmp(argName, "--hash-cons")) {
+      args->hashCons = 1;
+    } else if (!strcmp(argName, "--gc")) {
+      const char* gcMode = nextCmdLineArg(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+      if (!strcmp(gcMode, "mark-sweep")) {
+	args->gcMode = VmGcMarkSweep;
+      } else if (!strcmp(gcMode, "compacting")) {
+	args->gcMode = VmGcCompacting;
+      } else if (!strcmp(gcMode, "incremental")) {
+	args->gcMode = VmGcIncremental;
+      } else if (!strcmp(gcMode, "concurrent")) {
+	args->gcMode = VmGcConcurrent;
+      } else {
+	fprintf(stderr, "ERROR: Invalid value for %s (Must be mark-sweep, "
+		"compacting, incremental or concurrent)\n", argName);
+	destroyCmdLineArgParser(parser);
+	return -1;
+      }
+    } else if (!strcmp(argName, "--gc-slice-budget")) {
+      args->gcSliceBudget = nextCmdLineArgAsUInt64(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+      CHECK_FOR_INVALID_ARG(argName);
+    } else if (!strcmp(argName, "--gc-threads")) {
+      uint64_t numThreads = nextCmdLineArgAsUInt64(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+      CHECK_FOR_INVALID_ARG(argName);
+      if (!numThreads || (numThreads > 1024)) {
+	fprintf(stderr, "ERROR: Invalid value for %s (Must be between 1 "
+		"and 1024)\n", argName);
+	destroyCmdLineArgParser(parser);
+	return -1;
+      }
+      args->gcThreads = (uint32_t)numThreads;
+    } else if (!strcmp(argName, "--lazy-sweep")) {
+      args->lazySweep = 1;
+    } else if (!strcmp(argName, "--huge-pages")) {
+      args->hugePages = 1;
+    } else if (!strcmp(argName, "--gc-target-live")) {
+      uint64_t percent = nextCmdLineArgAsUInt64(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+      CHECK_FOR_INVALID_ARG(argName);
+      if (!percent || (percent > 99)) {
+	fprintf(stderr, "ERROR: Invalid value for %s (Must be a percentage "
+		"between 1 and 99)\n", argName);
+	destroyCmdLineArgParser(parser);
+	return -1;
+      }
+      args->gcTargetLiveFraction = percent / 100.0;
+    } else if (!strcmp(argName, "--gc-max-time")) {
+      uint64_t percent = nextCmdLineArgAsUInt64(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+      CHECK_FOR_INVALID_ARG(argName);
+      if (!percent || (percent > 100)) {
+	fprintf(stderr, "ERROR: Invalid value for %s (Must be a percentage "
+		"between 1 and 100)\n", argName);
+	destroyCmdLineArgParser(parser);
+	return -1;
+      }
+      args->gcMaxTimePercent = (double)percent;
     } else if (!strcmp(argName, "-h") || !strcmp(argName, "--help")) {
       args->showHelp = 1;
     } else if (!args->executableFilePath) {
@@ -484,6 +805,11 @@ static int parseCmdLineArgs(int argc, char** argv, VmCmdLineArgs* args) {
     args->maxVmSize = args->initialVmSize;
   }
 
+  if (args->lazySweep && (args->gcMode != VmGcMarkSweep)) {
+    fprintf(stderr, "ERROR: --lazy-sweep only works with --gc mark-sweep\n");
+    return -1;
+  }
+
   if (args->maxVmSize < args->initialVmSize) {
     fprintf(stderr, "ERROR: Max VM size (%" PRIu64 ") is less than initial "
 	    "VM size (%" PRIu64 ")\n", args->maxVmSize, args->initialVmSize);
@@ -0,0 +1,649 @@
+/** Translate a VM program image to C
+ *
+ *  unl2c reads a program image and writes a C translation unit that runs
+ *  the program with native code for the program area.  Every block of
+ *  PUSH, POP, SWAP, DUP, PCALL, RET and superinstructions in the program
+ *  area becomes a C function that executes directly on the VM's stacks.
+ *  Blocks start at the program's labels, its start address and wherever
+ *  execution can come back to the program area from the VM: after calls
+ *  and after the instructions native code leaves to the VM.  Functions on
+ *  the heap and everything else still run on the VM's interpreter, which
+ *  the translation links against (see vm_native.h).
+ *
+ *  Build the output with something like
+ *
+ *    cc -O2 -I<unlambda>/src -o program program.c liblibunlambda.a -lpthread
+ */
+#include <argparse.h>
+#include <symtab.h>
+#include <vm.h>
+#include <vm_image.h>
+#include <vm_instructions.h>
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Longest block unl2c will translate into one function */
+#define MAX_BLOCK_INSTRUCTIONS 1024
+
+typedef struct CmdLineArgs_ {
+  const char* imageFilename;
+  const char* outputFilename;
+  int showUsage;
+} CmdLineArgs;
+
+/** Program being translated */
+typedef struct Program_ {
+  /** The program's code */
+  const uint8_t* code;
+
+  /** Size of the code, in bytes */
+  uint64_t size;
+
+  /** Address of the first instruction */
+  uint64_t startAddress;
+
+  /** The program's labels.  May be empty */
+  SymbolTable symtab;
+
+  /** Nonzero for each address where an instruction starts */
+  uint8_t* isInstruction;
+
+  /** Nonzero for each address where a block of native code starts */
+  uint8_t* isBlockStart;
+} Program;
+
+static int isNativeInstruction(uint8_t opcode);
+static int isTransferInstruction(uint8_t opcode);
+static uint64_t readAddressOperand(const Program* program, uint64_t address);
+static void findBlocks(Program* program);
+static uint32_t findBlockSize(const Program* program, uint64_t address,
+			      uint64_t* end);
+static void writeProgramArea(const Program* program, FILE* out);
+static void writeBlock(const Program* program, uint64_t address, FILE* out);
+static void writeInstruction(const Program* program, uint64_t address,
+			     uint32_t refund, FILE* out);
+static void writeBlockTable(const Program* program, FILE* out);
+static void writeMain(const Program* program, const char* name, FILE* out);
+static void writeStringContents(const char* text, FILE* out);
+static void writeCommentText(const char* text, FILE* out);
+
+/** Instructions native code executes itself */
+static int isNativeInstruction(uint8_t opcode) {
+  return (opcode == PUSH_INSTRUCTION) || (opcode == POP_INSTRUCTION)
+           || (opcode == SWAP_INSTRUCTION) || (opcode == DUP_INSTRUCTION)
+           || isTransferInstruction(opcode);
+}
+
+/** Instructions that end a block because they transfer control */
+static int isTransferInstruction(uint8_t opcode) {
+  return (opcode == PCALL_INSTRUCTION) || (opcode == RET_INSTRUCTION)
+           || (opcode == PUSH_PCALL_INSTRUCTION)
+           || (opcode == PUSH_PCALL_RET_INSTRUCTION)
+           || (opcode == PCALL_RET_INSTRUCTION)
+           || (opcode == POP_PUSH_RET_INSTRUCTION);
+}
+
+static uint64_t readAddressOperand(const Program* program, uint64_t address) {
+  uint64_t operand;
+  memcpy(&operand, program->code + address + 1, 8);
+  return operand;
+}
+
+/** Find the instructions in the program area and the addresses where
+ *  blocks of native code start
+ */
+static void findBlocks(Program* program) {
+  const uint8_t* code = program->code;
+  const uint64_t size = program->size;
+  uint64_t address = 0;
+
+  /** Instructions are laid out one after the other from address 0 */
+  while (address < size) {
+    program->isInstruction[address] = 1;
+    address += instructionSize(code[address]);
+  }
+
+  if (program->startAddress < size) {
+    program->isBlockStart[program->startAddress] = 1;
+  }
+
+  for (SymbolIterator p = startOfSymbolTable(program->symtab);
+       p; p = nextSymbolInTable(program->symtab, p)) {
+    if ((*p)->address < size) {
+      program->isBlockStart[(*p)->address] = 1;
+    }
+  }
+
+  for (address = 0; address < size; address += instructionSize(code[address])) {
+    const uint64_t next = address + instructionSize(code[address]);
+
+    /** Calls return to the next instruction, and the VM comes back to the
+     *  program area after any instruction it executes for native code
+     */
+    if ((next < size)
+	  && ((code[address] == PCALL_INSTRUCTION)
+	        || (code[address] == PUSH_PCALL_INSTRUCTION)
+	        || !isNativeInstruction(code[address]))) {
+      program->isBlockStart[next] = 1;
+    }
+
+    /** Code can call any address it pushes */
+    if (instructionHasAddressOperand(code[address]) && (next <= size)) {
+      const uint64_t target = readAddressOperand(program, address);
+      if (target < size) {
+	program->isBlockStart[target] = 1;
+      }
+    }
+  }
+
+  /** Blocks have to start with an instruction native code can execute */
+  for (address = 0; address < size; ++address) {
+    if (program->isBlockStart[address]
+	  && (!program->isInstruction[address]
+	        || !isNativeInstruction(code[address])
+	        || ((size - address) < instructionSize(code[address])))) {
+      program->isBlockStart[address] = 0;
+    }
+  }
+}
+
+/** Count the instructions in the block at "address" and find the address
+ *  of the first instruction after it, which the VM executes
+ */
+static uint32_t findBlockSize(const Program* program, uint64_t address,
+			      uint64_t* end) {
+  uint32_t count = 0;
+
+  while ((count < MAX_BLOCK_INSTRUCTIONS) && (address < program->size)) {
+    const uint8_t opcode = program->code[address];
+    if (!isNativeInstruction(opcode)
+	  || ((program->size - address) < instructionSize(opcode))) {
+      break;
+    }
+    ++count;
+    address += instructionSize(opcode);
+    if (isTransferInstruction(opcode)) {
+      break;
+    }
+  }
+
+  *end = address;
+  return count;
+}
+
+static void writeProgramArea(const Program* program, FILE* out) {
+  fprintf(out, "/** The program area.  The VM executes it wherever native "
+	  "code can't */\n");
+  fprintf(out, "static const uint8_t PROGRAM[%" PRIu64 "] = {", program->size);
+  for (uint64_t i = 0; i < program->size; ++i) {
+    fprintf(out, "%s0x%02X%s", (i % 12) ? " " : "\n  ",
+	    (uint32_t)program->code[i], (i < (program->size - 1)) ? "," : "");
+  }
+  fprintf(out, "\n};\n\n");
+}
+
+static void writeBlock(const Program* program, uint64_t address, FILE* out) {
+  const Symbol* label = getSymbolAtAddress(program->symtab, address);
+  uint64_t end = address;
+  const uint32_t count = findBlockSize(program, address, &end);
+
+  if (label) {
+    fprintf(out, "/** %s */\n", label->name);
+  }
+  fprintf(out, "static int block%" PRIu64 "(VmNativeState* s) {\n", address);
+  fprintf(out, "  BEGIN_BLOCK(%" PRIu64 ", %" PRIu32 ");\n", address, count);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    writeInstruction(program, address, count - i, out);
+    address += instructionSize(program->code[address]);
+  }
+
+  if (!isTransferInstruction(program->code[address - 1])
+        || (address != end)) {
+    /** Let the VM execute whatever comes after the block */
+    fprintf(out, "  INTERPRET(%" PRIu64 ", 0);\n", end);
+  }
+  fprintf(out, "}\n\n");
+}
+
+/** Write the code for the instruction at "address", which is followed by
+ *  "refund" - 1 more instructions in its block
+ */
+static void writeInstruction(const Program* program, uint64_t address,
+			     uint32_t refund, FILE* out) {
+  const uint8_t opcode = program->code[address];
+  const uint64_t next = address + instructionSize(opcode);
+  const int nextIsReturn = (next < program->size)
+                             && (program->code[next] == RET_INSTRUCTION);
+
+  fprintf(out, "\n  /** %" PRIu64 ": %s", address, instructionName(opcode));
+  if (instructionHasAddressOperand(opcode)) {
+    const uint64_t operand = readAddressOperand(program, address);
+    const Symbol* symbol = getSymbolAtAddress(program->symtab, operand);
+    if (symbol) {
+      fprintf(out, " %s", symbol->name);
+    } else {
+      fprintf(out, " %" PRIu64, operand);
+    }
+  }
+  fprintf(out, " */\n");
+
+  switch (opcode) {
+    case PUSH_INSTRUCTION:
+      fprintf(out, "  if (addrTop == s->addressStackLimit) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  *addrTop++ = UINT64_C(%" PRIu64 ");\n",
+	      address, refund, readAddressOperand(program, address));
+      break;
+
+    case POP_INSTRUCTION:
+      fprintf(out, "  if (addrTop == s->addressStackBottom) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  --addrTop;\n", address, refund);
+      break;
+
+    case SWAP_INSTRUCTION:
+      fprintf(out, "  if ((addrTop - s->addressStackBottom) < 2) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  target = addrTop[-2];\n"
+	      "  addrTop[-2] = addrTop[-1];\n"
+	      "  addrTop[-1] = target;\n", address, refund);
+      break;
+
+    case DUP_INSTRUCTION:
+      fprintf(out, "  if ((addrTop == s->addressStackBottom)"
+	      " || (addrTop == s->addressStackLimit)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  addrTop[0] = addrTop[-1];\n"
+	      "  ++addrTop;\n", address, refund);
+      break;
+
+    case PCALL_INSTRUCTION:
+      fprintf(out, "  if ((addrTop == s->addressStackBottom)"
+	      " || ((s->callStackLimit - callTop) < 2)\n"
+	      "        || (addrTop[-1] >= s->memorySize)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  target = *--addrTop;\n", address, refund);
+      if (nextIsReturn) {
+	fprintf(out, "  TAIL_CALL(target);\n");
+      }
+      fprintf(out, "  CALL(target, %" PRIu64 ");\n", next);
+      break;
+
+    case RET_INSTRUCTION:
+      fprintf(out, "  if (((callTop - s->callStackBottom) < 2)"
+	      " || (callTop[-1] >= s->memorySize)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  target = callTop[-1];\n"
+	      "  callTop -= 2;\n"
+	      "  JUMP(target);\n", address, refund);
+      break;
+
+    case PUSH_PCALL_INSTRUCTION:
+      fprintf(out, "  if (((s->callStackLimit - callTop) < 2)"
+	      " || (UINT64_C(%" PRIu64 ") >= s->memorySize)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n", readAddressOperand(program, address), address, refund);
+      if (nextIsReturn) {
+	fprintf(out, "  TAIL_CALL(UINT64_C(%" PRIu64 "));\n",
+		readAddressOperand(program, address));
+      }
+      fprintf(out, "  CALL(UINT64_C(%" PRIu64 "), %" PRIu64 ");\n",
+	      readAddressOperand(program, address), next);
+      break;
+
+    case PUSH_PCALL_RET_INSTRUCTION:
+      fprintf(out, "  if (((callTop - s->callStackBottom) < 2)"
+	      " || (UINT64_C(%" PRIu64 ") >= s->memorySize)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  callTop[-2] = UINT64_C(%" PRIu64 ");\n"
+	      "  JUMP(UINT64_C(%" PRIu64 "));\n",
+	      readAddressOperand(program, address), address, refund,
+	      readAddressOperand(program, address),
+	      readAddressOperand(program, address));
+      break;
+
+    case PCALL_RET_INSTRUCTION:
+      fprintf(out, "  if ((addrTop == s->addressStackBottom)"
+	      " || ((callTop - s->callStackBottom) < 2)\n"
+	      "        || (addrTop[-1] >= s->memorySize)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  target = *--addrTop;\n"
+	      "  callTop[-2] = target;\n"
+	      "  JUMP(target);\n", address, refund);
+      break;
+
+    case POP_PUSH_RET_INSTRUCTION:
+      fprintf(out, "  if ((addrTop == s->addressStackBottom)"
+	      " || ((callTop - s->callStackBottom) < 2)\n"
+	      "        || (callTop[-1] >= s->memorySize)) {\n"
+	      "    INTERPRET(%" PRIu64 ", %" PRIu32 ");\n"
+	      "  }\n"
+	      "  addrTop[-1] = UINT64_C(%" PRIu64 ");\n"
+	      "  target = callTop[-1];\n"
+	      "  callTop -= 2;\n"
+	      "  JUMP(target);\n", address, refund,
+	      readAddressOperand(program, address));
+      break;
+
+    default:
+      /** findBlockSize() only puts native instructions in blocks */
+      break;
+  }
+}
+
+static void writeBlockTable(const Program* program, FILE* out) {
+  uint64_t numBlocks = 0;
+
+  fprintf(out, "static const VmNativeBlock NATIVE_BLOCKS[] = {\n");
+  for (uint64_t address = 0; address < program->size; ++address) {
+    if (program->isBlockStart[address]) {
+      fprintf(out, "  { %" PRIu64 ", block%" PRIu64 " },\n", address,
+	      address);
+      ++numBlocks;
+    }
+  }
+  if (!numBlocks) {
+    /** C doesn't allow empty arrays */
+    fprintf(out, "  { 0, NULL },\n");
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out, "#define NUM_NATIVE_BLOCKS %" PRIu64 "\n\n", numBlocks);
+}
+
+static void writeMain(const Program* program, const char* name, FILE* out) {
+  fprintf(out,
+	  "int main(void) {\n"
+	  "  UnlambdaVM vm = createUnlambdaVM(1024 * 1024, 1024 * 1024,\n"
+	  "                                   16 * 1024 * 1024, "
+	  "16 * 1024 * 1024);\n"
+	  "  int result = 0;\n"
+	  "\n"
+	  "  if (!vm) {\n"
+	  "    fprintf(stderr, \"Failed to create the VM.  Exiting.\\n\");\n"
+	  "    return -1;\n"
+	  "  }\n"
+	  "  if (loadVmProgramFromMemory(vm, \"");
+  writeStringContents(name, out);
+  fprintf(out,
+	  "\", PROGRAM, sizeof(PROGRAM))\n"
+	  "        || setVmPC(vm, UINT64_C(%" PRIu64 "))) {\n"
+	  "    fprintf(stderr, \"%%s\\n\", getVmStatusMsg(vm));\n"
+	  "    destroyUnlambdaVM(vm);\n"
+	  "    return -1;\n"
+	  "  }\n"
+	  "  setVmNativeCode(vm, NATIVE_BLOCKS, NUM_NATIVE_BLOCKS);\n"
+	  "\n"
+	  "  runVm(vm);\n"
+	  "  if (getVmStatus(vm) == VmPanicError) {\n"
+	  "    fprintf(stdout, \"VM executed PANIC instruction.\\n\");\n"
+	  "    result = -1;\n"
+	  "  } else if (getVmStatus(vm) != VmHalted) {\n"
+	  "    fprintf(stdout, \"%%s\\n\", getVmStatusMsg(vm));\n"
+	  "    result = -2;\n"
+	  "  }\n"
+	  "\n"
+	  "  destroyUnlambdaVM(vm);\n"
+	  "  return result;\n"
+	  "}\n", program->startAddress);
+}
+
+/** Write "text" as the contents of a C string literal, escaping the
+ *  characters that would end it or change its meaning
+ */
+static void writeStringContents(const char* text, FILE* out) {
+  for (const unsigned char* p = (const unsigned char*)text; *p; ++p) {
+    if ((*p == '"') || (*p == '\\')) {
+      fprintf(out, "\\%c", *p);
+    } else if ((*p < 0x20) || (*p == 0x7F)) {
+      fprintf(out, "\\%03o", *p);
+    } else {
+      fputc(*p, out);
+    }
+  }
+}
+
+/** Write "text" inside a C comment, breaking up any "*" "/" that would
+ *  end the comment early
+ */
+static void writeCommentText(const char* text, FILE* out) {
+  for (const char* p = text; *p; ++p) {
+    fputc(*p, out);
+    if ((*p == '*') && (p[1] == '/')) {
+      fputc(' ', out);
+    }
+  }
+}
+
+/** Write the program in "imageFilename" to "outputFilename" as C */
+static int translateVmImage(const char* imageFilename,
+			    const char* outputFilename) {
+  uint64_t programSize = 0, numSymbols = 0, startAddress = 0;
+  const char* errorMessage = NULL;
+
+  if (loadVmProgramHeader(imageFilename, &programSize, &numSymbols,
+			  &startAddress, &errorMessage)) {
+    fprintf(stderr, "%s\n", errorMessage);
+    free((void*)errorMessage);
+    return -1;
+  }
+
+  /** Just big enough to hold the program */
+  const uint64_t vmSize = (programSize + 4096) & ~(uint64_t)4095;
+  UnlambdaVM vm = createUnlambdaVM(16, 16, vmSize, vmSize);
+  if (!vm) {
+    fprintf(stderr, "Failed to create the VM\n");
+    return -1;
+  }
+
+  if (loadVmProgramImage(imageFilename, vm, 1, &startAddress,
+			 &errorMessage)) {
+    fprintf(stderr, "%s\n", errorMessage);
+    free((void*)errorMessage);
+    destroyUnlambdaVM(vm);
+    return -1;
+  }
+
+  Program program;
+  program.code = ptrToVmMemory(getVmMemory(vm));
+  program.size = programSize;
+  program.startAddress = startAddress;
+  program.symtab = getVmSymbolTable(vm);
+  program.isInstruction = (uint8_t*)calloc(programSize + 1, 1);
+  program.isBlockStart = (uint8_t*)calloc(programSize + 1, 1);
+  if (!program.isInstruction || !program.isBlockStart) {
+    fprintf(stderr, "Out of memory\n");
+    free((void*)program.isInstruction);
+    free((void*)program.isBlockStart);
+    destroyUnlambdaVM(vm);
+    return -1;
+  }
+
+  FILE* out = fopen(outputFilename, "w");
+  if (!out) {
+    fprintf(stderr, "Could not open %s for writing\n", outputFilename);
+    free((void*)program.isInstruction);
+    free((void*)program.isBlockStart);
+    destroyUnlambdaVM(vm);
+    return -1;
+  }
+
+  /** Name the program after its image, less any directories */
+  const char* name = strrchr(imageFilename, '/');
+  name = name ? name + 1 : imageFilename;
+
+  findBlocks(&program);
+
+  fprintf(out, "/** Generated by unl2c from ");
+  writeCommentText(name, out);
+  fprintf(out,
+	  ".  Do not edit. */\n"
+	  "#include <vm.h>\n"
+	  "#include <vm_native.h>\n"
+	  "\n"
+	  "#include <stdint.h>\n"
+	  "#include <stdio.h>\n"
+	  "\n"
+	  "/** Start a block of COUNT instructions at ADDRESS.  The VM "
+	  "executes the\n"
+	  " *  block if there aren't enough instructions left to run all "
+	  "of it.\n"
+	  " */\n"
+	  "#define BEGIN_BLOCK(ADDRESS, COUNT)                           \\\n"
+	  "  uint64_t* addrTop = s->addressStackTop;                     \\\n"
+	  "  uint64_t* callTop = s->callStackTop;                        \\\n"
+	  "  uint64_t target;                                            \\\n"
+	  "  (void)target;                                               \\\n"
+	  "  if (s->remaining < (COUNT)) {                               \\\n"
+	  "    s->pc = (ADDRESS);                                        \\\n"
+	  "    return VmNativeExitInterpret;                             \\\n"
+	  "  }                                                           \\\n"
+	  "  s->remaining -= (COUNT)\n"
+	  "\n"
+	  "/** Let the VM execute the instruction at ADDRESS, giving back "
+	  "the REFUND\n"
+	  " *  instructions of the block that didn't run\n"
+	  " */\n"
+	  "#define INTERPRET(ADDRESS, REFUND)                            \\\n"
+	  "  do {                                                        \\\n"
+	  "    s->addressStackTop = addrTop;                             \\\n"
+	  "    s->callStackTop = callTop;                                \\\n"
+	  "    s->remaining += (REFUND);                                 \\\n"
+	  "    s->pc = (ADDRESS);                                        \\\n"
+	  "    return VmNativeExitInterpret;                             \\\n"
+	  "  } while (0)\n"
+	  "\n"
+	  "/** Continue at TARGET */\n"
+	  "#define JUMP(TARGET)                                          \\\n"
+	  "  do {                                                        \\\n"
+	  "    s->addressStackTop = addrTop;                             \\\n"
+	  "    s->callStackTop = callTop;                                \\\n"
+	  "    s->pc = (TARGET);                                         \\\n"
+	  "    return VmNativeExitJump;                                  \\\n"
+	  "  } while (0)\n"
+	  "\n"
+	  "/** Call TARGET, returning to RETURN_ADDRESS */\n"
+	  "#define CALL(TARGET, RETURN_ADDRESS)                           \\\n"
+	  "  do {                                                        \\\n"
+	  "    callTop[0] = (TARGET);                                    \\\n"
+	  "    callTop[1] = (RETURN_ADDRESS);                            \\\n"
+	  "    callTop += 2;                                             \\\n"
+	  "    JUMP(TARGET);                                             \\\n"
+	  "  } while (0)\n"
+	  "\n"
+	  "/** Call TARGET in place of the current function, if there is "
+	  "one */\n"
+	  "#define TAIL_CALL(TARGET)                                     \\\n"
+	  "  do {                                                        \\\n"
+	  "    if ((callTop - s->callStackBottom) >= 2) {                \\\n"
+	  "      callTop[-2] = (TARGET);                                 \\\n"
+	  "      JUMP(TARGET);                                           \\\n"
+	  "    }                                                         \\\n"
+	  "  } while (0)\n"
+	  "\n");
+
+  writeProgramArea(&program, out);
+
+  for (uint64_t address = 0; address < programSize; ++address) {
+    if (program.isBlockStart[address]) {
+      writeBlock(&program, address, out);
+    }
+  }
+  writeBlockTable(&program, out);
+  writeMain(&program, name, out);
+
+  const int status = ferror(out) ? -1 : 0;
+  if (fclose(out) || status) {
+    fprintf(stderr, "Error writing to %s\n", outputFilename);
+    free((void*)program.isInstruction);
+    free((void*)program.isBlockStart);
+    destroyUnlambdaVM(vm);
+    return -1;
+  }
+
+  free((void*)program.isInstruction);
+  free((void*)program.isBlockStart);
+  destroyUnlambdaVM(vm);
+  return 0;
+}
+
+#define CHECK_FOR_MISSING_ARG(ARG_NAME)					\
+  if (getCmdLineArgParserStatus(parser) == NoMoreCmdLineArgsError) {    \
+    fprintf(stderr, "ERROR: Argument missing for %s\n", ARG_NAME);      \
+    destroyCmdLineArgParser(parser);                                    \
+    return -1;                                                          \
+  }
+
+static int parseCmdLineArgs(int argc, char** argv, CmdLineArgs* args) {
+  CmdLineArgParser parser = createCmdLineArgParser(argc, argv);
+  if (!parser) {
+    fprintf(stderr, "Could not allocate memory for command-line parser\n");
+    return -1;
+  }
+
+  args->imageFilename = NULL;
+  args->outputFilename = NULL;
+  args->showUsage = 0;
+
+  while (hasMoreCmdLineArgs(parser)) {
+    const char* argName = nextCmdLineArg(parser);
+    if (!strcmp(argName, "-h") || !strcmp(argName, "--help")) {
+      args->showUsage = 1;
+    } else if (!strcmp(argName, "-o")) {
+      args->outputFilename = nextCmdLineArg(parser);
+      CHECK_FOR_MISSING_ARG(argName);
+    } else if (!args->imageFilename) {
+      args->imageFilename = argName;
+    } else {
+      fprintf(stderr,
+	      "ERROR: Too many command-line arguments.  Use -h for help\n");
+      destroyCmdLineArgParser(parser);
+      return -1;
+    }
+  }
+  destroyCmdLineArgParser(parser);
+
+  if (!args->showUsage) {
+    if (!args->imageFilename) {
+      fprintf(stderr, "ERROR: Program image not specified.  "
+	      "Use -h for help\n");
+      return -1;
+    }
+    if (!args->outputFilename) {
+      fprintf(stderr, "ERROR: Output file not specified.  Use -h for help\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void usage() {
+  fprintf(stdout, "unl2c -o <output-file> <image-file>\n"
+	  "  <image-file>      Program image to translate\n"
+	  "  -o <output-file>  Where to write the C translation\n");
+}
+
+int main(int argc, char* argv[]) {
+  CmdLineArgs args;
+  int result = parseCmdLineArgs(argc, argv, &args);
+  if (!result) {
+    if (args.showUsage) {
+      usage();
+    } else {
+      result = translateVmImage(args.imageFilename, args.outputFilename);
+    }
+  }
+  return result;
+}
@@ -251,11 +251,14 @@ int writeBytecode(AssemblyLine* asml, SymbolTable symtab, Array bytecode,
   uint64_t operand = 0;
   
   switch (asml->value.instruction.opcode) {
-    case PUSH_INSTRUCTION: {
+    case PUSH_INSTRUCTION:
+    case PUSH_PCALL_INSTRUCTION:
+    case PUSH_PCALL_RET_INSTRUCTION:
+    case POP_PUSH_RET_INSTRUCTION: {
       uint64_t operand = 0;
       operand = resolveAsmValueToAddress(&asml->value.instruction.operand,
 					 symtab, errorMessage);
-      if (errorMessage) {
+      if (*errorMessage) {
 	return -1;
       }
       if (appendToArray(bytecode, (const uint8_t*)&operand, 8)) {
@@ -16,35 +16,59 @@
  *    reachable and should not be collected.  This is an implementation
  *    detail and invisible to the program executing in the VM.
  *
- *    Likewise, entries on the address stack are also a pair of addresses:
- *    one for the referenced item and one to the actual allocated block.
- *    The objects allocated by the function creation instructions (MKK, MKS0
- *    and so on) are very small (on the order of 20 - 40 bytes), so the
- *    allocator for created functions allocates N contiguous instances of
- *    the created function from the heap all at once and serves allocation
- *    requests from this block until it is exhaused, at which time the allocator
- *    allocates a new block of N contiguous instances and serves from that
- *    block.  To faciliate garbage collection, every "address" on the address
- *    stack is actually two addresses: the address of the created function
- *    and the address of the "block" of created functions from which it
- *    was allocated.  The garbage collector uses both addresses to mark
- *    a function instance as reachable and free the instances that are not
- *    reachable.
+ *    Entries on the address stack are plain addresses.  The objects
+ *    allocated by the function creation instructions (MKK, MKS0 and so on)
+ *    are very small (10 - 23 bytes of code), and most of them become
+ *    unreachable almost as soon as they are created, so the VM allocates
+ *    them from a nursery: a large block of the heap that is filled from
+ *    front to back by bumping a pointer.  When the nursery fills up, a
+ *    minor collection marks the functions in it that are still reachable
+ *    and frees the rest without looking at the rest of the heap.  That
+ *    works because functions never change after they are created, so the
+ *    only places that can hold addresses of functions in the nursery are
+ *    the two stacks, other functions in the nursery and the blocks
+ *    allocated outside the nursery since it was allocated, which the
+ *    memory remembers.  The functions that survive stay where they are
+ *    and become part of the rest of the heap.
  *
- *    "Addresses" on the address stack that reference a saved program state
- *    instead of a created function will have one pointer pointing to the start
- *    of the memory allocated for the saved state on the heap and the other
- *    pointing to the actual start of the saved state itself.  The difference
- *    between the two is a four-byte "dead zone" filled with PANIC instructions
- *    in case the block is accidentally the argument for a PCALL instruction.
+ *    When the heap is too small for a nursery, the VM allocates functions
+ *    from slabs: heap blocks divided into many cells of the same size
+ *    (see VmmSlab in vmmem.h).  Allocating a function just takes the
+ *    first cell off the list of free cells for its size, and a new slab
+ *    is only allocated from the heap when that list is empty.  Every cell
+ *    has its own block header, so the garbage collector marks the
+ *    functions in a slab like any other block on the heap.  It puts the
+ *    unreachable cells back on the free lists and returns a slab to the
+ *    heap once all of its cells are unreachable.
  *
- *    Again, that the "addresses" on the address stack are actually pairs
- *    of addresses is an implementation detail that is invisible to the
- *    program executing on the VM.
+ *    Addresses on the address stack that reference a saved program state
+ *    point to the start of the saved state itself, which begins with an
+ *    eight-byte "dead zone" filled with PANIC instructions in case the
+ *    block is accidentally the argument for a PCALL instruction.
  *
- *    The garbage collector is not currently a compacting collector, which
- *    can lead to heap fragmentation and inefficient usage.  This collector
- *    is good enough for this proof-of-concept implementation of the UVM.
+ *    By default, full collections mark the reachable blocks and free the
+ *    rest without moving anything, which can leave the heap fragmented.
+ *    A VM created with createUnlambdaVMWithGc() and VmGcCompacting copies
+ *    the reachable blocks to the start of the heap in depth-first order
+ *    instead, rewriting every address that refers to a block that moved,
+ *    including the program counter.  Instructions that allocate a block
+ *    must therefore read the addresses they need from the stacks after
+ *    the allocation succeeds, not before.
+ *
+ *    With VmGcIncremental, the VM starts an incremental collection when
+ *    a quarter of the heap or less is free and the program has used at
+ *    least half of the memory the last collection freed, and marks part
+ *    of the heap every VM_GC_SLICE_INTERVAL allocations until the
+ *    collection is over.
+ *    A full collection just finishes the incremental collection, if one
+ *    is in progress.
+ *
+ *    VmGcConcurrent starts a collection at the same point, but a thread
+ *    of its own marks the heap while the program keeps running.  The
+ *    VM polls for the end of marking at a safepoint before each
+ *    instruction that can't execute inline in runThreadedCode(), which
+ *    includes every instruction that allocates memory, and frees the
+ *    unreachable blocks there.
  *
  *    The maximum size of the call and address stacks are 2^32 entries.  The
  *    maximum heap size is 2^64 bytes.  host computer will probably run out
@@ -60,9 +84,31 @@
  *    *  PCALL       :  Push the address of the next instruction onto the
  *                        call stack, pop the address on top of the call
  *                        stack then jump to that address.
+ *                        If the next instruction is a RET, PCALL makes a
+ *                        tail call instead: it replaces the block in the
+ *                        current function's frame with the called address
+ *                        and never executes the RET, so calls in tail
+ *                        position don't grow the call stack.  PUSH_PCALL
+ *                        does the same.  A breakpoint on the RET turns
+ *                        this off, so the debugger can still stop there.
  *    *  RET         :  Return from a function call by popping the address
  *                        on top of the call stack and jumping to that address.
  *
+ *    Superinstructions
+ *    *  PUSH_PCALL a     :  Same as PUSH a; PCALL.  Calls a without
+ *                             touching the address stack.
+ *    *  PUSH_PCALL_RET a :  Same as PUSH a; PCALL; RET.  Jumps to a,
+ *                             replacing the current function's frame on
+ *                             the call stack, so a returns directly to
+ *                             the current function's caller.
+ *    *  PCALL_RET        :  Same as PCALL; RET.  Pops an address from the
+ *                             address stack and jumps to it, replacing the
+ *                             current function's frame like
+ *                             PUSH_PCALL_RET.
+ *    *  POP_PUSH_RET a   :  Same as POP; PUSH a; RET.  Replaces the address
+ *                             on top of the address stack with a and
+ *                             returns.
+ *
  *    Function creation
  *    * MKK          :  Pop the address at the top of the address stack.
  *                        Call it u.  Make a function on the heap that
@@ -124,9 +170,7 @@
  *
  * Code created by MKK[u]:
  *   PCALL   ; Evaluate argument
- *   POP     ; Discard argument value
- *   PUSH u  ; Function value
- *   RET     ; Return
+ *   POP_PUSH_RET u  ; Discard argument value and return u
  *
  * Implementation of s[x]:
  *   PCALL   ; Replace x with u = x()
@@ -150,17 +194,13 @@
  *   MKS2    ; Create a no-argument function q() that computes v(w).
  *           ; Pops both v and first w, leaving second w
  *   SWAP    ; Swap q and w
- *   PUSH u  ;
- *   PCALL   ; Compute a = u(w).  Pops u and second w and pushes a
- *   PCALL   ; Compute a(q).  This will pop and call q() to evaluate v(w)
- *           ;   then apply a to the result.
- *   RET     ; Done
+ *   PUSH_PCALL u  ; Compute a = u(w).  Pops second w and pushes a
+ *   PCALL_RET     ; Compute a(q) and return it.  This will pop and
+ *                 ;   call q() to evaluate v(w), then apply a to the result.
  *
  * Code created by MKS2[v, w]
  *   PUSH w  ; Push the argument to v
- *   PUSH v  ; Push v itself
- *   PCALL   ; Compute v(w) and put on top of stack, consuming v & w
- *   RET
+ *   PUSH_PCALL_RET v  ; Compute v(w) and return it, consuming w
  *
  * Implementation of i[x]:
  *   PCALL   ; Replace x with x()
@@ -179,13 +219,11 @@
  *   RET     ; Done
  *
  * Code created by MKD[x]:
- *   PUSH x  ; Have to evaluate x before y
- *   PCALL   ; Replace x with u = x()
+ *   PUSH_PCALL x  ; Have to evaluate x before y.  Push u = x()
  *   SWAP    ; Bring argument y to stack top
  *   PCALL   ; Replace argument y with v = y()
  *   SWAP    ; Swap u and v
- *   PCALL   ; Replace u and v with u(v)
- *   RET
+ *   PCALL_RET  ; Replace u and v with u(v) and return it
  *
  * Implementation of c[x]:
  *   SAVE 1  ; Save interpreter state, not including x
@@ -300,6 +338,39 @@
 #include <stdlib.h>
 #include <string.h>
 
+/** Raw pointers into the memory of one of the VM's stacks
+ *
+ *  The VM pushes and pops addresses through these pointers rather than
+ *  through the Stack API.  Only the Stack's top is ever out of date;
+ *  storeVmStackPointers() brings it up to date before anything outside
+ *  the VM (or inside it, such as the garbage collector) looks at the
+ *  Stack, and loadVmStackPointers() reloads the pointers after the Stack
+ *  grows or is changed through the Stack API.
+ */
+typedef struct VmStackPointers_ {
+  uint64_t* bottom;  /** Bottom of the stack */
+  uint64_t* top;     /** One past the entry on top of the stack */
+  uint64_t* limit;   /** End of the memory allocated to the stack */
+} VmStackPointers;
+
+/** What runThreadedCode() does when a call, return or jump reaches an
+ *  address in the program area.  See findProgramEntries().
+ */
+#define ENTRY_INTERPRET                   0  /** Interpret the bytecode */
+#define INTRINSIC_EVALUATE_ARGUMENT       1  /** PCALL, not before RET */
+#define INTRINSIC_EVALUATE_AND_RETURN     2  /** PCALL; RET */
+#define INTRINSIC_RETURN_CONSTANT         3  /** POP; PUSH a; RET */
+#define INTRINSIC_PRINT_AND_RETURN        4  /** PRINT c; RET */
+#define ENTRY_JIT                         5  /** Run compiled code */
+#define ENTRY_NATIVE                      6  /** Run native code */
+#define NUM_PROGRAM_ENTRIES               7
+
+/** Compiled code entered from the interpreter has to run at least this many
+ *  instructions to pay for entering and leaving it.  runThreadedCode() stops
+ *  entering code that doesn't.
+ */
+#define JIT_MIN_INSTRUCTIONS_PER_ENTRY    8
+
 typedef struct UnlambdaVmImpl_ {
   /** Name of the currently-loaded program.  Empty string if no program */
   const char* programName;
@@ -310,6 +381,15 @@ typedef struct UnlambdaVmImpl_ {
   /** The address stack */
   Stack addressStack;
 
+  /** Raw pointers into the call and address stacks
+   *
+   *  Valid while an instruction executes.  The tops of callStack and
+   *  addressStack are only up to date between calls to stepVm() and
+   *  runVmUntil().
+   */
+  VmStackPointers callStackPtrs;
+  VmStackPointers addressStackPtrs;
+
   /** The VM's memory
    *
    *  The program and the heap are stored here
@@ -350,6 +430,75 @@ typedef struct UnlambdaVmImpl_ {
 
   /** Handler for GC errors */
   GcErrorHandler gcErrorHandler;
+
+  /** Collector for full collections: VmGcMarkSweep, VmGcCompacting,
+   *  VmGcIncremental or VmGcConcurrent
+   */
+  int gcMode;
+
+  /** Longest time a slice of an incremental collection runs for, in
+   *  microseconds
+   */
+  uint64_t gcSliceBudget;
+
+  /** Blocks allocated since the last slice of an incremental collection */
+  uint32_t allocationsSinceGcSlice;
+
+  /** Bytes free on the heap after the last full or incremental collection,
+   *  or UINT64_MAX if there hasn't been one yet
+   */
+  uint64_t bytesFreeAfterGc;
+
+  /** Decides when to run a full collection before the heap fills up and
+   *  how big the heap should be after one
+   */
+  GcPolicy gcPolicy;
+
+  /** What runThreadedCode() does at each address in the program area
+   *  (see findProgramEntries()).  NULL until the first call to
+   *  runThreadedCode(), if nothing uses it (see programAreaHasEntries()),
+   *  or if there was not enough memory for it.
+   */
+  uint8_t* programEntries;
+
+  /** Nonzero if findProgramEntries() should look for intrinsics */
+  int intrinsicsEnabled;
+
+  /** Intrinsics executed by runThreadedCode() */
+  VmIntrinsicStats intrinsicStats;
+
+  /** Compiles the code runThreadedCode() executes.  NULL if the JIT is
+   *  disabled.
+   */
+  VmJit jit;
+
+  /** Functions the MK* instructions created, which they share instead of
+   *  creating them again.  NULL if hash-consing is disabled.
+   */
+  HashConsTable hashCons;
+
+  /** Functions the MK* instructions looked for and found in hashCons */
+  VmHashConsStats hashConsStats;
+
+  /** Native code for blocks in the program area.  Set by setVmNativeCode()
+   *  and owned by its caller.
+   */
+  const VmNativeBlock* nativeBlocks;
+
+  /** Number of blocks in nativeBlocks */
+  uint64_t numNativeBlocks;
+
+  /** Native code for each address in the program area, or NULL where
+   *  there is none.  Built by findProgramEntries() along with
+   *  programEntries, and NULL if there are no native blocks.
+   */
+  VmNativeCode* nativeCode;
+
+  /** Breakpoints runVmUntil() stops at.  Set by the debugger and NULL
+   *  if no debugger is attached.
+   */
+  BreakpointList persistentBreakpoints;
+  BreakpointList transientBreakpoints;
 } UnlambdaVmImpl;
 
 static const char NO_PROGRAM[] = "";
@@ -386,14 +535,61 @@ const int VmAddressStackOverflowError = -12;
 const int VmNoProgramLoadedError = -13;
 const int VmFatalError = -14;
 const int VmIllegalArgumentError = -15;
+const int VmJitUnavailableError = -16;
+
+/** Values native code returns to runThreadedCode() */
+const int VmNativeExitInterpret = 1;
+const int VmNativeExitJump = 2;
+
+/** Values for the stopMask argument to runVmUntil() */
+const uint32_t VmStopAtBreakpoint = 1;
+
+/** Values for the garbage collector modes */
+const int VmGcMarkSweep = 0;
+const int VmGcCompacting = 1;
+const int VmGcIncremental = 2;
+const int VmGcConcurrent = 3;
+
+/** Default value of gcSliceBudget */
+#define DEFAULT_GC_SLICE_BUDGET 500
+
+/** Number of allocations between slices of an incremental collection */
+#define VM_GC_SLICE_INTERVAL 64
 
 static int executeNextInstruction(UnlambdaVM vm);
+static int runThreadedCode(UnlambdaVM vm, uint64_t maxInstructions,
+			   int checkBreakpoints);
+static int isVmAtBreakpoint(UnlambdaVM vm, uint64_t pc);
+static uint8_t* findProgramEntries(UnlambdaVM vm);
+static void discardProgramEntries(UnlambdaVM vm);
+static int programAreaHasEntries(UnlambdaVM vm);
+static int isProgramConstant(const uint8_t* memory, uint64_t programSize,
+			     uint64_t address);
+static int matchIntrinsic(const uint8_t* code, uint64_t size,
+			  uint64_t address);
 static int executePushInstruction(UnlambdaVM vm);
 static int executePopInstruction(UnlambdaVM vm);
 static int executeSwapInstruction(UnlambdaVM vm);
 static int executeDupInstruction(UnlambdaVM vm);
 static int executePCallInstruction(UnlambdaVM vm);
 static int executeReturnInstruction(UnlambdaVM vm);
+static int readAddressOperand(UnlambdaVM vm, uint64_t* operand);
+static int isTailCall(UnlambdaVM vm, uint64_t returnAddress);
+static int tailCallVm(UnlambdaVM vm, const char* instruction,
+		      uint64_t target);
+static int executePushPCallInstruction(UnlambdaVM vm);
+static int executePushPCallReturnInstruction(UnlambdaVM vm);
+static int executePCallReturnInstruction(UnlambdaVM vm);
+static int executePopPushReturnInstruction(UnlambdaVM vm);
+static uint64_t findSharedFunction(UnlambdaVM vm, uint8_t instruction,
+				   uint64_t u, uint64_t v);
+static void shareFunction(UnlambdaVM vm, uint8_t instruction, uint64_t u,
+			  uint64_t v, const CodeBlock* f);
+static int pushSharedFunction(UnlambdaVM vm, const char* instruction,
+			      uint64_t address, int numArgs);
+static void forgetUnreachableFunctions(VmMemory memory, uint64_t low,
+				       uint64_t high, void* vm);
+static int functionIsMarked(uint64_t address, void* memory);
 static int executeMkkInstruction(UnlambdaVM vm);
 static int executeMks0Instruction(UnlambdaVM vm);
 static int executeMks1Instruction(UnlambdaVM vm);
@@ -403,12 +599,16 @@ static int executeMkcInstruction(UnlambdaVM vm);
 static int executeSaveInstruction(UnlambdaVM vm);
 static int executeRestoreInstruction(UnlambdaVM vm);
 static int executePrintInstruction(UnlambdaVM vm);
-static int pushAddressToVmStack(UnlambdaVM vm, Stack s, uint64_t addr,
-				int stackOverflowErrorCode,
+static void loadVmStackPointers(Stack s, VmStackPointers* p);
+static void storeVmStackPointers(Stack s, const VmStackPointers* p);
+static void loadVmStacks(UnlambdaVM vm);
+static void storeVmStacks(UnlambdaVM vm);
+static int pushAddressToVmStack(UnlambdaVM vm, Stack s, VmStackPointers* p,
+				uint64_t addr, int stackOverflowErrorCode,
 				const char* stackOverflowErrorMsg,
 				const char* outOfMemoryErrorMsg);
-static int popAddressFromVmStack(UnlambdaVM vm, Stack s, uint64_t* addr,
-				 int stackUnderflowCode,
+static int popAddressFromVmStack(UnlambdaVM vm, VmStackPointers* p,
+				 uint64_t* addr, int stackUnderflowCode,
 				 const char* stackUnderflowMsg);
 static int pushToAddressStack(UnlambdaVM vm, uint64_t addr);
 static int popFromAddressStack(UnlambdaVM vm, uint64_t* addr);
@@ -422,12 +622,20 @@ static VmStateBlock* allocateVmStateBlock(UnlambdaVM vm,
 					  const char* instruction,
 					  uint32_t callStackSize,
 					  uint32_t addressStackSize);
+static int collectGarbage(UnlambdaVM vm);
+static int collectGarbageIfDue(UnlambdaVM vm);
+static void finishGcCycle(UnlambdaVM vm);
+static uint64_t heapBytesInUse(UnlambdaVM vm);
+static void runIncrementalGcSlice(UnlambdaVM vm);
+static void reachVmSafepoint(UnlambdaVM vm);
 static void reportBlockAllocationFailure(UnlambdaVM vm,
 					 const char* instruction,
 					 uint64_t size,
 					 const char* details);
 static void handleGcError(VmMemory memory, uint64_t address, HeapBlock* block,
 			  const char* details, void* unused);
+static void logVmAddressStack(UnlambdaVM vm);
+static void logVmCallStack(UnlambdaVM vm);
 static void logCodeBlockContent(Logger logger, VmMemory memory,
 				SymbolTable symtab, CodeBlock* codeBlock);
 static void logStateBlockContent(Logger logger, VmMemory memory,
@@ -442,9 +650,24 @@ UnlambdaVM createUnlambdaVM(uint32_t maxCallStackSize,
 			    uint32_t maxAddressStackSize,
 			    uint64_t initialMemorySize,
 			    uint64_t maxMemorySize) {
+  return createUnlambdaVMWithGc(maxCallStackSize, maxAddressStackSize,
+				initialMemorySize, maxMemorySize,
+				VmGcMarkSweep);
+}
+
+UnlambdaVM createUnlambdaVMWithGc(uint32_t maxCallStackSize,
+				  uint32_t maxAddressStackSize,
+				  uint64_t initialMemorySize,
+				  uint64_t maxMemorySize,
+				  int gcMode) {
   static const int initialCallStackSize = 1024;
   static const int initialAddressStackSize = 1024;
   static const uint32_t maxSymbolTableSize = 256 * 1024 * 1024;
+  if ((gcMode != VmGcMarkSweep) && (gcMode != VmGcCompacting)
+        && (gcMode != VmGcIncremental) && (gcMode != VmGcConcurrent)) {
+    return NULL;
+  }
+
   UnlambdaVM vm = (UnlambdaVM)malloc(sizeof(UnlambdaVmImpl));
   if (!vm) {
     return NULL;
@@ -485,6 +708,17 @@ UnlambdaVM createUnlambdaVM(uint32_t maxCallStackSize,
     return NULL;
   }
 
+  vm->gcPolicy = createGcPolicy(DEFAULT_GC_TARGET_LIVE_FRACTION,
+				DEFAULT_GC_MAX_TIME_PERCENT);
+  if (!vm->gcPolicy) {
+    destroySymbolTable(vm->symtab);
+    destroyVmMemory(vm->memory);
+    destroyStack(vm->addressStack);
+    destroyStack(vm->callStack);
+    return NULL;
+  }
+
+  loadVmStacks(vm);
   vm->programName = NO_PROGRAM;
   vm->state = VmStateNoProgram;
   vm->pc = 0;
@@ -492,6 +726,24 @@ UnlambdaVM createUnlambdaVM(uint32_t maxCallStackSize,
   vm->statusCode = 0;
   vm->statusMsg = OK_MSG;
   vm->gcErrorHandler = handleGcError;
+  vm->gcMode = gcMode;
+  vm->gcSliceBudget = DEFAULT_GC_SLICE_BUDGET;
+  vm->allocationsSinceGcSlice = 0;
+  vm->bytesFreeAfterGc = UINT64_MAX;
+  vm->programEntries = NULL;
+  vm->intrinsicsEnabled = 1;
+  vm->intrinsicStats.intrinsicsExecuted = 0;
+  vm->intrinsicStats.instructionsReplaced = 0;
+  vm->jit = NULL;
+  vm->hashCons = NULL;
+  vm->hashConsStats.lookups = 0;
+  vm->hashConsStats.hits = 0;
+  vm->hashConsStats.tableSize = 0;
+  vm->nativeBlocks = NULL;
+  vm->numNativeBlocks = 0;
+  vm->nativeCode = NULL;
+  vm->persistentBreakpoints = NULL;
+  vm->transientBreakpoints = NULL;
 
   return vm;
 }
@@ -501,8 +753,12 @@ void destroyUnlambdaVM(UnlambdaVM vm) {
     clearVmStatus(vm);
     destroySymbolTable(vm->symtab);
     destroyVmMemory(vm->memory);
+    destroyGcPolicy(vm->gcPolicy);
     destroyStack(vm->addressStack);
     destroyStack(vm->callStack);
+    discardProgramEntries(vm);
+    destroyVmJit(vm->jit);
+    destroyHashConsTable(vm->hashCons);
 
     if (vm->programName && (vm->programName != NO_PROGRAM)) {
       free((void*)vm->programName);
@@ -581,6 +837,22 @@ VmMemory getVmMemory(UnlambdaVM vm) {
   return vm->memory;
 }
 
+int getVmGcMode(UnlambdaVM vm) {
+  return vm->gcMode;
+}
+
+uint64_t getVmGcSliceBudget(UnlambdaVM vm) {
+  return vm->gcSliceBudget;
+}
+
+void setVmGcSliceBudget(UnlambdaVM vm, uint64_t usec) {
+  vm->gcSliceBudget = usec;
+}
+
+GcPolicy getVmGcPolicy(UnlambdaVM vm) {
+  return vm->gcPolicy;
+}
+
 uint8_t* ptrToVmPC(UnlambdaVM vm) {
   return ptrToVmmAddress(vm->memory, vm->pc);
 }
@@ -711,7 +983,11 @@ int stepVm(UnlambdaVM vm) {
     setVmStatus(vm, VmNoProgramLoadedError, "No program");
     return -1;
   } else if (vm->state == VmStateReady) {
-    return executeNextInstruction(vm);
+    loadVmStacks(vm);
+    reachVmSafepoint(vm);
+    const int result = executeNextInstruction(vm);
+    storeVmStacks(vm);
+    return result;
   } else if (vm->state == VmStateHalted) {
     setVmStatus(vm, VmHalted, "VM halted");
     return -1;
@@ -728,6 +1004,126 @@ int stepVm(UnlambdaVM vm) {
   /** Never get here */
 }
 
+int runVm(UnlambdaVM vm) {
+  return runVmUntil(vm, 0, 0);
+}
+
+int runVmUntil(UnlambdaVM vm, uint64_t maxInstructions, uint32_t stopMask) {
+  if (vm->state != VmStateReady) {
+    /** Let stepVm() report why the VM cannot run */
+    return stepVm(vm);
+  }
+
+  const int checkBreakpoints =
+    (stopMask & VmStopAtBreakpoint)
+      && ((vm->persistentBreakpoints
+	     && breakpointListSize(vm->persistentBreakpoints))
+	  || (vm->transientBreakpoints
+	        && breakpointListSize(vm->transientBreakpoints)));
+
+  if (!maxInstructions) {
+    maxInstructions = UINT64_MAX;
+  }
+
+  if (TRACING_IS_ENABLED(vm->logger, LogInstructions)
+        || TRACING_IS_ENABLED(vm->logger, LogStacks)) {
+    for (uint64_t n = 0; n < maxInstructions; ++n) {
+      if (n && checkBreakpoints && isVmAtBreakpoint(vm, vm->pc)) {
+	return 0;
+      }
+      if (stepVm(vm)) {
+	return -1;
+      }
+    }
+    return 0;
+  }
+
+  loadVmStacks(vm);
+  const int result = runThreadedCode(vm, maxInstructions, checkBreakpoints);
+  storeVmStacks(vm);
+  return result;
+}
+
+void setVmBreakpointLists(UnlambdaVM vm, BreakpointList persistent,
+			  BreakpointList transient) {
+  vm->persistentBreakpoints = persistent;
+  vm->transientBreakpoints = transient;
+}
+
+void setVmIntrinsicsEnabled(UnlambdaVM vm, int enabled) {
+  if (vm->intrinsicsEnabled != enabled) {
+    /** Find the program area's entries again when runVmUntil() next runs */
+    discardProgramEntries(vm);
+    vm->intrinsicsEnabled = enabled;
+  }
+}
+
+void getVmIntrinsicStats(UnlambdaVM vm, VmIntrinsicStats* stats) {
+  *stats = vm->intrinsicStats;
+}
+
+int enableVmJit(UnlambdaVM vm, uint32_t hotClosureThreshold) {
+  static const uint64_t JIT_CODE_BUFFER_SIZE = 16 * 1024 * 1024;
+  VmJit jit = createVmJit(JIT_CODE_BUFFER_SIZE, hotClosureThreshold);
+
+  clearVmStatus(vm);
+  if (!jit) {
+    setVmStatus(vm, VmJitUnavailableError,
+		"Could not create the JIT compiler");
+    return -1;
+  }
+
+  disableVmJit(vm);
+  vm->jit = jit;
+  return 0;
+}
+
+void disableVmJit(UnlambdaVM vm) {
+  /** Find the program area's entries again when runVmUntil() next runs */
+  discardProgramEntries(vm);
+  destroyVmJit(vm->jit);
+  vm->jit = NULL;
+}
+
+VmJit getVmJit(UnlambdaVM vm) {
+  return vm->jit;
+}
+
+int enableVmHashConsing(UnlambdaVM vm, uint32_t tableSize) {
+  HashConsTable table = createHashConsTable(tableSize);
+
+  clearVmStatus(vm);
+  if (!table) {
+    setVmStatus(vm, VmOutOfMemoryError,
+		"Could not allocate the table of functions to share");
+    return -1;
+  }
+
+  disableVmHashConsing(vm);
+  vm->hashCons = table;
+  setVmmWeakRefHandler(vm->memory, forgetUnreachableFunctions, vm);
+  return 0;
+}
+
+void disableVmHashConsing(UnlambdaVM vm) {
+  setVmmWeakRefHandler(vm->memory, NULL, NULL);
+  destroyHashConsTable(vm->hashCons);
+  vm->hashCons = NULL;
+}
+
+void getVmHashConsStats(UnlambdaVM vm, VmHashConsStats* stats) {
+  *stats = vm->hashConsStats;
+  stats->tableSize = vm->hashCons ? hashConsTableSize(vm->hashCons) : 0;
+}
+
+void setVmNativeCode(UnlambdaVM vm, const VmNativeBlock* blocks,
+		     uint64_t numBlocks) {
+  /** Find the program area's entries again when runVmUntil() next runs */
+  discardProgramEntries(vm);
+  vm->nativeBlocks = numBlocks ? blocks : NULL;
+  vm->numNativeBlocks = numBlocks;
+}
+
 void setVmLogger(UnlambdaVM vm, Logger logger) {
   vm->logger = logger;
   setVmmLogger(vm->memory, logger);
@@ -748,13 +1144,13 @@ static int executeNextInstruction(UnlambdaVM vm) {
     return -1;
   }
 
-  if (loggingModuleIsEnabled(vm->logger, LogInstructions)) {
+  if (TRACING_IS_ENABLED(vm->logger, LogInstructions)) {
     const char* instruction = disassembleOneLine(
       pcp, ptrToVmMemory(vm->memory), getVmmHeapStart(vm->memory),
       ptrToVmMemoryEnd(vm->memory), vm->symtab
     );
     if (instruction) {
-      logMessage(vm->logger, LogInstructions, "EXECUTE: %s", instruction);
+      LOG_TRACE(vm->logger, LogInstructions, "EXECUTE: %s", instruction);
       free((void*)instruction);
     }
   }
@@ -806,6 +1202,18 @@ static int executeNextInstruction(UnlambdaVM vm) {
     case PRINT_INSTRUCTION:
       return executePrintInstruction(vm);
 
+    case PUSH_PCALL_INSTRUCTION:
+      return executePushPCallInstruction(vm);
+
+    case PUSH_PCALL_RET_INSTRUCTION:
+      return executePushPCallReturnInstruction(vm);
+
+    case PCALL_RET_INSTRUCTION:
+      return executePCallReturnInstruction(vm);
+
+    case POP_PUSH_RET_INSTRUCTION:
+      return executePopPushReturnInstruction(vm);
+
     case HALT_INSTRUCTION:
       logMessage(vm->logger, LogGeneralInfo, "VM halted");
       vm->state = VmStateHalted;
@@ -825,6 +1233,635 @@ static int executeNextInstruction(UnlambdaVM vm) {
   }
 }
 
+/** The threaded interpreter behind runVm()
+ *
+ *  Keeps the PC, the stack pointers and the start of VM memory in local
+ *  variables and jumps directly from one instruction to the next
+ *  through label addresses instead of returning to a switch statement.
+ *  The entry on top of the address stack is also kept in a local
+ *  variable ("tos"), so PCALL, SWAP and DUP don't have to read it back
+ *  from memory.  Writes to the address stack still go through to memory,
+ *  so "tos" never needs to be written back.
+ *
+ *  PUSH, POP, SWAP, DUP, PCALL, RET and the superinstructions built
+ *  from them execute inline.  All other instructions, and any inline
+ *  instruction that would underflow a stack, need more memory for a stack
+ *  or transfer control to an illegal address, are executed by
+ *  executeNextInstruction() after the local state is written back to the
+ *  VM.  That way the results are identical to those of stepVm(), right
+ *  down to the error codes and messages.  The local state is reloaded
+ *  afterwards, since the instruction may have moved the VM's memory or
+ *  either of its stacks.
+ *
+ *  Code in the program area never changes once the program is loaded,
+ *  so when intrinsics, the JIT or native code are enabled, the first
+ *  call looks for the places where they can take over (see
+ *  findProgramEntries()).  Every call, return or jump to an address in
+ *  the program area checks vm->programEntries for that address and
+ *  hands execution to them.  Code reached any other way is interpreted.
+ *
+ *  Unless intrinsics are disabled, calls and returns to the instruction
+ *  sequences that implement Unlambda's primitives execute the sequence,
+ *  or most of it, in one step (see matchIntrinsic()).  Each intrinsic
+ *  counts as the number of instructions it replaces and falls back on
+ *  executing just its first instruction if it would pass the instruction
+ *  limit, so the results are still identical to those of stepVm().
+ *
+ *  If the JIT is enabled, every other address in the program area goes
+ *  to "executeJit", which runs the compiled code for it (see vm_jit.h).
+ *  When compiled code needs the interpreter, it returns the address where
+ *  it stopped.  Execution comes back to "executeJit" at the next call or
+ *  return into the program area.  Addresses that start blocks the JIT
+ *  can't compile, or whose compiled code stops too soon to be worth
+ *  entering, are interpreted from then on.
+ *
+ *  Blocks with native code from setVmNativeCode() go to "executeNative",
+ *  which calls the native code the same way.
+ *
+ *  None of these run while there are breakpoints to check, since they
+ *  don't stop at the instructions they skip over.
+ *
+ *  Stops after executing "maxInstructions" instructions.  If
+ *  "checkBreakpoints" is nonzero, also stops when the PC reaches a
+ *  breakpoint, except for a breakpoint at the first instruction, so
+ *  execution can resume from a breakpoint.
+ */
+static int runThreadedCode(UnlambdaVM vm, uint64_t maxInstructions,
+			   int checkBreakpoints) {
+  static const void* const dispatch[256] = {
+    [0 ... 255] = &&executeSlowly,
+    [PUSH_INSTRUCTION] = &&executePush,
+    [POP_INSTRUCTION] = &&executePop,
+    [SWAP_INSTRUCTION] = &&executeSwap,
+    [DUP_INSTRUCTION] = &&executeDup,
+    [PCALL_INSTRUCTION] = &&executePCall,
+    [RET_INSTRUCTION] = &&executeReturn,
+    [PUSH_PCALL_INSTRUCTION] = &&executePushPCall,
+    [PUSH_PCALL_RET_INSTRUCTION] = &&executePushPCallReturn,
+    [PCALL_RET_INSTRUCTION] = &&executePCallReturn,
+    [POP_PUSH_RET_INSTRUCTION] = &&executePopPushReturn
+  };
+  static const void* const enter[NUM_PROGRAM_ENTRIES] = {
+    [INTRINSIC_EVALUATE_ARGUMENT] = &&executeEvaluateArgument,
+    [INTRINSIC_EVALUATE_AND_RETURN] = &&executeEvaluateAndReturn,
+    [INTRINSIC_RETURN_CONSTANT] = &&executeReturnConstant,
+    [INTRINSIC_PRINT_AND_RETURN] = &&executePrintAndReturn,
+    [ENTRY_JIT] = &&executeJit,
+    [ENTRY_NATIVE] = &&executeNative
+  };
+
+  uint8_t* memStart;     /** Start of VM memory */
+  uint8_t* memEnd;       /** End of VM memory */
+  uint8_t* pc;           /** Next instruction to execute */
+  uint64_t programSize;  /** Size of the program area */
+  uint8_t* entries;      /** vm->programEntries */
+  uint64_t entriesSize;  /** Addresses in "entries", or 0 if not in use */
+  uint64_t* addrBottom;  /** Bottom of the address stack */
+  uint64_t* addrTop;     /** Top of the address stack */
+  uint64_t* addrLimit;   /** End of memory allocated to the address stack */
+  uint64_t* callBottom;  /** Bottom of the call stack */
+  uint64_t* callTop;     /** Top of the call stack */
+  uint64_t* callLimit;   /** End of memory allocated to the call stack */
+  uint64_t tos = 0;      /** addrTop[-1], if the address stack isn't empty */
+  uint64_t remaining = maxInstructions;  /** Instructions left to execute */
+  uint64_t target;
+  const void* jitCode;   /** Compiled code to execute next */
+  VmJitState jitState;   /** State shared with the compiled code */
+  int exitReason;        /** Why the compiled or native code stopped */
+  VmNativeCode nativeCode;    /** Native code to execute next */
+  VmNativeState nativeState;  /** State shared with the native code */
+  uint8_t* jitEntry = NULL;   /** Entry compiled code was entered from */
+  uint64_t jitEntryRemaining = 0;  /** "remaining" when it was entered */
+
+#define LOAD_VM_STATE()							\
+  do {									\
+    memStart = ptrToVmMemory(vm->memory);				\
+    memEnd = ptrToVmMemoryEnd(vm->memory);				\
+    addrBottom = vm->addressStackPtrs.bottom;				\
+    addrTop = vm->addressStackPtrs.top;					\
+    addrLimit = vm->addressStackPtrs.limit;				\
+    callBottom = vm->callStackPtrs.bottom;				\
+    callTop = vm->callStackPtrs.top;					\
+    callLimit = vm->callStackPtrs.limit;				\
+    if (addrTop != addrBottom) {					\
+      tos = addrTop[-1];						\
+    }									\
+  } while (0)
+
+#define SAVE_VM_STATE(PC)						\
+  do {									\
+    vm->pc = (PC);							\
+    vm->addressStackPtrs.top = addrTop;					\
+    vm->callStackPtrs.top = callTop;					\
+  } while (0)
+
+#define DISPATCH()							\
+  do {									\
+    if (!remaining--) {							\
+      goto stop;							\
+    }									\
+    if (checkBreakpoints && isVmAtBreakpoint(vm, pc - memStart)) {	\
+      goto stop;							\
+    }									\
+    if (pc >= memEnd) {							\
+      goto executeSlowly;						\
+    }									\
+    goto *dispatch[*pc];						\
+  } while (0)
+
+  /** "ADDRESS" must not depend on "pc" */
+#define JUMP(ADDRESS)							\
+  do {									\
+    pc = memStart + (ADDRESS);						\
+    if (((ADDRESS) < entriesSize) && entries[ADDRESS]) {		\
+      if (!remaining--) {						\
+	goto stop;							\
+      }									\
+      goto *enter[entries[ADDRESS]];					\
+    }									\
+    DISPATCH();								\
+  } while (0)
+
+#define COUNT_INTRINSIC(INSTRUCTIONS)					\
+  do {									\
+    ++vm->intrinsicStats.intrinsicsExecuted;				\
+    vm->intrinsicStats.instructionsReplaced += (INSTRUCTIONS);		\
+  } while (0)
+
+  LOAD_VM_STATE();
+
+  programSize = getVmmProgramMemorySize(vm->memory);
+  if (!vm->programEntries && programAreaHasEntries(vm)) {
+    vm->programEntries = findProgramEntries(vm);
+  }
+  entries = vm->programEntries;
+  entriesSize = (entries && !checkBreakpoints) ? programSize : 0;
+
+  /** Don't stop at a breakpoint on the first instruction */
+  --remaining;
+  pc = memStart + vm->pc;
+  if ((vm->pc < entriesSize) && entries[vm->pc]) {
+    goto *enter[entries[vm->pc]];
+  }
+  if (pc >= memEnd) {
+    goto executeSlowly;
+  }
+  goto *dispatch[*pc];
+
+stop:
+  SAVE_VM_STATE(pc - memStart);
+  return 0;
+
+executeSlowly:
+  SAVE_VM_STATE(pc - memStart);
+  reachVmSafepoint(vm);
+  if (executeNextInstruction(vm)) {
+    return -1;
+  }
+  if (!ptrToVmPC(vm)) {
+    /** Let executeNextInstruction() report the illegal PC */
+    return executeNextInstruction(vm);
+  }
+  LOAD_VM_STATE();
+  JUMP(vm->pc);
+
+executePush:
+  if (((memEnd - pc) < 9) || (addrTop == addrLimit)) {
+    goto executeSlowly;
+  }
+  memcpy(&tos, pc + 1, 8);
+  *addrTop++ = tos;
+  pc += 9;
+  DISPATCH();
+
+executePop:
+  if (addrTop == addrBottom) {
+    goto executeSlowly;
+  }
+  if (--addrTop != addrBottom) {
+    tos = addrTop[-1];
+  }
+  ++pc;
+  DISPATCH();
+
+executeSwap:
+  if ((addrTop - addrBottom) < 2) {
+    goto executeSlowly;
+  }
+  target = addrTop[-2];
+  addrTop[-2] = tos;
+  addrTop[-1] = target;
+  tos = target;
+  ++pc;
+  DISPATCH();
+
+executeDup:
+  if ((addrTop == addrBottom) || (addrTop == addrLimit)) {
+    goto executeSlowly;
+  }
+  *addrTop++ = tos;
+  ++pc;
+  DISPATCH();
+
+executePCall:
+  if ((addrTop == addrBottom) || ((callLimit - callTop) < 2)
+        || (tos >= (uint64_t)(memEnd - memStart))) {
+    goto executeSlowly;
+  }
+  target = tos;
+  if (--addrTop != addrBottom) {
+    tos = addrTop[-1];
+  }
+  if (((memEnd - pc) > 1) && (pc[1] == RET_INSTRUCTION)
+        && ((callTop - callBottom) >= 2)
+        && !isVmAtBreakpoint(vm, (pc + 1) - memStart)) {
+    callTop[-2] = target;
+    JUMP(target);
+  }
+  callTop[0] = target;
+  callTop[1] = (pc + 1) - memStart;
+  callTop += 2;
+  JUMP(target);
+
+executeReturn:
+  if (((callTop - callBottom) < 2)
+        || (callTop[-1] >= (uint64_t)(memEnd - memStart))) {
+    goto executeSlowly;
+  }
+  target = callTop[-1];
+  callTop -= 2;
+  JUMP(target);
+
+executePushPCall:
+  if (((memEnd - pc) < 9) || ((callLimit - callTop) < 2)) {
+    goto executeSlowly;
+  }
+  memcpy(&target, pc + 1, 8);
+  if (target >= (uint64_t)(memEnd - memStart)) {
+    goto executeSlowly;
+  }
+  if (((memEnd - pc) > 9) && (pc[9] == RET_INSTRUCTION)
+        && ((callTop - callBottom) >= 2)
+        && !isVmAtBreakpoint(vm, (pc + 9) - memStart)) {
+    callTop[-2] = target;
+    JUMP(target);
+  }
+  callTop[0] = target;
+  callTop[1] = (pc + 9) - memStart;
+  callTop += 2;
+  JUMP(target);
+
+executePushPCallReturn:
+  if (((memEnd - pc) < 9) || ((callTop - callBottom) < 2)) {
+    goto executeSlowly;
+  }
+  memcpy(&target, pc + 1, 8);
+  if (target >= (uint64_t)(memEnd - memStart)) {
+    goto executeSlowly;
+  }
+  callTop[-2] = target;
+  JUMP(target);
+
+executePCallReturn:
+  if ((addrTop == addrBottom) || ((callTop - callBottom) < 2)
+        || (tos >= (uint64_t)(memEnd - memStart))) {
+    goto executeSlowly;
+  }
+  target = tos;
+  if (--addrTop != addrBottom) {
+    tos = addrTop[-1];
+  }
+  callTop[-2] = target;
+  JUMP(target);
+
+executePopPushReturn:
+  if (((memEnd - pc) < 9) || (addrTop == addrBottom)
+        || ((callTop - callBottom) < 2)
+        || (callTop[-1] >= (uint64_t)(memEnd - memStart))) {
+    goto executeSlowly;
+  }
+  memcpy(&tos, pc + 1, 8);
+  addrTop[-1] = tos;
+  target = callTop[-1];
+  callTop -= 2;
+  JUMP(target);
+
+  /** Intrinsics.  Each one executes its whole instruction sequence or,
+   *  if it can't, falls back on the handler for its first instruction.
+   */
+executeEvaluateArgument:
+  /** Calling "PUSH a; RET" in the program area just replaces it with a */
+  if ((remaining < 2) || (addrTop == addrBottom)
+        || ((callLimit - callTop) < 2) || !isProgramConstant(memStart,
+							   programSize,
+							   tos)) {
+    goto executePCall;
+  }
+  memcpy(&tos, memStart + tos + 1, 8);
+  addrTop[-1] = tos;
+  remaining -= 2;
+  COUNT_INTRINSIC(3);
+  target = (pc + 1) - memStart;
+  JUMP(target);
+
+executeEvaluateAndReturn:
+  /** Same as executeEvaluateArgument, but PCALL makes a tail call, so
+   *  the RET in "PUSH a; RET" returns to this function's caller
+   */
+  if ((remaining < 2) || (addrTop == addrBottom)
+        || ((callTop - callBottom) < 2) || !isProgramConstant(memStart,
+							    programSize,
+							    tos)) {
+    goto executePCall;
+  }
+  callTop[-2] = tos;
+  pc = memStart + tos + 9;
+  memcpy(&tos, pc - 8, 8);
+  addrTop[-1] = tos;
+  remaining -= 2;
+  COUNT_INTRINSIC(3);
+  goto executeReturn;
+
+executeReturnConstant:
+  if ((remaining < 2) || (addrTop == addrBottom)) {
+    goto executePop;
+  }
+  memcpy(&tos, pc + 2, 8);
+  addrTop[-1] = tos;
+  remaining -= 2;
+  COUNT_INTRINSIC(3);
+  pc += 10;
+  goto executeReturn;
+
+executePrintAndReturn:
+  if (remaining < 1) {
+    goto executeSlowly;
+  }
+  printf("%c", (char)pc[1]);
+  --remaining;
+  COUNT_INTRINSIC(2);
+  pc += 2;
+  goto executeReturn;
+
+  /** Program area with the JIT enabled.  Compiled code runs until it
+   *  needs the interpreter, either to execute an instruction or to find
+   *  the code for the target of a call or return.
+   */
+executeJit:
+  jitCode = getVmJitCodeForProgram(vm->jit, memStart, programSize,
+				   pc - memStart);
+  if (!jitCode) {
+    /** Don't ask the JIT about this address again */
+    entries[pc - memStart] = ENTRY_INTERPRET;
+    goto *dispatch[*pc];
+  }
+  /** Compiled code counts the instruction JUMP() did */
+  ++remaining;
+  jitEntry = entries + (pc - memStart);
+  jitEntryRemaining = remaining;
+
+runJitCode:
+  jitState.addressStackTop = addrTop;
+  jitState.addressStackBottom = addrBottom;
+  jitState.addressStackLimit = addrLimit;
+  jitState.callStackTop = callTop;
+  jitState.callStackBottom = callBottom;
+  jitState.callStackLimit = callLimit;
+  jitState.remaining = remaining;
+  jitState.memorySize = memEnd - memStart;
+  jitState.programSize = programSize;
+  exitReason = runVmJitCode(vm->jit, &jitState, jitCode);
+
+  if (jitEntry) {
+    if (((jitEntryRemaining - jitState.remaining)
+	   < JIT_MIN_INSTRUCTIONS_PER_ENTRY)
+	  && (jitState.remaining >= JIT_MIN_INSTRUCTIONS_PER_ENTRY)) {
+      /** Interpret this block from now on.  Other compiled code can still
+       *  go to its compiled code directly.
+       */
+      *jitEntry = ENTRY_INTERPRET;
+    }
+    jitEntry = NULL;
+  }
+
+  addrTop = jitState.addressStackTop;
+  callTop = jitState.callStackTop;
+  remaining = jitState.remaining;
+  target = jitState.pc;
+  if (addrTop != addrBottom) {
+    tos = addrTop[-1];
+  }
+  if (exitReason == VmJitExitLookup) {
+    jitCode = (target < programSize)
+                ? getVmJitCodeForProgram(vm->jit, memStart, programSize,
+					 target)
+                : getVmJitCodeForClosure(vm->jit, memStart,
+					 memEnd - memStart, target);
+    if (jitCode) {
+      goto runJitCode;
+    }
+    JUMP(target);
+  }
+
+  goto interpretAfterCompiledCode;
+
+  /** Blocks setVmNativeCode() supplied native code for.  Native code
+   *  returns to the VM with the same kinds of exits as compiled code.
+   */
+executeNative:
+  nativeCode = vm->nativeCode[pc - memStart];
+  /** Native code counts the instruction JUMP() did */
+  ++remaining;
+
+runNativeCode:
+  nativeState.addressStackTop = addrTop;
+  nativeState.addressStackBottom = addrBottom;
+  nativeState.addressStackLimit = addrLimit;
+  nativeState.callStackTop = callTop;
+  nativeState.callStackBottom = callBottom;
+  nativeState.callStackLimit = callLimit;
+  nativeState.remaining = remaining;
+  nativeState.memorySize = memEnd - memStart;
+  exitReason = nativeCode(&nativeState);
+
+  addrTop = nativeState.addressStackTop;
+  callTop = nativeState.callStackTop;
+  remaining = nativeState.remaining;
+  target = nativeState.pc;
+  if (addrTop != addrBottom) {
+    tos = addrTop[-1];
+  }
+  if (exitReason == VmNativeExitJump) {
+    if ((target < programSize) && vm->nativeCode[target]) {
+      nativeCode = vm->nativeCode[target];
+      goto runNativeCode;
+    }
+    JUMP(target);
+  }
+
+interpretAfterCompiledCode:
+  /** Interpret the instruction compiled or native code stopped at */
+  pc = memStart + target;
+  DISPATCH();
+
+#undef COUNT_INTRINSIC
+#undef JUMP
+#undef DISPATCH
+#undef SAVE_VM_STATE
+#undef LOAD_VM_STATE
+}
+
+/** Find the places in the program area where runThreadedCode() hands
+ *  execution to intrinsics, compiled code or native code
+ *
+ *  Returns an array with one entry for each byte of the program area.
+ *  The entry for an address says what runThreadedCode() does when a
+ *  call, return or jump reaches that address: ENTRY_INTERPRET, one of
+ *  the INTRINSIC_* values, ENTRY_JIT or ENTRY_NATIVE.
+ *
+ *  Blocks setVmNativeCode() supplied native code for get ENTRY_NATIVE,
+ *  and vm->nativeCode is rebuilt to map their addresses to the native
+ *  code.  Otherwise, if the VM has intrinsics enabled, the first
+ *  instruction of each sequence matchIntrinsic() recognizes gets that
+ *  intrinsic.  If the JIT is enabled, every other address gets
+ *  ENTRY_JIT.
+ *
+ *  Returns NULL if memory for the entries could not be allocated.
+ *  runThreadedCode() just interprets the whole program in that case.
+ */
+static uint8_t* findProgramEntries(UnlambdaVM vm) {
+  const uint8_t* const code = getProgramStartInVmm(vm->memory);
+  const uint64_t size = getVmmProgramMemorySize(vm->memory);
+  uint8_t* const entries = (uint8_t*)malloc(size ? size : 1);
+  uint64_t numIntrinsics = 0;
+
+  if (!entries) {
+    return NULL;
+  }
+
+  free((void*)vm->nativeCode);
+  vm->nativeCode = NULL;
+  if (vm->numNativeBlocks) {
+    vm->nativeCode = (VmNativeCode*)calloc(size, sizeof(VmNativeCode));
+    if (!vm->nativeCode) {
+      free((void*)entries);
+      return NULL;
+    }
+    for (uint64_t i = 0; i < vm->numNativeBlocks; ++i) {
+      if (vm->nativeBlocks[i].address < size) {
+	vm->nativeCode[vm->nativeBlocks[i].address] = vm->nativeBlocks[i].code;
+      }
+    }
+  }
+
+  for (uint64_t i = 0; i < size; ++i) {
+    entries[i] = ENTRY_INTERPRET;
+    if (vm->nativeCode && vm->nativeCode[i]) {
+      entries[i] = ENTRY_NATIVE;
+    } else if (vm->intrinsicsEnabled) {
+      entries[i] = matchIntrinsic(code, size, i);
+      if (entries[i] != ENTRY_INTERPRET) {
+	++numIntrinsics;
+      }
+    }
+    if (vm->jit && (entries[i] == ENTRY_INTERPRET)) {
+      entries[i] = ENTRY_JIT;
+    }
+  }
+
+  LOG_TRACE(vm->logger, LogCodeBlocks,
+	    "Found %" PRIu64 " intrinsics in %" PRIu64 " bytes of program "
+	    "area", numIntrinsics, size);
+  return entries;
+}
+
+/** Throw away the program area's entries and the native code map built
+ *  with them, so runThreadedCode() finds them again
+ */
+static void discardProgramEntries(UnlambdaVM vm) {
+  free((void*)vm->programEntries);
+  vm->programEntries = NULL;
+  free((void*)vm->nativeCode);
+  vm->nativeCode = NULL;
+}
+
+/** Returns nonzero if anything in runThreadedCode() needs the program
+ *  area's entries
+ */
+static int programAreaHasEntries(UnlambdaVM vm) {
+  return vm->intrinsicsEnabled || vm->jit || vm->numNativeBlocks;
+}
+
+/** Returns nonzero if "address" is a "PUSH a; RET" function in the
+ *  program area, which is how compiled code passes primitives and other
+ *  constants
+ */
+static int isProgramConstant(const uint8_t* memory, uint64_t programSize,
+			     uint64_t address) {
+  return (address < programSize) && ((programSize - address) >= 10)
+           && (memory[address] == PUSH_INSTRUCTION)
+           && (memory[address + 9] == RET_INSTRUCTION);
+}
+
+/** Match the instruction sequence at "address" in the program area
+ *  against the sequences runThreadedCode() has intrinsics for
+ *
+ *  The sequences are the bodies of Unlambda's primitives, as listed at
+ *  the top of this file:
+ *  *  INTRINSIC_EVALUATE_ARGUMENT starts k, s, v and .<ch>, and
+ *       INTRINSIC_EVALUATE_AND_RETURN is all of i.  Both evaluate the
+ *       argument without a call when it is a "PUSH a; RET" function in
+ *       the program area (see isProgramConstant()).
+ *  *  INTRINSIC_RETURN_CONSTANT finishes v.
+ *  *  INTRINSIC_PRINT_AND_RETURN finishes .<ch>.
+ *
+ *  The closures k, s, d and c build are still built by the MK*
+ *  instructions, so the rest of their bodies runs as ordinary
+ *  instructions.
+ *
+ *  Every instruction in the sequence must be in the program area.
+ *
+ *  Returns the intrinsic's number, or ENTRY_INTERPRET if nothing
+ *  matches.  The intrinsics read their operands from the bytecode.
+ */
+static int matchIntrinsic(const uint8_t* code, uint64_t size,
+			  uint64_t address) {
+  const uint8_t* const p = code + address;
+  const uint64_t left = size - address;
+
+  switch (p[0]) {
+    case PCALL_INSTRUCTION:
+      if (left < 2) {
+	return ENTRY_INTERPRET;
+      }
+      return (p[1] == RET_INSTRUCTION) ? INTRINSIC_EVALUATE_AND_RETURN
+	                               : INTRINSIC_EVALUATE_ARGUMENT;
+
+    case POP_INSTRUCTION:
+      if ((left >= 11) && (p[1] == PUSH_INSTRUCTION)
+	    && (p[10] == RET_INSTRUCTION)) {
+	return INTRINSIC_RETURN_CONSTANT;
+      }
+      return ENTRY_INTERPRET;
+
+    case PRINT_INSTRUCTION:
+      if ((left >= 3) && (p[2] == RET_INSTRUCTION)) {
+	return INTRINSIC_PRINT_AND_RETURN;
+      }
+      return ENTRY_INTERPRET;
+
+    default:
+      return ENTRY_INTERPRET;
+  }
+}
+
+static int isVmAtBreakpoint(UnlambdaVM vm, uint64_t pc) {
+  return (vm->persistentBreakpoints
+	    && isAtBreakpoint(vm->persistentBreakpoints, pc))
+           || (vm->transientBreakpoints
+	         && isAtBreakpoint(vm->transientBreakpoints, pc));
+}
+
 static int executePushInstruction(UnlambdaVM vm) {
   uint8_t* p = ptrToVmPC(vm);
   
@@ -842,9 +1879,7 @@ static int executePushInstruction(UnlambdaVM vm) {
     return -1;
   }
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   
   vm->pc += 9;  
   return 0;
@@ -855,53 +1890,44 @@ static int executePopInstruction(UnlambdaVM vm) {
   if (popFromAddressStack(vm, &address)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions, "Value popped from stack: %" PRIu64,
-	     address);
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  LOG_TRACE(vm->logger, LogInstructions, "Value popped from stack: %" PRIu64,
+	    address);
+  logVmAddressStack(vm);
   ++(vm->pc);
   return 0;
 }
 
 static int executeSwapInstruction(UnlambdaVM vm) {
-  if (swapStackTop(vm->addressStack, 8)) {
-    assert(getStackStatus(vm->addressStack) == StackUnderflowError);
+  uint64_t* const top = vm->addressStackPtrs.top;
+
+  if ((top - vm->addressStackPtrs.bottom) < 2) {
     char msg[100];
     snprintf(msg, sizeof(msg), "Cannot SWAP a stack with only %lu entries",
-	     stackSize(vm->addressStack) / 8);
+	     (unsigned long)(top - vm->addressStackPtrs.bottom));
     setVmStatus(vm, VmAddressStackUnderflowError, msg);
     return -1;
   }
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+
+  const uint64_t tmp = top[-1];
+  top[-1] = top[-2];
+  top[-2] = tmp;
+  logVmAddressStack(vm);
   ++(vm->pc);
   return 0;
 }
 
 static int executeDupInstruction(UnlambdaVM vm) {
-  if (dupStackTop(vm->addressStack, 8)) {
-    const int status = getStackStatus(vm->addressStack);
-    if (status == StackUnderflowError) {
-      setVmStatus(vm, VmAddressStackUnderflowError,
-		  "Cannot DUP the top of an empty stack");
-    } else if (status == StackOverflowError) {
-      setVmStatus(vm, VmAddressStackOverflowError, "Address stack overflow");
-    } else {
-      if (status != StackMemoryAllocationFailedError) {
-	printf("status = %d\n", status);
-      }
-      assert(status == StackMemoryAllocationFailedError);
-      setVmStatus(vm, VmFatalError,
-		  "Cannot allocate more memory for the address stack");
-    }
+  if (vm->addressStackPtrs.top == vm->addressStackPtrs.bottom) {
+    setVmStatus(vm, VmAddressStackUnderflowError,
+		"Cannot DUP the top of an empty stack");
+    return -1;
+  }
+
+  if (pushToAddressStack(vm, vm->addressStackPtrs.top[-1])) {
     return -1;
   }
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   ++(vm->pc);
   return 0;
 }
@@ -912,11 +1938,9 @@ static int executePCallInstruction(UnlambdaVM vm) {
   if (popFromAddressStack(vm, &target)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions, "Argument for PCALL: %" PRIu64,
-	     target);
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  LOG_TRACE(vm->logger, LogInstructions, "Argument for PCALL: %" PRIu64,
+	    target);
+  logVmAddressStack(vm);
 
   if (!isValidVmmAddress(vm->memory, target)) {
     // Call to invalid address
@@ -930,17 +1954,25 @@ static int executePCallInstruction(UnlambdaVM vm) {
     return -1;
   }
 
-  if (pushToCallStack(vm, target)
-        || pushToCallStack(vm, vm->pc + 1)) {
+  if (isTailCall(vm, vm->pc + 1)) {
+    /** Can't fail, since the target and the call stack were just checked */
+    return tailCallVm(vm, "PCALL", target);
+  }
+
+  if (pushToCallStack(vm, target)) {
     // Push the address back onto the address stack.  Since we just popped
     // it, there should be space for it
     assert(!pushToAddressStack(vm, target));
     return -1;
   }
+  if (pushToCallStack(vm, vm->pc + 1)) {
+    // Don't leave half a frame on the call stack
+    --(vm->callStackPtrs.top);
+    assert(!pushToAddressStack(vm, target));
+    return -1;
+  }
 
-  logCallStack(vm->logger, vm->callStack,
-	       vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-	       vm->symtab);
+  logVmCallStack(vm);
   vm->pc = target;
   return 0;
 }
@@ -954,16 +1986,161 @@ static int executeReturnInstruction(UnlambdaVM vm) {
     return -1;
   }
 
-  logMessage(vm->logger, LogInstructions,
-	     "Return to %" PRIu64 " (block address was %" PRIu64 ")",
-	     target, block);
-  logCallStack(vm->logger, vm->callStack,
-	       vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-	       vm->symtab);
+  LOG_TRACE(vm->logger, LogInstructions,
+	    "Return to %" PRIu64 " (block address was %" PRIu64 ")",
+	    target, block);
+  logVmCallStack(vm);
+  vm->pc = target;
+  return 0;
+}
+
+static int readAddressOperand(UnlambdaVM vm, uint64_t* operand) {
+  uint8_t* p = ptrToVmPC(vm);
+  if ((p + 9) > ptrToVmMemoryEnd(vm->memory)) {
+    char msg[100];
+    snprintf(msg, sizeof(msg), "Cannot read 8 bytes from address %lu",
+	     vm->pc + 1);
+    setVmStatus(vm, VmIllegalAddressError, msg);
+    return -1;
+  }
+
+  memcpy(operand, p + 1, 8);
+  return 0;
+}
+
+/** Nonzero if a call that would return to "returnAddress" can reuse the
+ *  current function's frame on the call stack instead of pushing a new one
+ *
+ *  True when the instruction at "returnAddress" is a RET, which would just
+ *  return to the current function's caller, and the call stack has a
+ *  frame to reuse.  A breakpoint on the RET disables this, so the debugger
+ *  can still stop there.
+ */
+static int isTailCall(UnlambdaVM vm, uint64_t returnAddress) {
+  const uint8_t* const memory = ptrToVmMemory(vm->memory);
+  const uint64_t memorySize = ptrToVmMemoryEnd(vm->memory) - memory;
+
+  return (returnAddress < memorySize)
+           && (memory[returnAddress] == RET_INSTRUCTION)
+           && ((vm->callStackPtrs.top - vm->callStackPtrs.bottom) >= 2)
+           && !isVmAtBreakpoint(vm, returnAddress);
+}
+
+/** Replace the block in the frame on top of the call stack with "target"
+ *  and jump to it.  The return address in that frame stays the same, so
+ *  when "target" returns, it returns to the caller of the function
+ *  that made the tail call.
+ */
+static int tailCallVm(UnlambdaVM vm, const char* instruction,
+		      uint64_t target) {
+  if (!isValidVmmAddress(vm->memory, target)) {
+    char details[200];
+    snprintf(details, sizeof(details), "%s to invalid address 0x%" PRIx64,
+	     instruction, target);
+    setVmStatus(vm, VmIllegalAddressError, details);
+    return -1;
+  }
+
+  if ((vm->callStackPtrs.top - vm->callStackPtrs.bottom) < 2) {
+    setVmStatus(vm, VmCallStackUnderflowError, "Call stack underflow");
+    return -1;
+  }
+
+  vm->callStackPtrs.top[-2] = target;
+  logVmCallStack(vm);
+  vm->pc = target;
+  return 0;
+}
+
+static int executePushPCallInstruction(UnlambdaVM vm) {
+  uint64_t target = 0;
+
+  if (readAddressOperand(vm, &target)) {
+    return -1;
+  }
+
+  if (!isValidVmmAddress(vm->memory, target)) {
+    char details[200];
+    snprintf(details, sizeof(details),
+	     "PUSH_PCALL to invalid address 0x%" PRIx64, target);
+    setVmStatus(vm, VmIllegalAddressError, details);
+    return -1;
+  }
+
+  if (isTailCall(vm, vm->pc + 9)) {
+    return tailCallVm(vm, "PUSH_PCALL", target);
+  }
+
+  if (pushToCallStack(vm, target)) {
+    return -1;
+  }
+  if (pushToCallStack(vm, vm->pc + 9)) {
+    --(vm->callStackPtrs.top);
+    return -1;
+  }
+
+  logVmCallStack(vm);
   vm->pc = target;
   return 0;
 }
 
+static int executePushPCallReturnInstruction(UnlambdaVM vm) {
+  uint64_t target = 0;
+
+  if (readAddressOperand(vm, &target)) {
+    return -1;
+  }
+  return tailCallVm(vm, "PUSH_PCALL_RET", target);
+}
+
+static int executePCallReturnInstruction(UnlambdaVM vm) {
+  uint64_t target = 0;
+
+  if (popFromAddressStack(vm, &target)) {
+    return -1;
+  }
+  LOG_TRACE(vm->logger, LogInstructions, "Argument for PCALL_RET: %" PRIu64,
+	    target);
+
+  if (tailCallVm(vm, "PCALL_RET", target)) {
+    /** Put the address back onto the address stack */
+    assert(!pushToAddressStack(vm, target));
+    return -1;
+  }
+
+  logVmAddressStack(vm);
+  return 0;
+}
+
+static int executePopPushReturnInstruction(UnlambdaVM vm) {
+  VmStackPointers* const addressStack = &vm->addressStackPtrs;
+  VmStackPointers* const callStack = &vm->callStackPtrs;
+  uint64_t value = 0;
+
+  if (readAddressOperand(vm, &value)) {
+    return -1;
+  }
+
+  if (addressStack->top == addressStack->bottom) {
+    setVmStatus(vm, VmAddressStackUnderflowError, "Address stack underflow");
+    return -1;
+  }
+
+  if ((callStack->top - callStack->bottom) < 2) {
+    setVmStatus(vm, VmCallStackUnderflowError, "Call stack underflow");
+    return -1;
+  }
+
+  addressStack->top[-1] = value;
+  vm->pc = callStack->top[-1];
+  callStack->top -= 2;
+
+  LOG_TRACE(vm->logger, LogInstructions, "Return to %" PRIu64, vm->pc);
+  logVmAddressStack(vm);
+  logVmCallStack(vm);
+  return 0;
+}
+
 /** For all of the MK* instructions, or any instruction that pops arguments
  *  from the stack, allocates a code or state block, and then references
  *  those arguments in the generated code, do not pop the values from the
@@ -972,7 +2149,9 @@ static int executeReturnInstruction(UnlambdaVM vm) {
  *  new code or state block is constructed, leaving those blocks pointing
  *  to free blocks.  Instead, use readFromAddressStackTop() to read the
  *  arguments from the address stack without popping them, then construct
- *  the code or state block, then pop the values if successful.
+ *  the code or state block, then pop the values if successful.  The
+ *  compacting collector moves blocks, so read the arguments again after
+ *  the allocation.
  */
 static int executeMkkInstruction(UnlambdaVM vm) {
   uint64_t arg = 0;
@@ -981,27 +2160,30 @@ static int executeMkkInstruction(UnlambdaVM vm) {
     /** Error code set by readFromAddressStackTop() */
     return -1;    
   }
-  logMessage(vm->logger, LogInstructions, "Argument for MKK: %" PRIu64, arg);
+  LOG_TRACE(vm->logger, LogInstructions, "Argument for MKK: %" PRIu64, arg);
 
-  CodeBlock* f = allocateCodeBlock(vm, "MKK", 12);
+  const uint64_t shared = findSharedFunction(vm, MKK_INSTRUCTION, arg, 0);
+  if (shared) {
+    return pushSharedFunction(vm, "MKK", shared, 1);
+  }
+
+  CodeBlock* f = allocateCodeBlock(vm, "MKK", 10);
   if (!f) {
     return -1;
   }
+  readFromAddressStackTop(vm, 0, &arg);
+  shareFunction(vm, MKK_INSTRUCTION, arg, 0, f);
 
   f->code[0] = PCALL_INSTRUCTION;
-  f->code[1] = POP_INSTRUCTION;
-  f->code[2] = PUSH_INSTRUCTION;
-  *(uint64_t*)(f->code + 3) = arg;
-  f->code[11] = RET_INSTRUCTION;
+  f->code[1] = POP_PUSH_RET_INSTRUCTION;
+  *(uint64_t*)(f->code + 2) = arg;
 
   /** Just read 8 bytes, so this should always succeed */
   /** TODO: Create a replaceStackTop() operation to replace POP + PUSH */
   assert(!popFromAddressStack(vm, NULL));
   assert(!pushToAddressStack(vm, vmmAddressForPtr(vm->memory, f->code)));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logCodeBlockContent(vm->logger, vm->memory, vm->symtab, f);
   ++(vm->pc);
   return 0;
@@ -1013,12 +2195,19 @@ static int executeMks0Instruction(UnlambdaVM vm) {
   if (readFromAddressStackTop(vm, 0, &arg)) {
     return -1;    
   }
-  logMessage(vm->logger, LogInstructions, "Argument for MKS0: %" PRIu64, arg);
+  LOG_TRACE(vm->logger, LogInstructions, "Argument for MKS0: %" PRIu64, arg);
+
+  const uint64_t shared = findSharedFunction(vm, MKS0_INSTRUCTION, arg, 0);
+  if (shared) {
+    return pushSharedFunction(vm, "MKS0", shared, 1);
+  }
   
   CodeBlock* f = allocateCodeBlock(vm, "MKS0", 12);
   if (!f) {
     return -1;
   }
+  readFromAddressStackTop(vm, 0, &arg);
+  shareFunction(vm, MKS0_INSTRUCTION, arg, 0, f);
   f->code[0] = PCALL_INSTRUCTION;
   f->code[1] = PUSH_INSTRUCTION;
   *(uint64_t*)(f->code + 2) = arg;
@@ -1029,9 +2218,7 @@ static int executeMks0Instruction(UnlambdaVM vm) {
   assert(!popFromAddressStack(vm, NULL));
   assert(!pushToAddressStack(vm, vmmAddressForPtr(vm->memory, f->code)));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logCodeBlockContent(vm->logger, vm->memory, vm->symtab, f);
   ++(vm->pc);
   return 0;
@@ -1044,24 +2231,30 @@ static int executeMks1Instruction(UnlambdaVM vm) {
         || readFromAddressStackTop(vm, 1, &v)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions,
-	     "Arguments for MKS1: %" PRIu64 ", %" PRIu64, u, v);
+  LOG_TRACE(vm->logger, LogInstructions,
+	    "Arguments for MKS1: %" PRIu64 ", %" PRIu64, u, v);
+
+  const uint64_t shared = findSharedFunction(vm, MKS1_INSTRUCTION, u, v);
+  if (shared) {
+    return pushSharedFunction(vm, "MKS1", shared, 2);
+  }
 
-  CodeBlock* f = allocateCodeBlock(vm, "MKS1", 25);
+  CodeBlock* f = allocateCodeBlock(vm, "MKS1", 23);
   if (!f) {
     return -1;
   }
+  readFromAddressStackTop(vm, 0, &u);
+  readFromAddressStackTop(vm, 1, &v);
+  shareFunction(vm, MKS1_INSTRUCTION, u, v, f);
   f->code[0] = PCALL_INSTRUCTION; /** Evaluate w = z() */
   f->code[1] = DUP_INSTRUCTION;   /** Duplicate w */
   f->code[2] = PUSH_INSTRUCTION;  /** Push v */
   *(uint64_t*)(f->code + 3) = v;
   f->code[11] = MKS2_INSTRUCTION; /** Create q = lambda.v(w) */
   f->code[12] = SWAP_INSTRUCTION; /** Swap q and w */
-  f->code[13] = PUSH_INSTRUCTION; /** Push u */
+  f->code[13] = PUSH_PCALL_INSTRUCTION; /** Compute a = u(w) */
   *(uint64_t*)(f->code + 14) = u;
-  f->code[22] = PCALL_INSTRUCTION; /** Compute a = u(w) */
-  f->code[23] = PCALL_INSTRUCTION; /** Compute a(q) */
-  f->code[24] = RET_INSTRUCTION;
+  f->code[22] = PCALL_RET_INSTRUCTION; /** Compute a(q) and return it */
 
   /** Just read 16 bytes, so popping16 and pushing 8 should succeed */
   const uint64_t codeAddr = vmmAddressForPtr(vm->memory, f->code);
@@ -1070,9 +2263,7 @@ static int executeMks1Instruction(UnlambdaVM vm) {
   assert(!popFromAddressStack(vm, &arg2));
   assert(!pushToAddressStack(vm, codeAddr));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logCodeBlockContent(vm->logger, vm->memory, vm->symtab, f);
   ++(vm->pc);
   return 0;
@@ -1085,27 +2276,31 @@ static int executeMks2Instruction(UnlambdaVM vm) {
         || readFromAddressStackTop(vm, 1, &v)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions,
-	     "Arguments for MKS2: %" PRIu64 ", %" PRIu64, u, v);
+  LOG_TRACE(vm->logger, LogInstructions,
+	    "Arguments for MKS2: %" PRIu64 ", %" PRIu64, u, v);
+
+  const uint64_t shared = findSharedFunction(vm, MKS2_INSTRUCTION, u, v);
+  if (shared) {
+    return pushSharedFunction(vm, "MKS2", shared, 2);
+  }
 
-  CodeBlock* f = allocateCodeBlock(vm, "MKS2", 20);
+  CodeBlock* f = allocateCodeBlock(vm, "MKS2", 18);
   if (!f) {
     return -1;
   }
+  readFromAddressStackTop(vm, 0, &u);
+  readFromAddressStackTop(vm, 1, &v);
+  shareFunction(vm, MKS2_INSTRUCTION, u, v, f);
   f->code[0] = PUSH_INSTRUCTION;
   *(uint64_t*)(f->code + 1) = v;
-  f->code[9] = PUSH_INSTRUCTION;
+  f->code[9] = PUSH_PCALL_RET_INSTRUCTION;
   *(uint64_t*)(f->code + 10) = u;
-  f->code[18] = PCALL_INSTRUCTION;
-  f->code[19] = RET_INSTRUCTION;
 
   assert(!popFromAddressStack(vm, NULL));
   assert(!popFromAddressStack(vm, NULL));
   assert(!pushToAddressStack(vm, vmmAddressForPtr(vm->memory, f->code)));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logCodeBlockContent(vm->logger, vm->memory, vm->symtab, f);
   ++(vm->pc);
   return 0;
@@ -1117,46 +2312,129 @@ static int executeMkdInstruction(UnlambdaVM vm) {
   if (readFromAddressStackTop(vm, 0, &arg)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions, "Argument for MKD: %" PRIu64, arg);
+  LOG_TRACE(vm->logger, LogInstructions, "Argument for MKD: %" PRIu64, arg);
+
+  const uint64_t shared = findSharedFunction(vm, MKD_INSTRUCTION, arg, 0);
+  if (shared) {
+    return pushSharedFunction(vm, "MKD", shared, 1);
+  }
 
-  CodeBlock* f = allocateCodeBlock(vm, "MKD", 15);
+  CodeBlock* f = allocateCodeBlock(vm, "MKD", 13);
   if (!f) {
     return -1;
   }
-  f->code[0] = PUSH_INSTRUCTION;
+  readFromAddressStackTop(vm, 0, &arg);
+  shareFunction(vm, MKD_INSTRUCTION, arg, 0, f);
+  f->code[0] = PUSH_PCALL_INSTRUCTION;
   *(uint64_t*)(f->code + 1) = arg;
-  f->code[9] = PCALL_INSTRUCTION;
-  f->code[10] = SWAP_INSTRUCTION;
-  f->code[11] = PCALL_INSTRUCTION;
-  f->code[12] = SWAP_INSTRUCTION;
-  f->code[13] = PCALL_INSTRUCTION;
-  f->code[14] = RET_INSTRUCTION;
+  f->code[9] = SWAP_INSTRUCTION;
+  f->code[10] = PCALL_INSTRUCTION;
+  f->code[11] = SWAP_INSTRUCTION;
+  f->code[12] = PCALL_RET_INSTRUCTION;
 
   // Just read 8 bytes, so this should succeed
   assert(!popFromAddressStack(vm, NULL));
   assert(!pushToAddressStack(vm, vmmAddressForPtr(vm->memory, f->code)));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logCodeBlockContent(vm->logger, vm->memory, vm->symtab, f);
   ++(vm->pc);
   return 0;
 }
 
+/** Look for a live function "instruction" already created from "u" and
+ *  "v", if hash-consing is enabled
+ *
+ *  Returns the function's address, or 0 if there isn't one.
+ */
+static uint64_t findSharedFunction(UnlambdaVM vm, uint8_t instruction,
+				   uint64_t u, uint64_t v) {
+  if (!vm->hashCons) {
+    return 0;
+  }
+
+  ++vm->hashConsStats.lookups;
+  const uint64_t address = findInHashConsTable(vm->hashCons, instruction,
+					       u, v);
+
+  /** An incremental or concurrent collection frees the functions that
+   *  weren't reachable when it took its snapshot of the stacks, even if
+   *  the program reaches them again afterwards, so only the ones it has
+   *  already marked are safe to share until it is done
+   */
+  if (!address
+        || (vmmIncrementalCollectionInProgress(vm->memory)
+	      && !functionIsMarked(address, vm->memory))) {
+    return 0;
+  }
+
+  ++vm->hashConsStats.hits;
+  return address;
+}
+
+/** Add the function "instruction" just created from "u" and "v" to the
+ *  table of functions to share, if hash-consing is enabled
+ */
+static void shareFunction(UnlambdaVM vm, uint8_t instruction, uint64_t u,
+			  uint64_t v, const CodeBlock* f) {
+  if (vm->hashCons) {
+    addToHashConsTable(vm->hashCons, instruction, u, v,
+		       vmmAddressForPtr(vm->memory, f->code));
+  }
+}
+
+/** Replace the "numArgs" arguments on top of the address stack with the
+ *  address of the function findSharedFunction() found
+ */
+static int pushSharedFunction(UnlambdaVM vm, const char* instruction,
+			      uint64_t address, int numArgs) {
+  LOG_TRACE(vm->logger, LogInstructions, "%s shares the function at %"
+	    PRIu64, instruction, address);
+
+  /** The caller read "numArgs" addresses, so these should always
+   *  succeed
+   */
+  for (int i = 0; i < numArgs; ++i) {
+    assert(!popFromAddressStack(vm, NULL));
+  }
+  assert(!pushToAddressStack(vm, address));
+
+  logVmAddressStack(vm);
+  ++(vm->pc);
+  return 0;
+}
+
+/** Remove the functions the collector is about to free from the table of
+ *  functions to share
+ */
+static void forgetUnreachableFunctions(VmMemory memory, uint64_t low,
+				       uint64_t high, void* vm) {
+  pruneHashConsTable(((UnlambdaVM)vm)->hashCons, low, high,
+		     functionIsMarked, memory);
+}
+
+static int functionIsMarked(uint64_t address, void* memory) {
+  return vmmBlockIsMarked(
+    (VmMemory)memory,
+    (const HeapBlock*)(ptrToVmMemory((VmMemory)memory) + address
+		         - sizeof(HeapBlock))
+  );
+}
+
 static int executeMkcInstruction(UnlambdaVM vm) {
   uint64_t savedState = 0;
 
   if (readFromAddressStackTop(vm, 0, &savedState)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions, "Argument for MKC: %" PRIu64,
-	     savedState);
+  LOG_TRACE(vm->logger, LogInstructions, "Argument for MKC: %" PRIu64,
+	    savedState);
 
   CodeBlock* f = allocateCodeBlock(vm, "MKC", 13);
   if (!f) {
     return -1;
   }
+  readFromAddressStackTop(vm, 0, &savedState);
 
   f->code[0] = PCALL_INSTRUCTION;
   f->code[1] = PUSH_INSTRUCTION;
@@ -1169,9 +2447,7 @@ static int executeMkcInstruction(UnlambdaVM vm) {
   assert(!popFromAddressStack(vm, NULL));
   assert(!pushToAddressStack(vm, vmmAddressForPtr(vm->memory, f->code)));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logCodeBlockContent(vm->logger, vm->memory, vm->symtab, f);
   ++(vm->pc);
   return 0;
@@ -1180,8 +2456,12 @@ static int executeMkcInstruction(UnlambdaVM vm) {
 static int executeSaveInstruction(UnlambdaVM vm) {
   uint8_t* const ppc = ptrToVmPC(vm);
   const uint8_t skip = ppc[1];  /** # of addresses to skip on address stack */
+  const uint64_t callStackSize =
+    8 * (vm->callStackPtrs.top - vm->callStackPtrs.bottom);
+  const uint64_t addressStackSize =
+    8 * (vm->addressStackPtrs.top - vm->addressStackPtrs.bottom);
 
-  if (stackSize(vm->addressStack) < (8 * (uint64_t)skip)) {
+  if (addressStackSize < (8 * (uint64_t)skip)) {
     setVmStatus(vm, VmAddressStackUnderflowError, "Address stack underflow");
     return -1;
   }
@@ -1189,26 +2469,24 @@ static int executeSaveInstruction(UnlambdaVM vm) {
   /** Make sure there is space on the address stack for the pointer to
    *  the saved state block.
    */
-  if (stackSize(vm->addressStack) == stackMaxSize(vm->addressStack)) {
+  if (addressStackSize == stackMaxSize(vm->addressStack)) {
     setVmStatus(vm, VmAddressStackOverflowError, "Address stack overflow");
     return -1;
   }
   
   VmStateBlock* const state = allocateVmStateBlock(
-      vm, "SAVE", stackSize(vm->callStack) / 16,
-      (stackSize(vm->addressStack) / 8) - skip
+      vm, "SAVE", callStackSize / 16, (addressStackSize / 8) - skip
   );
   if (!state) {
     return -1;
   }
 
-  uint8_t* const addressStackStart =
-      state->stacks + stackSize(vm->callStack);
+  uint8_t* const addressStackStart = state->stacks + callStackSize;
 
-  memcpy((void*)state->stacks, (const void*)bottomOfStack(vm->callStack),
-	 stackSize(vm->callStack));
-  memcpy((void*)addressStackStart, (const void*)bottomOfStack(vm->addressStack),
-	 stackSize(vm->addressStack) - (8 * skip));
+  memcpy((void*)state->stacks, (const void*)vm->callStackPtrs.bottom,
+	 callStackSize);
+  memcpy((void*)addressStackStart, (const void*)vm->addressStackPtrs.bottom,
+	 addressStackSize - (8 * skip));
 
   // Address of state block's data goes on stack.  
   const uint64_t stateAddr = vmmAddressForPtr(vm->memory, (uint8_t*)state)
@@ -1218,9 +2496,7 @@ static int executeSaveInstruction(UnlambdaVM vm) {
    */
   assert(!pushToAddressStack(vm, stateAddr));
 
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmAddressStack(vm);
   logStateBlockContent(vm->logger, vm->memory, vm->symtab, state);
   vm->pc += 2;
   return 0;
@@ -1240,8 +2516,8 @@ static int executeRestoreInstruction(UnlambdaVM vm) {
   if (popFromAddressStack(vm, &savedStateAddr)) {
     return -1;
   }
-  logMessage(vm->logger, LogInstructions, "Address of state block: %" PRIu64,
-	     savedStateAddr);
+  LOG_TRACE(vm->logger, LogInstructions, "Address of state block: %" PRIu64,
+	    savedStateAddr);
   
   /** Get a pointer to the VmStateBlock on the heap */
   VmStateBlock* vmState = (VmStateBlock*)(
@@ -1271,7 +2547,8 @@ static int executeRestoreInstruction(UnlambdaVM vm) {
   }
 
   /** Save "save" addresses on the top of the address stack to push later */
-  if (stackSize(vm->addressStack) < bytesToSave) {
+  if ((8 * (uint64_t)(vm->addressStackPtrs.top - vm->addressStackPtrs.bottom))
+        < bytesToSave) {
     assert(!pushToAddressStack(vm, savedStateAddr));
     setVmStatus(vm, VmAddressStackUnderflowError, "Address stack underflow");
     return -1;
@@ -1287,7 +2564,7 @@ static int executeRestoreInstruction(UnlambdaVM vm) {
   }
 
   memcpy((void*)savedData,
-	 (const void*)(topOfStack(vm->addressStack) - bytesToSave),
+	 (const void*)((uint8_t*)vm->addressStackPtrs.top - bytesToSave),
 	 bytesToSave);
 
   /** Ensure the address stack can hold the restored stack plus any data
@@ -1300,14 +2577,17 @@ static int executeRestoreInstruction(UnlambdaVM vm) {
     return -1;
   }
   
-  /** Restore the call and address stacks */
-
+  /** Restore the call and address stacks.  The Stack API may need to
+   *  grow them, so the stack pointers have to be reloaded afterwards.
+   */
+  storeVmStacks(vm);
   if (setStack(vm->callStack, vmState->stacks, 16 * vmState->callStackSize)) {
     char msg[200];
     snprintf(msg, sizeof(msg), "Could not restore call stack (%s)",
 	     getStackStatusMsg(vm->callStack));
     setVmStatus(vm, VmFatalError, msg);
     free((void*)savedData);
+    loadVmStacks(vm);
     return -1;
   }
 
@@ -1320,6 +2600,7 @@ static int executeRestoreInstruction(UnlambdaVM vm) {
 	     getStackStatusMsg(vm->addressStack));
     setVmStatus(vm, VmFatalError, msg);
     free((void*)savedData);
+    loadVmStacks(vm);
     return -1;    
   }
 
@@ -1335,18 +2616,16 @@ static int executeRestoreInstruction(UnlambdaVM vm) {
 		    "Could not allocate more memory for the address stack");
       }
       free((void*)savedData);
+      loadVmStacks(vm);
       return -1;
     }
   }
 
   free((void*)savedData);
+  loadVmStacks(vm);
 
-  logCallStack(vm->logger, vm->callStack,
-	       vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-	       vm->symtab);
-  logAddressStack(vm->logger, vm->addressStack,
-		  vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
-		  vm->symtab);
+  logVmCallStack(vm);
+  logVmAddressStack(vm);
 
   vm->pc += 2;
   return 0;
@@ -1359,10 +2638,37 @@ static int executePrintInstruction(UnlambdaVM vm) {
   return 0;
 }
 
-static int pushAddressToVmStack(UnlambdaVM vm, Stack s, uint64_t addr,
-				int stackOverflowErrorCode,
+static void loadVmStackPointers(Stack s, VmStackPointers* p) {
+  p->bottom = (uint64_t*)bottomOfStack(s);
+  p->top = (uint64_t*)topOfStack(s);
+  p->limit = p->bottom + stackAllocated(s) / sizeof(uint64_t);
+}
+
+static void storeVmStackPointers(Stack s, const VmStackPointers* p) {
+  setStackTop(s, (uint8_t*)p->top);
+}
+
+static void loadVmStacks(UnlambdaVM vm) {
+  loadVmStackPointers(vm->callStack, &vm->callStackPtrs);
+  loadVmStackPointers(vm->addressStack, &vm->addressStackPtrs);
+}
+
+static void storeVmStacks(UnlambdaVM vm) {
+  storeVmStackPointers(vm->callStack, &vm->callStackPtrs);
+  storeVmStackPointers(vm->addressStack, &vm->addressStackPtrs);
+}
+
+static int pushAddressToVmStack(UnlambdaVM vm, Stack s, VmStackPointers* p,
+				uint64_t addr, int stackOverflowErrorCode,
 				const char* stackOverflowErrorMsg,
 				const char* outOfMemoryErrorMsg) {
+  if (p->top < p->limit) {
+    *(p->top++) = addr;
+    return 0;
+  }
+
+  /** Out of room, so let the Stack grow itself */
+  storeVmStackPointers(s, p);
   if (pushStack(s, &addr, sizeof(addr))) {
     const int status = getStackStatus(s);
 
@@ -1374,56 +2680,60 @@ static int pushAddressToVmStack(UnlambdaVM vm, Stack s, uint64_t addr,
     }
     return -1;
   }
+  loadVmStackPointers(s, p);
   return 0;
 }
 
-static int popAddressFromVmStack(UnlambdaVM vm, Stack s, uint64_t* addr,
-				 int stackUnderflowErrorCode,
+static int popAddressFromVmStack(UnlambdaVM vm, VmStackPointers* p,
+				 uint64_t* addr, int stackUnderflowErrorCode,
 				 const char* stackUnderflowErrorMsg) {
-  if (popStack(s, addr, sizeof(uint64_t))) {
-    assert(getStackStatus(s) == StackUnderflowError);
+  if (p->top == p->bottom) {
     setVmStatus(vm, stackUnderflowErrorCode, stackUnderflowErrorMsg);
     return -1;
   }
+
+  --(p->top);
+  if (addr) {
+    *addr = *(p->top);
+  }
   return 0;
 }
 
 static int pushToAddressStack(UnlambdaVM vm, uint64_t addr) {
   return pushAddressToVmStack(
-      vm, vm->addressStack, addr, VmAddressStackOverflowError,
-      "Address stack overflow",
+      vm, vm->addressStack, &vm->addressStackPtrs, addr,
+      VmAddressStackOverflowError, "Address stack overflow",
       "Cannot allocate more memory for the address stack"
   );
 }
 
 static int popFromAddressStack(UnlambdaVM vm, uint64_t* addr) {
-  return popAddressFromVmStack(vm, vm->addressStack, addr,
+  return popAddressFromVmStack(vm, &vm->addressStackPtrs, addr,
 			       VmAddressStackUnderflowError,
 			       "Address stack underflow");
 }
 
 static int pushToCallStack(UnlambdaVM vm, uint64_t addr) {
-  return pushAddressToVmStack(vm, vm->callStack, addr, VmCallStackOverflowError,
-			      "Call stack overflow",
+  return pushAddressToVmStack(vm, vm->callStack, &vm->callStackPtrs, addr,
+			      VmCallStackOverflowError, "Call stack overflow",
 			      "Cannot allocate more memory for the call stack");
 }
 
 static int popFromCallStack(UnlambdaVM vm, uint64_t* addr) {
-  return popAddressFromVmStack(vm, vm->callStack, addr,
+  return popAddressFromVmStack(vm, &vm->callStackPtrs, addr,
 			       VmCallStackUnderflowError,
 			       "Call stack underflow");
 }
 
 static int readFromAddressStackTop(UnlambdaVM vm, uint64_t depth,
 				   uint64_t* value) {
-  Stack addressStack = getVmAddressStack(vm);
-  const uint64_t offset = (depth + 1) * 8;
-  if ((offset < (depth + 1)) || (offset > stackSize(addressStack))) {
+  const VmStackPointers* const p = &vm->addressStackPtrs;
+  if (depth >= (uint64_t)(p->top - p->bottom)) {
     setVmStatus(vm, VmAddressStackUnderflowError, "Address stack underflow");
     return -1;
   }
 
-  *value = *(uint64_t*)(topOfStack(addressStack) - offset);
+  *value = p->top[-1 - (int64_t)depth];
   return 0;
 }
 
@@ -1432,12 +2742,29 @@ static CodeBlock* allocateCodeBlock(UnlambdaVM vm, const char* instruction,
   logMessage(vm->logger, LogMemoryAllocations,
 	     "Allocate CODE block of size %" PRIu64 " for %s", size,
 	     instruction);
-  CodeBlock* f = allocateVmmCodeBlock(vm->memory, size);
+  if ((vm->gcMode == VmGcIncremental) || (vm->gcMode == VmGcConcurrent)) {
+    runIncrementalGcSlice(vm);
+  } else if (collectGarbageIfDue(vm)) {
+    reportBlockAllocationFailure(vm, instruction, size, "GC failed");
+    return NULL;
+  }
+  CodeBlock* f = allocateVmmCodeBlockFromNursery(vm->memory, size);
+  if ((!f) && (getVmmStatus(vm->memory) == VmmNurseryFullError)) {
+    logMessage(vm->logger, LogMemoryAllocations,
+	       "Nursery is full - collect unreachable blocks in the nursery");
+    storeVmStacks(vm);
+    if (collectVmmNursery(vm->memory, vm->callStack, vm->addressStack,
+			  vm->gcErrorHandler, NULL)) {
+      reportBlockAllocationFailure(vm, instruction, size, "GC failed");
+      return NULL;
+    }
+    f = allocateVmmCodeBlockFromNursery(vm->memory, size);
+  }
+
   if (!f) {
     logMessage(vm->logger, LogMemoryAllocations,
 	       "Not enough memory - collect unreachable blocks");
-    if (collectUnreachableVmmBlocks(vm->memory, vm->callStack, vm->addressStack,
-				    vm->gcErrorHandler, NULL)) {
+    if (collectGarbage(vm)) {
       /** If collection fails, the heap is corrupt, so indicate we could
        *  not allocate the code block on the heap
        */
@@ -1445,7 +2772,7 @@ static CodeBlock* allocateCodeBlock(UnlambdaVM vm, const char* instruction,
       return NULL;
     }
 
-    f = allocateVmmCodeBlock(vm->memory, size);
+    f = allocateVmmCodeBlockFromNursery(vm->memory, size);
     while ((!f) && (currentVmmSize(vm->memory) < maxVmmSize(vm->memory))) {
       logMessage(vm->logger, LogMemoryAllocations,
 		 "Still not enough memory - increase VM memory");
@@ -1457,7 +2784,7 @@ static CodeBlock* allocateCodeBlock(UnlambdaVM vm, const char* instruction,
       logMessage(vm->logger, LogMemoryAllocations,
 		 "VM memory increased to %" PRIu64 " bytes",
 		 currentVmmSize(vm->memory));
-      f = allocateVmmCodeBlock(vm->memory, size);
+      f = allocateVmmCodeBlockFromNursery(vm->memory, size);
     }
 
     if (!f) {
@@ -1475,9 +2802,17 @@ static VmStateBlock* allocateVmStateBlock(UnlambdaVM vm,
 					  const char* instruction,
 					  uint32_t callStackSize,
 					  uint32_t addressStackSize) {
+  const uint64_t size = 16 * callStackSize + 8 * addressStackSize + 16;
+
+  if ((vm->gcMode == VmGcIncremental) || (vm->gcMode == VmGcConcurrent)) {
+    runIncrementalGcSlice(vm);
+  } else if (collectGarbageIfDue(vm)) {
+    reportBlockAllocationFailure(vm, instruction, size, "GC failed");
+    return NULL;
+  }
+
   VmStateBlock* b = allocateVmmStateBlock(vm->memory, callStackSize,
 					  addressStackSize);
-  const uint64_t size = 16 * callStackSize + 8 * addressStackSize + 16;
 
   logMessage(vm->logger, LogMemoryAllocations, "Allocate STATE block for %s "
 	     "with %" PRIu64 " call stack frames and %"  PRIu64 " address "
@@ -1486,8 +2821,7 @@ static VmStateBlock* allocateVmStateBlock(UnlambdaVM vm,
   if (!b) {
     logMessage(vm->logger, LogMemoryAllocations,
 	       "Not enough memory - collect unreachable blocks");
-    if (collectUnreachableVmmBlocks(vm->memory, vm->callStack, vm->addressStack,
-				    vm->gcErrorHandler, NULL)) {
+    if (collectGarbage(vm)) {
       /** If collection fails, the heap is corrupt, so indicate we could
        *  not allocate the code block on the heap
        */
@@ -1521,6 +2855,171 @@ static VmStateBlock* allocateVmStateBlock(UnlambdaVM vm,
   return b;
 }
 
+/** Run a full collection with the VM's collector */
+static int collectGarbage(UnlambdaVM vm) {
+  int result;
+
+  storeVmStacks(vm);
+  if (vm->gcMode == VmGcCompacting) {
+    startGcPolicyCollection(vm->gcPolicy, heapBytesInUse(vm));
+    result = collectAndCompactVmmBlocks(vm->memory, vm->callStack,
+					vm->addressStack, &vm->pc,
+					vm->gcErrorHandler, NULL);
+  } else if (((vm->gcMode == VmGcIncremental)
+	        || (vm->gcMode == VmGcConcurrent))
+	       && vmmIncrementalCollectionInProgress(vm->memory)) {
+    /** The GC policy has been timing this collection since it started */
+    resumeGcPolicyCollection(vm->gcPolicy);
+    result = finishIncrementalVmmCollection(vm->memory, vm->gcErrorHandler,
+					    NULL);
+  } else {
+    startGcPolicyCollection(vm->gcPolicy, heapBytesInUse(vm));
+    result = collectUnreachableVmmBlocks(vm->memory, vm->callStack,
+					 vm->addressStack, vm->gcErrorHandler,
+					 NULL);
+  }
+  if (!result) {
+    finishGcCycle(vm);
+  }
+  return result;
+}
+
+/** Run a full collection if the GC policy says the program has allocated
+ *  enough since the last one, even though the heap may still have room
+ *
+ *  Returns 0 if successful or nonzero if the collection failed.
+ */
+static int collectGarbageIfDue(UnlambdaVM vm) {
+  const uint64_t bytesAllocated = vmmBytesAllocatedSinceGc(vm->memory);
+  if (!gcPolicyShouldCollect(vm->gcPolicy, bytesAllocated)) {
+    return 0;
+  }
+
+  logMessage(vm->logger, LogMemoryAllocations,
+	     "Allocated %" PRIu64 " bytes since the last collection - "
+	     "collect unreachable blocks", bytesAllocated);
+  return collectGarbage(vm);
+}
+
+/** Tell the GC policy about the full collection that just finished and
+ *  grow the heap to the size the policy asks for
+ *
+ *  The memory doubles until the heap is that big, same as when an
+ *  allocation fails, so growing a little at a time doesn't copy the heap
+ *  over and over.  Growing the heap is only an optimization here, so if
+ *  the memory can't grow, the VM carries on and collects more often.
+ */
+static void finishGcCycle(UnlambdaVM vm) {
+  const uint64_t bytesLive = vmmBytesLive(vm->memory);
+  const uint64_t targetHeapSize =
+    finishGcPolicyCollection(vm->gcPolicy, vmmHeapSize(vm->memory),
+			     bytesLive);
+
+  while ((vmmHeapSize(vm->memory) < targetHeapSize)
+	   && (currentVmmSize(vm->memory) < maxVmmSize(vm->memory))) {
+    logMessage(vm->logger, LogMemoryAllocations,
+	       "%" PRIu64 "/%" PRIu64 " bytes live after collection - "
+	       "increase VM memory", bytesLive, vmmHeapSize(vm->memory));
+    if (increaseVmmSize(vm->memory)) {
+      logMessage(vm->logger, LogMemoryAllocations,
+		 "Could not increase VM memory (%s)",
+		 getVmmStatusMsg(vm->memory));
+      clearVmmStatus(vm->memory);
+      break;
+    }
+  }
+
+  /** Give the free memory back to the system once the heap in use drops
+   *  well below its high-water mark.  The pages come back as the program
+   *  allocates blocks on them again.
+   */
+  const uint64_t bytesInUse = heapBytesInUse(vm);
+  if (gcPolicyShouldReleaseMemory(vm->gcPolicy, bytesInUse)) {
+    const uint64_t bytesReleased = releaseVmmFreeMemory(vm->memory);
+    logMessage(vm->logger, LogMemoryAllocations,
+	       "%" PRIu64 " bytes in use after collection, down from %"
+	       PRIu64 " - returned %" PRIu64 " free bytes to the system",
+	       bytesInUse, gcPolicyHighWaterMark(vm->gcPolicy),
+	       bytesReleased);
+    resetGcPolicyHighWaterMark(vm->gcPolicy, bytesInUse);
+  }
+  vm->bytesFreeAfterGc = vmmBytesFree(vm->memory);
+}
+
+/** Number of bytes in use on the heap, including blocks a lazy sweep
+ *  hasn't freed yet
+ */
+static uint64_t heapBytesInUse(UnlambdaVM vm) {
+  return vmmHeapSize(vm->memory) - vmmBytesFree(vm->memory);
+}
+
+/** Start an incremental or concurrent collection when the heap is
+ *  getting full, or mark part of the heap for the incremental collection
+ *  in progress every VM_GC_SLICE_INTERVAL allocations
+ *
+ *  The GC policy times the whole cycle as one collection, but only
+ *  counts the slices, not the program running between them.
+ *
+ *  When most of the heap is live, the last collection freed little, and
+ *  starting another collection right away would find little more, so
+ *  the VM waits until the program has used half of what it freed.  It
+ *  also starts one when the GC policy's allocation budget runs out.
+ */
+static void runIncrementalGcSlice(UnlambdaVM vm) {
+  if (!vmmIncrementalCollectionInProgress(vm->memory)) {
+    const uint64_t bytesFree = vmmBytesFree(vm->memory);
+    if (((bytesFree < (vmmHeapSize(vm->memory) / 4))
+	   && (bytesFree < (vm->bytesFreeAfterGc / 2)))
+	  || gcPolicyShouldCollect(vm->gcPolicy,
+				   vmmBytesAllocatedSinceGc(vm->memory))) {
+      storeVmStacks(vm);
+      startGcPolicyCollection(vm->gcPolicy, heapBytesInUse(vm));
+      if (vm->gcMode == VmGcConcurrent) {
+	logMessage(vm->logger, LogMemoryAllocations,
+		   "Heap is getting full - start concurrent collection");
+	startConcurrentVmmCollection(vm->memory, vm->callStack,
+				     vm->addressStack, vm->gcErrorHandler,
+				     NULL);
+      } else {
+	logMessage(vm->logger, LogMemoryAllocations,
+		   "Heap is getting full - start incremental collection");
+	startIncrementalVmmCollection(vm->memory, vm->callStack,
+				      vm->addressStack, vm->gcErrorHandler,
+				      NULL);
+      }
+      suspendGcPolicyCollection(vm->gcPolicy);
+      vm->allocationsSinceGcSlice = 0;
+    }
+  } else if ((vm->gcMode == VmGcIncremental)
+	       && (++vm->allocationsSinceGcSlice >= VM_GC_SLICE_INTERVAL)) {
+    resumeGcPolicyCollection(vm->gcPolicy);
+    continueIncrementalVmmCollection(vm->memory, vm->gcSliceBudget,
+				     vm->gcErrorHandler, NULL);
+    vm->allocationsSinceGcSlice = 0;
+    if (vmmIncrementalCollectionInProgress(vm->memory)) {
+      suspendGcPolicyCollection(vm->gcPolicy);
+    } else {
+      finishGcCycle(vm);
+    }
+  }
+}
+
+/** Finish the concurrent collection in progress once its thread is done
+ *  marking the heap
+ *
+ *  Called between instructions, with the VM's state written back to it,
+ *  so the collector is free to change the heap.
+ */
+static void reachVmSafepoint(UnlambdaVM vm) {
+  if ((vm->gcMode == VmGcConcurrent) && vmmGcSafepointRequested(vm->memory)) {
+    logMessage(vm->logger, LogMemoryAllocations,
+	       "Concurrent mark is done - collect unreachable blocks");
+    resumeGcPolicyCollection(vm->gcPolicy);
+    finishIncrementalVmmCollection(vm->memory, vm->gcErrorHandler, NULL);
+    finishGcCycle(vm);
+  }
+}
+
 static void reportBlockAllocationFailure(UnlambdaVM vm,
 					 const char* instruction,
 					 uint64_t size,
@@ -1538,17 +3037,35 @@ static void handleGcError(VmMemory memory, uint64_t address, HeapBlock* block,
   snprintf(msg, sizeof(msg),
 	   "**GC ERROR at address 0x%" PRIX64 " (block size=0x%" PRIu64
 	   ", type = %u, mark = %d): %s\n", address, getVmmBlockSize(block),
-	   getVmmBlockType(block), vmmBlockIsMarked(block), details);
+	   getVmmBlockType(block), vmmBlockIsMarked(memory, block), details);
   /** TODO: Log GC errors from within vmmem */
   logMessage(getVmmLogger(memory), LogGeneralInfo, msg);
   printf("%s", msg);
 }
 
+static void logVmAddressStack(UnlambdaVM vm) {
+  if (TRACING_IS_ENABLED(vm->logger, LogStacks)) {
+    storeVmStackPointers(vm->addressStack, &vm->addressStackPtrs);
+    LOG_ADDRESS_STACK(vm->logger, vm->addressStack,
+		      vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
+		      vm->symtab);
+  }
+}
+
+static void logVmCallStack(UnlambdaVM vm) {
+  if (TRACING_IS_ENABLED(vm->logger, LogStacks)) {
+    storeVmStackPointers(vm->callStack, &vm->callStackPtrs);
+    LOG_CALL_STACK(vm->logger, vm->callStack,
+		   vmmAddressForPtr(vm->memory, getVmmHeapStart(vm->memory)),
+		   vm->symtab);
+  }
+}
+
 static void logCodeBlockContent(Logger logger, VmMemory memory,
 				SymbolTable symtab, CodeBlock* codeBlock) {
   static const uint32_t MAX_LINES = 100;
   
-  if (loggingModuleIsEnabled(logger, LogCodeBlocks)) {
+  if (TRACING_IS_ENABLED(logger, LogCodeBlocks)) {
     char *text = NULL;
     size_t textLength = 0;
     FILE* memstream = open_memstream(&text, &textLength);
@@ -1557,8 +3074,8 @@ static void logCodeBlockContent(Logger logger, VmMemory memory,
       getVmmBlockSize((HeapBlock*)codeBlock) - sizeof(HeapBlock);
 
     if (!memstream) {
-      logMessage(logger, LogCodeBlocks, "Could not log code block at %" PRIu64
-		 ": open_memstream returned NULL", codeBlockAddress);
+      LOG_TRACE(logger, LogCodeBlocks, "Could not log code block at %" PRIu64
+		": open_memstream returned NULL", codeBlockAddress);
       return;
     }
     
@@ -1579,10 +3096,10 @@ static void logCodeBlockContent(Logger logger, VmMemory memory,
     fclose(memstream);
 
     if (!text) {
-      logMessage(logger, LogCodeBlocks, "Could not log code block at %" PRIu64
-		 ": text is NULL", codeBlockAddress);
+      LOG_TRACE(logger, LogCodeBlocks, "Could not log code block at %" PRIu64
+		": text is NULL", codeBlockAddress);
     } else {
-      logMessage(logger, LogCodeBlocks, text);
+      LOG_TRACE(logger, LogCodeBlocks, text);
       free((void*)text);
     }
   }
@@ -1595,8 +3112,6 @@ static void logStateBlockContent(Logger logger, VmMemory memory,
 
   if (loggingModuleIsEnabled(logger, LogStateBlocks)) {
     uint64_t stateBlockAddress = vmmAddressForPtr(memory, (uint8_t*)stateBlock);
-    uint64_t stateBlockSize =
-      getVmmBlockSize((HeapBlock*)stateBlock) - sizeof(HeapBlock);
     uint64_t heapStartAddress =
       vmmAddressForPtr(memory, getVmmHeapStart(memory));
     char *text = NULL;
@@ -1,10 +1,15 @@
 #ifndef __VM_H__
 #define __VM_H__
 
+#include <brkpt.h>
+#include <gcpolicy.h>
+#include <hashcons.h>
 #include <logging.h>
 #include <stdint.h>
 #include <stack.h>
 #include <symtab.h>
+#include <vm_jit.h>
+#include <vm_native.h>
 #include <vmmem.h>
 
 /** The Unlambda virtual machine itself */
@@ -27,6 +32,40 @@ UnlambdaVM createUnlambdaVM(uint32_t maxCallStackSize,
 			    uint64_t initialMemorySize,
 			    uint64_t maxMemorySize);
 
+/** Create an Unlambda virtual machine instance that uses the given
+ *  garbage collector
+ *
+ *  createUnlambdaVM() creates a VM that uses the mark/sweep collector,
+ *  which never moves blocks on the heap.  The compacting collector moves
+ *  the reachable blocks to the start of the heap in depth-first order
+ *  every time it runs a full collection, which keeps the heap from
+ *  fragmenting and keeps functions near the functions they call.  Since
+ *  blocks move, breakpoints on addresses in the heap may not stay with
+ *  the code they were set on.  The incremental collector marks the heap
+ *  a little at a time while the program runs, in slices no longer than
+ *  the budget set with setVmGcSliceBudget(), and only stops the program
+ *  for a full collection when the heap runs out of room first.  The
+ *  concurrent collector marks the heap with a thread of its own while
+ *  the program runs, and only stops the program to take a snapshot of
+ *  the stacks and, once marking is done, to free the unreachable blocks.
+ *
+ *  Arguments:
+ *    maxCallStackSize      Maximum number of entries on the call stack.
+ *    maxAddressStackSize   Maximum number of entries on the address stack
+ *    initialMemorySize     Initial size of the VM's memory, in bytes
+ *    maxMemorySize         Maximum size of the VM's memory, in bytes
+ *    gcMode                VmGcMarkSweep, VmGcCompacting,
+ *                          VmGcIncremental or VmGcConcurrent
+ *
+ *  Returns
+ *    A new UnlambdaVM instance, or NULL if one could not be created
+ */
+UnlambdaVM createUnlambdaVMWithGc(uint32_t maxCallStackSize,
+				  uint32_t maxAddressStackSize,
+				  uint64_t initialMemorySize,
+				  uint64_t maxMemorySize,
+				  int gcMode);
+
 /** Destroy and Unlambda VM and release all the resources it owns */
 void destroyUnlambdaVM(UnlambdaVM vm);
 
@@ -81,6 +120,37 @@ SymbolTable getVmSymbolTable(UnlambdaVM vm);
 /** Get the VM's memory */
 VmMemory getVmMemory(UnlambdaVM vm);
 
+/** Get the garbage collector the VM uses for full collections
+ *
+ *  Returns VmGcMarkSweep, VmGcCompacting, VmGcIncremental or
+ *  VmGcConcurrent
+ */
+int getVmGcMode(UnlambdaVM vm);
+
+/** Get the longest time the incremental collector marks the heap for
+ *  before it lets the program run again, in microseconds
+ */
+uint64_t getVmGcSliceBudget(UnlambdaVM vm);
+
+/** Set the longest time the incremental collector marks the heap for
+ *  before it lets the program run again, in microseconds
+ *
+ *  Only VMs that use VmGcIncremental collect the heap in slices.  A
+ *  slice always does a little work, even if the budget is 0.
+ */
+void setVmGcSliceBudget(UnlambdaVM vm, uint64_t usec);
+
+/** Get the policy that decides when the VM runs a full collection and how
+ *  much the heap grows after one
+ *
+ *  The VM collects when the program has allocated the policy's budget
+ *  since the last full collection, or when an allocation fails, and
+ *  grows the memory afterwards to the heap size the policy asks for, up
+ *  to the memory's maximum size.  Change the policy's settings to tune
+ *  the collector.  The policy belongs to the VM.
+ */
+GcPolicy getVmGcPolicy(UnlambdaVM vm);
+
 /** Get a pointer to the location of the PC in the VM's memory
  *
  *  Equivalent to ptrToVmAddress(vm, getVmPC(vm));
@@ -154,6 +224,153 @@ int loadVmProgramFromMemory(UnlambdaVM vm, const char* name,
  */
 int stepVm(UnlambdaVM vm);
 
+/** Execute instructions until the VM halts, panics or encounters an error
+ *
+ *  Equivalent to runVmUntil(vm, 0, 0).
+ */
+int runVm(UnlambdaVM vm);
+
+/** Execute instructions until the VM halts, panics, encounters an error,
+ *  reaches a breakpoint or executes a given number of instructions
+ *
+ *  Produces exactly the same results as calling stepVm() repeatedly, but
+ *  runs much faster.  Falls back on stepVm() if the VM's logger has either
+ *  the LogInstructions or LogStacks module enabled, since the fast
+ *  interpreter does not log individual instructions.
+ *
+ *  If "stopMask" includes VmStopAtBreakpoint, execution stops before
+ *  executing an instruction at an address in one of the breakpoint lists
+ *  given to setVmBreakpointLists().  The first instruction is always
+ *  executed, even if it is at a breakpoint, so execution can resume from
+ *  a breakpoint.
+ *
+ *  Arguments:
+ *    vm               The virtual machine
+ *    maxInstructions  Maximum number of instructions to execute.  Zero
+ *                       means there is no limit.
+ *    stopMask         Additional conditions that stop execution.  Either
+ *                       zero or VmStopAtBreakpoint.
+ *
+ *  Returns:
+ *    0 if execution stopped at a breakpoint or after executing
+ *    "maxInstructions" instructions, and nonzero if the VM halted,
+ *    panicked or encountered an error.  Use getVmStatus() or
+ *    getVmStatusMsg() to find out why.  A VM that executes a HALT
+ *    instruction reports VmHalted.
+ */
+int runVmUntil(UnlambdaVM vm, uint64_t maxInstructions, uint32_t stopMask);
+
+/** Set the breakpoints runVmUntil() stops at
+ *
+ *  The VM does not own the lists.  The debugger sets them when it is
+ *  created and clears them when it is destroyed.  Either list may be NULL.
+ */
+void setVmBreakpointLists(UnlambdaVM vm, BreakpointList persistent,
+			  BreakpointList transient);
+
+/** Counts of the intrinsics runVmUntil() has executed */
+typedef struct VmIntrinsicStats_ {
+  /** Number of intrinsics executed */
+  uint64_t intrinsicsExecuted;
+
+  /** Number of VM instructions those intrinsics replaced */
+  uint64_t instructionsReplaced;
+} VmIntrinsicStats;
+
+/** Enable or disable intrinsics
+ *
+ *  Intrinsics are native implementations of parts of the instruction
+ *  sequences that implement Unlambda's primitives, which runVmUntil()
+ *  substitutes for those sequences when it finds them in the program
+ *  area.  They evaluate a primitive's argument without a call when the
+ *  argument is a constant function in the program area, all of i, and
+ *  the returns at the end of v and .<ch>.  The closures k, s, d and c
+ *  create are still built by the MK* instructions.  Intrinsics produce
+ *  exactly the same results as the instructions they replace, so the only
+ *  reason to disable them is to measure how much faster they are.
+ *  Intrinsics are enabled by default.
+ */
+void setVmIntrinsicsEnabled(UnlambdaVM vm, int enabled);
+
+/** Get the number of intrinsics runVmUntil() has executed so far */
+void getVmIntrinsicStats(UnlambdaVM vm, VmIntrinsicStats* stats);
+
+/** Compile code to x86-64 machine code as runVmUntil() executes it
+ *
+ *  Code in the program area is compiled the first time it executes.
+ *  Code on the heap is compiled once it has been called
+ *  "hotClosureThreshold" times from compiled code.  The results are
+ *  exactly the same as interpreting the code, but runVmUntil() ignores
+ *  the compiled code and executes one instruction at a time while there
+ *  are breakpoints to stop at.  Primitive bodies the VM replaces with
+ *  intrinsics still run as intrinsics when the interpreter reaches them.
+ *
+ *  Returns:
+ *    0 on success, nonzero if the compiler could not be created.  The
+ *    VM reports VmJitUnavailableError if the host is not an x86-64
+ *    machine or memory for the compiled code could not be allocated.
+ */
+int enableVmJit(UnlambdaVM vm, uint32_t hotClosureThreshold);
+
+/** Stop compiling code and throw away the code compiled so far */
+void disableVmJit(UnlambdaVM vm);
+
+/** Get the VM's JIT compiler, or NULL if the JIT is not enabled */
+VmJit getVmJit(UnlambdaVM vm);
+
+/** Counts of the functions the VM shared instead of creating them again */
+typedef struct VmHashConsStats_ {
+  /** Number of times a function creation instruction looked for a
+   *  function it could share
+   */
+  uint64_t lookups;
+
+  /** Number of times it found one */
+  uint64_t hits;
+
+  /** Number of functions in the table now */
+  uint64_t tableSize;
+} VmHashConsStats;
+
+/** Share the functions the VM creates instead of creating them again
+ *
+ *  Once hash-consing is enabled, MKK, MKS0, MKS1, MKS2 and MKD look for a
+ *  live function the same instruction created from the same addresses in
+ *  a table of "tableSize" slots (see hashcons.h), and push its address
+ *  instead of allocating a new block when they find one.  Functions never
+ *  change, so the only difference the program sees is that it allocates
+ *  less.  MKC always creates a new function, since no two continuations
+ *  come from the same saved state.  The table doesn't keep the functions
+ *  in it alive: the garbage collector removes the ones it frees.
+ *
+ *  Returns:
+ *    0 on success, nonzero if there wasn't enough memory for the table,
+ *    in which case the VM reports VmOutOfMemoryError.  Enabling
+ *    hash-consing when it is already enabled starts over with an empty
+ *    table of the new size.
+ */
+int enableVmHashConsing(UnlambdaVM vm, uint32_t tableSize);
+
+/** Stop sharing functions and throw away the table of functions */
+void disableVmHashConsing(UnlambdaVM vm);
+
+/** Get the number of functions the VM has shared so far */
+void getVmHashConsStats(UnlambdaVM vm, VmHashConsStats* stats);
+
+/** Replace blocks of code in the program area with native code
+ *
+ *  Whenever runVmUntil() reaches the address of one of "blocks", it calls
+ *  the block's native code instead of interpreting the code there (see
+ *  vm_native.h), except while there are breakpoints to stop at.  Blocks
+ *  outside the program area are ignored.
+ *
+ *  The VM does not copy "blocks", which must remain valid until native
+ *  code is replaced or the VM is destroyed.  Pass 0 for "numBlocks" to go
+ *  back to interpreting the whole program area.
+ */
+void setVmNativeCode(UnlambdaVM vm, const VmNativeBlock* blocks,
+		     uint64_t numBlocks);
+
 /** Set the VM's logger
  *
  *  Also sets the logger the VM's memory uses to this logger.
@@ -227,6 +444,26 @@ const int VmFatalError = -14;
 /** One of the arguments to a function is invalid */
 const int VmIllegalArgumentError = -15;
 
+/** The JIT compiler could not be created */
+const int VmJitUnavailableError = -16;
+
+/** Stop runVmUntil() when the VM reaches a breakpoint */
+const uint32_t VmStopAtBreakpoint = 1;
+
+/** Full collections mark the reachable blocks and free the rest */
+const int VmGcMarkSweep = 0;
+
+/** Full collections also move the reachable blocks to the start of the
+ *  heap
+ */
+const int VmGcCompacting = 1;
+
+/** Mark the heap a little at a time while the program runs */
+const int VmGcIncremental = 2;
+
+/** Mark the heap with another thread while the program runs */
+const int VmGcConcurrent = 3;
+
 #else
 
 /** Indicates a program is already loaded */
@@ -288,6 +525,25 @@ const int VmFatalError;
 /** One of the arguments to a function is invalid */
 const int VmIllegalArgumentError;
 
+/** The JIT compiler could not be created */
+const int VmJitUnavailableError;
+
+/** Stop runVmUntil() when the VM reaches a breakpoint */
+const uint32_t VmStopAtBreakpoint;
+
+/** Full collections mark the reachable blocks and free the rest */
+const int VmGcMarkSweep;
+
+/** Full collections also move the reachable blocks to the start of the
+ *  heap
+ */
+const int VmGcCompacting;
+
+/** Mark the heap a little at a time while the program runs */
+const int VmGcIncremental;
+
+/** Mark the heap with another thread while the program runs */
+const int VmGcConcurrent;
 
 #endif
 
@@ -4,12 +4,13 @@
 #include <stdarg.h>
 
 static const uint8_t INSTRUCTION_SIZE[] = {
-    1, 9, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 1,
+    1, 9, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 9, 9, 1, 9,
 };
 
 static const char* INSTRUCTION_NAME[] = {
     "PANIC", "PUSH", "POP", "SWAP", "DUP", "PCALL", "RET", "MKK", "MKS0",
-    "MKS1", "MKS2", "MKD", "MKC", "SAVE", "RESTORE", "PRINT", "HALT"
+    "MKS1", "MKS2", "MKD", "MKC", "SAVE", "RESTORE", "PRINT", "HALT",
+    "PUSH_PCALL", "PUSH_PCALL_RET", "PCALL_RET", "POP_PUSH_RET"
 };
 
 static const char UNKNOWN_INSTRUCTION_NAME[] = "???";
@@ -26,6 +27,13 @@ const char* instructionName(uint8_t instruction) {
                                           : UNKNOWN_INSTRUCTION_NAME;
 }
 
+int instructionHasAddressOperand(uint8_t instruction) {
+  return (instruction == PUSH_INSTRUCTION)
+           || (instruction == PUSH_PCALL_INSTRUCTION)
+           || (instruction == PUSH_PCALL_RET_INSTRUCTION)
+           || (instruction == POP_PUSH_RET_INSTRUCTION);
+}
+
 static void writeRawHex(const uint8_t* instruction,
 			const uint8_t* endOfMemory,
 			char* out, size_t outSize) {
@@ -115,7 +123,10 @@ const uint8_t* disassembleVmCode(const uint8_t* code,
 	  rawHex);
 	  
   switch (*code) {
-    case PUSH_INSTRUCTION: {
+    case PUSH_INSTRUCTION:
+    case PUSH_PCALL_INSTRUCTION:
+    case PUSH_PCALL_RET_INSTRUCTION:
+    case POP_PUSH_RET_INSTRUCTION: {
       if ((code + 9) > endOfMemory) {
 	fprintf(out, " **ERROR: Address for %s trucated by end of memory\n",
 		INSTRUCTION_NAME[*code]);
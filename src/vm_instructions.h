@@ -24,7 +24,13 @@
 #define PRINT_INSTRUCTION   (uint8_t)15
 #define HALT_INSTRUCTION    (uint8_t)16
 
-#define NUM_VM_INSTRUCTIONS 17
+/** Superinstructions that fuse the sequences MK* instructions generate */
+#define PUSH_PCALL_INSTRUCTION     (uint8_t)17
+#define PUSH_PCALL_RET_INSTRUCTION (uint8_t)18
+#define PCALL_RET_INSTRUCTION      (uint8_t)19
+#define POP_PUSH_RET_INSTRUCTION   (uint8_t)20
+
+#define NUM_VM_INSTRUCTIONS 21
 
   
 /** Number of bytes the instruction occupies, including both operator and
@@ -35,6 +41,14 @@ uint8_t instructionSize(uint8_t instruction);
 /** Human-readable instruction mnemonic */
 const char* instructionName(uint8_t instruction);
 
+/** Nonzero if the instruction's operand is an 8-byte VM address
+ *
+ *  True for PUSH and the superinstructions built from it.  The assembler,
+ *  the disassembler and the garbage collector all use this to find
+ *  operands that refer to other code.
+ */
+int instructionHasAddressOperand(uint8_t instruction);
+
 /** Disassemble a line of code 
  *
  *  Disassemble a line of code starting at "code" and print the result to
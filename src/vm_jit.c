@@ -0,0 +1,950 @@
+/** Template JIT compiler for the Unlambda VM
+ *
+ *  Compiled code keeps the interpreter state it uses in callee-saved
+ *  registers:
+ *    rbx   The VmJitState
+ *    r12   Top of the address stack
+ *    r13   Top of the call stack
+ *    r14   Instructions left to execute
+ *    r15   The table of compiled code for the program area, indexed by
+ *            address
+ *  and uses rax and rcx as scratch registers.  It reads the bottoms
+ *  and limits of the stacks, the size of the VM's memory and the size of
+ *  the program area from the VmJitState as it needs them.
+ *
+ *  The code buffer starts with four stubs shared by all compiled code:
+ *    enter       Called by runVmJitCode().  Saves the callee-saved
+ *                  registers, loads the state into them and jumps to
+ *                  the compiled code.
+ *    dispatch    Jumps to the compiled code for the address in rax, or
+ *                  exits with VmJitExitLookup if there isn't any.
+ *    interpret   Exits with VmJitExitInterpret and the address in rax.
+ *                  Program area addresses whose block starts with an
+ *                  instruction compiled code can't execute point here,
+ *                  so dispatch can go straight to the interpreter.
+ *    exit        Writes the registers back to the state, restores the
+ *                  callee-saved registers and returns to runVmJitCode().
+ *
+ *  Each block starts by charging all its instructions against r14, or
+ *  exits to let the interpreter execute them one at a time if there
+ *  aren't enough left.  Every instruction template checks the same
+ *  conditions the threaded interpreter does before executing an
+ *  instruction inline.  If any check fails, the block refunds the
+ *  instructions it hasn't executed and lets the interpreter execute the
+ *  instruction instead, so it can report the error or grow the stack.
+ *
+ *  The code buffer is never writable and executable at the same time.
+ *  It is mapped read-write, and the pages that hold compiled code are
+ *  switched to read-execute once the code is written.  Compiling a block
+ *  switches the pages it goes in back to read-write until it is done,
+ *  which takes away the compiled code that shares its first page for
+ *  that long.  Nothing compiled runs while a block is being compiled.
+ */
+#include "vm_jit.h"
+#include "vm_instructions.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+const int VmJitExitInterpret = 1;
+const int VmJitExitLookup = 2;
+
+#if defined(__x86_64__)
+
+/** Longest block the compiler will produce, in VM instructions */
+#define MAX_BLOCK_INSTRUCTIONS 64
+
+/** Most bytecode compiled for a block on the heap.  Longer than any
+ *  function the MK* instructions create.
+ */
+#define MAX_CLOSURE_CODE_SIZE 32
+
+/** Number of entries in the table of heap code.  Must be a power of 2 */
+#define NUM_CLOSURE_SLOTS 4096
+
+/** Registers */
+#define RAX 0
+#define RCX 1
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+/** Condition codes for conditional jumps */
+#define CC_B   0x2
+#define CC_AE  0x3
+#define CC_E   0x4
+
+/** Opcodes for "op r64, r/m64" and "op r/m64, r64" instructions */
+#define OP_SUB_RM_REG  0x29
+#define OP_SUB_REG_RM  0x2B
+#define OP_CMP_REG_RM  0x3B
+#define OP_TEST_RM_REG 0x85
+#define OP_MOV_RM_REG  0x89
+#define OP_MOV_REG_RM  0x8B
+
+/** Opcode extensions for "op r/m64, imm" instructions */
+#define EXT_ADD 0
+#define EXT_SUB 5
+#define EXT_CMP 7
+
+/** Offsets of the fields of VmJitState */
+#define STATE_ADDRESS_TOP     offsetof(VmJitState, addressStackTop)
+#define STATE_ADDRESS_BOTTOM  offsetof(VmJitState, addressStackBottom)
+#define STATE_ADDRESS_LIMIT   offsetof(VmJitState, addressStackLimit)
+#define STATE_CALL_TOP        offsetof(VmJitState, callStackTop)
+#define STATE_CALL_BOTTOM     offsetof(VmJitState, callStackBottom)
+#define STATE_CALL_LIMIT      offsetof(VmJitState, callStackLimit)
+#define STATE_REMAINING       offsetof(VmJitState, remaining)
+#define STATE_PC              offsetof(VmJitState, pc)
+#define STATE_MEMORY_SIZE     offsetof(VmJitState, memorySize)
+#define STATE_PROGRAM_SIZE    offsetof(VmJitState, programSize)
+#define STATE_PROGRAM_CODE    offsetof(VmJitState, programCode)
+
+typedef int (*JitEntryPoint)(VmJitState* state, const void* code);
+
+/** Compiled code for a block on the heap */
+typedef struct JitClosure_ {
+  /** Address of the block */
+  uint64_t address;
+
+  /** Number of times the block has been called */
+  uint32_t calls;
+
+  /** Number of bytes in "bytecode" */
+  uint32_t bytecodeSize;
+
+  /** The compiled code.  NULL if the block hasn't been compiled, and the
+   *  "interpret" stub if it can't be.
+   */
+  const void* code;
+
+  /** The bytecode that was compiled */
+  uint8_t bytecode[MAX_CLOSURE_CODE_SIZE];
+} JitClosure;
+
+typedef struct VmJitImpl_ {
+  /** Start of the code buffer */
+  uint8_t* code;
+
+  /** Size of the code buffer */
+  uint64_t codeSize;
+
+  /** Size of the pages the code buffer's protection is set on */
+  uint64_t pageSize;
+
+  /** Where the next block goes */
+  uint8_t* next;
+
+  /** End of the stubs, where "next" goes when the buffer is emptied */
+  uint8_t* firstBlock;
+
+  /** The stubs */
+  JitEntryPoint enter;
+  const uint8_t* dispatch;
+  const uint8_t* interpret;
+  const uint8_t* exit;
+
+  /** Compiled code for each address in the program area.  NULL for
+   *  addresses that haven't been compiled yet.
+   */
+  const void** programCode;
+  uint64_t programSize;
+
+  /** Compiled code for blocks on the heap */
+  JitClosure* closures;
+  uint32_t hotClosureThreshold;
+
+  VmJitStats stats;
+} VmJitImpl;
+
+/** Writes machine code into the code buffer */
+typedef struct CodeEmitter_ {
+  uint8_t* p;
+  uint8_t* end;
+  int overflow;
+} CodeEmitter;
+
+/** A jump to an exit from the block that hasn't been emitted yet */
+typedef struct BlockExit_ {
+  uint8_t* rel32;      /** Displacement of the jump to patch */
+  uint64_t pc;         /** Instruction the interpreter should execute */
+  uint32_t refund;     /** Instructions not executed */
+} BlockExit;
+
+typedef struct BlockCompiler_ {
+  VmJit jit;
+  CodeEmitter e;
+  BlockExit exits[4 * MAX_BLOCK_INSTRUCTIONS + 1];
+  uint32_t numExits;
+} BlockCompiler;
+
+static void emitStubs(VmJit jit);
+static const void* compileBlock(VmJit jit, const uint8_t* memory,
+				uint64_t address, uint64_t limit,
+				uint64_t* bytecodeSize);
+static const void* tryToCompileBlock(VmJit jit, const uint8_t* memory,
+				     uint64_t address, uint64_t limit,
+				     uint64_t* bytecodeSize);
+static void flushCodeBuffer(VmJit jit);
+static int makeCodeWritable(VmJit jit, uint8_t* start);
+static int makeCodeExecutable(VmJit jit, uint8_t* start, uint8_t* end);
+static void emitInstruction(BlockCompiler* c, const uint8_t* code,
+			    uint64_t address, uint32_t index, uint32_t count,
+			    int isTailCall);
+static void emitExit(BlockCompiler* c, uint8_t cc, uint64_t pc,
+		     uint32_t refund);
+static void emitByte(CodeEmitter* e, uint8_t b);
+static void emitUInt32(CodeEmitter* e, uint32_t v);
+static void emitUInt64(CodeEmitter* e, uint64_t v);
+static void emitRegMem(CodeEmitter* e, uint8_t opcode, int reg, int base,
+		       int32_t disp);
+static void emitRegReg(CodeEmitter* e, uint8_t opcode, int rm, int reg);
+static void emitRegImm(CodeEmitter* e, int ext, int reg, int32_t imm);
+static void emitMovRegImm(CodeEmitter* e, int reg, uint64_t imm);
+static void emitLoadIndexed(CodeEmitter* e, int dst, int base, int index);
+static void emitPush(CodeEmitter* e, int reg);
+static void emitPop(CodeEmitter* e, int reg);
+static void emitJmpReg(CodeEmitter* e, int reg);
+static uint8_t* emitJcc(CodeEmitter* e, uint8_t cc);
+static uint8_t* emitJmp(CodeEmitter* e);
+static void patchRel32(CodeEmitter* e, uint8_t* rel32,
+		       const uint8_t* target);
+
+VmJit createVmJit(uint64_t codeBufferSize, uint32_t hotClosureThreshold) {
+  VmJit jit = (VmJit)malloc(sizeof(VmJitImpl));
+  if (!jit) {
+    return NULL;
+  }
+
+  jit->closures = (JitClosure*)calloc(NUM_CLOSURE_SLOTS, sizeof(JitClosure));
+  if (!jit->closures) {
+    free((void*)jit);
+    return NULL;
+  }
+
+  jit->code = (uint8_t*)mmap(NULL, codeBufferSize,
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    free((void*)jit->closures);
+    free((void*)jit);
+    return NULL;
+  }
+
+  jit->codeSize = codeBufferSize;
+  jit->pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+  jit->next = jit->code;
+  jit->programCode = NULL;
+  jit->programSize = 0;
+  jit->hotClosureThreshold = hotClosureThreshold;
+  memset(&jit->stats, 0, sizeof(jit->stats));
+
+  emitStubs(jit);
+  if (!jit->firstBlock
+        || makeCodeExecutable(jit, jit->code, jit->firstBlock)) {
+    /** Code buffer too small to hold even the stubs, or they couldn't be
+     *  made executable
+     */
+    destroyVmJit(jit);
+    return NULL;
+  }
+  return jit;
+}
+
+void destroyVmJit(VmJit jit) {
+  if (jit) {
+    munmap((void*)jit->code, jit->codeSize);
+    free((void*)jit->programCode);
+    free((void*)jit->closures);
+    free((void*)jit);
+  }
+}
+
+const void* getVmJitCodeForProgram(VmJit jit, const uint8_t* program,
+				   uint64_t programSize, uint64_t address) {
+  if (programSize != jit->programSize) {
+    const void** table = (const void**)calloc(programSize, sizeof(void*));
+    if (!table) {
+      return NULL;
+    }
+    free((void*)jit->programCode);
+    jit->programCode = table;
+    jit->programSize = programSize;
+  }
+
+  if (address >= programSize) {
+    return NULL;
+  }
+
+  if (!jit->programCode[address]) {
+    uint64_t bytecodeSize = 0;
+    const void* code = compileBlock(jit, program, address, programSize,
+				    &bytecodeSize);
+    if (!code) {
+      return NULL;
+    }
+    jit->programCode[address] = code;
+    ++jit->stats.blocksCompiled;
+  }
+
+  return (jit->programCode[address] == jit->interpret)
+           ? NULL : jit->programCode[address];
+}
+
+const void* getVmJitCodeForClosure(VmJit jit, const uint8_t* memory,
+				   uint64_t memorySize, uint64_t address) {
+  if (address >= memorySize) {
+    return NULL;
+  }
+
+  const uint64_t hash = ((address >> 3) * 0x9E3779B97F4A7C15ULL) >> 32;
+  JitClosure* closure = jit->closures + (hash & (NUM_CLOSURE_SLOTS - 1));
+
+  if (closure->address != address) {
+    closure->address = address;
+    closure->calls = 0;
+    closure->code = NULL;
+  }
+
+  if (closure->code) {
+    if ((closure->bytecodeSize <= (memorySize - address))
+	  && !memcmp(closure->bytecode, memory + address,
+		     closure->bytecodeSize)) {
+      return (closure->code == jit->interpret) ? NULL : closure->code;
+    }
+    /** Garbage collector reused the memory for different code */
+    closure->calls = 0;
+    closure->code = NULL;
+  }
+
+  if (++closure->calls < jit->hotClosureThreshold) {
+    return NULL;
+  }
+
+  const uint64_t limit =
+    ((memorySize - address) < MAX_CLOSURE_CODE_SIZE)
+      ? memorySize : (address + MAX_CLOSURE_CODE_SIZE);
+  uint64_t bytecodeSize = 0;
+  const void* code = compileBlock(jit, memory, address, limit,
+				  &bytecodeSize);
+  if (!code) {
+    return NULL;
+  }
+
+  /** compileBlock() may have emptied the code buffer, which clears the
+   *  closure table
+   */
+  closure->address = address;
+  closure->calls = jit->hotClosureThreshold;
+  closure->code = code;
+  closure->bytecodeSize = (uint32_t)bytecodeSize;
+  memcpy(closure->bytecode, memory + address, bytecodeSize);
+  ++jit->stats.closuresCompiled;
+
+  return (code == jit->interpret) ? NULL : code;
+}
+
+int runVmJitCode(VmJit jit, VmJitState* state, const void* code) {
+  state->programCode = jit->programCode;
+  if (state->programSize > jit->programSize) {
+    state->programSize = jit->programSize;
+  }
+  ++jit->stats.codeEntries;
+  return jit->enter(state, code);
+}
+
+void getVmJitStats(VmJit jit, VmJitStats* stats) {
+  *stats = jit->stats;
+}
+
+static void emitStubs(VmJit jit) {
+  CodeEmitter e = { jit->code, jit->code + jit->codeSize, 0 };
+  uint8_t* toLookup;
+  uint8_t* notCompiled;
+  uint8_t* toExit;
+  uint8_t* lookup;
+
+  /** enter(state = rdi, code = rsi) */
+  jit->enter = (JitEntryPoint)e.p;
+  emitPush(&e, RBX);
+  emitPush(&e, R12);
+  emitPush(&e, R13);
+  emitPush(&e, R14);
+  emitPush(&e, R15);
+  emitRegReg(&e, OP_MOV_RM_REG, RBX, RDI);
+  emitRegMem(&e, OP_MOV_REG_RM, R12, RBX, STATE_ADDRESS_TOP);
+  emitRegMem(&e, OP_MOV_REG_RM, R13, RBX, STATE_CALL_TOP);
+  emitRegMem(&e, OP_MOV_REG_RM, R14, RBX, STATE_REMAINING);
+  emitRegMem(&e, OP_MOV_REG_RM, R15, RBX, STATE_PROGRAM_CODE);
+  emitJmpReg(&e, RSI);
+
+  /** dispatch(target = rax) */
+  jit->dispatch = e.p;
+  emitRegMem(&e, OP_CMP_REG_RM, RAX, RBX, STATE_PROGRAM_SIZE);
+  toLookup = emitJcc(&e, CC_AE);
+  emitLoadIndexed(&e, RCX, R15, RAX);
+  emitRegReg(&e, OP_TEST_RM_REG, RCX, RCX);
+  notCompiled = emitJcc(&e, CC_E);
+  emitJmpReg(&e, RCX);
+
+  lookup = e.p;
+  emitRegMem(&e, OP_MOV_RM_REG, RAX, RBX, STATE_PC);
+  emitMovRegImm(&e, RAX, (uint64_t)VmJitExitLookup);
+  toExit = emitJmp(&e);
+
+  /** interpret(pc = rax) */
+  jit->interpret = e.p;
+  emitRegMem(&e, OP_MOV_RM_REG, RAX, RBX, STATE_PC);
+  emitMovRegImm(&e, RAX, (uint64_t)VmJitExitInterpret);
+
+  /** exit(reason = eax) */
+  jit->exit = e.p;
+  emitRegMem(&e, OP_MOV_RM_REG, R12, RBX, STATE_ADDRESS_TOP);
+  emitRegMem(&e, OP_MOV_RM_REG, R13, RBX, STATE_CALL_TOP);
+  emitRegMem(&e, OP_MOV_RM_REG, R14, RBX, STATE_REMAINING);
+  emitPop(&e, R15);
+  emitPop(&e, R14);
+  emitPop(&e, R13);
+  emitPop(&e, R12);
+  emitPop(&e, RBX);
+  emitByte(&e, 0xC3);  /** ret */
+
+  if (e.overflow) {
+    jit->firstBlock = NULL;
+    return;
+  }
+
+  patchRel32(&e, toLookup, lookup);
+  patchRel32(&e, notCompiled, lookup);
+  patchRel32(&e, toExit, jit->exit);
+  jit->firstBlock = e.p;
+  jit->next = e.p;
+}
+
+/** Compile the block at "address," emptying the code buffer and trying
+ *  again if it fills up
+ *
+ *  Returns the compiled code or the "interpret" stub if the first
+ *  instruction in the block can't be compiled.  Returns NULL if the
+ *  block is too big for an empty code buffer.
+ */
+static const void* compileBlock(VmJit jit, const uint8_t* memory,
+				uint64_t address, uint64_t limit,
+				uint64_t* bytecodeSize) {
+  const void* code = tryToCompileBlock(jit, memory, address, limit,
+				       bytecodeSize);
+  if (!code) {
+    flushCodeBuffer(jit);
+    code = tryToCompileBlock(jit, memory, address, limit, bytecodeSize);
+  }
+  return code;
+}
+
+static const void* tryToCompileBlock(VmJit jit, const uint8_t* memory,
+				     uint64_t address, uint64_t limit,
+				     uint64_t* bytecodeSize) {
+  uint64_t addresses[MAX_BLOCK_INSTRUCTIONS];
+  uint32_t count = 0;
+  uint64_t pc = address;
+  int endsWithTransfer = 0;
+  int isTailCall = 0;
+
+  /** Find the instructions in the block */
+  *bytecodeSize = 0;
+  while ((count < MAX_BLOCK_INSTRUCTIONS) && (pc < limit)) {
+    const uint8_t opcode = memory[pc];
+    const uint64_t size = instructionSize(opcode);
+
+    if ((limit - pc) < size) {
+      break;
+    }
+
+    if ((opcode == PUSH_INSTRUCTION) || (opcode == POP_INSTRUCTION)
+	  || (opcode == SWAP_INSTRUCTION) || (opcode == DUP_INSTRUCTION)) {
+      addresses[count++] = pc;
+      pc += size;
+    } else if ((opcode == PCALL_INSTRUCTION) || (opcode == RET_INSTRUCTION)
+	         || (opcode == PUSH_PCALL_INSTRUCTION)
+	         || (opcode == PUSH_PCALL_RET_INSTRUCTION)
+	         || (opcode == PCALL_RET_INSTRUCTION)
+	         || (opcode == POP_PUSH_RET_INSTRUCTION)) {
+      addresses[count++] = pc;
+      pc += size;
+      endsWithTransfer = 1;
+      if ((opcode == PCALL_INSTRUCTION)
+	    || (opcode == PUSH_PCALL_INSTRUCTION)) {
+	/** Same test the interpreter makes for a tail call */
+	if (pc < limit) {
+	  isTailCall = (memory[pc] == RET_INSTRUCTION);
+	  *bytecodeSize = pc + 1 - address;
+	}
+      }
+      break;
+    } else {
+      break;
+    }
+  }
+  if (!*bytecodeSize) {
+    *bytecodeSize = pc - address;
+  }
+
+  if (!count) {
+    return jit->interpret;
+  }
+
+  if (makeCodeWritable(jit, jit->next)) {
+    return NULL;
+  }
+
+  BlockCompiler c;
+  c.jit = jit;
+  c.e.p = jit->next;
+  c.e.end = jit->code + jit->codeSize;
+  c.e.overflow = 0;
+  c.numExits = 0;
+
+  uint8_t* const start = c.e.p;
+
+  /** Charge for the whole block up front */
+  emitRegImm(&c.e, EXT_CMP, R14, (int32_t)count);
+  emitExit(&c, CC_B, address, 0);
+  emitRegImm(&c.e, EXT_SUB, R14, (int32_t)count);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    emitInstruction(&c, memory, addresses[i], i, count,
+		    (i == (count - 1)) && isTailCall);
+  }
+
+  if (!endsWithTransfer) {
+    /** Let the interpreter execute the instruction after the block, or
+     *  go on to the next block if the block got too long
+     */
+    emitMovRegImm(&c.e, RAX, pc);
+    patchRel32(&c.e, emitJmp(&c.e),
+	       (count < MAX_BLOCK_INSTRUCTIONS) ? jit->interpret
+	                                        : jit->dispatch);
+  }
+
+  /** Exits for failed checks */
+  for (uint32_t i = 0; i < c.numExits; ++i) {
+    patchRel32(&c.e, c.exits[i].rel32, c.e.p);
+    if (c.exits[i].refund) {
+      emitRegImm(&c.e, EXT_ADD, R14, (int32_t)c.exits[i].refund);
+    }
+    emitMovRegImm(&c.e, RAX, c.exits[i].pc);
+    patchRel32(&c.e, emitJmp(&c.e), jit->interpret);
+  }
+
+  /** Even if the block is thrown away, the code before it on its first
+   *  page has to be executable again
+   */
+  if (makeCodeExecutable(jit, start, c.e.p) || c.e.overflow) {
+    return NULL;
+  }
+  jit->next = c.e.p;
+  return start;
+}
+
+static void flushCodeBuffer(VmJit jit) {
+  jit->next = jit->firstBlock;
+  if (jit->programCode) {
+    memset((void*)jit->programCode, 0, jit->programSize * sizeof(void*));
+  }
+  memset((void*)jit->closures, 0, NUM_CLOSURE_SLOTS * sizeof(JitClosure));
+  ++jit->stats.codeBufferFlushes;
+}
+
+/** Make the code buffer writable from the page "start" is on to the end
+ *  of the buffer.  Returns 0 on success or -1 if mprotect() fails.
+ */
+static int makeCodeWritable(VmJit jit, uint8_t* start) {
+  uint8_t* const page =
+    jit->code + ((uint64_t)(start - jit->code) & ~(jit->pageSize - 1));
+  return mprotect((void*)page, (jit->code + jit->codeSize) - page,
+		  PROT_READ | PROT_WRITE) ? -1 : 0;
+}
+
+/** Make the pages that hold the code from "start" to "end" executable
+ *  and read-only.  Returns 0 on success or -1 if mprotect() fails.
+ */
+static int makeCodeExecutable(VmJit jit, uint8_t* start, uint8_t* end) {
+  const uint64_t first = (uint64_t)(start - jit->code) & ~(jit->pageSize - 1);
+  const uint64_t last = ((uint64_t)(end - jit->code) + jit->pageSize - 1)
+                          & ~(jit->pageSize - 1);
+  if (last <= first) {
+    return 0;
+  }
+  return mprotect((void*)(jit->code + first), last - first,
+		  PROT_READ | PROT_EXEC) ? -1 : 0;
+}
+
+/** Emit code that checks the address stack has at least one address */
+static void emitAddressStackCheck(BlockCompiler* c, uint64_t pc,
+				  uint32_t refund) {
+  emitRegMem(&c->e, OP_CMP_REG_RM, R12, RBX, STATE_ADDRESS_BOTTOM);
+  emitExit(c, CC_E, pc, refund);
+}
+
+/** Emit code that checks the call stack has room for another frame */
+static void emitCallStackRoomCheck(BlockCompiler* c, uint64_t pc,
+				   uint32_t refund) {
+  emitRegMem(&c->e, OP_MOV_REG_RM, RAX, RBX, STATE_CALL_LIMIT);
+  emitRegReg(&c->e, OP_SUB_RM_REG, RAX, R13);
+  emitRegImm(&c->e, EXT_CMP, RAX, 16);
+  emitExit(c, CC_B, pc, refund);
+}
+
+/** Emit code that checks the call stack has at least one frame */
+static void emitCallStackFrameCheck(BlockCompiler* c, uint64_t pc,
+				    uint32_t refund) {
+  emitRegReg(&c->e, OP_MOV_RM_REG, RAX, R13);
+  emitRegMem(&c->e, OP_SUB_REG_RM, RAX, RBX, STATE_CALL_BOTTOM);
+  emitRegImm(&c->e, EXT_CMP, RAX, 16);
+  emitExit(c, CC_B, pc, refund);
+}
+
+/** Emit code that checks the address in "reg" is inside the VM's memory */
+static void emitTargetCheck(BlockCompiler* c, int reg, uint64_t pc,
+			    uint32_t refund) {
+  emitRegMem(&c->e, OP_CMP_REG_RM, reg, RBX, STATE_MEMORY_SIZE);
+  emitExit(c, CC_AE, pc, refund);
+}
+
+/** Emit code that jumps to the address in rax */
+static void emitDispatch(BlockCompiler* c) {
+  patchRel32(&c->e, emitJmp(&c->e), c->jit->dispatch);
+}
+
+/** Emit the template for the "index"th of "count" instructions */
+static void emitInstruction(BlockCompiler* c, const uint8_t* code,
+			    uint64_t address, uint32_t index, uint32_t count,
+			    int isTailCall) {
+  CodeEmitter* const e = &c->e;
+  const uint8_t opcode = code[address];
+  const uint32_t refund = count - index;
+  uint64_t operand = 0;
+
+  if (instructionHasAddressOperand(opcode)) {
+    memcpy(&operand, code + address + 1, 8);
+  }
+
+  switch (opcode) {
+    case PUSH_INSTRUCTION:
+      emitRegMem(e, OP_CMP_REG_RM, R12, RBX, STATE_ADDRESS_LIMIT);
+      emitExit(c, CC_E, address, refund);
+      emitMovRegImm(e, RAX, operand);
+      emitRegMem(e, OP_MOV_RM_REG, RAX, R12, 0);
+      emitRegImm(e, EXT_ADD, R12, 8);
+      break;
+
+    case POP_INSTRUCTION:
+      emitAddressStackCheck(c, address, refund);
+      emitRegImm(e, EXT_SUB, R12, 8);
+      break;
+
+    case SWAP_INSTRUCTION:
+      emitRegReg(e, OP_MOV_RM_REG, RAX, R12);
+      emitRegMem(e, OP_SUB_REG_RM, RAX, RBX, STATE_ADDRESS_BOTTOM);
+      emitRegImm(e, EXT_CMP, RAX, 16);
+      emitExit(c, CC_B, address, refund);
+      emitRegMem(e, OP_MOV_REG_RM, RAX, R12, -8);
+      emitRegMem(e, OP_MOV_REG_RM, RCX, R12, -16);
+      emitRegMem(e, OP_MOV_RM_REG, RCX, R12, -8);
+      emitRegMem(e, OP_MOV_RM_REG, RAX, R12, -16);
+      break;
+
+    case DUP_INSTRUCTION:
+      emitAddressStackCheck(c, address, refund);
+      emitRegMem(e, OP_CMP_REG_RM, R12, RBX, STATE_ADDRESS_LIMIT);
+      emitExit(c, CC_E, address, refund);
+      emitRegMem(e, OP_MOV_REG_RM, RAX, R12, -8);
+      emitRegMem(e, OP_MOV_RM_REG, RAX, R12, 0);
+      emitRegImm(e, EXT_ADD, R12, 8);
+      break;
+
+    case PCALL_INSTRUCTION:
+      emitAddressStackCheck(c, address, refund);
+      if (isTailCall) {
+	/** The interpreter makes an ordinary call if there is no frame
+	 *  to replace
+	 */
+	emitCallStackFrameCheck(c, address, refund);
+      } else {
+	emitCallStackRoomCheck(c, address, refund);
+      }
+      emitRegMem(e, OP_MOV_REG_RM, RAX, R12, -8);
+      emitTargetCheck(c, RAX, address, refund);
+      emitRegImm(e, EXT_SUB, R12, 8);
+      if (isTailCall) {
+	emitRegMem(e, OP_MOV_RM_REG, RAX, R13, -16);
+      } else {
+	emitRegMem(e, OP_MOV_RM_REG, RAX, R13, 0);
+	emitMovRegImm(e, RCX, address + 1);
+	emitRegMem(e, OP_MOV_RM_REG, RCX, R13, 8);
+	emitRegImm(e, EXT_ADD, R13, 16);
+      }
+      emitDispatch(c);
+      break;
+
+    case RET_INSTRUCTION:
+      emitCallStackFrameCheck(c, address, refund);
+      emitRegMem(e, OP_MOV_REG_RM, RAX, R13, -8);
+      emitTargetCheck(c, RAX, address, refund);
+      emitRegImm(e, EXT_SUB, R13, 16);
+      emitDispatch(c);
+      break;
+
+    case PUSH_PCALL_INSTRUCTION:
+      if (isTailCall) {
+	emitCallStackFrameCheck(c, address, refund);
+      } else {
+	emitCallStackRoomCheck(c, address, refund);
+      }
+      emitMovRegImm(e, RAX, operand);
+      emitTargetCheck(c, RAX, address, refund);
+      if (isTailCall) {
+	emitRegMem(e, OP_MOV_RM_REG, RAX, R13, -16);
+      } else {
+	emitRegMem(e, OP_MOV_RM_REG, RAX, R13, 0);
+	emitMovRegImm(e, RCX, address + 9);
+	emitRegMem(e, OP_MOV_RM_REG, RCX, R13, 8);
+	emitRegImm(e, EXT_ADD, R13, 16);
+      }
+      emitDispatch(c);
+      break;
+
+    case PUSH_PCALL_RET_INSTRUCTION:
+      emitCallStackFrameCheck(c, address, refund);
+      emitMovRegImm(e, RAX, operand);
+      emitTargetCheck(c, RAX, address, refund);
+      emitRegMem(e, OP_MOV_RM_REG, RAX, R13, -16);
+      emitDispatch(c);
+      break;
+
+    case PCALL_RET_INSTRUCTION:
+      emitAddressStackCheck(c, address, refund);
+      emitCallStackFrameCheck(c, address, refund);
+      emitRegMem(e, OP_MOV_REG_RM, RAX, R12, -8);
+      emitTargetCheck(c, RAX, address, refund);
+      emitRegImm(e, EXT_SUB, R12, 8);
+      emitRegMem(e, OP_MOV_RM_REG, RAX, R13, -16);
+      emitDispatch(c);
+      break;
+
+    case POP_PUSH_RET_INSTRUCTION:
+      emitAddressStackCheck(c, address, refund);
+      emitCallStackFrameCheck(c, address, refund);
+      emitRegMem(e, OP_MOV_REG_RM, RAX, R13, -8);
+      emitTargetCheck(c, RAX, address, refund);
+      emitMovRegImm(e, RCX, operand);
+      emitRegMem(e, OP_MOV_RM_REG, RCX, R12, -8);
+      emitRegImm(e, EXT_SUB, R13, 16);
+      emitDispatch(c);
+      break;
+
+    default:
+      /** tryToCompileBlock() only passes the instructions above */
+      assert(0);
+  }
+}
+
+/** Emit a conditional jump to an exit that lets the interpreter execute
+ *  the instruction at "pc" after refunding "refund" instructions
+ */
+static void emitExit(BlockCompiler* c, uint8_t cc, uint64_t pc,
+		     uint32_t refund) {
+  uint8_t* const rel32 = emitJcc(&c->e, cc);
+  if (c->numExits < (sizeof(c->exits) / sizeof(c->exits[0]))) {
+    c->exits[c->numExits].rel32 = rel32;
+    c->exits[c->numExits].pc = pc;
+    c->exits[c->numExits].refund = refund;
+    ++c->numExits;
+  } else {
+    c->e.overflow = 1;
+  }
+}
+
+static void emitByte(CodeEmitter* e, uint8_t b) {
+  if (e->p < e->end) {
+    *e->p++ = b;
+  } else {
+    e->overflow = 1;
+  }
+}
+
+static void emitUInt32(CodeEmitter* e, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    emitByte(e, (uint8_t)(v >> (8 * i)));
+  }
+}
+
+static void emitUInt64(CodeEmitter* e, uint64_t v) {
+  emitUInt32(e, (uint32_t)v);
+  emitUInt32(e, (uint32_t)(v >> 32));
+}
+
+/** Emit a REX prefix with REX.W set */
+static void emitRexW(CodeEmitter* e, int reg, int index, int base) {
+  emitByte(e, 0x48 | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+}
+
+/** Emit "op reg, [base + disp]" or "op [base + disp], reg" */
+static void emitRegMem(CodeEmitter* e, uint8_t opcode, int reg, int base,
+		       int32_t disp) {
+  const int shortDisp = (disp >= -128) && (disp <= 127);
+
+  emitRexW(e, reg, 0, base);
+  emitByte(e, opcode);
+  emitByte(e, (shortDisp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emitByte(e, 0x24);  /** SIB with no index */
+  }
+  if (shortDisp) {
+    emitByte(e, (uint8_t)disp);
+  } else {
+    emitUInt32(e, (uint32_t)disp);
+  }
+}
+
+/** Emit "op rm, reg" with both operands in registers */
+static void emitRegReg(CodeEmitter* e, uint8_t opcode, int rm, int reg) {
+  emitRexW(e, reg, 0, rm);
+  emitByte(e, opcode);
+  emitByte(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/** Emit "op reg, imm" for the op given by "ext" */
+static void emitRegImm(CodeEmitter* e, int ext, int reg, int32_t imm) {
+  const int shortImm = (imm >= -128) && (imm <= 127);
+
+  emitRexW(e, 0, 0, reg);
+  emitByte(e, shortImm ? 0x83 : 0x81);
+  emitByte(e, 0xC0 | (ext << 3) | (reg & 7));
+  if (shortImm) {
+    emitByte(e, (uint8_t)imm);
+  } else {
+    emitUInt32(e, (uint32_t)imm);
+  }
+}
+
+/** Emit "mov reg, imm," using the shorter 32-bit form if it fits */
+static void emitMovRegImm(CodeEmitter* e, int reg, uint64_t imm) {
+  if (imm <= 0xFFFFFFFFULL) {
+    if (reg >= 8) {
+      emitByte(e, 0x41);
+    }
+    emitByte(e, 0xB8 | (reg & 7));
+    emitUInt32(e, (uint32_t)imm);
+  } else {
+    emitRexW(e, 0, 0, reg);
+    emitByte(e, 0xB8 | (reg & 7));
+    emitUInt64(e, imm);
+  }
+}
+
+/** Emit "mov dst, [base + index * 8]" */
+static void emitLoadIndexed(CodeEmitter* e, int dst, int base, int index) {
+  const int needsDisp = ((base & 7) == RBP);
+
+  emitRexW(e, dst, index, base);
+  emitByte(e, OP_MOV_REG_RM);
+  emitByte(e, (needsDisp ? 0x40 : 0x00) | ((dst & 7) << 3) | RSP);
+  emitByte(e, 0xC0 | ((index & 7) << 3) | (base & 7));
+  if (needsDisp) {
+    emitByte(e, 0);
+  }
+}
+
+static void emitPush(CodeEmitter* e, int reg) {
+  if (reg >= 8) {
+    emitByte(e, 0x41);
+  }
+  emitByte(e, 0x50 | (reg & 7));
+}
+
+static void emitPop(CodeEmitter* e, int reg) {
+  if (reg >= 8) {
+    emitByte(e, 0x41);
+  }
+  emitByte(e, 0x58 | (reg & 7));
+}
+
+static void emitJmpReg(CodeEmitter* e, int reg) {
+  if (reg >= 8) {
+    emitByte(e, 0x41);
+  }
+  emitByte(e, 0xFF);
+  emitByte(e, 0xE0 | (reg & 7));
+}
+
+/** Emit a conditional jump and return where its displacement goes */
+static uint8_t* emitJcc(CodeEmitter* e, uint8_t cc) {
+  emitByte(e, 0x0F);
+  emitByte(e, 0x80 | cc);
+  uint8_t* const rel32 = e->p;
+  emitUInt32(e, 0);
+  return rel32;
+}
+
+/** Emit a jump and return where its displacement goes */
+static uint8_t* emitJmp(CodeEmitter* e) {
+  emitByte(e, 0xE9);
+  uint8_t* const rel32 = e->p;
+  emitUInt32(e, 0);
+  return rel32;
+}
+
+static void patchRel32(CodeEmitter* e, uint8_t* rel32,
+		       const uint8_t* target) {
+  /** Jumps emitted after the buffer filled up have nowhere to go, but the
+   *  code they're in is thrown away anyway
+   */
+  if (!e->overflow) {
+    const int32_t disp = (int32_t)(target - (rel32 + 4));
+    memcpy(rel32, &disp, 4);
+  }
+}
+
+#else
+
+/** No JIT on this platform */
+
+VmJit createVmJit(uint64_t codeBufferSize, uint32_t hotClosureThreshold) {
+  return NULL;
+}
+
+void destroyVmJit(VmJit jit) {
+}
+
+const void* getVmJitCodeForProgram(VmJit jit, const uint8_t* program,
+				   uint64_t programSize, uint64_t address) {
+  return NULL;
+}
+
+const void* getVmJitCodeForClosure(VmJit jit, const uint8_t* memory,
+				   uint64_t memorySize, uint64_t address) {
+  return NULL;
+}
+
+int runVmJitCode(VmJit jit, VmJitState* state, const void* code) {
+  return VmJitExitInterpret;
+}
+
+void getVmJitStats(VmJit jit, VmJitStats* stats) {
+  memset(stats, 0, sizeof(VmJitStats));
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef __VM_JIT_H__
+#define __VM_JIT_H__
+
+#include <stdint.h>
+
+/** Template JIT compiler for the Unlambda VM
+ *
+ *  Translates VM code into x86-64 machine code by copying a template for
+ *  each instruction into an executable region of memory.  The compiler
+ *  works on blocks: straight-line runs of instructions that start at
+ *  some address and end with the first instruction that transfers
+ *  control.
+ *
+ *  Compiled code executes PUSH, POP, SWAP, DUP, PCALL, RET and the
+ *  superinstructions built from them.  Control transfers go straight to
+ *  the compiled block for their target if it is in the program area and
+ *  has already been compiled.  Compiled code returns to its caller
+ *  (see runVmJitCode()) to let the interpreter handle everything else:
+ *  all other instructions, instructions that would fail, transfers to
+ *  code that isn't compiled yet and running out of instructions to
+ *  execute.
+ *
+ *  Code in the program area is compiled the first time it is executed.
+ *  Code on the heap is compiled only after it has been called more than
+ *  a given number of times.  Heap code doesn't change after the MK*
+ *  instruction that creates it writes it, but the garbage collector can
+ *  reuse its memory for different code, so the compiler keeps a copy of
+ *  the bytecode it compiled and checks it still matches before using
+ *  the compiled code.
+ *
+ *  The compiler is only available on x86-64.  createVmJit() returns NULL
+ *  on other platforms.
+ */
+typedef struct VmJitImpl_* VmJit;
+
+/** Interpreter state compiled code reads and updates
+ *
+ *  runVmJitCode() loads the tops of the stacks and "remaining" into
+ *  registers and writes them back when the compiled code returns.  The
+ *  compiled code reads the other fields directly from this structure.
+ */
+typedef struct VmJitState_ {
+  uint64_t* addressStackTop;      /** Top of the address stack */
+  uint64_t* addressStackBottom;   /** Bottom of the address stack */
+  uint64_t* addressStackLimit;    /** End of the address stack's memory */
+  uint64_t* callStackTop;         /** Top of the call stack */
+  uint64_t* callStackBottom;      /** Bottom of the call stack */
+  uint64_t* callStackLimit;       /** End of the call stack's memory */
+  uint64_t remaining;             /** Instructions left to execute */
+  uint64_t pc;                    /** Where execution stopped */
+  uint64_t memorySize;            /** Size of the VM's memory */
+  uint64_t programSize;           /** Size of the program area */
+  const void** programCode;       /** Set by runVmJitCode() */
+} VmJitState;
+
+/** Counters describing what the JIT compiler has done */
+typedef struct VmJitStats_ {
+  /** Number of blocks compiled from the program area */
+  uint64_t blocksCompiled;
+
+  /** Number of blocks compiled from code on the heap */
+  uint64_t closuresCompiled;
+
+  /** Number of times compiled code was entered from the interpreter */
+  uint64_t codeEntries;
+
+  /** Number of times the code buffer filled up and was emptied */
+  uint64_t codeBufferFlushes;
+} VmJitStats;
+
+/** Create a JIT compiler
+ *
+ *  Arguments:
+ *    codeBufferSize         Size of the region that holds compiled code,
+ *                             in bytes.  When it fills up, all compiled
+ *                             code is thrown away and compilation starts
+ *                             over.
+ *    hotClosureThreshold    Number of times code on the heap has to be
+ *                             called before it is compiled
+ *
+ *  Returns:
+ *    The new compiler or NULL if it could not be created, either because
+ *    memory for it or its code buffer could not be allocated or because
+ *    the host is not an x86-64 machine.
+ */
+VmJit createVmJit(uint64_t codeBufferSize, uint32_t hotClosureThreshold);
+
+/** Destroy a JIT compiler, along with all the code it has compiled */
+void destroyVmJit(VmJit jit);
+
+/** Get the compiled code for the block at "address" in the program area
+ *
+ *  Compiles the block if it hasn't been compiled yet.
+ *
+ *  Arguments:
+ *    jit          The compiler
+ *    program      Start of the program area
+ *    programSize  Size of the program area
+ *    address      Address of the block in the program area
+ *
+ *  Returns:
+ *    The block's code, or NULL if the block starts with an instruction
+ *    compiled code can't execute, or if it couldn't be compiled.
+ */
+const void* getVmJitCodeForProgram(VmJit jit, const uint8_t* program,
+				   uint64_t programSize, uint64_t address);
+
+/** Get the compiled code for the block at "address" on the heap
+ *
+ *  Counts the call and compiles the block if it has been called at least
+ *  as many times as the hot closure threshold.
+ *
+ *  Arguments:
+ *    jit         The compiler
+ *    memory      Start of the VM's memory
+ *    memorySize  Size of the VM's memory
+ *    address     Address of the block on the heap
+ *
+ *  Returns:
+ *    The block's code, or NULL if the block isn't hot yet, starts with an
+ *    instruction compiled code can't execute or could not be compiled.
+ */
+const void* getVmJitCodeForClosure(VmJit jit, const uint8_t* memory,
+				   uint64_t memorySize, uint64_t address);
+
+/** Execute compiled code
+ *
+ *  Runs "code" until it reaches something it can't handle itself, then
+ *  writes the address of the next instruction to execute to state->pc,
+ *  updates the stack tops and state->remaining and returns why it
+ *  stopped.
+ *
+ *  Returns:
+ *    VmJitExitInterpret if the interpreter should execute the instruction
+ *    at state->pc, or VmJitExitLookup if state->pc is the target of a
+ *    control transfer with no compiled code.
+ */
+int runVmJitCode(VmJit jit, VmJitState* state, const void* code);
+
+/** Get the compiler's counters */
+void getVmJitStats(VmJit jit, VmJitStats* stats);
+
+#ifdef __cplusplus
+
+/** Returned by runVmJitCode() when the interpreter should execute the
+ *  instruction at state->pc
+ */
+const int VmJitExitInterpret = 1;
+
+/** Returned by runVmJitCode() when state->pc is the target of a call
+ *  or return that isn't compiled
+ */
+const int VmJitExitLookup = 2;
+
+#else
+
+const int VmJitExitInterpret;
+const int VmJitExitLookup;
+
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __VM_NATIVE_H__
+#define __VM_NATIVE_H__
+
+#include <stdint.h>
+
+/** Native code for the program area
+ *
+ *  A program can supply native functions that replace blocks of code in
+ *  its program area (see setVmNativeCode()).  unl2c generates them from
+ *  a program image.  Each function executes its block directly on the
+ *  VM's stacks and returns to the VM when it reaches code it can't
+ *  handle itself: instructions other than PUSH, POP, SWAP, DUP, PCALL,
+ *  RET and the superinstructions built from them, instructions that
+ *  would fail, the target of a call or return and running out of
+ *  instructions to execute.  The VM then carries on from the address
+ *  the function stopped at.
+ *
+ *  Native code has to count the instructions it executes in "remaining"
+ *  and leave the stacks exactly as the VM would, so running a program
+ *  with native code gives the same results as interpreting it.
+ */
+
+/** State of the VM, as seen by native code
+ *
+ *  The VM fills this in before calling native code, which updates the
+ *  stack tops, "remaining" and "pc" before it returns.
+ */
+typedef struct VmNativeState_ {
+  uint64_t* addressStackTop;      /** Top of the address stack */
+  uint64_t* addressStackBottom;   /** Bottom of the address stack */
+  uint64_t* addressStackLimit;    /** End of the address stack's memory */
+  uint64_t* callStackTop;         /** Top of the call stack */
+  uint64_t* callStackBottom;      /** Bottom of the call stack */
+  uint64_t* callStackLimit;       /** End of the call stack's memory */
+  uint64_t remaining;             /** Instructions left to execute */
+  uint64_t pc;                    /** Where execution continues */
+  uint64_t memorySize;            /** Size of the VM's memory */
+} VmNativeState;
+
+/** Native code for a block
+ *
+ *  Returns VmNativeExitJump if state->pc is the target of a control
+ *  transfer, or VmNativeExitInterpret if the VM should execute the
+ *  instruction at state->pc itself.
+ */
+typedef int (*VmNativeCode)(VmNativeState* state);
+
+/** Native code and the address of the block it replaces */
+typedef struct VmNativeBlock_ {
+  uint64_t address;
+  VmNativeCode code;
+} VmNativeBlock;
+
+#ifdef __cplusplus
+
+/** Returned by native code when the VM should execute the instruction at
+ *  state->pc
+ */
+const int VmNativeExitInterpret = 1;
+
+/** Returned by native code when state->pc is the target of a call or
+ *  return
+ */
+const int VmNativeExitJump = 2;
+
+#else
+
+const int VmNativeExitInterpret;
+const int VmNativeExitJump;
+
+#endif
+
+#endif
@@ -3,12 +3,106 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** Cell sizes for slabs are multiples of eight from 16 up to this size */
+#define MAX_SLAB_CELL_SIZE 32
+#define NUM_SLAB_CELL_SIZES ((MAX_SLAB_CELL_SIZE / 8) - 1)
+
+/** Number of cells in each slab */
+#define CELLS_PER_SLAB 64
+
+/** Free blocks with up to this many bytes go on the lists of small free
+ *  blocks.  Larger free blocks go in the tree of large free blocks.
+ */
+#define MAX_SMALL_FREE_BLOCK_SIZE 256
+#define NUM_SMALL_FREE_LISTS (MAX_SMALL_FREE_BLOCK_SIZE / 8)
+
+/** Default size of the nursery, including the header of its first block */
+#define DEFAULT_NURSERY_SIZE (256 * 1024)
+
+/** Alignment of the address space reserved for the memory, so the
+ *  kernel can back it with transparent huge pages
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/** releaseVmmFreeMemory() skips free blocks smaller than this, which
+ *  hold too few whole pages to be worth a system call
+ */
+#define MIN_RELEASED_BLOCK_SIZE (64 * 1024)
+
+/** Initial capacity of the remembered set */
+#define INITIAL_REMEMBERED_SET_SIZE 64
+
+/** Initial capacity of the mark stack */
+#define INITIAL_MARK_STACK_SIZE 1024
+
+/** Number of blocks whose headers the marker prefetches ahead of the
+ *  block it is marking
+ */
+#define MARK_PREFETCH_DISTANCE 8
+
+/** Number of addresses continueIncrementalVmmCollection() takes off the
+ *  mark stack between looks at the clock
+ */
+#define MARK_SLICE_WORK 256
+
+/** Capacity of each worker's deque in a parallel collection.  Must be a
+ *  power of two.
+ */
+#define MARK_DEQUE_SIZE 8192
+
+/** Heaps smaller than this are collected by one thread, no matter how
+ *  many threads the collector may use, since starting the threads would
+ *  take longer than the collection
+ */
+#define MIN_PARALLEL_GC_HEAP_SIZE (1024 * 1024)
+
+/** Number of bytes sweepLazily() sweeps at a time, at least */
+#define LAZY_SWEEP_CHUNK_SIZE (64 * 1024)
+
+/** Most GC errors the background thread of a concurrent collection keeps
+ *  until the collection finishes and reports them
+ */
+#define MAX_DEFERRED_GC_ERRORS 16
+
+/** A large free block, which is also a node in the tree of large free
+ *  blocks
+ *
+ *  The tree is a treap ordered by block size and then by address, with
+ *  priorities that come from hashing the block's address.  The child and
+ *  parent links are addresses, and 0 means there is no such node.
+ */
+typedef struct FreeTreeNode_ {
+  FreeBlock block;
+  uint64_t left;
+  uint64_t right;
+  uint64_t parent;
+} FreeTreeNode;
+
+/** A GC error found by the background thread of a concurrent collection */
+typedef struct VmmDeferredGcError_ {
+  uint64_t address;
+  int hasBlock;
+  char details[100];
+} VmmDeferredGcError;
 
 typedef struct VmMemoryImpl_ {
-  /** The VM memory itself */
+  /** The VM memory itself.  The memory reserves address space for its
+   *  maximum size up front and commits pages as it grows, so growing it
+   *  never moves it.
+   */
   uint8_t* bytes;
 
   /** End of the VM memory */
@@ -16,6 +110,27 @@ typedef struct VmMemoryImpl_ {
 
   /** Maximum size of the memory */
   uint64_t maxSize;
+
+  /** Whether the kernel should back the memory with huge pages */
+  int hugePages;
+
+  /** Bytes releaseVmmFreeMemory() has returned to the system, in total */
+  uint64_t bytesReleased;
+
+  /** The mark bitmap.  Bit (a % 64) of markBits[a / 64] is the mark for
+   *  the block or slab cell whose header is at address 8 * a.  Covering
+   *  the program area too keeps the arithmetic simple, and costs one
+   *  byte for every 64 bytes the program uses.
+   */
+  uint64_t* markBits;
+
+  /** The block-start bitmap, laid out like the mark bitmap, with a bit
+   *  set for every block on the heap.  Cells in slabs are not blocks on
+   *  the heap and don't have bits of their own.  With it, the sweep can
+   *  find where the blocks between two marked blocks start without
+   *  reading their headers.
+   */
+  uint64_t* startBits;
   
   /** Start address of the heap.  Also doubles as the end of the memory
    *  reserved for the program.
@@ -25,8 +140,149 @@ typedef struct VmMemoryImpl_ {
   /** Number of bytes free on the heap */
   uint64_t bytesFree;
 
-  /** Address of first free block */
-  uint64_t firstFree;
+  /** Number of bytes taken from the free blocks since the last full
+   *  collection started marking.  The nursery counts for the blocks that
+   *  survive minor collections rather than its size.  A lazy sweep
+   *  doesn't change it, so it counts what the program allocated whether
+   *  or not the heap has been swept.
+   */
+  uint64_t bytesAllocatedSinceGc;
+
+  /** Number of bytes in the blocks and slab cells the last full
+   *  collection marked, headers included.  Blocks allocated while an
+   *  incremental collection marks the heap are live but not counted.
+   */
+  uint64_t bytesMarked;
+
+  /** Lists of small free blocks.  List i holds the free blocks with
+   *  8 * (i + 1) bytes of data.  0 marks an empty list.
+   */
+  uint64_t smallFreeLists[NUM_SMALL_FREE_LISTS];
+
+  /** Bit i is set when smallFreeLists[i] is not empty */
+  uint64_t nonEmptySmallFreeLists;
+
+  /** Root of the tree of large free blocks, or 0 if the tree is empty */
+  uint64_t freeTreeRoot;
+
+  /** Nonzero if the block at address 0 is free.  The lists and the tree
+   *  use 0 to mean "no block," so that block can't go on them.  It only
+   *  exists when no memory is reserved for the program.
+   */
+  int freeBlockAtZero;
+
+  /** Address of the first free cell in the slabs of each size, or 0
+   *  if there are no free cells of that size
+   */
+  uint64_t firstFreeCell[NUM_SLAB_CELL_SIZES];
+
+  /** Nonzero if the heap didn't have room for the last slab
+   *  allocateVmmCodeBlockFromSlab() tried to allocate.  It won't try
+   *  again until the garbage collector runs or the memory grows.
+   */
+  int slabAllocationFailed;
+
+  /** The nursery, a block from the heap that
+   *  allocateVmmCodeBlockFromNursery() fills from front to back.  Every
+   *  function allocated in the nursery has its own block header, and the
+   *  unused part at the end of the nursery is a free block that isn't in
+   *  the lists or tree of free blocks.  nurseryStart and nurseryEnd are
+   *  the addresses of the first byte of the nursery and the byte after
+   *  it, and nurseryTop is the address of the header of the free block
+   *  at its end.  All three are 0 when there is no nursery.
+   */
+  uint64_t nurseryStart;
+  uint64_t nurseryTop;
+  uint64_t nurseryEnd;
+
+  /** Size of the next nursery.  0 disables the nursery */
+  uint64_t nurserySize;
+
+  /** Nonzero if the heap didn't have room for the last nursery
+   *  allocateVmmCodeBlockFromNursery() tried to allocate.  It won't try
+   *  again until the garbage collector runs or the memory grows.
+   */
+  int nurseryAllocationFailed;
+
+  /** The remembered set: addresses of the headers of the blocks allocated
+   *  outside the nursery since the nursery was allocated.  These are the
+   *  only blocks on the heap that can hold addresses of blocks in the
+   *  nursery, since blocks never change once they are written.
+   */
+  uint64_t* rememberedBlocks;
+  uint64_t numRememberedBlocks;
+  uint64_t rememberedBlocksCapacity;
+
+  /** The mark stack: addresses of blocks the garbage collector has found
+   *  but not marked yet.  Marking with an explicit stack instead of
+   *  recursion lets the collector handle chains of functions of any
+   *  length.
+   */
+  uint64_t* markStack;
+  uint64_t markStackSize;
+  uint64_t markStackCapacity;
+
+  /** Nonzero if the mark stack couldn't grow and dropped addresses */
+  int markStackOverflowed;
+
+  /** Nonzero while an incremental collection is marking the heap.  The
+   *  mark stack holds the addresses that are left to mark between calls
+   *  to continueIncrementalVmmCollection(), and every block allocated in
+   *  the meantime is marked when it is allocated.
+   */
+  int incrementalMarking;
+
+  /** The thread that marks the heap during a concurrent collection.
+   *  While it runs, it owns the mark stack, and the heap must not move or
+   *  grow.  The thread sets concurrentMarkDone when there is nothing left
+   *  on the mark stack and stops early when stopMarkThread is set.  Both
+   *  are read and written with atomic operations.
+   */
+  pthread_t markThread;
+  int markThreadRunning;
+  int concurrentMarkDone;
+  int stopMarkThread;
+
+  /** GC errors the thread found.  The program may be running when the
+   *  thread finds them, so they are reported when the collection
+   *  finishes.
+   */
+  VmmDeferredGcError deferredGcErrors[MAX_DEFERRED_GC_ERRORS];
+  uint32_t numDeferredGcErrors;
+
+  /** Number of threads that mark and sweep the heap in a full collection */
+  uint32_t gcThreads;
+
+  /** Nonzero if full collections leave the sweep to the allocator */
+  int lazySweep;
+
+  /** The part of the heap a lazy sweep hasn't swept yet.  The blocks in
+   *  use there are still marked, and the free memory there isn't on the
+   *  lists or tree of free blocks or counted in bytesFree.  Both are 0
+   *  when there is nothing left to sweep.
+   */
+  uint64_t lazySweepStart;
+  uint64_t lazySweepEnd;
+  uint64_t lazySweepBlocksInFreeRanges;
+  uint64_t lazySweepBlocksKept;
+
+  /** Statistics on the collections so far.  getVmmGcStats() fills in the
+   *  ones about the free blocks when it is called.
+   */
+  VmmGcStats gcStats;
+
+  /** Collections call each other, so only the outermost one's pause
+   *  counts.  This is how deeply they are nested, and when the outermost
+   *  one started.
+   */
+  uint32_t gcPauseDepth;
+  struct timespec gcPauseStart;
+
+  /** Called to forget the blocks a collection is about to free.  NULL if
+   *  nothing holds weak references to blocks.
+   */
+  VmmWeakRefHandler weakRefHandler;
+  void* weakRefContext;
 
   /** Logger this VmMemory uses to write debugging & info messages */
   Logger logger;
@@ -39,6 +295,134 @@ typedef struct VmMemoryImpl_ {
   
 } VmMemoryImpl;
 
+/** Value of VmmRelocation.newAddress for a block that hasn't been copied */
+#define BLOCK_NOT_COPIED (~(uint64_t)0)
+
+/** Where a live block was before compaction and where it is afterwards */
+typedef struct VmmRelocation_ {
+  /** Address of the block's header before compaction */
+  uint64_t oldAddress;
+
+  /** Address of the block's header after compaction, or BLOCK_NOT_COPIED */
+  uint64_t newAddress;
+} VmmRelocation;
+
+/** State of a compacting collection */
+typedef struct VmmCompaction_ {
+  VmMemory memory;
+
+  /** The new memory, which the collector copies the live blocks into */
+  uint8_t* toSpace;
+
+  /** Address in toSpace where the next block goes */
+  uint64_t top;
+
+  /** Address in toSpace of the last block copied */
+  uint64_t lastBlock;
+
+  /** The live blocks in address order, so the collector can find the
+   *  block that contains an address with a binary search
+   */
+  VmmRelocation* blocks;
+  uint64_t numBlocks;
+
+  /** Addresses in toSpace of the blocks that have been copied, but
+   *  whose contents still have the old addresses.  The collector uses
+   *  this as a stack, which makes the copy depth-first.
+   */
+  uint64_t* pending;
+  uint64_t numPending;
+} VmmCompaction;
+
+/** A worker's deque of addresses of blocks to mark in a parallel
+ *  collection
+ *
+ *  The worker pushes and pops addresses at the bottom, and the other
+ *  workers steal them from the top, as in Chase and Lev's dynamic
+ *  circular work-stealing deque, but with an array that doesn't grow.
+ *  Addresses that don't fit go on the memory's mark stack.  Each deque
+ *  has a cache line to itself, so the workers don't fight over them.
+ */
+typedef struct VmmMarkDeque_ {
+  uint64_t top;
+  uint64_t bottom;
+  uint64_t* items;
+} __attribute__((aligned(64))) VmmMarkDeque;
+
+/** State of a parallel mark */
+typedef struct VmmParallelMark_ {
+  VmMemory memory;
+
+  /** One deque for each worker */
+  VmmMarkDeque* deques;
+  uint32_t numWorkers;
+
+  /** Number of workers that have run out of blocks to mark.  Marking is
+   *  over when all of them have.
+   */
+  uint32_t numIdle;
+
+  uint64_t numBlocksMarked;
+
+  /** Guards the memory's mark stack and calls to the error handler */
+  pthread_mutex_t lock;
+  GcErrorHandler errorHandler;
+  void* errorContext;
+} VmmParallelMark;
+
+/** A thread that marks blocks in a parallel mark */
+typedef struct VmmMarkWorker_ {
+  VmmParallelMark* mark;
+  VmmMarkDeque* deque;
+  uint32_t index;
+} VmmMarkWorker;
+
+/** A range of the heap one thread sweeps in a full collection
+ *
+ *  When the heap is swept in parallel, the free blocks each thread finds
+ *  go on a list of their own, linked in address order through their
+ *  "next" fields, and so do the free cells in its slabs.  The lists are
+ *  merged once all the ranges have been swept.
+ */
+typedef struct VmmSweep_ {
+  VmMemory memory;
+
+  /** Address of the first block in the range and of the byte after the
+   *  last one
+   */
+  uint64_t start;
+  uint64_t end;
+
+  /** A lazy sweep stops at the first block in use that ends at or after
+   *  this address, so the last block it sweeps is never a free block that
+   *  the next sweep could have made bigger.  The sweep sets "end" to the
+   *  address where it stopped.
+   */
+  uint64_t stop;
+
+  /** Nonzero if the free blocks go right on the memory's lists and tree,
+   *  which is what happens when one thread sweeps the whole heap
+   */
+  int addFreeBlocksToHeap;
+
+  /** The list of free blocks, if they don't go on the heap's lists */
+  uint64_t firstFreeBlock;
+  uint64_t lastFreeBlock;
+
+  /** Lists of free cells in slabs, by size */
+  uint64_t firstFreeCell[NUM_SLAB_CELL_SIZES];
+  uint64_t lastFreeCell[NUM_SLAB_CELL_SIZES];
+
+  uint64_t bytesFree;
+
+  /** Blocks in the ranges the sweep turned into free blocks.  These
+   *  include the free blocks already there, since the sweep only looks
+   *  at the block-start bitmap, not the blocks' headers.
+   */
+  uint64_t numBlocksInFreeRanges;
+  uint64_t numBlocksKept;
+} VmmSweep;
+
 /** "OK" message that indicates no error */
 static const char OK_MSG[] = "OK";
 
@@ -51,6 +435,7 @@ static const char DEFAULT_ERR_MSG[] = "ERROR";
 const int VmmFreeBlockType = 0;
 const int VmmCodeBlockType = 1;
 const int VmmStateBlockType = 2;
+const int VmmSlabBlockType = 3;
 
 /** Values for the error codes */
 const int VmmInvalidArgumentError = -1;
@@ -59,22 +444,144 @@ const int VmmMaxSizeExceededError = -3;
 const int VmmSizeIncreaseFailedError = -4;
 const int VmmNotEnoughMemoryError = -5;
 const int VmmHeapInUseError = -6;
+const int VmmNurseryFullError = -7;
+const int VmmHugePagesNotSupportedError = -8;
 
 static void writeFreeBlock(uint8_t* where, uint64_t size, uint64_t next);
+static uint64_t vmmPageSize(void);
+static uint64_t roundToPageSize(uint64_t size);
+static uint8_t* reserveHeapMemory(uint64_t maxSize, uint64_t size,
+				  int hugePages);
+static int commitHeapMemory(uint8_t* bytes, uint64_t oldSize,
+			    uint64_t newSize);
+static void releaseHeapMemory(uint8_t* bytes, uint64_t maxSize);
+static int adviseHugePages(uint8_t* bytes, uint64_t maxSize, int enabled);
 static int ptrOutOfBounds(VmMemory memory, uint8_t* p);
+static int growVmm(VmMemory memory);
 static HeapBlock* allocateBlock(VmMemory memory, uint64_t size);
-static FreeBlock* findFreeBlockWithSize(VmMemory memory, uint64_t size,
-					FreeBlock** prevFree);
+static FreeBlock* takeFreeBlockWithSize(VmMemory memory, uint64_t size);
+static FreeBlock* takeSweptFreeBlockWithSize(VmMemory memory,
+					     uint64_t size);
 static HeapBlock* splitFreeBlock(VmMemory memory, FreeBlock* block,
-				 FreeBlock* prev, uint64_t size);
-static void visitBlock(VmMemory memory, uint64_t address,
-		       GcErrorHandler errorHandler, void* errorContext);
-static void visitCodeBlock(VmMemory memory, CodeBlock* block,
-			   GcErrorHandler errorHandler, void* errorContext);
-static void visitVmStateBlock(VmMemory memory, VmStateBlock* block,
-			      GcErrorHandler errorHandler, void* errorContext);
+				 uint64_t size);
+static void resetFreeBlocks(VmMemory memory);
+static void addFreeBlock(VmMemory memory, FreeBlock* block);
+static void removeFreeBlock(VmMemory memory, FreeBlock* block);
+static FreeBlock* firstSmallOrLargeFreeBlock(VmMemory memory,
+					     uint32_t firstList);
+static void insertIntoFreeTree(VmMemory memory, FreeTreeNode* node);
+static void removeFromFreeTree(VmMemory memory, FreeTreeNode* node);
+static void rotateFreeTreeNodeUp(VmMemory memory, FreeTreeNode* node);
+static FreeTreeNode* smallestFreeTreeNodeWithSize(VmMemory memory,
+						  uint64_t size);
+static FreeTreeNode* leftmostFreeTreeNode(VmMemory memory, uint64_t root);
+static FreeTreeNode* nextFreeTreeNode(VmMemory memory, FreeTreeNode* node);
+static void pushOnMarkStack(VmMemory memory, uint64_t address);
+static void pushBlockReferences(VmMemory memory, HeapBlock* block,
+				uint64_t low, uint64_t high);
+static void pushReferenceOnMarkStack(void* memory, uint64_t address);
+static inline void scanBlockReferences(HeapBlock* block, uint64_t low,
+				       uint64_t high,
+				       void (*push)(void*, uint64_t),
+				       void* target);
+static uint64_t drainMarkStack(VmMemory memory, int young,
+			       uint64_t maxWork,
+			       GcErrorHandler errorHandler,
+			       void* errorContext);
+static void abandonIncrementalCollection(VmMemory memory);
+static void takeRootSnapshot(VmMemory memory, Stack callStack,
+			     Stack addressStack, GcErrorHandler errorHandler,
+			     void* errorContext);
+static int startMarkThread(VmMemory memory);
+static void stopConcurrentMark(VmMemory memory);
+static void* runConcurrentMark(void* memory);
+static void deferGcError(VmMemory memory, uint64_t address, HeapBlock* block,
+			 const char* details, void* unused);
+static void reportDeferredGcErrors(VmMemory memory,
+				   GcErrorHandler errorHandler,
+				   void* errorContext);
+static void pushReferencesFromMarkedBlocks(VmMemory memory, int young);
+static void markReachableBlocks(VmMemory memory, Stack callStack,
+				Stack addressStack,
+				GcErrorHandler errorHandler,
+				void* errorContext);
+static uint64_t markBlocksReachableFromStacks(VmMemory memory,
+					      Stack callStack,
+					      Stack addressStack,
+					      GcErrorHandler errorHandler,
+					      void* errorContext);
+static int markReachableBlocksInParallel(VmMemory memory, Stack callStack,
+					 Stack addressStack,
+					 GcErrorHandler errorHandler,
+					 void* errorContext,
+					 uint64_t* numBlocksMarked);
+static void* runMarkWorker(void* worker);
+static void markBlocksFromDeques(VmmMarkWorker* worker);
+static int takeMarkWork(VmmMarkWorker* worker, uint64_t* address);
+static int stealMarkWork(VmmMarkWorker* worker, uint64_t* address);
+static int markWorkIsAvailable(VmmParallelMark* mark);
+static void pushOnMarkDeque(VmmParallelMark* mark, VmmMarkDeque* deque,
+			    uint64_t address);
+static void pushReferenceOnMarkDeque(void* worker, uint64_t address);
+static int popFromMarkDeque(VmmMarkDeque* deque, uint64_t* address);
+static int stealFromMarkDeque(VmmMarkDeque* deque, uint64_t* address);
+static void reportParallelGcError(VmmParallelMark* mark, uint64_t address,
+				  HeapBlock* block, const char* details);
 static int collectUnmarkedBlocks(VmMemory memory, GcErrorHandler errorHandler,
 				 void* errorContext);
+static void startLazySweep(VmMemory memory);
+static int sweepLazily(VmMemory memory);
+static void abandonLazySweep(VmMemory memory);
+static uint32_t splitHeapForSweep(VmMemory memory, VmmSweep* sweeps,
+				  uint32_t numSweeps);
+static void initSweep(VmmSweep* sweep, VmMemory memory, uint64_t start,
+		      uint64_t end, int addFreeBlocksToHeap);
+static void sweepInParallel(VmMemory memory, VmmSweep* sweeps,
+			    uint32_t numSweeps);
+static void* runSweepWorker(void* sweep);
+static void sweepRange(VmmSweep* sweep);
+static uint64_t findNextLiveBlock(VmMemory memory, uint64_t from,
+				  uint64_t to);
+static void finishFreeBlock(VmmSweep* sweep, HeapBlock* block);
+static void addSweptFreeBlock(VmMemory memory, HeapBlock* block);
+static void mergeSweeps(VmMemory memory, VmmSweep* sweeps,
+			uint32_t numSweeps);
+static void sweepSlab(VmmSweep* sweep, VmmSlab* slab);
+static VmmSlab* allocateSlab(VmMemory memory, uint64_t cellSize);
+static void resetFreeCells(VmMemory memory);
+static int allocateNursery(VmMemory memory);
+static void retireNursery(VmMemory memory);
+static void resetNursery(VmMemory memory);
+static void rememberBlock(VmMemory memory, HeapBlock* block);
+static void sweepNursery(VmMemory memory);
+static int startCompaction(VmMemory memory,
+			   VmmCompaction* compaction);
+static uint64_t copyLiveBlock(VmmCompaction* compaction,
+			      uint64_t address);
+static void relocatePendingBlocks(VmmCompaction* compaction);
+static uint64_t relocateInteriorAddress(VmmCompaction* compaction,
+					uint64_t address);
+static void finishCompaction(VmmCompaction* compaction);
+
+static uint64_t bitmapWords(uint64_t memorySize);
+static int growBitmaps(VmMemory memory, uint64_t newSize);
+static inline int testBit(const uint64_t* bits, uint64_t address);
+static inline void setBit(uint64_t* bits, uint64_t address);
+static inline int blockIsMarked(VmMemory memory, uint64_t blockAddress);
+static inline void markBlock(VmMemory memory, uint64_t blockAddress);
+static void clearBits(uint64_t* bits, uint64_t from, uint64_t to);
+static uint64_t findNextBit(const uint64_t* bits, uint64_t from,
+			    uint64_t to);
+static uint64_t findLastBit(const uint64_t* bits, uint64_t from,
+			    uint64_t to);
+static uint64_t countBits(const uint64_t* bits, uint64_t from, uint64_t to);
+static void clearAllMarks(VmMemory memory);
+static void rebuildStartBits(VmMemory memory);
+static double usecSince(const struct timespec* start);
+static void startGcPause(VmMemory memory);
+static void endGcPause(VmMemory memory);
+static void forgetUnmarkedBlocks(VmMemory memory, uint64_t low,
+				 uint64_t high);
 
 static uint64_t alignTo8(uint64_t v) {
   return (v + 7) & ~(uint64_t)7;
@@ -102,19 +609,268 @@ static int shouldDeallocateStatusMsg(VmMemory memory) {
     && (memory->statusMsg != DEFAULT_ERR_MSG);
 }
 
-int vmmBlockIsMarked(const HeapBlock* block) {
-  return (int)(block->typeAndSize >> 63);
+int vmmBlockIsMarked(VmMemory memory, const HeapBlock* block) {
+  return blockIsMarked(memory, (const uint8_t*)block - memory->bytes);
+}
+
+void clearVmmBlockMark(VmMemory memory, HeapBlock* block) {
+  const uint64_t address = (uint8_t*)block - memory->bytes;
+  clearBits(memory->markBits, address, address + 8);
+}
+
+void setVmmBlockMark(VmMemory memory, HeapBlock* block) {
+  markBlock(memory, (uint8_t*)block - memory->bytes);
+}
+
+/** Number of 64-bit words in a bitmap for a memory of the given size */
+static uint64_t bitmapWords(uint64_t memorySize) {
+  return (memorySize / 8 + 63) / 64;
+}
+
+/** Grow the mark and block-start bitmaps to cover a memory of size
+ *  "newSize."  The bits for the new memory start out clear.
+ *
+ *  Returns 0 if successful and -1 if there isn't enough memory, in which
+ *  case the bitmaps still cover the old memory.
+ */
+static int growBitmaps(VmMemory memory, uint64_t newSize) {
+  const uint64_t oldWords = bitmapWords(currentVmmSize(memory));
+  const uint64_t newWords = bitmapWords(newSize);
+  uint64_t* const markBits =
+    (uint64_t*)realloc(memory->markBits, newWords * sizeof(uint64_t));
+  if (!markBits) {
+    return -1;
+  }
+  memset(markBits + oldWords, 0, (newWords - oldWords) * sizeof(uint64_t));
+  memory->markBits = markBits;
+
+  uint64_t* const startBits =
+    (uint64_t*)realloc(memory->startBits, newWords * sizeof(uint64_t));
+  if (!startBits) {
+    return -1;
+  }
+  memset(startBits + oldWords, 0, (newWords - oldWords) * sizeof(uint64_t));
+  memory->startBits = startBits;
+  return 0;
+}
+
+static inline int testBit(const uint64_t* bits, uint64_t address) {
+  return (int)((bits[address / 512] >> ((address / 8) % 64)) & 1);
+}
+
+static inline void setBit(uint64_t* bits, uint64_t address) {
+  bits[address / 512] |= (uint64_t)1 << ((address / 8) % 64);
+}
+
+/** Nonzero if the block whose header is at "blockAddress" is marked
+ *
+ *  The load is atomic because the mark thread of a concurrent collection
+ *  and the program can both mark blocks whose bits share a word.
+ */
+static inline int blockIsMarked(VmMemory memory, uint64_t blockAddress) {
+  const uint64_t word = __atomic_load_n(memory->markBits + blockAddress / 512,
+					__ATOMIC_RELAXED);
+  return (int)((word >> ((blockAddress / 8) % 64)) & 1);
+}
+
+/** Mark the block whose header is at "blockAddress."  Uses an atomic
+ *  operation while the mark thread of a concurrent collection is running.
+ */
+static inline void markBlock(VmMemory memory, uint64_t blockAddress) {
+  uint64_t* const word = memory->markBits + blockAddress / 512;
+  const uint64_t bit = (uint64_t)1 << ((blockAddress / 8) % 64);
+  if (memory->markThreadRunning) {
+    __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+  } else {
+    *word |= bit;
+  }
+}
+
+/** Clear the bits for the addresses in [from, to) */
+static void clearBits(uint64_t* bits, uint64_t from, uint64_t to) {
+  uint64_t i = from / 8;
+  const uint64_t n = (to + 7) / 8;
+
+  while ((i < n) && (i % 64)) {
+    bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+    ++i;
+  }
+  if ((n - i) >= 64) {
+    memset(bits + i / 64, 0, ((n - i) / 64) * sizeof(uint64_t));
+    i += ((n - i) / 64) * 64;
+  }
+  while (i < n) {
+    bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+    ++i;
+  }
+}
+
+/** Find the first set bit for the addresses in [from, to)
+ *
+ *  Skips over words with no bits set 32 bytes at a time, which is most
+ *  of the bitmap when most of the heap is garbage.
+ *
+ *  Returns the address the bit is for, or "to" if there isn't one.
+ */
+static uint64_t findNextBit(const uint64_t* bits, uint64_t from,
+			    uint64_t to) {
+  const uint64_t n = (to + 7) / 8;
+  uint64_t i = from / 8;
+
+  if (i >= n) {
+    return to;
+  }
+
+  uint64_t w = i / 64;
+  uint64_t word = bits[w] & (~(uint64_t)0 << (i % 64));
+  const uint64_t lastWord = (n - 1) / 64;
+
+  if (!word) {
+    ++w;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    while ((w + 4) <= lastWord) {
+      const __m128i lo = _mm_loadu_si128((const __m128i*)(bits + w));
+      const __m128i hi = _mm_loadu_si128((const __m128i*)(bits + w + 2));
+      const __m128i v = _mm_or_si128(lo, hi);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) {
+	break;
+      }
+      w += 4;
+    }
+#endif
+    while ((w <= lastWord) && !bits[w]) {
+      ++w;
+    }
+    if (w > lastWord) {
+      return to;
+    }
+    word = bits[w];
+  }
+
+  i = w * 64 + __builtin_ctzll(word);
+  return (i < n) ? i * 8 : to;
+}
+
+/** Find the last set bit for the addresses in [from, to)
+ *
+ *  Returns the address the bit is for, or "to" if there isn't one.
+ */
+static uint64_t findLastBit(const uint64_t* bits, uint64_t from,
+			    uint64_t to) {
+  const uint64_t first = from / 8;
+  uint64_t i = (to + 7) / 8;
+
+  while (i > first) {
+    const uint64_t w = (i - 1) / 64;
+    uint64_t word = bits[w] & (~(uint64_t)0 >> (63 - (i - 1) % 64));
+    if ((w * 64) < first) {
+      word &= ~(uint64_t)0 << (first % 64);
+    }
+    if (word) {
+      return (w * 64 + 63 - __builtin_clzll(word)) * 8;
+    }
+    i = w * 64;
+  }
+  return to;
+}
+
+/** Count the set bits for the addresses in [from, to) */
+static uint64_t countBits(const uint64_t* bits, uint64_t from, uint64_t to) {
+  uint64_t i = from / 8;
+  const uint64_t n = (to + 7) / 8;
+  uint64_t count = 0;
+
+  while ((i < n) && (i % 64)) {
+    count += testBit(bits, i * 8);
+    ++i;
+  }
+  while ((n - i) >= 64) {
+    count += __builtin_popcountll(bits[i / 64]);
+    i += 64;
+  }
+  while (i < n) {
+    count += testBit(bits, i * 8);
+    ++i;
+  }
+  return count;
+}
+
+/** Clear every mark with one pass over the mark bitmap */
+static void clearAllMarks(VmMemory memory) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(memory->markBits, 0,
+	 bitmapWords(currentVmmSize(memory)) * sizeof(uint64_t));
+  memory->gcStats.clearUsec += usecSince(&start);
+}
+
+/** Microseconds from "start" to now */
+static double usecSince(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e6
+           + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/** Note the start of a collection that stops the program */
+static void startGcPause(VmMemory memory) {
+  if (!memory->gcPauseDepth++) {
+    clock_gettime(CLOCK_MONOTONIC, &memory->gcPauseStart);
+  }
+}
+
+/** Note the end of a collection that stopped the program, and add the
+ *  pause to the histogram if the collection wasn't part of another one
+ */
+static void endGcPause(VmMemory memory) {
+  if (--memory->gcPauseDepth) {
+    return;
+  }
+
+  const double usec = usecSince(&memory->gcPauseStart);
+  const uint64_t wholeUsec = (uint64_t)usec;
+  uint32_t bucket = wholeUsec ? 63 - __builtin_clzll(wholeUsec) : 0;
+  if (bucket >= VMM_GC_PAUSE_HISTOGRAM_SIZE) {
+    bucket = VMM_GC_PAUSE_HISTOGRAM_SIZE - 1;
+  }
+  ++memory->gcStats.pauseHistogram[bucket];
+  ++memory->gcStats.numPauses;
+  memory->gcStats.totalPauseUsec += usec;
+  if (usec > memory->gcStats.maxPauseUsec) {
+    memory->gcStats.maxPauseUsec = usec;
+  }
 }
 
-void clearVmmBlockMark(HeapBlock* block) {
-  block->typeAndSize &= 0x7FFFFFFFFFFFFFFF;
+/** Tell the weak reference handler, if there is one, that the unmarked
+ *  blocks in [low, high) are about to be freed
+ */
+static void forgetUnmarkedBlocks(VmMemory memory, uint64_t low,
+				 uint64_t high) {
+  if (memory->weakRefHandler) {
+    memory->weakRefHandler(memory, low, high, memory->weakRefContext);
+  }
 }
 
-void setVmmBlockMark(HeapBlock* block) {
-  block->typeAndSize |= 0x8000000000000000;
+/** Set the block-start bits from the headers on the heap, after the
+ *  heap's layout changed all at once
+ */
+static void rebuildStartBits(VmMemory memory) {
+  memset(memory->startBits, 0,
+	 bitmapWords(currentVmmSize(memory)) * sizeof(uint64_t));
+  for (HeapBlock* p = firstHeapBlockInVmm(memory); p;
+       p = nextHeapBlockInVmm(memory, p)) {
+    setBit(memory->startBits, (uint8_t*)p - memory->bytes);
+  }
 }
 
 VmMemory createVmMemory(uint64_t initialSize, uint64_t maxSize) {
+  /** Every block starts at a multiple of eight, so the blocks' bits in
+   *  the mark and block-start bitmaps are their addresses divided by 8
+   */
+  initialSize &= ~(uint64_t)7;
+  maxSize &= ~(uint64_t)7;
+
   /** Check initialSize >= 16 and <= maxSize
    *  16 is the smallest block we can allocate
    */
@@ -127,34 +883,182 @@ VmMemory createVmMemory(uint64_t initialSize, uint64_t maxSize) {
     return NULL;
   }
 
-  memory->bytes = (uint8_t*)malloc(initialSize);
+  memory->bytes = reserveHeapMemory(maxSize, initialSize, 0);
   if (!memory->bytes) {
     free((void*)memory);
     return NULL;
   }
 
+  memory->markStack =
+    (uint64_t*)malloc(INITIAL_MARK_STACK_SIZE * sizeof(uint64_t));
+  if (!memory->markStack) {
+    releaseHeapMemory(memory->bytes, maxSize);
+    free((void*)memory);
+    return NULL;
+  }
+
+  memory->markBits =
+    (uint64_t*)calloc(bitmapWords(initialSize), sizeof(uint64_t));
+  memory->startBits =
+    (uint64_t*)calloc(bitmapWords(initialSize), sizeof(uint64_t));
+  if (!memory->markBits || !memory->startBits) {
+    free((void*)memory->markBits);
+    free((void*)memory->startBits);
+    free((void*)memory->markStack);
+    releaseHeapMemory(memory->bytes, maxSize);
+    free((void*)memory);
+    return NULL;
+  }
+
   memory->end = memory->bytes + initialSize;
   memory->maxSize = maxSize;
+  memory->hugePages = 0;
+  memory->bytesReleased = 0;
   memory->heapStart = 0;
   memory->bytesFree = initialSize - sizeof(HeapBlock);
-  memory->firstFree = 0;
+  memory->bytesAllocatedSinceGc = 0;
+  memory->bytesMarked = 0;
+  resetFreeBlocks(memory);
+  resetFreeCells(memory);
+  memory->nurseryStart = 0;
+  memory->nurseryTop = 0;
+  memory->nurseryEnd = 0;
+  memory->nurserySize = DEFAULT_NURSERY_SIZE;
+  memory->nurseryAllocationFailed = 0;
+  memory->rememberedBlocks = NULL;
+  memory->numRememberedBlocks = 0;
+  memory->rememberedBlocksCapacity = 0;
+  memory->markStackSize = 0;
+  memory->markStackCapacity = INITIAL_MARK_STACK_SIZE;
+  memory->markStackOverflowed = 0;
+  memory->incrementalMarking = 0;
+  memory->markThreadRunning = 0;
+  memory->concurrentMarkDone = 0;
+  memory->stopMarkThread = 0;
+  memory->numDeferredGcErrors = 0;
+  memory->gcThreads = 1;
+  memory->lazySweep = 0;
+  memory->lazySweepStart = 0;
+  memory->lazySweepEnd = 0;
+  memory->lazySweepBlocksInFreeRanges = 0;
+  memory->lazySweepBlocksKept = 0;
+  memset(&memory->gcStats, 0, sizeof(memory->gcStats));
+  memory->gcPauseDepth = 0;
+  memory->weakRefHandler = NULL;
+  memory->weakRefContext = NULL;
   memory->logger = NULL;
   memory->statusCode = 0;
   memory->statusMsg = OK_MSG;
 
   writeFreeBlock(memory->bytes, initialSize - 8, 0);
+  addFreeBlock(memory, (FreeBlock*)memory->bytes);
+  setBit(memory->startBits, 0);
 
   return memory;
 }
 
 void destroyVmMemory(VmMemory memory) {
+  stopConcurrentMark(memory);
   if (shouldDeallocateStatusMsg(memory)) {
     free((void*)memory->statusMsg);
   }
-  free((void*)memory->bytes);
+  free((void*)memory->rememberedBlocks);
+  free((void*)memory->markStack);
+  free((void*)memory->markBits);
+  free((void*)memory->startBits);
+  releaseHeapMemory(memory->bytes, memory->maxSize);
   free((void*)memory);
 }
 
+static uint64_t vmmPageSize(void) {
+  return (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/** Round "size" up to a multiple of the page size */
+static uint64_t roundToPageSize(uint64_t size) {
+  const uint64_t pageSize = vmmPageSize();
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+/** Reserve address space for a memory of up to "maxSize" bytes and
+ *  commit the first "size" bytes of it
+ *
+ *  The reservation is aligned to HUGE_PAGE_SIZE, so the kernel can back
+ *  all of it with huge pages if "hugePages" is nonzero.  Whether it does
+ *  is up to the kernel, so failing to ask for them isn't an error.
+ *
+ *  Returns the start of the memory, or NULL if the address space or the
+ *  committed pages aren't available.
+ */
+static uint8_t* reserveHeapMemory(uint64_t maxSize, uint64_t size,
+				  int hugePages) {
+  const uint64_t reservedSize = roundToPageSize(maxSize);
+  uint8_t* const start =
+    (uint8_t*)mmap(NULL, reservedSize + HUGE_PAGE_SIZE, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (start == (uint8_t*)MAP_FAILED) {
+    return NULL;
+  }
+
+  /** Give back the address space before and after the aligned part */
+  uint8_t* const bytes =
+    (uint8_t*)(((uintptr_t)start + HUGE_PAGE_SIZE - 1)
+		 & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (bytes > start) {
+    munmap((void*)start, bytes - start);
+  }
+  if ((start + HUGE_PAGE_SIZE) > bytes) {
+    munmap((void*)(bytes + reservedSize), start + HUGE_PAGE_SIZE - bytes);
+  }
+
+  if (hugePages) {
+    adviseHugePages(bytes, maxSize, 1);
+  }
+  if (commitHeapMemory(bytes, 0, size)) {
+    releaseHeapMemory(bytes, maxSize);
+    return NULL;
+  }
+  return bytes;
+}
+
+/** Commit the pages a memory needs to grow from "oldSize" to "newSize"
+ *  bytes.  Pages the kernel hasn't touched yet read as zeros.
+ *
+ *  Returns 0 if successful and -1 if the pages aren't available.
+ */
+static int commitHeapMemory(uint8_t* bytes, uint64_t oldSize,
+			    uint64_t newSize) {
+  const uint64_t from = roundToPageSize(oldSize);
+  const uint64_t to = roundToPageSize(newSize);
+  if ((to > from)
+        && mprotect((void*)(bytes + from), to - from,
+		    PROT_READ | PROT_WRITE)) {
+    return -1;
+  }
+  return 0;
+}
+
+/** Release the address space reserveHeapMemory() reserved */
+static void releaseHeapMemory(uint8_t* bytes, uint64_t maxSize) {
+  if (bytes) {
+    munmap((void*)bytes, roundToPageSize(maxSize));
+  }
+}
+
+/** Ask the kernel to back a memory with huge pages or to stop doing so
+ *
+ *  Returns 0 if the kernel took the advice and -1 if it doesn't support
+ *  transparent huge pages.
+ */
+static int adviseHugePages(uint8_t* bytes, uint64_t maxSize, int enabled) {
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+  return madvise((void*)bytes, roundToPageSize(maxSize),
+		 enabled ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
 static void writeFreeBlock(uint8_t* where, uint64_t size, uint64_t next) {
   uint64_t* const p = (uint64_t*)where;
   p[0] = ((uint64_t)VmmFreeBlockType << 56) | size;
@@ -212,6 +1116,14 @@ uint64_t vmmBytesFree(VmMemory memory) {
   return memory->bytesFree;
 }
 
+uint64_t vmmBytesAllocatedSinceGc(VmMemory memory) {
+  return memory->bytesAllocatedSinceGc;
+}
+
+uint64_t vmmBytesLive(VmMemory memory) {
+  return memory->bytesMarked;
+}
+
 uint64_t vmmHeapSize(VmMemory memory) {
   return (memory->end - memory->bytes) - memory->heapStart;
 }
@@ -247,6 +1159,8 @@ int reserveVmMemoryForProgram(VmMemory memory, uint64_t size) {
   }
 
   memory->heapStart = alignedSize;
+  resetFreeCells(memory);
+  resetNursery(memory);
 
   /** 16 is the minimum block size */
   if (vmmHeapSize(memory) >= 16) {
@@ -255,16 +1169,18 @@ int reserveVmMemoryForProgram(VmMemory memory, uint64_t size) {
      */
     memory->bytesFree = currentVmmSize(memory) - alignedSize
                           - sizeof(HeapBlock);
-    memory->firstFree = alignedSize;
+    resetFreeBlocks(memory);
     writeFreeBlock(memory->bytes + alignedSize, memory->bytesFree, 0);
+    addFreeBlock(memory, (FreeBlock*)(memory->bytes + alignedSize));
   } else {
     /** Not enough for even one block, so allocate all of the memory to
      *  the program.
      */
     memory->heapStart = currentVmmSize(memory);
     memory->bytesFree = 0;
-    memory->firstFree = 0;
+    resetFreeBlocks(memory);
   }
+  rebuildStartBits(memory);
 
   logMessage(memory->logger, LogGeneralInfo,
 	     "Heap starts at %" PRIu64 " and occupies %" PRIu64 " bytes with %"
@@ -273,8 +1189,6 @@ int reserveVmMemoryForProgram(VmMemory memory, uint64_t size) {
   logMessage(memory->logger, LogGeneralInfo,
 	     "VM memory size is %" PRIu64 "/%" PRIu64,
 	     currentVmmSize(memory), maxVmmSize(memory));
-  logMessage(memory->logger, LogGC1, "First free block is at %" PRIu64,
-	     memory->firstFree);
   return 0;
 }
 
@@ -313,7 +1227,9 @@ uint64_t vmmAddressForPtr(VmMemory memory, const uint8_t* p) {
 }
 
 HeapBlock* firstHeapBlockInVmm(VmMemory memory) {
-  return (HeapBlock*)(memory->bytes + memory->heapStart);
+  /** The program can take up all of the memory, leaving no heap */
+  return (memory->heapStart < currentVmmSize(memory))
+           ? (HeapBlock*)(memory->bytes + memory->heapStart) : NULL;
 }
 
 HeapBlock* nextHeapBlockInVmm(VmMemory memory, HeapBlock* block) {
@@ -341,18 +1257,10 @@ HeapBlock* forEachVmmBlock(
 }
 
 FreeBlock* firstFreeBlockInVmm(VmMemory memory) {
-    /** If firstFree is zero, then either the first free block is at
-     *  address zero or there are no free blocks.  Check to see if there
-     *  is a program area allocated.  If there is, then firstFree == 0 means
-     *  there are no free blocks.  Otherwise, firstFree == 0 means the
-     *  first free block is at address zero.
-     */
-  if (!memory->firstFree && memory->heapStart) {
-    /** No free blocks */
-    return NULL;  
+  if (memory->freeBlockAtZero) {
+    return (FreeBlock*)memory->bytes;
   }
-
-  return (FreeBlock*)(((uint8_t*)memory->bytes) + memory->firstFree);
+  return firstSmallOrLargeFreeBlock(memory, 0);
 }
 
 FreeBlock* nextFreeBlockInVmm(VmMemory memory, FreeBlock* block) {
@@ -362,15 +1270,37 @@ FreeBlock* nextFreeBlockInVmm(VmMemory memory, FreeBlock* block) {
     return NULL;
   }
 
-  return block->next ? (FreeBlock*)(memory->bytes + block->next) : NULL;
+  if ((uint8_t*)block == memory->bytes) {
+    /** The block at address zero comes before all the others */
+    return firstSmallOrLargeFreeBlock(memory, 0);
+  }
+
+  const uint64_t size = getVmmBlockSize((HeapBlock*)block);
+  if (size > MAX_SMALL_FREE_BLOCK_SIZE) {
+    return (FreeBlock*)nextFreeTreeNode(memory, (FreeTreeNode*)block);
+  } else if (block->next) {
+    return (FreeBlock*)(memory->bytes + block->next);
+  } else {
+    return firstSmallOrLargeFreeBlock(memory, (uint32_t)(size / 8));
+  }
 }
 
 /** This function is not part of VmMemory's public API and is only used
- *  for testing
+ *  for testing.  Rebuilds the lists and tree of free blocks and the
+ *  block-start bitmap from the blocks on the heap, which tests lay out by
+ *  hand.
  */
 void setVmmFreeList(VmMemory memory, uint64_t addrOfFirstFreeBlock,
 		    uint64_t bytesFree) {
-  memory->firstFree = addrOfFirstFreeBlock;
+  resetFreeBlocks(memory);
+  resetNursery(memory);
+  for (HeapBlock* p = firstHeapBlockInVmm(memory); p;
+       p = nextHeapBlockInVmm(memory, p)) {
+    if (getVmmBlockType(p) == VmmFreeBlockType) {
+      addFreeBlock(memory, (FreeBlock*)p);
+    }
+  }
+  rebuildStartBits(memory);
   memory->bytesFree = bytesFree;
 }
 
@@ -400,294 +1330,2125 @@ CodeBlock* allocateVmmCodeBlock(VmMemory memory, uint64_t size) {
   HeapBlock* block = allocateBlock(memory, alignTo8(size));
   if (block) {
     setVmmBlockType(block, VmmCodeBlockType);
+
+    /** Fill the space past the end of the code with PANIC instructions,
+     *  so pushBlockReferences() doesn't mistake whatever the block held
+     *  before for an instruction with an address operand.
+     */
+    uint8_t* const code = ((CodeBlock*)block)->code;
+    const uint64_t blockSize = getVmmBlockSize(block);
+    for (uint64_t i = size; i < blockSize; ++i) {
+      code[i] = PANIC_INSTRUCTION;
+    }
+
+    /** Blocks allocated while an incremental collection is marking the
+     *  heap are live until the next collection
+     */
+    if (memory->incrementalMarking) {
+      markBlock(memory, (uint8_t*)block - memory->bytes);
+    }
+
+    if (memory->nurseryEnd) {
+      rememberBlock(memory, block);
+    }
   }
   return (CodeBlock*)block;
 }
 
-VmStateBlock* allocateVmmStateBlock(VmMemory memory, uint32_t callStackSize,
-				    uint32_t addressStackSize) {
-  const uint64_t neededSize = (16 * (uint64_t)callStackSize)
-                                  + (8 * (uint64_t)addressStackSize) + 16;
-  VmStateBlock* block = (VmStateBlock*)allocateBlock(memory, neededSize);
-  if (!block) {
-    return NULL;  /** Status already set */
+CodeBlock* allocateVmmCodeBlockFromSlab(VmMemory memory, uint64_t size) {
+  if (!size || (size > MAX_SLAB_CELL_SIZE)) {
+    return allocateVmmCodeBlock(memory, size);
   }
 
-  setVmmBlockType((HeapBlock*)block, VmmStateBlockType);
-  for (int i = 0; i < 8; ++i) {
-    block->guard[i] = PANIC_INSTRUCTION;
+  const uint64_t cellSize = (size < 16) ? 16 : alignTo8(size);
+  const int sizeClass = (int)(cellSize / 8) - 2;
+
+  if (!memory->firstFreeCell[sizeClass]) {
+    if (memory->slabAllocationFailed || !allocateSlab(memory, cellSize)) {
+      /** Not enough room for a slab, so give the code a block of its own */
+      memory->slabAllocationFailed = 1;
+      clearVmmStatus(memory);
+      return allocateVmmCodeBlock(memory, size);
+    }
   }
-  block->callStackSize = callStackSize;
-  block->addressStackSize = addressStackSize;
 
-  /** Caller needs to copy the call and address stack data into block->stacks
-   */
-  return block;
+  FreeBlock* const cell =
+    (FreeBlock*)(memory->bytes + memory->firstFreeCell[sizeClass]);
+  memory->firstFreeCell[sizeClass] = cell->next;
+
+  /** Same as allocateVmmCodeBlock() */
+  cell->header.typeAndSize = ((uint64_t)VmmCodeBlockType << 56) | cellSize;
+  uint8_t* const code = ((CodeBlock*)cell)->code;
+  for (uint64_t i = size; i < cellSize; ++i) {
+    code[i] = PANIC_INSTRUCTION;
+  }
+
+  if (memory->incrementalMarking) {
+    markBlock(memory, (uint8_t*)cell - memory->bytes);
+  }
+
+  if (memory->nurseryEnd) {
+    rememberBlock(memory, (HeapBlock*)cell);
+  }
+  return (CodeBlock*)cell;
 }
 
-static HeapBlock* clearBlockMark(VmMemory memory, HeapBlock* block,
-				 void* unused) {
-  /* printf("Clear block mark at %lu\n",
-   *        (uint8_t*)block - ptrToVmMemory(memory));
+CodeBlock* allocateVmmCodeBlockFromNursery(VmMemory memory, uint64_t size) {
+  const uint64_t blockSize = alignTo8(size);
+
+  /** A block has to leave room for the free block at the end of the
+   *  nursery, which needs at least 16 bytes
    */
-  clearVmmBlockMark(block);
-  return NULL;
-}
+  if (!size || ((blockSize + 3 * sizeof(HeapBlock)) > memory->nurserySize)) {
+    return allocateVmmCodeBlockFromSlab(memory, size);
+  }
 
-int collectUnreachableVmmBlocks(VmMemory memory, Stack callStack,
+  if (!memory->nurseryEnd
+        && (memory->incrementalMarking || memory->nurseryAllocationFailed
+	      || allocateNursery(memory))) {
+    /** Not enough room for a nursery, or an incremental collection is
+     *  marking the heap, which would have to scan the whole nursery
+     */
+    return allocateVmmCodeBlockFromSlab(memory, size);
+  }
+
+  const uint64_t top = memory->nurseryTop;
+  const uint64_t newTop = top + sizeof(HeapBlock) + blockSize;
+  if ((newTop + 2 * sizeof(HeapBlock)) > memory->nurseryEnd) {
+    setVmmStatus(memory, VmmNurseryFullError, "Nursery is full");
+    return NULL;
+  }
+
+  HeapBlock* const block = (HeapBlock*)(memory->bytes + top);
+  block->typeAndSize = ((uint64_t)VmmCodeBlockType << 56) | blockSize;
+
+  /** Same as allocateVmmCodeBlock() */
+  uint8_t* const code = ((CodeBlock*)block)->code;
+  for (uint64_t i = size; i < blockSize; ++i) {
+    code[i] = PANIC_INSTRUCTION;
+  }
+
+  writeFreeBlock(memory->bytes + newTop,
+		 memory->nurseryEnd - newTop - sizeof(HeapBlock), 0);
+  setBit(memory->startBits, newTop);
+  memory->nurseryTop = newTop;
+  return (CodeBlock*)block;
+}
+
+uint64_t vmmNurserySize(VmMemory memory) {
+  return memory->nurserySize;
+}
+
+void setVmmNurserySize(VmMemory memory, uint64_t size) {
+  memory->nurserySize = alignTo8(size);
+  memory->nurseryAllocationFailed = 0;
+}
+
+int vmmLazySweepEnabled(VmMemory memory) {
+  return memory->lazySweep;
+}
+
+void setVmmLazySweep(VmMemory memory, int enabled) {
+  memory->lazySweep = enabled;
+}
+
+void setVmmWeakRefHandler(VmMemory memory, VmmWeakRefHandler handler,
+			  void* context) {
+  memory->weakRefHandler = handler;
+  memory->weakRefContext = context;
+}
+
+int vmmHugePagesEnabled(VmMemory memory) {
+  return memory->hugePages;
+}
+
+int setVmmHugePages(VmMemory memory, int enabled) {
+  clearVmmStatus(memory);
+  if (adviseHugePages(memory->bytes, memory->maxSize, enabled)) {
+    setVmmStatus(memory, VmmHugePagesNotSupportedError,
+		 "The system does not support transparent huge pages");
+    return -1;
+  }
+  memory->hugePages = enabled;
+  return 0;
+}
+
+uint64_t vmmBytesUnswept(VmMemory memory) {
+  return memory->lazySweepEnd - memory->lazySweepStart;
+}
+
+void finishVmmSweep(VmMemory memory) {
+  while (sweepLazily(memory)) {
+  }
+}
+
+uint32_t vmmGcThreads(VmMemory memory) {
+  return memory->gcThreads;
+}
+
+void setVmmGcThreads(VmMemory memory, uint32_t numThreads) {
+  memory->gcThreads = numThreads ? numThreads : 1;
+}
+
+/** Allocate a new nursery from the heap
+ *
+ *  Returns 0 if successful and -1 if the heap doesn't have a free block
+ *  big enough for the nursery.  Doesn't change the status either way.
+ */
+static int allocateNursery(VmMemory memory) {
+  const uint64_t size = memory->nurserySize - sizeof(HeapBlock);
+  FreeBlock* const block = takeFreeBlockWithSize(memory, size);
+  if (!block) {
+    memory->nurseryAllocationFailed = 1;
+    return -1;
+  }
+
+  /** The nursery starts out as one free block.  The blocks in it count
+   *  as allocated once they survive a minor collection or the nursery
+   *  retires, not before.
+   */
+  const uint64_t bytesAllocatedSinceGc = memory->bytesAllocatedSinceGc;
+  HeapBlock* const nursery = splitFreeBlock(memory, block, size);
+  memory->bytesAllocatedSinceGc = bytesAllocatedSinceGc;
+  memory->nurseryStart = (uint8_t*)nursery - memory->bytes;
+  memory->nurseryTop = memory->nurseryStart;
+  memory->nurseryEnd =
+    memory->nurseryStart + sizeof(HeapBlock) + getVmmBlockSize(nursery);
+  memory->numRememberedBlocks = 0;
+
+  LOG_TRACE(memory->logger, LogGC1, "Allocate nursery at %" PRIu64
+	    " with size %" PRIu64, memory->nurseryStart,
+	    memory->nurseryEnd - memory->nurseryStart);
+  return 0;
+}
+
+/** Promote every block in the nursery without collecting any of them
+ *  and return the unused part of the nursery to the heap
+ */
+static void retireNursery(VmMemory memory) {
+  if (memory->nurseryEnd) {
+    FreeBlock* const rest = (FreeBlock*)(memory->bytes + memory->nurseryTop);
+    addFreeBlock(memory, rest);
+    memory->bytesFree += getVmmBlockSize((HeapBlock*)rest);
+    memory->bytesAllocatedSinceGc +=
+      memory->nurseryTop - memory->nurseryStart;
+    resetNursery(memory);
+  }
+}
+
+/** Forget the nursery.  The blocks in it become ordinary heap blocks. */
+static void resetNursery(VmMemory memory) {
+  memory->nurseryStart = 0;
+  memory->nurseryTop = 0;
+  memory->nurseryEnd = 0;
+  memory->nurseryAllocationFailed = 0;
+  memory->numRememberedBlocks = 0;
+}
+
+/** Add a block allocated outside the nursery to the remembered set */
+static void rememberBlock(VmMemory memory, HeapBlock* block) {
+  if (memory->numRememberedBlocks == memory->rememberedBlocksCapacity) {
+    const uint64_t newCapacity = memory->rememberedBlocksCapacity
+      ? 2 * memory->rememberedBlocksCapacity : INITIAL_REMEMBERED_SET_SIZE;
+    uint64_t* const newBlocks = (uint64_t*)realloc(
+      memory->rememberedBlocks, newCapacity * sizeof(uint64_t)
+    );
+    if (!newBlocks) {
+      /** Without the remembered set, the next minor collection might
+       *  miss addresses of blocks in the nursery, so promote everything
+       *  in the nursery now.
+       */
+      retireNursery(memory);
+      return;
+    }
+    memory->rememberedBlocks = newBlocks;
+    memory->rememberedBlocksCapacity = newCapacity;
+  }
+
+  memory->rememberedBlocks[memory->numRememberedBlocks++] =
+    (uint8_t*)block - memory->bytes;
+}
+
+/** Allocate a slab with cells of the given size and put all of its cells
+ *  on the list of free cells of that size
+ */
+static VmmSlab* allocateSlab(VmMemory memory, uint64_t cellSize) {
+  const uint64_t stride = cellSize + sizeof(HeapBlock);
+  VmmSlab* const slab = (VmmSlab*)allocateBlock(
+    memory, (sizeof(VmmSlab) - sizeof(HeapBlock)) + CELLS_PER_SLAB * stride
+  );
+  if (!slab) {
+    return NULL;
+  }
+
+  const int sizeClass = (int)(cellSize / 8) - 2;
+  uint64_t next = memory->firstFreeCell[sizeClass];
+
+  setVmmBlockType((HeapBlock*)slab, VmmSlabBlockType);
+  slab->cellSize = (uint32_t)cellSize;
+  slab->numCells = CELLS_PER_SLAB;
+
+  /** Link the cells in address order.  Filling them with PANIC
+   *  instructions first leaves nothing uninitialized in the slab.
+   */
+  memset(slab->cells, PANIC_INSTRUCTION, CELLS_PER_SLAB * stride);
+  for (uint32_t i = CELLS_PER_SLAB; i > 0; --i) {
+    uint8_t* const cell = slab->cells + (i - 1) * stride;
+    writeFreeBlock(cell, cellSize, next);
+    next = cell - memory->bytes;
+  }
+  memory->firstFreeCell[sizeClass] = next;
+
+  LOG_TRACE(memory->logger, LogGC2, "Allocate slab at %" PRIu64
+	    " with %" PRIu32 " cells of size %" PRIu64,
+	    vmmAddressForPtr(memory, (uint8_t*)slab), slab->numCells,
+	    cellSize);
+  return slab;
+}
+
+static void resetFreeCells(VmMemory memory) {
+  for (int i = 0; i < NUM_SLAB_CELL_SIZES; ++i) {
+    memory->firstFreeCell[i] = 0;
+  }
+  memory->slabAllocationFailed = 0;
+}
+
+VmStateBlock* allocateVmmStateBlock(VmMemory memory, uint32_t callStackSize,
+				    uint32_t addressStackSize) {
+  const uint64_t neededSize = (16 * (uint64_t)callStackSize)
+                                  + (8 * (uint64_t)addressStackSize) + 16;
+  VmStateBlock* block = (VmStateBlock*)allocateBlock(memory, neededSize);
+  if (!block) {
+    return NULL;  /** Status already set */
+  }
+
+  setVmmBlockType((HeapBlock*)block, VmmStateBlockType);
+  for (int i = 0; i < 8; ++i) {
+    block->guard[i] = PANIC_INSTRUCTION;
+  }
+  block->callStackSize = callStackSize;
+  block->addressStackSize = addressStackSize;
+
+  if (memory->incrementalMarking) {
+    markBlock(memory, (uint8_t*)block - memory->bytes);
+  }
+
+  if (memory->nurseryEnd) {
+    rememberBlock(memory, (HeapBlock*)block);
+  }
+
+  /** Caller needs to copy the call and address stack data into block->stacks
+   */
+  return block;
+}
+
+int collectUnreachableVmmBlocks(VmMemory memory, Stack callStack,
+				Stack addressStack,
+				GcErrorHandler errorHandler,
+				void* errorContext) {
+  LOG_TRACE(memory->logger, LogGC1, "Start collection of unreachable blocks");
+  startGcPause(memory);
+  ++memory->gcStats.numCollections;
+
+  /** A full collection treats the nursery like the rest of the heap, and
+   *  the sweep puts its unused part back on the lists or tree of free
+   *  blocks.  The next allocation from the nursery allocates a new one.
+   */
+  resetNursery(memory);
+  abandonIncrementalCollection(memory);
+  abandonLazySweep(memory);
+
+  /** Clear the marks on all the blocks */
+  LOG_TRACE(memory->logger, LogGC1, "Clear block marks");
+  clearAllMarks(memory);
+
+  markReachableBlocks(memory, callStack, addressStack, errorHandler,
+		      errorContext);
+  forgetUnmarkedBlocks(memory, memory->heapStart, currentVmmSize(memory));
+
+  if (memory->lazySweep) {
+    startLazySweep(memory);
+    LOG_TRACE(memory->logger, LogGC1, "End collection of unreachable blocks");
+    endGcPause(memory);
+    return 0;
+  }
+
+  LOG_TRACE(memory->logger, LogGC1, "Collect unmarked blocks");
+  int result = collectUnmarkedBlocks(memory, errorHandler, errorContext);
+  LOG_TRACE(memory->logger, LogGC1, "End collection of unreachable blocks");
+  endGcPause(memory);
+  return result;
+}
+
+int startIncrementalVmmCollection(VmMemory memory, Stack callStack,
+				  Stack addressStack,
+				  GcErrorHandler errorHandler,
+				  void* errorContext) {
+  if (memory->incrementalMarking) {
+    return 0;
+  }
+
+  LOG_TRACE(memory->logger, LogGC1, "Start incremental collection");
+  startGcPause(memory);
+  takeRootSnapshot(memory, callStack, addressStack, errorHandler,
+		   errorContext);
+  endGcPause(memory);
+  return 0;
+}
+
+int startConcurrentVmmCollection(VmMemory memory, Stack callStack,
+				 Stack addressStack,
+				 GcErrorHandler errorHandler,
+				 void* errorContext) {
+  if (memory->incrementalMarking) {
+    return 0;
+  }
+
+  LOG_TRACE(memory->logger, LogGC1, "Start concurrent collection");
+  startGcPause(memory);
+  takeRootSnapshot(memory, callStack, addressStack, errorHandler,
+		   errorContext);
+  endGcPause(memory);
+
+  memory->numDeferredGcErrors = 0;
+  if (startMarkThread(memory)) {
+    /** Without a thread, the collection ends at the next safepoint with
+     *  the program marking the heap itself
+     */
+    LOG_TRACE(memory->logger, LogGC1, "Could not start the mark thread.  "
+	      "Mark the heap at the next safepoint instead");
+    memory->concurrentMarkDone = 1;
+  }
+  return 0;
+}
+
+int vmmIncrementalCollectionInProgress(VmMemory memory) {
+  return memory->incrementalMarking;
+}
+
+int vmmGcSafepointRequested(VmMemory memory) {
+  return __atomic_load_n(&memory->concurrentMarkDone, __ATOMIC_ACQUIRE);
+}
+
+int continueIncrementalVmmCollection(VmMemory memory, uint64_t budgetUsec,
+				     GcErrorHandler errorHandler,
+				     void* errorContext) {
+  if (!memory->incrementalMarking) {
+    return 0;
+  }
+
+  if (memory->markThreadRunning || memory->concurrentMarkDone) {
+    /** The mark stack belongs to the mark thread */
+    return vmmGcSafepointRequested(memory)
+             ? finishIncrementalVmmCollection(memory, errorHandler,
+					      errorContext)
+             : 0;
+  }
+
+  struct timespec start;
+  uint64_t numBlocksMarked = 0;
+  double usec = 0.0;
+
+  startGcPause(memory);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    numBlocksMarked += drainMarkStack(memory, 0, MARK_SLICE_WORK,
+				      errorHandler, errorContext);
+    usec = usecSince(&start);
+  } while ((memory->markStackSize || memory->markStackOverflowed)
+	     && (usec < budgetUsec));
+  memory->gcStats.markUsec += usec;
+
+  LOG_TRACE(memory->logger, LogGC1, "Marked %" PRIu64 " blocks in %.1f us. "
+	    "%" PRIu64 " addresses left on the mark stack", numBlocksMarked,
+	    usec, memory->markStackSize);
+
+  int result = 0;
+  if (!memory->markStackSize && !memory->markStackOverflowed) {
+    result = finishIncrementalVmmCollection(memory, errorHandler,
+					    errorContext);
+  }
+  endGcPause(memory);
+  return result;
+}
+
+int finishIncrementalVmmCollection(VmMemory memory,
+				   GcErrorHandler errorHandler,
+				   void* errorContext) {
+  if (!memory->incrementalMarking) {
+    return 0;
+  }
+
+  /** Whatever the mark thread didn't get to, including rescanning the
+   *  heap if the mark stack overflowed, is done here with the program
+   *  stopped
+   */
+  struct timespec start;
+  startGcPause(memory);
+  ++memory->gcStats.numCollections;
+  stopConcurrentMark(memory);
+  reportDeferredGcErrors(memory, errorHandler, errorContext);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  drainMarkStack(memory, 0, UINT64_MAX, errorHandler, errorContext);
+  memory->gcStats.markUsec += usecSince(&start);
+  memory->incrementalMarking = 0;
+  memory->concurrentMarkDone = 0;
+  forgetUnmarkedBlocks(memory, memory->heapStart, currentVmmSize(memory));
+
+  LOG_TRACE(memory->logger, LogGC1, "Collect unmarked blocks");
+  const int result = collectUnmarkedBlocks(memory, errorHandler,
+					   errorContext);
+  LOG_TRACE(memory->logger, LogGC1, "End incremental collection");
+  endGcPause(memory);
+  return result;
+}
+
+/** Stop the incremental collection in progress, if there is one, without
+ *  collecting anything.  The caller has to clear the marks it left.
+ */
+static void abandonIncrementalCollection(VmMemory memory) {
+  stopConcurrentMark(memory);
+  memory->incrementalMarking = 0;
+  memory->concurrentMarkDone = 0;
+  memory->numDeferredGcErrors = 0;
+  memory->markStackSize = 0;
+  memory->markStackOverflowed = 0;
+}
+
+/** Take the snapshot of the roots an incremental or concurrent collection
+ *  marks from, and start marking
+ */
+static void takeRootSnapshot(VmMemory memory, Stack callStack,
+			     Stack addressStack, GcErrorHandler errorHandler,
+			     void* errorContext) {
+  /** The blocks the last lazy sweep didn't get to are still marked */
+  finishVmmSweep(memory);
+
+  /** Collect the nursery first, since most of what is in it is garbage,
+   *  then promote the rest.  No blocks are marked outside of a
+   *  collection, so there are no marks to clear.
+   */
+  collectVmmNursery(memory, callStack, addressStack, errorHandler,
+		    errorContext);
+  retireNursery(memory);
+
+  /** Blocks never change once the VM writes them, and every block
+   *  allocated from now on is marked, so the blocks reachable from the
+   *  stacks right now are the only ones the collector has to find.
+   *  Copying the stacks to the mark stack is all the snapshot takes.
+   */
+  memory->markStackSize = 0;
+  memory->markStackOverflowed = 0;
+  memory->bytesAllocatedSinceGc = 0;
+  memory->bytesMarked = 0;
+  for (uint64_t* p = (uint64_t*)bottomOfStack(callStack);
+       p < (uint64_t*)topOfStack(callStack);
+       p += 2) {
+    if (*p >= (memory->heapStart + sizeof(HeapBlock))) {
+      pushOnMarkStack(memory, *p);
+    }
+  }
+  for (uint64_t* p = (uint64_t*)bottomOfStack(addressStack);
+       p < (uint64_t*)topOfStack(addressStack);
+       ++p) {
+    if (*p >= (memory->heapStart + sizeof(HeapBlock))) {
+      pushOnMarkStack(memory, *p);
+    }
+  }
+
+  if (memory->markStackOverflowed) {
+    /** Rescanning the marked blocks won't find the roots that didn't fit
+     *  on the stack, so mark everything now instead
+     */
+    LOG_TRACE(memory->logger, LogGC1, "Mark stack overflowed while taking "
+	      "the snapshot.  Mark the whole heap now");
+    memory->markStackSize = 0;
+    memory->markStackOverflowed = 0;
+    markReachableBlocks(memory, callStack, addressStack, errorHandler,
+			errorContext);
+  }
+
+  memory->incrementalMarking = 1;
+}
+
+/** Start the thread that marks the heap for a concurrent collection
+ *
+ *  Returns 0 if successful and -1 if the thread could not be started.
+ */
+static int startMarkThread(VmMemory memory) {
+  memory->stopMarkThread = 0;
+  memory->concurrentMarkDone = 0;
+  memory->markThreadRunning = 1;
+  if (pthread_create(&memory->markThread, NULL, runConcurrentMark, memory)) {
+    memory->markThreadRunning = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/** Wait for the mark thread to stop, asking it to stop early if it isn't
+ *  done yet.  Does nothing if it isn't running.
+ */
+static void stopConcurrentMark(VmMemory memory) {
+  if (memory->markThreadRunning) {
+    __atomic_store_n(&memory->stopMarkThread, 1, __ATOMIC_RELAXED);
+    pthread_join(memory->markThread, NULL);
+    memory->markThreadRunning = 0;
+  }
+}
+
+static void* runConcurrentMark(void* memoryPtr) {
+  VmMemory memory = (VmMemory)memoryPtr;
+
+  /** drainMarkStack() leaves the addresses that overflowed the mark stack
+   *  for finishIncrementalVmmCollection(), since finding them means
+   *  walking the heap, which the program changes as it allocates blocks
+   */
+  while (memory->markStackSize
+	   && !__atomic_load_n(&memory->stopMarkThread, __ATOMIC_RELAXED)) {
+    drainMarkStack(memory, 0, MARK_SLICE_WORK, deferGcError, NULL);
+  }
+  __atomic_store_n(&memory->concurrentMarkDone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/** Error handler for the mark thread, which keeps the error for
+ *  reportDeferredGcErrors()
+ */
+static void deferGcError(VmMemory memory, uint64_t address, HeapBlock* block,
+			 const char* details, void* unused) {
+  if (memory->numDeferredGcErrors < MAX_DEFERRED_GC_ERRORS) {
+    VmmDeferredGcError* const error =
+      memory->deferredGcErrors + memory->numDeferredGcErrors++;
+    error->address = address;
+    error->hasBlock = block != NULL;
+    snprintf(error->details, sizeof(error->details), "%s", details);
+  }
+}
+
+static void reportDeferredGcErrors(VmMemory memory,
+				   GcErrorHandler errorHandler,
+				   void* errorContext) {
+  for (uint32_t i = 0; i < memory->numDeferredGcErrors; ++i) {
+    const VmmDeferredGcError* const error = memory->deferredGcErrors + i;
+    HeapBlock* const block =
+      error->hasBlock ? (HeapBlock*)(memory->bytes + error->address) : NULL;
+    errorHandler(memory, error->address, block, error->details,
+		 errorContext);
+  }
+  memory->numDeferredGcErrors = 0;
+}
+
+/** Mark all blocks reachable from the call stack and the address stack */
+static void markReachableBlocks(VmMemory memory, Stack callStack,
 				Stack addressStack,
 				GcErrorHandler errorHandler,
 				void* errorContext) {
-  logMessage(memory->logger, LogGC1, "Start collection of unreachable blocks");
+  struct timespec start;
+  uint64_t numBlocksMarked = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memory->bytesAllocatedSinceGc = 0;
+  memory->bytesMarked = 0;
+  if (markReachableBlocksInParallel(memory, callStack, addressStack,
+				    errorHandler, errorContext,
+				    &numBlocksMarked)) {
+    numBlocksMarked = markBlocksReachableFromStacks(memory, callStack,
+						    addressStack,
+						    errorHandler,
+						    errorContext);
+  }
+
+  const double usec = usecSince(&start);
+  memory->gcStats.markUsec += usec;
+  LOG_TRACE(memory->logger, LogGC1, "Marked %" PRIu64 " blocks in %.1f us "
+	    "(%.1f blocks/us)", numBlocksMarked, usec,
+	    (usec > 0.0) ? numBlocksMarked / usec : 0.0);
+}
+
+/** Mark all blocks reachable from the call stack and the address stack
+ *  with one thread
+ *
+ *  Returns the number of blocks marked.
+ */
+static uint64_t markBlocksReachableFromStacks(VmMemory memory,
+					      Stack callStack,
+					      Stack addressStack,
+					      GcErrorHandler errorHandler,
+					      void* errorContext) {
+  uint64_t numBlocksMarked = 0;
+
+  /** Mark all blocks reachable from the call stack.  Draining the mark
+   *  stack after each root keeps the stack from overflowing while the
+   *  roots are pushed on it.
+   */
+  LOG_TRACE(memory->logger, LogGC1, "Mark blocks reachable from call stack");
+  for (uint64_t* p = (uint64_t*)bottomOfStack(callStack);
+       p < (uint64_t*)topOfStack(callStack);
+       p += 2) {
+    if (*p >= (memory->heapStart + sizeof(HeapBlock))) {
+      pushOnMarkStack(memory, *p);
+      numBlocksMarked += drainMarkStack(memory, 0, UINT64_MAX, errorHandler,
+					errorContext);
+    }
+  }
+
+  /** Mark all blocks reachable from the address stack */
+  LOG_TRACE(memory->logger, LogGC1,
+	    "Mark blocks reachable from address stack");
+  for (uint64_t* p = (uint64_t*)bottomOfStack(addressStack);
+       p < (uint64_t*)topOfStack(addressStack);
+       ++p) {
+    if (*p >= (memory->heapStart + sizeof(HeapBlock))) {
+      pushOnMarkStack(memory, *p);
+      numBlocksMarked += drainMarkStack(memory, 0, UINT64_MAX, errorHandler,
+					errorContext);
+    }
+  }
+
+  return numBlocksMarked;
+}
+
+/** Push the address of a block's data on the mark stack
+ *
+ *  If the stack can't grow, the address is dropped and the collector
+ *  rescans the marked blocks for it once the stack is empty.
+ */
+static void pushOnMarkStack(VmMemory memory, uint64_t address) {
+  if (memory->markStackSize == memory->markStackCapacity) {
+    const uint64_t newCapacity = 2 * memory->markStackCapacity;
+    uint64_t* const newStack = (uint64_t*)realloc(
+      memory->markStack, newCapacity * sizeof(uint64_t)
+    );
+    if (!newStack) {
+      memory->markStackOverflowed = 1;
+      return;
+    }
+    memory->markStack = newStack;
+    memory->markStackCapacity = newCapacity;
+  }
+  memory->markStack[memory->markStackSize++] = address;
+}
+
+/** Push the addresses a code or state block references that lie in
+ *  [low, high) on the mark stack
+ *
+ *  The addresses go on the stack whether the blocks they reference are
+ *  marked or not.  drainMarkStack() looks at the marks when it pops them,
+ *  after it has had time to prefetch the blocks' headers.
+ */
+static void pushBlockReferences(VmMemory memory, HeapBlock* block,
+				uint64_t low, uint64_t high) {
+  scanBlockReferences(block, low, high, pushReferenceOnMarkStack, memory);
+}
+
+static void pushReferenceOnMarkStack(void* memory, uint64_t address) {
+  pushOnMarkStack((VmMemory)memory, address);
+}
+
+/** Call "push" with each address in [low, high) that a code or state
+ *  block references
+ *
+ *  The serial and parallel markers push the addresses on different
+ *  stacks.  This function is inline so the compiler can turn the calls
+ *  to "push" into direct calls.
+ */
+static inline void scanBlockReferences(HeapBlock* block, uint64_t low,
+				       uint64_t high,
+				       void (*push)(void*, uint64_t),
+				       void* target) {
+  if (getVmmBlockType(block) == VmmCodeBlockType) {
+    const uint8_t* p = ((CodeBlock*)block)->code;
+    const uint8_t* const end = p + getVmmBlockSize(block);
+
+    while (p < end) {
+      /** Most of the code on the heap is what the MK* instructions
+       *  write, which is mostly instructions with address operands, so
+       *  checking for those first skips most calls to instructionSize()
+       */
+      if (instructionHasAddressOperand(*p)) {
+	uint64_t address;
+	memcpy(&address, p + 1, sizeof(address));
+	if ((address >= low) && (address < high)) {
+	  push(target, address);
+	}
+	p += 9;
+      } else {
+	p += instructionSize(*p);
+      }
+    }
+    assert(p == end);
+  } else {
+    VmStateBlock* const state = (VmStateBlock*)block;
+    const uint64_t* const callStackEnd =
+      (const uint64_t*)state->stacks + 2 * (uint64_t)state->callStackSize;
+    const uint64_t* const addressStackEnd =
+      callStackEnd + state->addressStackSize;
+
+    /** The called blocks in the saved call stack, then the addresses on the
+     *  saved address stack
+     */
+    for (const uint64_t* p = (const uint64_t*)state->stacks; p < callStackEnd;
+	 p += 2) {
+      if ((*p >= low) && (*p < high)) {
+	push(target, *p);
+      }
+    }
+    for (const uint64_t* p = callStackEnd; p < addressStackEnd; ++p) {
+      if ((*p >= low) && (*p < high)) {
+	push(target, *p);
+      }
+    }
+  }
+}
+
+/** Mark the blocks on the mark stack and the blocks they reference until
+ *  the stack is empty or the marker has taken "maxWork" addresses off
+ *  of it
+ *
+ *  Addresses popped from the stack go through a small queue, and the
+ *  collector prefetches a block's header when the address enters the
+ *  queue, so the header is usually in the cache by the time the address
+ *  leaves it.  When the marker stops early, the addresses still in the
+ *  queue go back on the stack.  For a minor collection ("young" is
+ *  nonzero), only blocks in the nursery get marked.
+ *
+ *  Returns the number of blocks marked.
+ */
+static uint64_t drainMarkStack(VmMemory memory, int young,
+			       uint64_t maxWork,
+			       GcErrorHandler errorHandler,
+			       void* errorContext) {
+  const uint64_t low = young ? memory->nurseryStart + sizeof(HeapBlock)
+                             : memory->heapStart + sizeof(HeapBlock);
+  const uint64_t high = young ? memory->nurseryEnd : UINT64_MAX;
+  const uint64_t size = currentVmmSize(memory);
+  uint64_t queue[MARK_PREFETCH_DISTANCE];
+  uint32_t queueStart = 0;
+  uint32_t queueSize = 0;
+  uint64_t numBlocksMarked = 0;
+  uint64_t bytesMarked = 0;
+  uint64_t work = 0;
+
+  while (1) {
+    if (work == maxWork) {
+      /** Put the queue back so the address at its head is on top */
+      for (uint32_t i = queueSize; i > 0; --i) {
+	pushOnMarkStack(memory,
+			queue[(queueStart + i - 1) % MARK_PREFETCH_DISTANCE]);
+      }
+      break;
+    }
+
+    while ((queueSize < MARK_PREFETCH_DISTANCE) && memory->markStackSize) {
+      const uint64_t address = memory->markStack[--memory->markStackSize];
+      if (address <= size) {
+	__builtin_prefetch(memory->bytes + address - sizeof(HeapBlock), 0);
+      }
+      queue[(queueStart + queueSize++) % MARK_PREFETCH_DISTANCE] = address;
+    }
+
+    if (!queueSize) {
+      if (!memory->markStackOverflowed || memory->markThreadRunning) {
+	break;
+      }
+
+      /** Some addresses didn't fit on the stack.  They are all in blocks
+       *  that are already marked, so pushing the references in those
+       *  blocks again will find them.
+       */
+      LOG_TRACE(memory->logger, LogGC1, "Mark stack overflowed.  Rescan "
+		"marked blocks");
+      memory->markStackOverflowed = 0;
+      pushReferencesFromMarkedBlocks(memory, young);
+      continue;
+    }
+
+    const uint64_t address = queue[queueStart];
+    const uint64_t blockAddress = address - sizeof(HeapBlock);
+    queueStart = (queueStart + 1) % MARK_PREFETCH_DISTANCE;
+    --queueSize;
+    ++work;
+
+    if (address > size) {
+      errorHandler(memory, address, NULL, "Address of block is invalid",
+		   errorContext);
+      continue;
+    }
+
+    if (blockIsMarked(memory, blockAddress)) {
+      continue;
+    }
+
+    HeapBlock* const block = (HeapBlock*)(memory->bytes + blockAddress);
+
+    const int blockType = getVmmBlockType(block);
+    if ((blockType == VmmFreeBlockType)
+	  || (young && (blockAddress >= memory->nurseryTop))) {
+      errorHandler(memory, blockAddress, block, "Free block is reachable",
+		   errorContext);
+    } else if ((blockType == VmmCodeBlockType)
+	         || (blockType == VmmStateBlockType)) {
+      LOG_TRACE(memory->logger, LogGC2,
+		"Mark block at %" PRIu64 " with type %d", address, blockType);
+      markBlock(memory, blockAddress);
+      pushBlockReferences(memory, block, low, high);
+      ++numBlocksMarked;
+      bytesMarked += sizeof(HeapBlock) + getVmmBlockSize(block);
+    } else {
+      char msg[100];
+      snprintf(msg, sizeof(msg), "Unknown block type %u",
+	       (unsigned int)blockType);
+      errorHandler(memory, blockAddress, block, msg, errorContext);
+    }
+  }
+
+  if (!young) {
+    memory->bytesMarked += bytesMarked;
+  }
+  return numBlocksMarked;
+}
+
+/** Push the references in all the marked blocks on the mark stack, after
+ *  the mark stack overflowed
+ *
+ *  The marked blocks, including the marked cells in slabs, are the bits
+ *  set in the mark bitmap.  For a minor collection, only looks at the
+ *  blocks in the nursery.
+ */
+static void pushReferencesFromMarkedBlocks(VmMemory memory, int young) {
+  const uint64_t start = young ? memory->nurseryStart : memory->heapStart;
+  const uint64_t end = young ? memory->nurseryTop : currentVmmSize(memory);
+  const uint64_t high = young ? memory->nurseryEnd : UINT64_MAX;
+
+  for (uint64_t address = findNextBit(memory->markBits, start, end);
+       address < end;
+       address = findNextBit(memory->markBits, address + 8, end)) {
+    pushBlockReferences(memory, (HeapBlock*)(memory->bytes + address),
+			start + sizeof(HeapBlock), high);
+  }
+}
+
+/** Mark all blocks reachable from the call stack and the address stack
+ *  with memory->gcThreads threads
+ *
+ *  The calling thread is one of the workers.  It pushes the roots on its
+ *  own deque, and the other workers steal them from it.  A worker that
+ *  runs out of blocks to mark tries to steal from the others, and the
+ *  mark is over once every worker has run out.  The bit in the mark
+ *  bitmap is set with an atomic operation, so only one worker marks each
+ *  block.
+ *
+ *  Returns 0 if successful and -1 without marking anything if there is
+ *  only one thread, the heap is too small to be worth marking in
+ *  parallel, or there isn't enough memory for the deques.
+ */
+static int markReachableBlocksInParallel(VmMemory memory, Stack callStack,
+					 Stack addressStack,
+					 GcErrorHandler errorHandler,
+					 void* errorContext,
+					 uint64_t* numBlocksMarked) {
+  const uint32_t numWorkers = memory->gcThreads;
+
+  if ((numWorkers < 2) || (vmmHeapSize(memory) < MIN_PARALLEL_GC_HEAP_SIZE)) {
+    return -1;
+  }
+
+  VmmParallelMark mark;
+  VmmMarkWorker* const workers =
+    (VmmMarkWorker*)malloc(numWorkers * sizeof(VmmMarkWorker));
+  pthread_t* const threads =
+    (pthread_t*)malloc(numWorkers * sizeof(pthread_t));
+  uint64_t* const items =
+    (uint64_t*)malloc(numWorkers * MARK_DEQUE_SIZE * sizeof(uint64_t));
+  void* deques = NULL;
+
+  if (!workers || !threads || !items
+        || posix_memalign(&deques, sizeof(VmmMarkDeque),
+			  numWorkers * sizeof(VmmMarkDeque))) {
+    free((void*)workers);
+    free((void*)threads);
+    free((void*)items);
+    return -1;
+  }
+
+  mark.memory = memory;
+  mark.deques = (VmmMarkDeque*)deques;
+  mark.numWorkers = numWorkers;
+  mark.numIdle = 0;
+  mark.numBlocksMarked = 0;
+  pthread_mutex_init(&mark.lock, NULL);
+  mark.errorHandler = errorHandler;
+  mark.errorContext = errorContext;
+
+  for (uint32_t i = 0; i < numWorkers; ++i) {
+    mark.deques[i].top = 0;
+    mark.deques[i].bottom = 0;
+    mark.deques[i].items = items + i * MARK_DEQUE_SIZE;
+    workers[i].mark = &mark;
+    workers[i].deque = mark.deques + i;
+    workers[i].index = i;
+  }
+
+  LOG_TRACE(memory->logger, LogGC1, "Mark blocks reachable from the stacks "
+	    "with %" PRIu32 " threads", numWorkers);
+  for (uint64_t* p = (uint64_t*)bottomOfStack(callStack);
+       p < (uint64_t*)topOfStack(callStack);
+       p += 2) {
+    if (*p >= (memory->heapStart + sizeof(HeapBlock))) {
+      pushOnMarkDeque(&mark, mark.deques, *p);
+    }
+  }
+  for (uint64_t* p = (uint64_t*)bottomOfStack(addressStack);
+       p < (uint64_t*)topOfStack(addressStack);
+       ++p) {
+    if (*p >= (memory->heapStart + sizeof(HeapBlock))) {
+      pushOnMarkDeque(&mark, mark.deques, *p);
+    }
+  }
+
+  /** A worker that couldn't be started never has any blocks to mark, so
+   *  it counts as idle from the start
+   */
+  uint32_t numStarted = 1;
+  for (uint32_t i = 1; i < numWorkers; ++i) {
+    if (pthread_create(threads + numStarted, NULL, runMarkWorker,
+		       workers + i)) {
+      __atomic_add_fetch(&mark.numIdle, 1, __ATOMIC_SEQ_CST);
+    } else {
+      ++numStarted;
+    }
+  }
+
+  markBlocksFromDeques(workers);
+  for (uint32_t i = 1; i < numStarted; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  *numBlocksMarked = mark.numBlocksMarked;
+
+  /** Addresses that didn't fit on the mark stack either are found by
+   *  rescanning the marked blocks, which one thread does
+   */
+  if (memory->markStackSize || memory->markStackOverflowed) {
+    *numBlocksMarked += drainMarkStack(memory, 0, UINT64_MAX, errorHandler,
+				       errorContext);
+  }
+
+  pthread_mutex_destroy(&mark.lock);
+  free(deques);
+  free((void*)items);
+  free((void*)threads);
+  free((void*)workers);
+  return 0;
+}
+
+static void* runMarkWorker(void* worker) {
+  markBlocksFromDeques((VmmMarkWorker*)worker);
+  return NULL;
+}
+
+/** Mark blocks until no worker in a parallel mark has any left */
+static void markBlocksFromDeques(VmmMarkWorker* worker) {
+  VmmParallelMark* const mark = worker->mark;
+  VmMemory const memory = mark->memory;
+  const uint64_t low = memory->heapStart + sizeof(HeapBlock);
+  const uint64_t size = currentVmmSize(memory);
+  uint64_t numBlocksMarked = 0;
+  uint64_t bytesMarked = 0;
+  uint64_t address;
+
+  while (takeMarkWork(worker, &address)) {
+    if (address > size) {
+      reportParallelGcError(mark, address, NULL,
+			    "Address of block is invalid");
+      continue;
+    }
+
+    const uint64_t blockAddress = address - sizeof(HeapBlock);
+    if (blockIsMarked(memory, blockAddress)) {
+      continue;
+    }
+
+    HeapBlock* const block = (HeapBlock*)(memory->bytes + blockAddress);
+
+    const int blockType = getVmmBlockType(block);
+    if (blockType == VmmFreeBlockType) {
+      reportParallelGcError(mark, blockAddress, block,
+			    "Free block is reachable");
+    } else if ((blockType == VmmCodeBlockType)
+	         || (blockType == VmmStateBlockType)) {
+      /** Another worker may have marked the block since the check above */
+      const uint64_t bit = (uint64_t)1 << ((blockAddress / 8) % 64);
+      if (!(__atomic_fetch_or(memory->markBits + blockAddress / 512, bit,
+			      __ATOMIC_RELAXED) & bit)) {
+	scanBlockReferences(block, low, UINT64_MAX, pushReferenceOnMarkDeque,
+			    worker);
+	++numBlocksMarked;
+	bytesMarked += sizeof(HeapBlock) + getVmmBlockSize(block);
+      }
+    } else {
+      char msg[100];
+      snprintf(msg, sizeof(msg), "Unknown block type %u",
+	       (unsigned int)blockType);
+      reportParallelGcError(mark, blockAddress, block, msg);
+    }
+  }
+
+  __atomic_add_fetch(&mark->numBlocksMarked, numBlocksMarked,
+		     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&memory->bytesMarked, bytesMarked, __ATOMIC_RELAXED);
+}
+
+/** Get the address of the next block a worker should mark
+ *
+ *  Takes it from the worker's own deque, or steals it from another
+ *  worker or takes it from the memory's mark stack if that deque is
+ *  empty.  If there are no blocks to mark anywhere, the worker waits for
+ *  one of the others to push some, until all of them are waiting.
+ *
+ *  Returns 1 if it got an address and 0 if marking is over.
+ */
+static int takeMarkWork(VmmMarkWorker* worker, uint64_t* address) {
+  VmmParallelMark* const mark = worker->mark;
+
+  while (1) {
+    if (popFromMarkDeque(worker->deque, address)
+	  || stealMarkWork(worker, address)) {
+      return 1;
+    }
+
+    __atomic_add_fetch(&mark->numIdle, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+      if (__atomic_load_n(&mark->numIdle, __ATOMIC_SEQ_CST)
+	    == mark->numWorkers) {
+	return 0;
+      }
+      if (markWorkIsAvailable(mark)) {
+	__atomic_sub_fetch(&mark->numIdle, 1, __ATOMIC_SEQ_CST);
+	break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+/** Steal an address from another worker's deque, or take one from the
+ *  memory's mark stack
+ *
+ *  Returns 1 if successful and 0 if there was nothing to take.
+ */
+static int stealMarkWork(VmmMarkWorker* worker, uint64_t* address) {
+  VmmParallelMark* const mark = worker->mark;
+  VmMemory const memory = mark->memory;
+
+  for (uint32_t i = 1; i < mark->numWorkers; ++i) {
+    VmmMarkDeque* const victim =
+      mark->deques + (worker->index + i) % mark->numWorkers;
+    int result;
+
+    /** Try again if another worker took the address first */
+    while ((result = stealFromMarkDeque(victim, address)) < 0) {
+    }
+    if (result) {
+      return 1;
+    }
+  }
+
+  int result = 0;
+  pthread_mutex_lock(&mark->lock);
+  if (memory->markStackSize) {
+    *address = memory->markStack[--memory->markStackSize];
+    result = 1;
+  }
+  pthread_mutex_unlock(&mark->lock);
+  return result;
+}
+
+/** Return nonzero if any deque or the memory's mark stack has an address
+ *  on it
+ */
+static int markWorkIsAvailable(VmmParallelMark* mark) {
+  for (uint32_t i = 0; i < mark->numWorkers; ++i) {
+    VmmMarkDeque* const deque = mark->deques + i;
+    if ((int64_t)(__atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE)
+		    - __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE)) > 0) {
+      return 1;
+    }
+  }
+  return __atomic_load_n(&mark->memory->markStackSize, __ATOMIC_RELAXED) != 0;
+}
+
+/** Push an address on the bottom of a worker's deque, or on the memory's
+ *  mark stack if the deque is full
+ *
+ *  Only the worker that owns the deque may push on it.
+ */
+static void pushOnMarkDeque(VmmParallelMark* mark, VmmMarkDeque* deque,
+			    uint64_t address) {
+  const uint64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  const uint64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+  if ((bottom - top) >= MARK_DEQUE_SIZE) {
+    pthread_mutex_lock(&mark->lock);
+    pushOnMarkStack(mark->memory, address);
+    pthread_mutex_unlock(&mark->lock);
+    return;
+  }
+
+  __atomic_store_n(&deque->items[bottom & (MARK_DEQUE_SIZE - 1)], address,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+static void pushReferenceOnMarkDeque(void* worker, uint64_t address) {
+  VmmMarkWorker* const w = (VmmMarkWorker*)worker;
+  pushOnMarkDeque(w->mark, w->deque, address);
+}
+
+/** Pop an address from the bottom of a worker's deque
+ *
+ *  Only the worker that owns the deque may pop from it.  Returns 1 if
+ *  successful and 0 if the deque is empty.
+ */
+static int popFromMarkDeque(VmmMarkDeque* deque, uint64_t* address) {
+  const uint64_t bottom =
+    __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if ((int64_t)(bottom - top) < 0) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  *address = __atomic_load_n(&deque->items[bottom & (MARK_DEQUE_SIZE - 1)],
+			     __ATOMIC_RELAXED);
+  if (bottom != top) {
+    return 1;
+  }
+
+  /** The last address on the deque.  A thief might take it first. */
+  const int won = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return won;
+}
+
+/** Steal an address from the top of another worker's deque
+ *
+ *  Returns 1 if successful, 0 if the deque is empty and -1 if another
+ *  thread took the address first.
+ */
+static int stealFromMarkDeque(VmmMarkDeque* deque, uint64_t* address) {
+  uint64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  const uint64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if ((int64_t)(bottom - top) <= 0) {
+    return 0;
+  }
+
+  *address = __atomic_load_n(&deque->items[top & (MARK_DEQUE_SIZE - 1)],
+			     __ATOMIC_RELAXED);
+  return __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+				     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+           ? 1 : -1;
+}
+
+/** Call the error handler for a parallel mark, one thread at a time */
+static void reportParallelGcError(VmmParallelMark* mark, uint64_t address,
+				  HeapBlock* block, const char* details) {
+  pthread_mutex_lock(&mark->lock);
+  mark->errorHandler(mark->memory, address, block, details,
+		     mark->errorContext);
+  pthread_mutex_unlock(&mark->lock);
+}
+
+int collectVmmNursery(VmMemory memory, Stack callStack, Stack addressStack,
+		      GcErrorHandler errorHandler, void* errorContext) {
+  if (!memory->nurseryEnd) {
+    return 0;
+  }
+
+  LOG_TRACE(memory->logger, LogGC1, "Start collection of the nursery");
+  startGcPause(memory);
+  ++memory->gcStats.numNurseryCollections;
+
+  /** Only blocks in the nursery can reference other blocks in the
+   *  nursery, so the collector doesn't look inside blocks outside of it
+   */
+  const uint64_t low = memory->nurseryStart + sizeof(HeapBlock);
+  const uint64_t high = memory->nurseryEnd;
+  uint64_t numBlocksMarked = 0;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /** Mark all blocks in the nursery reachable from the call stack */
+  for (uint64_t* p = (uint64_t*)bottomOfStack(callStack);
+       p < (uint64_t*)topOfStack(callStack);
+       p += 2) {
+    if ((*p >= low) && (*p < high)) {
+      pushOnMarkStack(memory, *p);
+      numBlocksMarked += drainMarkStack(memory, 1, UINT64_MAX, errorHandler,
+					errorContext);
+    }
+  }
+
+  /** Mark all blocks in the nursery reachable from the address stack */
+  for (uint64_t* p = (uint64_t*)bottomOfStack(addressStack);
+       p < (uint64_t*)topOfStack(addressStack);
+       ++p) {
+    if ((*p >= low) && (*p < high)) {
+      pushOnMarkStack(memory, *p);
+      numBlocksMarked += drainMarkStack(memory, 1, UINT64_MAX, errorHandler,
+					errorContext);
+    }
+  }
+
+  /** Mark all blocks in the nursery reachable from the remembered set */
+  for (uint64_t i = 0; i < memory->numRememberedBlocks; ++i) {
+    pushBlockReferences(
+      memory, (HeapBlock*)(memory->bytes + memory->rememberedBlocks[i]),
+      low, high
+    );
+    numBlocksMarked += drainMarkStack(memory, 1, UINT64_MAX, errorHandler,
+				      errorContext);
+  }
+
+  LOG_TRACE(memory->logger, LogGC1, "Marked %" PRIu64 " blocks in the "
+	    "nursery", numBlocksMarked);
+  memory->gcStats.markUsec += usecSince(&start);
+  forgetUnmarkedBlocks(memory, memory->nurseryStart, memory->nurseryEnd);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sweepNursery(memory);
+  resetNursery(memory);
+  memory->gcStats.sweepUsec += usecSince(&start);
+  LOG_TRACE(memory->logger, LogGC1, "End collection of the nursery.  %"
+	    PRIu64 "/%" PRIu64 " bytes free", vmmBytesFree(memory),
+	    vmmHeapSize(memory));
+  endGcPause(memory);
+  return 0;
+}
+
+/** Free the unmarked blocks in the nursery, coalescing them with their
+ *  neighbors in the nursery, and clear the marks on the rest.  The blocks
+ *  that are still marked stay where they are and become part of the heap
+ *  outside the nursery.
+ */
+static void sweepNursery(VmMemory memory) {
+  uint8_t* p = memory->bytes + memory->nurseryStart;
+  uint8_t* const end = memory->bytes + memory->nurseryEnd;
+  HeapBlock* freeRun = NULL;
+  uint64_t numBlocksCollected = 0;
+  uint64_t numBlocksKept = 0;
+
+  while (p < end) {
+    HeapBlock* const block = (HeapBlock*)p;
+    const uint64_t size = getVmmBlockSize(block);
+
+    if (testBit(memory->markBits, p - memory->bytes)) {
+      if (freeRun) {
+	addSweptFreeBlock(memory, freeRun);
+	memory->bytesFree += getVmmBlockSize(freeRun);
+	freeRun = NULL;
+      }
+      memory->bytesAllocatedSinceGc += sizeof(HeapBlock) + size;
+      ++numBlocksKept;
+    } else {
+      if (getVmmBlockType(block) != VmmFreeBlockType) {
+	++numBlocksCollected;
+	memory->gcStats.bytesReclaimed += sizeof(HeapBlock) + size;
+      }
+      if (freeRun) {
+	setVmmBlockSize(freeRun,
+			getVmmBlockSize(freeRun) + sizeof(HeapBlock) + size);
+      } else {
+	setVmmBlockType(block, VmmFreeBlockType);
+	freeRun = block;
+      }
+    }
+    p += sizeof(HeapBlock) + size;
+  }
+  assert(p == end);
+
+  if (freeRun) {
+    addSweptFreeBlock(memory, freeRun);
+    memory->bytesFree += getVmmBlockSize(freeRun);
+  }
+  clearBits(memory->markBits, memory->nurseryStart, memory->nurseryEnd);
+
+  LOG_TRACE(memory->logger, LogGC1, "Collected %" PRIu64 " blocks from the "
+	    "nursery and promoted %" PRIu64, numBlocksCollected,
+	    numBlocksKept);
+}
+
+static int collectUnmarkedBlocks(VmMemory memory,
+				 GcErrorHandler errorHandler,
+				 void* errorContext) {
+  VmmSweep oneSweep;
+  VmmSweep* sweeps = NULL;
+  uint32_t numSweeps = 0;
+  uint64_t numBlocksInFreeRanges = 0;
+  uint64_t numBlocksKept = 0;
+  const uint64_t bytesInUse = vmmHeapSize(memory) - memory->bytesFree;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /** Free blocks go into the lists and tree once they can't grow any
+   *  larger, which is when the sweep reaches the next block in use or
+   *  the end of the heap.
+   */
+  resetFreeBlocks(memory);
+
+  /** mergeSweeps() rebuilds the lists of free cells */
+  resetFreeCells(memory);
+
+  if ((memory->gcThreads > 1)
+        && (vmmHeapSize(memory) >= MIN_PARALLEL_GC_HEAP_SIZE)) {
+    sweeps = (VmmSweep*)malloc(memory->gcThreads * sizeof(VmmSweep));
+    if (sweeps) {
+      numSweeps = splitHeapForSweep(memory, sweeps, memory->gcThreads);
+    }
+  }
+
+  if (numSweeps > 1) {
+    sweepInParallel(memory, sweeps, numSweeps);
+  } else {
+    free((void*)sweeps);
+    sweeps = &oneSweep;
+    numSweeps = 1;
+    initSweep(&oneSweep, memory, memory->heapStart, currentVmmSize(memory),
+	      1);
+    sweepRange(&oneSweep);
+  }
+
+  mergeSweeps(memory, sweeps, numSweeps);
+  memory->gcStats.sweepUsec += usecSince(&start);
+  clearAllMarks(memory);
+  for (uint32_t i = 0; i < numSweeps; ++i) {
+    numBlocksInFreeRanges += sweeps[i].numBlocksInFreeRanges;
+    numBlocksKept += sweeps[i].numBlocksKept;
+  }
+  if (sweeps != &oneSweep) {
+    free((void*)sweeps);
+  }
+
+  const uint64_t bytesStillInUse = vmmHeapSize(memory) - memory->bytesFree;
+  if (bytesInUse > bytesStillInUse) {
+    memory->gcStats.bytesReclaimed += bytesInUse - bytesStillInUse;
+  }
+  memory->gcStats.blocksKept = numBlocksKept;
+
+  if (1) {
+    /** Verify that sum of memory in free blocks equals memory->bytesFree */
+    /* printf("Verify free byte count\n"); */
+    FreeBlock *q = firstFreeBlockInVmm(memory);
+    uint64_t bytesFree = 0;
+
+    LOG_TRACE(memory->logger, LogGC1, "Check free bytes count");
+    
+    while (q) {
+      bytesFree += getVmmBlockSize((HeapBlock*)q);
+      q = nextFreeBlockInVmm(memory, q);
+    }
+
+    if (bytesFree != memory->bytesFree) {
+      /**
+      printf("memory->bytesFree = %lu, sum of free blocks = %lu.  "
+	     "Signaling error.\n", memory->bytesFree, bytesFree);
+       **/
+      char msg[200];
+      snprintf(msg, sizeof(msg),
+	       "After garbage collection, memory->bytesFree is %lu, but "
+	       "total number of bytes in free blocks is %lu",
+	       memory->bytesFree, bytesFree);
+      errorHandler(memory, 0, NULL, msg, errorContext);
+    }
+  }
+
+  LOG_TRACE(memory->logger, LogGC1,
+	    "Freed ranges of %" PRIu64 " blocks and kept %" PRIu64 ".  %"
+	    PRIu64 "/%" PRIu64 " bytes free", numBlocksInFreeRanges,
+	    numBlocksKept, vmmBytesFree(memory), vmmHeapSize(memory));
+  return 0;
+}
+
+/** Start a lazy sweep of the whole heap
+ *
+ *  The allocator sweeps the heap a piece at a time when it runs out of
+ *  free blocks, so everything on the lists and tree of free blocks comes
+ *  from the part that has been swept.
+ */
+static void startLazySweep(VmMemory memory) {
+  LOG_TRACE(memory->logger, LogGC1, "Leave unmarked blocks for the "
+	    "allocator to collect");
+
+  /** Whatever isn't live will be free once the allocator has swept the
+   *  whole heap
+   */
+  const uint64_t bytesInUse = vmmHeapSize(memory) - memory->bytesFree;
+  if (bytesInUse > memory->bytesMarked) {
+    memory->gcStats.bytesReclaimed += bytesInUse - memory->bytesMarked;
+  }
+  resetFreeBlocks(memory);
+  resetFreeCells(memory);
+  memory->bytesFree = 0;
+  memory->lazySweepStart = memory->heapStart;
+  memory->lazySweepEnd = currentVmmSize(memory);
+  memory->lazySweepBlocksInFreeRanges = 0;
+  memory->lazySweepBlocksKept = 0;
+}
+
+/** Sweep the next LAZY_SWEEP_CHUNK_SIZE bytes or so of the heap, if the
+ *  last full collection left any unswept
+ *
+ *  Returns 1 if it swept anything and 0 if there was nothing to sweep.
+ */
+static int sweepLazily(VmMemory memory) {
+  if (memory->lazySweepStart >= memory->lazySweepEnd) {
+    return 0;
+  }
+
+  VmmSweep sweep;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  initSweep(&sweep, memory, memory->lazySweepStart, memory->lazySweepEnd, 1);
+  if ((sweep.end - sweep.start) > LAZY_SWEEP_CHUNK_SIZE) {
+    sweep.stop = sweep.start + LAZY_SWEEP_CHUNK_SIZE;
+  }
+  sweepRange(&sweep);
+  clearBits(memory->markBits, sweep.start, sweep.end);
+
+  /** The cells freed in this piece of the heap go in front of the ones
+   *  freed in the pieces before it, like they do in a full sweep
+   */
+  for (int c = 0; c < NUM_SLAB_CELL_SIZES; ++c) {
+    if (sweep.firstFreeCell[c]) {
+      ((FreeBlock*)(memory->bytes + sweep.lastFreeCell[c]))->next =
+	memory->firstFreeCell[c];
+      memory->firstFreeCell[c] = sweep.firstFreeCell[c];
+    }
+  }
+
+  memory->bytesFree += sweep.bytesFree;
+  memory->lazySweepBlocksInFreeRanges += sweep.numBlocksInFreeRanges;
+  memory->lazySweepBlocksKept += sweep.numBlocksKept;
+  memory->lazySweepStart = sweep.end;
+  memory->gcStats.sweepUsec += usecSince(&start);
+  if (memory->lazySweepStart >= memory->lazySweepEnd) {
+    memory->gcStats.blocksKept = memory->lazySweepBlocksKept;
+    LOG_TRACE(memory->logger, LogGC1,
+	      "Lazy sweep freed ranges of %" PRIu64 " blocks and kept %"
+	      PRIu64 ".  %" PRIu64 "/%" PRIu64 " bytes free",
+	      memory->lazySweepBlocksInFreeRanges, memory->lazySweepBlocksKept,
+	      vmmBytesFree(memory), vmmHeapSize(memory));
+    memory->lazySweepStart = 0;
+    memory->lazySweepEnd = 0;
+  }
+  return 1;
+}
+
+/** Forget about the part of the heap the last lazy sweep didn't get to,
+ *  before a collection that clears the marks and sweeps the whole heap
+ *  itself
+ */
+static void abandonLazySweep(VmMemory memory) {
+  memory->lazySweepStart = 0;
+  memory->lazySweepEnd = 0;
+}
+
+/** Split the heap into as many as "numSweeps" ranges of about the same
+ *  size that start at the start of a block, and set up a sweep for each
+ *
+ *  Returns the number of ranges.
+ */
+static uint32_t splitHeapForSweep(VmMemory memory, VmmSweep* sweeps,
+				  uint32_t numSweeps) {
+  const uint64_t heapEnd = currentVmmSize(memory);
+  const uint64_t rangeSize = vmmHeapSize(memory) / numSweeps;
+  uint64_t start = memory->heapStart;
+  uint32_t n = 0;
+
+  while ((start < heapEnd) && (n < (numSweeps - 1))) {
+    const uint64_t address =
+      findNextBit(memory->startBits, start + rangeSize, heapEnd);
+    if (address >= heapEnd) {
+      break;
+    }
+    initSweep(sweeps + n, memory, start, address, 0);
+    start = address;
+    ++n;
+  }
+  if (start < heapEnd) {
+    initSweep(sweeps + n, memory, start, heapEnd, 0);
+    ++n;
+  }
+  return n;
+}
+
+static void initSweep(VmmSweep* sweep, VmMemory memory, uint64_t start,
+		      uint64_t end, int addFreeBlocksToHeap) {
+  sweep->memory = memory;
+  sweep->start = start;
+  sweep->end = end;
+  sweep->stop = end;
+  sweep->addFreeBlocksToHeap = addFreeBlocksToHeap;
+  sweep->firstFreeBlock = 0;
+  sweep->lastFreeBlock = 0;
+  for (int i = 0; i < NUM_SLAB_CELL_SIZES; ++i) {
+    sweep->firstFreeCell[i] = 0;
+    sweep->lastFreeCell[i] = 0;
+  }
+  sweep->bytesFree = 0;
+  sweep->numBlocksInFreeRanges = 0;
+  sweep->numBlocksKept = 0;
+}
+
+/** Sweep each range on its own thread.  The calling thread sweeps the
+ *  first one, and any range that doesn't get a thread of its own.
+ */
+static void sweepInParallel(VmMemory memory, VmmSweep* sweeps,
+			    uint32_t numSweeps) {
+  pthread_t* const threads =
+    (pthread_t*)malloc(numSweeps * sizeof(pthread_t));
+  uint32_t numStarted = 0;
+
+  LOG_TRACE(memory->logger, LogGC1, "Sweep the heap with %" PRIu32
+	    " threads", numSweeps);
+  for (uint32_t i = 1; i < numSweeps; ++i) {
+    if (threads && !pthread_create(threads + numStarted, NULL,
+				   runSweepWorker, sweeps + i)) {
+      ++numStarted;
+    } else {
+      sweepRange(sweeps + i);
+    }
+  }
+  sweepRange(sweeps);
+  for (uint32_t i = 0; i < numStarted; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free((void*)threads);
+}
+
+static void* runSweepWorker(void* sweep) {
+  sweepRange((VmmSweep*)sweep);
+  return NULL;
+}
+
+/** Free the unmarked blocks in a range of the heap, coalescing
+ *  neighboring free blocks
+ *
+ *  The sweep goes from one block in use to the next with the mark and
+ *  block-start bitmaps, and everything in between becomes one free block,
+ *  so it never reads the headers of the blocks it frees.  It leaves the
+ *  marks for its caller to clear.
+ */
+static void sweepRange(VmmSweep* sweep) {
+  VmMemory const memory = sweep->memory;
+  const uint64_t end = sweep->end;
+  uint64_t p = sweep->start;
+
+  while (p < end) {
+    const uint64_t live = findNextLiveBlock(memory, p, end);
+
+    if (live > p) {
+      LOG_TRACE(memory->logger, LogGC2, "Free blocks from %" PRIu64
+		" to %" PRIu64, p, live);
+      writeFreeBlock(memory->bytes + p, live - p - sizeof(HeapBlock), 0);
+      sweep->bytesFree += live - p - sizeof(HeapBlock);
+      sweep->numBlocksInFreeRanges += countBits(memory->startBits, p, live);
+      finishFreeBlock(sweep, (HeapBlock*)(memory->bytes + p));
+    }
+    if (live >= end) {
+      p = end;
+      break;
+    }
+
+    HeapBlock* const block = (HeapBlock*)(memory->bytes + live);
+    LOG_TRACE(memory->logger, LogGC2, "Keep marked block at %" PRIu64,
+	      live + sizeof(HeapBlock));
+    if (getVmmBlockType(block) == VmmSlabBlockType) {
+      sweepSlab(sweep, (VmmSlab*)block);
+    }
+    ++sweep->numBlocksKept;
+    p = live + sizeof(HeapBlock) + getVmmBlockSize(block);
+    if (p >= sweep->stop) {
+      break;
+    }
+  }
+  assert(p <= end);
+  sweep->end = p;
+}
+
+/** Find the first block in [from, to) that is marked or is a slab with
+ *  marked cells.  "from" must be the address of a block's header.
+ *
+ *  A marked bit with no block starting there is a cell, and the last
+ *  block that starts before it is its slab.
+ *
+ *  Returns the address of the block's header, or "to" if there isn't
+ *  one.
+ */
+static uint64_t findNextLiveBlock(VmMemory memory, uint64_t from,
+				  uint64_t to) {
+  uint64_t address = findNextBit(memory->markBits, from, to);
+
+  while ((address < to) && !testBit(memory->startBits, address)) {
+    const uint64_t slab = findLastBit(memory->startBits, from, address);
+    if ((slab < address)
+	  && (getVmmBlockType((HeapBlock*)(memory->bytes + slab))
+	        == VmmSlabBlockType)) {
+      return slab;
+    }
+
+    /** Only a corrupt heap has marks anywhere else */
+    address = findNextBit(memory->markBits, address + 8, to);
+  }
+  return address;
+}
 
-  /** Clear the marks on all the blocks */
-  logMessage(memory->logger, LogGC1, "Clear block marks");
-  forEachVmmBlock(memory, clearBlockMark, NULL);
+/** Put a free block that can't grow any larger on the heap's lists or
+ *  tree, or on the sweep's own list of free blocks
+ */
+static void finishFreeBlock(VmmSweep* sweep, HeapBlock* block) {
+  VmMemory const memory = sweep->memory;
+
+  if (sweep->addFreeBlocksToHeap) {
+    addSweptFreeBlock(memory, block);
+    return;
+  }
+
+  const uint64_t address = (uint8_t*)block - memory->bytes;
+  if (sweep->lastFreeBlock) {
+    ((FreeBlock*)(memory->bytes + sweep->lastFreeBlock))->next = address;
+  } else {
+    sweep->firstFreeBlock = address;
+  }
+  sweep->lastFreeBlock = address;
+}
+
+/** Put a free block the sweep made out of one or more blocks on the
+ *  heap's lists or tree, and clear the block-start bits of all but the
+ *  first of them
+ *
+ *  Sweeps that run in parallel leave this to mergeSweeps(), since the
+ *  bits at the ends of neighboring ranges may share a word.
+ */
+static void addSweptFreeBlock(VmMemory memory, HeapBlock* block) {
+  const uint64_t address = (uint8_t*)block - memory->bytes;
+  clearBits(memory->startBits, address + sizeof(HeapBlock),
+	    address + sizeof(HeapBlock) + getVmmBlockSize(block));
+  addFreeBlock(memory, (FreeBlock*)block);
+}
+
+/** Put the free blocks and free cells the sweeps found on the heap's
+ *  lists and tree, coalescing a free block at the end of one range with
+ *  a free block at the start of the next, and add up the free bytes
+ */
+static void mergeSweeps(VmMemory memory, VmmSweep* sweeps,
+			uint32_t numSweeps) {
+  HeapBlock* pending = NULL;
+
+  memory->bytesFree = 0;
+  for (uint32_t i = 0; i < numSweeps; ++i) {
+    uint64_t address = sweeps[i].firstFreeBlock;
+
+    memory->bytesFree += sweeps[i].bytesFree;
+    while (address) {
+      HeapBlock* const block = (HeapBlock*)(memory->bytes + address);
+      address = ((FreeBlock*)block)->next;
+
+      if (pending && (nextHeapBlockInVmm(memory, pending) == block)) {
+	setVmmBlockSize(pending, getVmmBlockSize(pending) + sizeof(HeapBlock)
+			           + getVmmBlockSize(block));
+	memory->bytesFree += sizeof(HeapBlock);
+      } else {
+	if (pending) {
+	  addSweptFreeBlock(memory, pending);
+	}
+	pending = block;
+      }
+    }
+  }
+  if (pending) {
+    addSweptFreeBlock(memory, pending);
+  }
+
+  /** Chain the lists of free cells together.  One sweep puts the cells in
+   *  each slab at the front of the list, so the last range goes first,
+   *  like it would if one thread swept the whole heap.
+   */
+  for (int c = 0; c < NUM_SLAB_CELL_SIZES; ++c) {
+    uint64_t first = 0;
+    for (uint32_t i = 0; i < numSweeps; ++i) {
+      const VmmSweep* const sweep = sweeps + i;
+      if (sweep->firstFreeCell[c]) {
+	((FreeBlock*)(memory->bytes + sweep->lastFreeCell[c]))->next = first;
+	first = sweep->firstFreeCell[c];
+      }
+    }
+    memory->firstFreeCell[c] = first;
+  }
+}
+
+/** Free the unmarked cells in a slab that has cells in use
+ *
+ *  Slabs with no cells in use have no marks, so the sweep frees them
+ *  along with the blocks around them without calling sweepSlab().
+ */
+static void sweepSlab(VmmSweep* sweep, VmmSlab* slab) {
+  VmMemory const memory = sweep->memory;
+  const uint64_t stride = slab->cellSize + sizeof(HeapBlock);
+  const int sizeClass = (int)(slab->cellSize / 8) - 2;
+  uint64_t next = sweep->firstFreeCell[sizeClass];
+  uint32_t numLive = 0;
+
+  for (uint32_t i = slab->numCells; i > 0; --i) {
+    HeapBlock* const cell = (HeapBlock*)(slab->cells + (i - 1) * stride);
+    if (testBit(memory->markBits, (uint8_t*)cell - memory->bytes)) {
+      ++numLive;
+    } else {
+      /** The first free cell the sweep finds ends up last on its list */
+      if (!next) {
+	sweep->lastFreeCell[sizeClass] = (uint8_t*)cell - memory->bytes;
+      }
+      writeFreeBlock((uint8_t*)cell, slab->cellSize, next);
+      next = (uint8_t*)cell - memory->bytes;
+    }
+  }
+  sweep->firstFreeCell[sizeClass] = next;
+
+  LOG_TRACE(memory->logger, LogGC2, "Slab at %" PRIu64 " has %" PRIu32
+	    " of %" PRIu32 " cells in use",
+	    vmmAddressForPtr(memory, (uint8_t*)slab), numLive,
+	    slab->numCells);
+}
+
+int collectAndCompactVmmBlocks(VmMemory memory, Stack callStack,
+			       Stack addressStack, uint64_t* pc,
+			       GcErrorHandler errorHandler,
+			       void* errorContext) {
+  VmmCompaction compaction;
+
+  LOG_TRACE(memory->logger, LogGC1, "Start compacting collection");
+  startGcPause(memory);
+  ++memory->gcStats.numCollections;
+
+  /** Mark the reachable blocks the same way collectUnreachableVmmBlocks()
+   *  does, so the collector can fall back on sweeping the heap if it
+   *  can't allocate the memory to copy it
+   */
+  resetNursery(memory);
+  abandonIncrementalCollection(memory);
+  abandonLazySweep(memory);
+  clearAllMarks(memory);
+  markReachableBlocks(memory, callStack, addressStack, errorHandler,
+		      errorContext);
+
+  const uint64_t bytesInUse = vmmHeapSize(memory) - memory->bytesFree;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (startCompaction(memory, &compaction)) {
+    LOG_TRACE(memory->logger, LogGC1, "Not enough memory to compact the "
+	      "heap - collect unmarked blocks instead");
+    forgetUnmarkedBlocks(memory, memory->heapStart, currentVmmSize(memory));
+    const int result = collectUnmarkedBlocks(memory, errorHandler,
+					     errorContext);
+    LOG_TRACE(memory->logger, LogGC1, "End compacting collection");
+    endGcPause(memory);
+    return result;
+  }
 
-  /** Mark all blocks reachable from the call stack */
-  logMessage(memory->logger, LogGC1, "Mark blocks reachable from call stack");
+  /** The program area doesn't move */
+  memcpy(compaction.toSpace, memory->bytes, memory->heapStart);
+
+  /** Copy the blocks reachable from each root before moving on to the
+   *  next one, so each function ends up near the functions it calls
+   */
   for (uint64_t* p = (uint64_t*)bottomOfStack(callStack);
        p < (uint64_t*)topOfStack(callStack);
        p += 2) {
-    /* printf("Visit call stack frame\n"); */
-    visitBlock(memory, *p, errorHandler, errorContext);
+    *p = copyLiveBlock(&compaction, *p);
+    relocatePendingBlocks(&compaction);
   }
 
-  /** Mark all blocks reachable from the address stack */
-  logMessage(memory->logger, LogGC1,
-	     "Mark blocks reachable from address stack");
   for (uint64_t* p = (uint64_t*)bottomOfStack(addressStack);
        p < (uint64_t*)topOfStack(addressStack);
        ++p) {
-    /* printf("Visit address stack frame\n"); */
-    visitBlock(memory, *p, errorHandler, errorContext);
+    *p = copyLiveBlock(&compaction, *p);
+    relocatePendingBlocks(&compaction);
   }
 
-  logMessage(memory->logger, LogGC1, "Collect unmarked blocks");
-  int result = collectUnmarkedBlocks(memory, errorHandler, errorContext);
-  logMessage(memory->logger, LogGC1, "End collection of unreachable blocks");
-  return result;
-}
+  /** Return addresses and the program counter point into the middle of
+   *  blocks, so they can't be relocated until all the blocks are copied
+   */
+  for (uint64_t* p = (uint64_t*)bottomOfStack(callStack) + 1;
+       p < (uint64_t*)topOfStack(callStack);
+       p += 2) {
+    *p = relocateInteriorAddress(&compaction, *p);
+  }
 
-static void visitBlock(VmMemory memory, uint64_t address,
-		       GcErrorHandler errorHandler,
-		       void* errorContext) {
-  if (address >= memory->heapStart) {
-    HeapBlock* block = (HeapBlock*)ptrToVmmAddress(memory,
-						   address - sizeof(HeapBlock));
-
-    if (!vmmBlockIsMarked(block)) {
-      const int blockType = getVmmBlockType(block);
-
-      logMessage(memory->logger, LogGC2,
-		 "Visit block at %" PRIu64 " with type %d", address, blockType);
-		 
-      setVmmBlockMark(block);
-
-      if (blockType == VmmFreeBlockType) {
-	/** Should not have an address pointing to a free block...*/
-	clearVmmBlockMark(block);
-	errorHandler(memory, vmmAddressForPtr(memory, (uint8_t*)block), block,
-		     "Free block is reachable", errorContext);
-      } else if (blockType == VmmCodeBlockType) {
-	visitCodeBlock(memory, (CodeBlock*)block, errorHandler, errorContext);
-      } else if (blockType == VmmStateBlockType) {
-	visitVmStateBlock(memory, (VmStateBlock*)block, errorHandler,
-			  errorContext);
-      } else {
-	char msg[100];
+  if (pc) {
+    *pc = relocateInteriorAddress(&compaction, *pc);
+  }
 
-	clearVmmBlockMark(block);
-	snprintf(msg, sizeof(msg), "Unknown block type %u",
-		 (unsigned int)getVmmBlockType(block));
-	errorHandler(memory, vmmAddressForPtr(memory, (uint8_t*)block), block,
-		     msg, errorContext);
+  for (uint64_t i = 0; i < compaction.numBlocks; ++i) {
+    const uint64_t address = compaction.blocks[i].newAddress;
+    if ((address != BLOCK_NOT_COPIED)
+	  && (getVmmBlockType((HeapBlock*)(compaction.toSpace + address))
+	        == VmmStateBlockType)) {
+      VmStateBlock* const block =
+	(VmStateBlock*)(compaction.toSpace + address);
+      uint64_t* const callStackEnd =
+	(uint64_t*)block->stacks + 2 * (uint64_t)block->callStackSize;
+      for (uint64_t* p = (uint64_t*)block->stacks + 1; p < callStackEnd;
+	   p += 2) {
+	*p = relocateInteriorAddress(&compaction, *p);
       }
     }
   }
+
+  finishCompaction(&compaction);
+  memory->gcStats.sweepUsec += usecSince(&start);
+
+  /** None of the blocks are marked now, so the handler forgets them all,
+   *  since they moved
+   */
+  forgetUnmarkedBlocks(memory, memory->heapStart, currentVmmSize(memory));
+
+  /** Copying the blocks is this collector's sweep */
+  const uint64_t bytesStillInUse = vmmHeapSize(memory) - memory->bytesFree;
+  if (bytesInUse > bytesStillInUse) {
+    memory->gcStats.bytesReclaimed += bytesInUse - bytesStillInUse;
+  }
+  memory->gcStats.blocksKept = compaction.numBlocks;
+  LOG_TRACE(memory->logger, LogGC1, "End compacting collection.  %" PRIu64
+	    "/%" PRIu64 " bytes free", vmmBytesFree(memory),
+	    vmmHeapSize(memory));
+  endGcPause(memory);
+  return 0;
 }
 
-static void visitCodeBlock(VmMemory memory, CodeBlock* block,
-			   GcErrorHandler errorHandler, void* errorContext) {
-  uint8_t* p = block->code;
-  uint8_t* end = p + getVmmBlockSize((HeapBlock*)block);
+/** Find the marked blocks and allocate the memory the compaction needs
+ *
+ *  Returns 0 if successful and -1 if there isn't enough memory for the
+ *  compaction, in which case the marks are unchanged.
+ */
+static int startCompaction(VmMemory memory, VmmCompaction* compaction) {
+  const uint64_t heapEnd = currentVmmSize(memory);
+  const uint64_t numBlocks =
+    countBits(memory->markBits, memory->heapStart, heapEnd);
+
+  compaction->memory = memory;
+  compaction->top = memory->heapStart;
+  compaction->lastBlock = 0;
+  compaction->numBlocks = 0;
+  compaction->numPending = 0;
+  compaction->toSpace = reserveHeapMemory(memory->maxSize,
+					  currentVmmSize(memory),
+					  memory->hugePages);
+  compaction->blocks =
+    (VmmRelocation*)malloc((numBlocks + 1) * sizeof(VmmRelocation));
+  compaction->pending = (uint64_t*)malloc((numBlocks + 1) * sizeof(uint64_t));
+
+  if (!compaction->toSpace || !compaction->blocks || !compaction->pending) {
+    releaseHeapMemory(compaction->toSpace, memory->maxSize);
+    free(compaction->blocks);
+    free(compaction->pending);
+    return -1;
+  }
 
-  while (p < end) {
-    if (*p == PUSH_INSTRUCTION) {
-      /** TODO: Replace this with a read that will work on processors
-       *        that don't support unaligned reads
-       */
-      const uint64_t address = *(uint64_t*)(p + 1);
-      // If the operand lies inside the heap, it is the address of the
-      // block's data, not the header, which is sizeof(HeapBlock) bytes behind.
-      //
-      // Could just call visitBlock with the operand and that would ignore
-      // operands outside the heap, but this gives us extra checking that
-      // if the operand lies inside the heap, it references a code block.
-      if (address >= memory->heapStart) {
-	HeapBlock* const q = (HeapBlock*)ptrToVmmAddress(
-	  memory, address - sizeof(HeapBlock)
-	);
-	if (!q) {
-	  errorHandler(memory, address, q,
-		       "Operand of PUSH instruction is invalid",
-		       errorContext);
-
-	} else if (getVmmBlockType(q) != VmmCodeBlockType) {
-	  errorHandler(memory, address, q,
-		       "Operand of PUSH instruction does not point to "
-		       "a code block", errorContext);
-	} else {
-	  visitBlock(memory, address, errorHandler, errorContext);
-	}
-      }
+  /** Slabs come apart during compaction, so their cells in use are live
+   *  blocks like any other.  The mark bitmap has them all in address
+   *  order.
+   */
+  for (uint64_t address = findNextBit(memory->markBits, memory->heapStart,
+				      heapEnd);
+       address < heapEnd;
+       address = findNextBit(memory->markBits, address + 8, heapEnd)) {
+    VmmRelocation* const r = &(compaction->blocks[compaction->numBlocks++]);
+    r->oldAddress = address;
+    r->newAddress = BLOCK_NOT_COPIED;
+  }
+  assert(compaction->numBlocks == numBlocks);
+
+  /** The blocks get their bits in the block-start bitmap as they are
+   *  copied
+   */
+  memset(memory->startBits, 0, bitmapWords(heapEnd) * sizeof(uint64_t));
+  return 0;
+}
+
+/** Find the live block that contains the given address
+ *
+ *  Returns NULL if the address isn't inside a live block.
+ */
+static VmmRelocation* findLiveBlock(VmmCompaction* compaction,
+				    uint64_t address) {
+  uint64_t low = 0;
+  uint64_t high = compaction->numBlocks;
+
+  /** Find the last block that starts at or before "address" */
+  while (low < high) {
+    const uint64_t mid = low + (high - low) / 2;
+    if (compaction->blocks[mid].oldAddress <= address) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
+  }
 
-    p += instructionSize(*p);
+  if (!low) {
+    return NULL;
   }
 
-  assert(p == end);
+  VmmRelocation* const r = &(compaction->blocks[low - 1]);
+  const HeapBlock* const block =
+    (const HeapBlock*)(compaction->memory->bytes + r->oldAddress);
+  return (address < (r->oldAddress + sizeof(HeapBlock)
+		       + getVmmBlockSize(block))) ? r : NULL;
 }
 
-static void visitVmStateBlock(VmMemory memory, VmStateBlock* block,
-			      GcErrorHandler errorHandler,
-			      void* errorContext) {
-  uint64_t* const callStackEnd =
-    (uint64_t*)block->stacks + 2 * (uint64_t)block->callStackSize;
-  uint64_t* const addressStackEnd = callStackEnd + block->addressStackSize;
+/** Copy the block whose data starts at "address" to the new memory, if it
+ *  hasn't been copied already
+ *
+ *  Returns the address of the block's data in the new memory.  Addresses
+ *  outside the heap and addresses that don't refer to live blocks stay the
+ *  same.  markReachableBlocks() has already reported the latter.
+ */
+static uint64_t copyLiveBlock(VmmCompaction* compaction, uint64_t address) {
+  VmMemory memory = compaction->memory;
 
-  /** Visit all the addresses in the saved call stack */
-  for (uint64_t* p = (uint64_t*)block->stacks; p < callStackEnd; p += 2) {
-    visitBlock(memory, *p, errorHandler, errorContext);
+  if (address < (memory->heapStart + sizeof(HeapBlock))) {
+    return address;
   }
 
-  /** Visit all the addresses in the saved address stack */
-  for (uint64_t* p = callStackEnd; p < addressStackEnd; ++p) {
-    visitBlock(memory, *p, errorHandler, errorContext);
+  VmmRelocation* const r =
+    findLiveBlock(compaction, address - sizeof(HeapBlock));
+  if (!r || (r->oldAddress != (address - sizeof(HeapBlock)))) {
+    return address;
   }
-}
 
-static int collectUnmarkedBlocks(VmMemory memory,
-				 GcErrorHandler errorHandler,
-				 void* errorContext) {
-  HeapBlock* p = firstHeapBlockInVmm(memory);
-  HeapBlock* prev = NULL;
-  FreeBlock* prevFree = NULL;
-  uint64_t numBlocksCollected = 0;
-  uint64_t numBlocksKept = 0;
+  if (r->newAddress == BLOCK_NOT_COPIED) {
+    HeapBlock* const block = (HeapBlock*)(memory->bytes + r->oldAddress);
+    const uint64_t size = sizeof(HeapBlock) + getVmmBlockSize(block);
+    HeapBlock* const copy = (HeapBlock*)(compaction->toSpace
+					 + compaction->top);
+
+    memcpy(copy, block, size);
+    setBit(memory->startBits, compaction->top);
+    r->newAddress = compaction->top;
+    compaction->pending[compaction->numPending++] = compaction->top;
+    compaction->lastBlock = compaction->top;
+    compaction->top += size;
+
+    LOG_TRACE(memory->logger, LogGC2, "Move block at %" PRIu64 " to %"
+	      PRIu64, address, r->newAddress + sizeof(HeapBlock));
+  }
 
-  memory->bytesFree = 0;
-  memory->firstFree = 0;
-  
-  while (p) {
-    /** Get the next block now, since we may overwrite the current block */
-    HeapBlock* const next = nextHeapBlockInVmm(memory, p);
-    uint64_t blockAddress = vmmAddressForPtr(memory,
-					     (uint8_t*)p + sizeof(HeapBlock));
-    
-    /**
-    printf("prev = %p, prevFree = %p, p = %p, next = %p\n", prev, prevFree, p,
-           next);
-    if (p) {
-      printf("addr(p) = %lu\n", (uint64_t)((uint8_t*)p - ptrToVmMemory(memory)));
-    } else {
-      printf("addr(p) = (nil)\n");
-    }
-    **/
-    
-    assert(!prev || (nextHeapBlockInVmm(memory, prev) == p));
-
-    if (vmmBlockIsMarked(p)) {
-      /* printf("Clear mark\n"); */
-      logMessage(memory->logger, LogGC2, "Keep marked block at %" PRIu64,
-		 blockAddress);
-      clearVmmBlockMark(p);
-      prev = p;
-      ++numBlocksKept;
+  return r->newAddress + sizeof(HeapBlock);
+}
+
+/** Copy the blocks the copied blocks reference and update their
+ *  addresses, until there are no copied blocks left to update
+ */
+static void relocatePendingBlocks(VmmCompaction* compaction) {
+  while (compaction->numPending) {
+    HeapBlock* const block = (HeapBlock*)(
+      compaction->toSpace + compaction->pending[--compaction->numPending]
+    );
+
+    if (getVmmBlockType(block) == VmmCodeBlockType) {
+      uint8_t* p = ((CodeBlock*)block)->code;
+      uint8_t* const end = p + getVmmBlockSize(block);
+
+      while (p < end) {
+	if (instructionHasAddressOperand(*p)) {
+	  uint64_t address;
+	  memcpy(&address, p + 1, sizeof(address));
+	  address = copyLiveBlock(compaction, address);
+	  memcpy(p + 1, &address, sizeof(address));
+	}
+	p += instructionSize(*p);
+      }
     } else {
-      assert(!prev || !vmmBlockIsMarked(prev));
-      
-      if (prev && (getVmmBlockType(prev) == VmmFreeBlockType)) {
-	/* printf("Merge into prior free block\n"); */
-	/** prev should be at the end of the free list */
-	assert((HeapBlock*)prevFree == prev);
-	assert(((FreeBlock*)prev)->next == 0);
-
-	logMessage(memory->logger, LogGC2,
-		   "Coalesce unreferenced block at %" PRIu64
-		   " into previous free block at %" PRIu64,
-		   blockAddress,
-		   vmmAddressForPtr(memory,
-				    (uint8_t*)prev + sizeof(HeapBlock)));
-	
-	/** Coalesce block into previous free block */
-	const uint64_t blockSize = sizeof(HeapBlock) + getVmmBlockSize(p);
-	setVmmBlockSize(prev, getVmmBlockSize(prev) + blockSize);
-	memory->bytesFree += blockSize;
-      } else {
-	/* printf("Change to free block\n"); */
-	/** Change to free block */
-	assert(getVmmBlockSize(p) >= 8);
-
-	logMessage(memory->logger, LogGC2,
-		   "Change block at %" PRIu64 " to free block", blockAddress);
-	
-	setVmmBlockType(p, VmmFreeBlockType);
-	((FreeBlock*)p)->next = 0;
-
-	if (prevFree) {
-	  assert(!prevFree->next);
-	  prevFree->next = vmmAddressForPtr(memory, (uint8_t*)p);
-	} else {
-	  assert(!memory->firstFree);
-	  memory->firstFree = vmmAddressForPtr(memory, (uint8_t*)p);
-	}	
-	memory->bytesFree += getVmmBlockSize(p);
-
-	prev = p;
-	prevFree = (FreeBlock*)p;
+      /** The return addresses get relocated once all blocks are copied */
+      VmStateBlock* const state = (VmStateBlock*)block;
+      uint64_t* const callStackEnd =
+	(uint64_t*)state->stacks + 2 * (uint64_t)state->callStackSize;
+      uint64_t* const addressStackEnd =
+	callStackEnd + state->addressStackSize;
+
+      for (uint64_t* p = (uint64_t*)state->stacks; p < callStackEnd; p += 2) {
+	*p = copyLiveBlock(compaction, *p);
+      }
+      for (uint64_t* p = callStackEnd; p < addressStackEnd; ++p) {
+	*p = copyLiveBlock(compaction, *p);
       }
-      ++numBlocksCollected;
     }
+  }
+}
 
-    p = next;
+/** Relocate an address that may point into the middle of a block, such as
+ *  a return address
+ */
+static uint64_t relocateInteriorAddress(VmmCompaction* compaction,
+					uint64_t address) {
+  if (address < compaction->memory->heapStart) {
+    return address;
   }
 
-  /* printf("Done collecting free blocks\n"); */
-  assert(!(prev && nextHeapBlockInVmm(memory, prev)));
+  const VmmRelocation* const r = findLiveBlock(compaction, address);
+  if (!r || (r->newAddress == BLOCK_NOT_COPIED)) {
+    return address;
+  }
+  return address - r->oldAddress + r->newAddress;
+}
 
-  if (1) {
-    /** Verify that sum of memory in free blocks equals memory->bytesFree */
-    /* printf("Verify free byte count\n"); */
-    FreeBlock *q = firstFreeBlockInVmm(memory);
-    uint64_t bytesFree = 0;
+/** Turn the rest of the new memory into a free block and replace the old
+ *  memory with the new one
+ */
+static void finishCompaction(VmmCompaction* compaction) {
+  VmMemory memory = compaction->memory;
+  const uint64_t size = currentVmmSize(memory);
 
-    logMessage(memory->logger, LogGC1, "Check free bytes count");
-    
-    while (q) {
-      bytesFree += getVmmBlockSize((HeapBlock*)q);
-      q = nextFreeBlockInVmm(memory, q);
-    }
+  resetFreeBlocks(memory);
+  resetFreeCells(memory);
+  memory->bytesFree = 0;
 
-    if (bytesFree != memory->bytesFree) {
-      /**
-      printf("memory->bytesFree = %lu, sum of free blocks = %lu.  "
-	     "Signaling error.\n", memory->bytesFree, bytesFree);
-       **/
-      char msg[200];
-      snprintf(msg, sizeof(msg),
-	       "After garbage collection, memory->bytesFree is %lu, but "
-	       "total number of bytes in free blocks is %lu",
-	       memory->bytesFree, bytesFree);
-      errorHandler(memory, 0, NULL, msg, errorContext);
-    }
+  releaseHeapMemory(memory->bytes, memory->maxSize);
+  free(compaction->blocks);
+  free(compaction->pending);
+  memory->bytes = compaction->toSpace;
+  memory->end = memory->bytes + size;
+  clearAllMarks(memory);
+
+  if ((size - compaction->top) >= 2 * sizeof(HeapBlock)) {
+    writeFreeBlock(memory->bytes + compaction->top,
+		   size - compaction->top - sizeof(HeapBlock), 0);
+    addFreeBlock(memory, (FreeBlock*)(memory->bytes + compaction->top));
+    setBit(memory->startBits, compaction->top);
+    memory->bytesFree = size - compaction->top - sizeof(HeapBlock);
+  } else if (compaction->top < size) {
+    /** Eight bytes are too few for a free block, so they go to the last
+     *  block.  A code block gets PANIC instructions, same as
+     *  allocateVmmCodeBlock() gives the space past the end of the code.
+     */
+    HeapBlock* const last = (HeapBlock*)(memory->bytes
+					 + compaction->lastBlock);
+    assert(compaction->lastBlock);
+    memset(memory->bytes + compaction->top, PANIC_INSTRUCTION,
+	   size - compaction->top);
+    setVmmBlockSize(last, getVmmBlockSize(last) + size - compaction->top);
   }
 
-  logMessage(memory->logger, LogGC1,
-	     "Collected %" PRIu64 " blocks and kept %" PRIu64 ".  %" PRIu64
-	     "/%" PRIu64 " bytes free", numBlocksCollected, numBlocksKept,
-	     vmmBytesFree(memory), vmmHeapSize(memory));
-  return 0;
+  LOG_TRACE(memory->logger, LogGC1, "Compacted %" PRIu64 " blocks into %"
+	    PRIu64 " bytes", compaction->numBlocks,
+	    compaction->top - memory->heapStart);
 }
 
 static int ptrOutOfBounds(VmMemory memory, uint8_t* p) {
@@ -695,8 +3456,7 @@ static int ptrOutOfBounds(VmMemory memory, uint8_t* p) {
 }
 
 static HeapBlock* allocateBlock(VmMemory memory, uint64_t size) {
-  FreeBlock* prevFree;
-  FreeBlock* block = findFreeBlockWithSize(memory, size, &prevFree);
+  FreeBlock* block = takeFreeBlockWithSize(memory, size);
   if (!block) {
     char msg[100];
     snprintf(msg, sizeof(msg),
@@ -706,85 +3466,329 @@ static HeapBlock* allocateBlock(VmMemory memory, uint64_t size) {
     return NULL;
   }
 
-  return splitFreeBlock(memory, block, prevFree, size);
+  return splitFreeBlock(memory, block, size);
+}
+
+/** Find the smallest free block with at least "size" bytes and remove
+ *  it from the lists and tree of free blocks
+ *
+ *  Returns NULL if there is no such block.
+ */
+/** Take the smallest free block with at least "size" bytes off the lists
+ *  or tree of free blocks.  If there isn't one, sweeps more of the heap
+ *  until there is, if the last collection left the sweep to the
+ *  allocator.
+ */
+static FreeBlock* takeFreeBlockWithSize(VmMemory memory, uint64_t size) {
+  FreeBlock* block = takeSweptFreeBlockWithSize(memory, size);
+  while (!block && sweepLazily(memory)) {
+    block = takeSweptFreeBlockWithSize(memory, size);
+  }
+  return block;
 }
 
-static FreeBlock* findFreeBlockWithSize(VmMemory memory, uint64_t size,
-					FreeBlock** prevFree) {
-  *prevFree = NULL;
+static FreeBlock* takeSweptFreeBlockWithSize(VmMemory memory,
+					     uint64_t size) {
   if (size > memory->bytesFree) {
     return NULL;
   }
-  
-  FreeBlock* block = firstFreeBlockInVmm(memory);
 
-  while (block) {
-    if (getVmmBlockSize((HeapBlock*)block) >= size) {
-      return block;
+  FreeBlock* block = NULL;
+
+  if (size <= MAX_SMALL_FREE_BLOCK_SIZE) {
+    /** Look for the smallest nonempty list of blocks that are big enough */
+    const uint32_t firstList = (uint32_t)((size + 7) / 8) - 1;
+    const uint64_t candidates =
+      memory->nonEmptySmallFreeLists & (~(uint64_t)0 << firstList);
+    if (candidates) {
+      block = (FreeBlock*)(memory->bytes + memory->smallFreeLists[
+				 __builtin_ctzll(candidates)]);
     }
-    *prevFree = block;
-    block = nextFreeBlockInVmm(memory, block);
   }
 
-  return NULL;
+  if (!block) {
+    block = (FreeBlock*)smallestFreeTreeNodeWithSize(memory, size);
+  }
+
+  if (block) {
+    removeFreeBlock(memory, block);
+  } else if (memory->freeBlockAtZero
+	       && (getVmmBlockSize((HeapBlock*)memory->bytes) >= size)) {
+    block = (FreeBlock*)memory->bytes;
+    memory->freeBlockAtZero = 0;
+  }
+
+  return block;
 }
 
 static const uint64_t MIN_FREE_BLOCK_SIZE = 16;
 
+/** Allocate "size" bytes from the front of a free block that is not in
+ *  the lists or tree of free blocks, and return what is left to them.
+ */
 static HeapBlock* splitFreeBlock(VmMemory memory, FreeBlock* block,
-				 FreeBlock* prev, uint64_t size) {
+				 uint64_t size) {
   const uint64_t remaining = getVmmBlockSize((HeapBlock*)block) - size;
   if (remaining < MIN_FREE_BLOCK_SIZE) {
     /** Allocate the whole block */
-    if (loggingModuleIsEnabled(memory->logger, LogGC2)) {
-      uint64_t blockAddress =
-	vmmAddressForPtr(memory, (uint8_t*)block + sizeof(HeapBlock));
-      logMessage(memory->logger, LogGC2, "Allocate entire block at %" PRIu64
-		 " with size %" PRIu64 " to satisfy a request for %" PRIu64
-		 " bytes", blockAddress, getVmmBlockSize((HeapBlock*)block),
-		 size);
+    if (TRACING_IS_ENABLED(memory->logger, LogGC2)) {
+      LOG_TRACE(memory->logger, LogGC2, "Allocate entire block at %" PRIu64
+		" with size %" PRIu64 " to satisfy a request for %" PRIu64
+		" bytes",
+		vmmAddressForPtr(memory, (uint8_t*)block + sizeof(HeapBlock)),
+		getVmmBlockSize((HeapBlock*)block), size);
     }
     
-    if (prev) {
-      prev->next = block->next;
-    } else {
-      /** This is the first free block */
-      assert(((FreeBlock*)(memory->bytes + memory->firstFree)) == block);
-      memory->firstFree = block->next;
-    }
     memory->bytesFree -= getVmmBlockSize((HeapBlock*)block);
+    memory->bytesAllocatedSinceGc += getVmmBlockSize((HeapBlock*)block);
     return (HeapBlock*)block;
   } else {
     /** Split the free block in two */    
     uint8_t* newFreeBlock = ((uint8_t*)block) + size + sizeof(HeapBlock);
-    if (loggingModuleIsEnabled(memory->logger, LogGC2)) {
-      uint64_t blockAddress =
-	vmmAddressForPtr(memory, (uint8_t*)block + sizeof(HeapBlock));
-      uint64_t newBlockAddress = vmmAddressForPtr(memory, newFreeBlock);
-      logMessage(memory->logger, LogGC2, "Split free block at %" PRIu64
-		 " with size %" PRIu64 " into an allocated block of size %"
-		 PRIu64 " and a new free block at %" PRIu64 " with size %"
-		 PRIu64, blockAddress, getVmmBlockSize((HeapBlock*)block),
-		 size, newBlockAddress, remaining - sizeof(HeapBlock));
+    if (TRACING_IS_ENABLED(memory->logger, LogGC2)) {
+      LOG_TRACE(memory->logger, LogGC2, "Split free block at %" PRIu64
+		" with size %" PRIu64 " into an allocated block of size %"
+		PRIu64 " and a new free block at %" PRIu64 " with size %"
+		PRIu64,
+		vmmAddressForPtr(memory, (uint8_t*)block + sizeof(HeapBlock)),
+		getVmmBlockSize((HeapBlock*)block), size,
+		vmmAddressForPtr(memory, newFreeBlock),
+		remaining - sizeof(HeapBlock));
     }
     
-    writeFreeBlock(newFreeBlock, remaining - sizeof(HeapBlock), block->next);
-    if (prev) {
-      prev->next = newFreeBlock - memory->bytes;
-    } else {
-      /** This is the first free block */
-      assert(((FreeBlock*)(memory->bytes + memory->firstFree)) == block);
-      memory->firstFree = newFreeBlock - memory->bytes;
-    }
+    writeFreeBlock(newFreeBlock, remaining - sizeof(HeapBlock), 0);
+    addFreeBlock(memory, (FreeBlock*)newFreeBlock);
+    setBit(memory->startBits, newFreeBlock - memory->bytes);
     setVmmBlockSize((HeapBlock*)block, size);
     memory->bytesFree -= size + sizeof(HeapBlock);
+    memory->bytesAllocatedSinceGc += size + sizeof(HeapBlock);
     return (HeapBlock*)block;
   }
 }
 
+static void resetFreeBlocks(VmMemory memory) {
+  for (uint32_t i = 0; i < NUM_SMALL_FREE_LISTS; ++i) {
+    memory->smallFreeLists[i] = 0;
+  }
+  memory->nonEmptySmallFreeLists = 0;
+  memory->freeTreeRoot = 0;
+  memory->freeBlockAtZero = 0;
+}
+
+static void addFreeBlock(VmMemory memory, FreeBlock* block) {
+  const uint64_t address = (uint8_t*)block - memory->bytes;
+  const uint64_t size = getVmmBlockSize((HeapBlock*)block);
+
+  if (!address) {
+    memory->freeBlockAtZero = 1;
+  } else if (size <= MAX_SMALL_FREE_BLOCK_SIZE) {
+    const uint32_t list = (uint32_t)(size / 8) - 1;
+    block->next = memory->smallFreeLists[list];
+    memory->smallFreeLists[list] = address;
+    memory->nonEmptySmallFreeLists |= (uint64_t)1 << list;
+  } else {
+    insertIntoFreeTree(memory, (FreeTreeNode*)block);
+  }
+}
+
+static void removeFreeBlock(VmMemory memory, FreeBlock* block) {
+  const uint64_t address = (uint8_t*)block - memory->bytes;
+  const uint64_t size = getVmmBlockSize((HeapBlock*)block);
+
+  if (!address) {
+    memory->freeBlockAtZero = 0;
+  } else if (size <= MAX_SMALL_FREE_BLOCK_SIZE) {
+    const uint32_t list = (uint32_t)(size / 8) - 1;
+    uint64_t* p = &(memory->smallFreeLists[list]);
+
+    while (*p != address) {
+      assert(*p);
+      p = &(((FreeBlock*)(memory->bytes + *p))->next);
+    }
+    *p = block->next;
+    if (!memory->smallFreeLists[list]) {
+      memory->nonEmptySmallFreeLists &= ~((uint64_t)1 << list);
+    }
+  } else {
+    removeFromFreeTree(memory, (FreeTreeNode*)block);
+  }
+}
+
+/** Return the first block on the lists of small free blocks, starting
+ *  with list "firstList," or the smallest large free block if those lists
+ *  are empty.
+ */
+static FreeBlock* firstSmallOrLargeFreeBlock(VmMemory memory,
+					     uint32_t firstList) {
+  const uint64_t candidates = (firstList < NUM_SMALL_FREE_LISTS)
+    ? (memory->nonEmptySmallFreeLists & (~(uint64_t)0 << firstList)) : 0;
+  if (candidates) {
+    const int list = __builtin_ctzll(candidates);
+    return (FreeBlock*)(memory->bytes + memory->smallFreeLists[list]);
+  }
+  return (FreeBlock*)leftmostFreeTreeNode(memory, memory->freeTreeRoot);
+}
+
+#define FREE_TREE_NODE(ADDR) ((FreeTreeNode*)(memory->bytes + (ADDR)))
+
+/** Treap priority of a node in the tree of large free blocks */
+static uint64_t freeTreePriority(uint64_t address) {
+  return address * 0x9E3779B97F4A7C15ull;
+}
+
+/** Returns nonzero if block "a" comes before block "b" in the tree of
+ *  large free blocks
+ */
+static int freeTreeNodeIsBefore(FreeTreeNode* a, FreeTreeNode* b) {
+  const uint64_t aSize = getVmmBlockSize(&(a->block.header));
+  const uint64_t bSize = getVmmBlockSize(&(b->block.header));
+  return (aSize < bSize) || ((aSize == bSize) && (a < b));
+}
+
+/** Point the link to "node" in its parent (or the root) at "child" */
+static void replaceFreeTreeChild(VmMemory memory, FreeTreeNode* node,
+				 uint64_t child) {
+  if (!node->parent) {
+    memory->freeTreeRoot = child;
+  } else if (FREE_TREE_NODE(node->parent)->left
+	       == (uint8_t*)node - memory->bytes) {
+    FREE_TREE_NODE(node->parent)->left = child;
+  } else {
+    FREE_TREE_NODE(node->parent)->right = child;
+  }
+  if (child) {
+    FREE_TREE_NODE(child)->parent = node->parent;
+  }
+}
+
+static void insertIntoFreeTree(VmMemory memory, FreeTreeNode* node) {
+  const uint64_t address = (uint8_t*)node - memory->bytes;
+  uint64_t parent = 0;
+  uint64_t* link = &(memory->freeTreeRoot);
+
+  while (*link) {
+    parent = *link;
+    link = freeTreeNodeIsBefore(node, FREE_TREE_NODE(parent))
+             ? &(FREE_TREE_NODE(parent)->left)
+             : &(FREE_TREE_NODE(parent)->right);
+  }
+
+  node->block.next = 0;
+  node->left = 0;
+  node->right = 0;
+  node->parent = parent;
+  *link = address;
+
+  while (node->parent
+	   && (freeTreePriority(address) > freeTreePriority(node->parent))) {
+    rotateFreeTreeNodeUp(memory, node);
+  }
+}
+
+static void removeFromFreeTree(VmMemory memory, FreeTreeNode* node) {
+  /** Rotate the node down until it has at most one child, then replace
+   *  it with that child
+   */
+  while (node->left && node->right) {
+    if (freeTreePriority(node->left) > freeTreePriority(node->right)) {
+      rotateFreeTreeNodeUp(memory, FREE_TREE_NODE(node->left));
+    } else {
+      rotateFreeTreeNodeUp(memory, FREE_TREE_NODE(node->right));
+    }
+  }
+  replaceFreeTreeChild(memory, node, node->left ? node->left : node->right);
+}
+
+/** Swap a node with its parent while keeping the tree in order */
+static void rotateFreeTreeNodeUp(VmMemory memory, FreeTreeNode* node) {
+  const uint64_t address = (uint8_t*)node - memory->bytes;
+  const uint64_t parentAddress = node->parent;
+  FreeTreeNode* const parent = FREE_TREE_NODE(parentAddress);
+
+  replaceFreeTreeChild(memory, parent, address);
+  if (parent->left == address) {
+    parent->left = node->right;
+    if (node->right) {
+      FREE_TREE_NODE(node->right)->parent = parentAddress;
+    }
+    node->right = parentAddress;
+  } else {
+    parent->right = node->left;
+    if (node->left) {
+      FREE_TREE_NODE(node->left)->parent = parentAddress;
+    }
+    node->left = parentAddress;
+  }
+  parent->parent = address;
+}
+
+/** Return the smallest large free block with at least "size" bytes, or
+ *  NULL if there isn't one
+ */
+static FreeTreeNode* smallestFreeTreeNodeWithSize(VmMemory memory,
+						  uint64_t size) {
+  FreeTreeNode* best = NULL;
+  uint64_t p = memory->freeTreeRoot;
+
+  while (p) {
+    FreeTreeNode* const node = FREE_TREE_NODE(p);
+    if (getVmmBlockSize(&(node->block.header)) >= size) {
+      best = node;
+      p = node->left;
+    } else {
+      p = node->right;
+    }
+  }
+  return best;
+}
+
+static FreeTreeNode* leftmostFreeTreeNode(VmMemory memory, uint64_t root) {
+  if (!root) {
+    return NULL;
+  }
+  while (FREE_TREE_NODE(root)->left) {
+    root = FREE_TREE_NODE(root)->left;
+  }
+  return FREE_TREE_NODE(root);
+}
+
+static FreeTreeNode* nextFreeTreeNode(VmMemory memory, FreeTreeNode* node) {
+  if (node->right) {
+    return leftmostFreeTreeNode(memory, node->right);
+  }
+
+  uint64_t address = (uint8_t*)node - memory->bytes;
+  while (node->parent && (FREE_TREE_NODE(node->parent)->right == address)) {
+    address = node->parent;
+    node = FREE_TREE_NODE(address);
+  }
+  return node->parent ? FREE_TREE_NODE(node->parent) : NULL;
+}
+
+#undef FREE_TREE_NODE
+
 int increaseVmmSize(VmMemory memory) {
   clearVmmStatus(memory);
 
+  /** The mark thread can't follow the bitmaps to their new location, so
+   *  stop it while they move and start it again afterwards
+   */
+  const int restartMarkThread =
+    memory->markThreadRunning && !vmmGcSafepointRequested(memory);
+  stopConcurrentMark(memory);
+
+  /** Sweep the rest of the heap, so the free block at its end can grow */
+  finishVmmSweep(memory);
+
+  const int result = growVmm(memory);
+  if (restartMarkThread && startMarkThread(memory)) {
+    memory->concurrentMarkDone = 1;
+  }
+  return result;
+}
+
+/** Double the size of the memory, up to its maximum size */
+static int growVmm(VmMemory memory) {
   const uint64_t currentSize = currentVmmSize(memory);
   
   if (currentSize >= memory->maxSize) {
@@ -798,62 +3802,54 @@ int increaseVmmSize(VmMemory memory) {
     newSize = memory->maxSize;
   }
 
-  uint8_t* newMemory = (uint8_t*)realloc(memory->bytes, newSize);
-  if (!newMemory) {
+  if (growBitmaps(memory, newSize)
+        || commitHeapMemory(memory->bytes, currentSize, newSize)) {
     setVmmStatus(memory, VmmSizeIncreaseFailedError,
 		 "Could not allocate enough memory to increase VMM size");
     return -1;
   }
 
-  memory->bytes = newMemory;
   memory->end = memory->bytes + newSize;
   memory->bytesFree += newSize - currentSize;
+  memory->slabAllocationFailed = 0;
+  memory->nurseryAllocationFailed = 0;
   
-  /** Find the last free block.  If this block is the last block in
-   *  the old heap, extend it to cover the increase in memory size.  If not,
-   *  write a new free block at the end of memory and add it to the
-   *  free list.
-   */
-  FreeBlock* p = firstFreeBlockInVmm(memory);
-  if (!p) {
-    /** There were no free blocks on the heap, so write one at the end
-     *  of the old heap and point the free block pointer to it
-     */
-      writeFreeBlock(memory->bytes + currentSize,
-		     newSize - currentSize - sizeof(HeapBlock), 0);
-      memory->firstFree = currentSize;
+  /** Look at the last block on the old heap, which the block-start
+   *  bitmap finds without walking the heap or the free blocks.  If it is
+   *  a free block, extend it to cover the increase in memory size.  If
+   *  not, write a new free block at the end of the old heap.  The free
+   *  part of the nursery isn't on the free lists, so it doesn't count.
+   */
+  const uint64_t lastBlock =
+    findLastBit(memory->startBits, memory->heapStart, currentSize);
+  FreeBlock* p = NULL;
+  if ((lastBlock < currentSize)
+        && ((lastBlock < memory->nurseryStart)
+	      || (lastBlock >= memory->nurseryEnd))
+        && (getVmmBlockType((HeapBlock*)(memory->bytes + lastBlock))
+	      == VmmFreeBlockType)) {
+    p = (FreeBlock*)(memory->bytes + lastBlock);
+  }
 
-      /** Account for the header of the new block */
-      memory->bytesFree -= sizeof(HeapBlock);    
+  if (p) {
+    /** The last block on the old heap is a free block, so just increase its
+     *  size to cover the newly-allocated memory
+     */
+    removeFreeBlock(memory, p);
+    setVmmBlockSize((HeapBlock*)p,
+		    getVmmBlockSize((HeapBlock*)p) + (newSize - currentSize));
   } else {
-    FreeBlock* next = nextFreeBlockInVmm(memory, p);
-
-    while (next) {
-      p = next;
-      next = nextFreeBlockInVmm(memory, p);
-    }
-
-    uint8_t* const nextBlock = (uint8_t*)nextHeapBlockInVmm(memory,
-							    (HeapBlock*)p);
-    if (nextBlock == (memory->bytes + currentSize)) {
-      /** The last block on the old heap is a free block, so just increase its
-       *  size to cover the newly-allocated memory
-       */
-      setVmmBlockSize((HeapBlock*)p,
-		      getVmmBlockSize((HeapBlock*)p) + (newSize - currentSize));
-    } else {
-      /** The last block on the old heap is not a free block, so create a new
-       *  free block to cover the newly-added memory and add it to the
-       *  free list.
-       */
-      writeFreeBlock(memory->bytes + currentSize,
-		     newSize - currentSize - sizeof(HeapBlock), 0);
-      p->next = currentSize;
+    /** The last block on the old heap is not a free block, so create a new
+     *  free block to cover the newly-added memory.
+     */
+    p = (FreeBlock*)(memory->bytes + currentSize);
+    writeFreeBlock((uint8_t*)p, newSize - currentSize - sizeof(HeapBlock), 0);
+    setBit(memory->startBits, currentSize);
 
-      /** Account for the header of the new block */
-      memory->bytesFree -= sizeof(HeapBlock);
-    }
+    /** Account for the header of the new block */
+    memory->bytesFree -= sizeof(HeapBlock);
   }
+  addFreeBlock(memory, p);
 
   logMessage(memory->logger, LogGeneralInfo,
 	     "Increase VM memory size to %" PRIu64 "/%" PRIu64,
@@ -861,3 +3857,60 @@ int increaseVmmSize(VmMemory memory) {
   return 0;
 }
 
+uint64_t releaseVmmFreeMemory(VmMemory memory) {
+  const uint64_t pageSize = vmmPageSize();
+  uint64_t bytesReleased = 0;
+  uint64_t numBlocks = 0;
+
+  for (FreeBlock* p = firstFreeBlockInVmm(memory); p;
+       p = nextFreeBlockInVmm(memory, p)) {
+    const uint64_t size = getVmmBlockSize((HeapBlock*)p);
+    if (size >= MIN_RELEASED_BLOCK_SIZE) {
+      /** Keep the header and the links in the tree of free blocks, and
+       *  release the whole pages after them
+       */
+      const uint64_t address = (uint8_t*)p - memory->bytes;
+      const uint64_t start = roundToPageSize(address + sizeof(FreeTreeNode));
+      const uint64_t end =
+	(address + sizeof(HeapBlock) + size) & ~(pageSize - 1);
+      if ((end > start)
+	    && !madvise((void*)(memory->bytes + start), end - start,
+			MADV_DONTNEED)) {
+	bytesReleased += end - start;
+	++numBlocks;
+      }
+    }
+  }
+
+  memory->bytesReleased += bytesReleased;
+  logMessage(memory->logger, LogGeneralInfo,
+	     "Returned %" PRIu64 " bytes in %" PRIu64 " free blocks to the "
+	     "system", bytesReleased, numBlocks);
+  return bytesReleased;
+}
+
+uint64_t vmmBytesReleased(VmMemory memory) {
+  return memory->bytesReleased;
+}
+
+void getVmmGcStats(VmMemory memory, VmmGcStats* stats) {
+  *stats = memory->gcStats;
+  stats->numFreeBlocks = 0;
+  stats->largestFreeBlock = 0;
+  stats->fragmentation = 0.0;
+
+  uint64_t bytesInFreeBlocks = 0;
+  for (FreeBlock* p = firstFreeBlockInVmm(memory); p;
+       p = nextFreeBlockInVmm(memory, p)) {
+    const uint64_t size = getVmmBlockSize((HeapBlock*)p);
+    ++stats->numFreeBlocks;
+    bytesInFreeBlocks += size;
+    if (size > stats->largestFreeBlock) {
+      stats->largestFreeBlock = size;
+    }
+  }
+  if (bytesInFreeBlocks) {
+    stats->fragmentation =
+      1.0 - (double)stats->largestFreeBlock / (double)bytesInFreeBlocks;
+  }
+}
@@ -17,8 +17,12 @@ typedef struct HeapBlock_ {
    *      00: Free block
    *      01: Block containing VM code
    *      10: Block containing saved VM state
-   *  Bits 58-62: Unused (should be 0)
-   *  Bit 63:     Mark for garbage collection
+   *      11: Slab of small code blocks
+   *  Bits 58-63: Unused (should be 0)
+   *
+   *  The garbage collector keeps its marks in a bitmap on the side, so
+   *  it doesn't have to write to a block's header to mark it or clear
+   *  the mark.
    */
   uint64_t typeAndSize;
 } HeapBlock;
@@ -28,7 +32,9 @@ typedef struct FreeBlock_ {
   /** Block type and size */
   HeapBlock header;
   
-  /** Address of next free block */
+  /** Address of next free block of the same size, or 0 if there isn't
+   *  one.  Only meaningful for small free blocks; see firstFreeBlockInVmm().
+   */
   uint64_t next;
 } FreeBlock;
 
@@ -65,33 +71,74 @@ typedef struct VmStateBlock_ {
   uint8_t stacks[];
 } VmStateBlock;
 
+/** A block divided into cells that hold small code blocks
+ *
+ *  The functions MK* instructions create are all small and there are
+ *  a lot of them, so allocateVmmCodeBlockFromSlab() serves them from
+ *  slabs instead of searching the free list for each one.  All the cells
+ *  in a slab have the same size.  Each cell is a complete CodeBlock with
+ *  its own header, so the VM and the garbage collector treat the code in
+ *  a cell like any other code block.  Cells that aren't in use are
+ *  FreeBlocks on a list of free cells of that size.
+ *
+ *  The garbage collector frees unreachable cells and returns a slab to
+ *  the heap once none of its cells are reachable.
+ */
+typedef struct VmmSlab_ {
+  /** Block type and size */
+  HeapBlock header;
+
+  /** Size of the code in each cell, not including the cell's header */
+  uint32_t cellSize;
+
+  /** Number of cells in the slab */
+  uint32_t numCells;
+
+  /** The cells themselves */
+  uint8_t cells[];
+} VmmSlab;
+
 /** Functions for working with blocks */
 uint8_t getVmmBlockType(const HeapBlock* block);
 uint64_t getVmmBlockSize(const HeapBlock* block);
-int vmmBlockIsMarked(const HeapBlock* block);
-void clearVmmBlockMark(HeapBlock* block);
-void setVmmBlockMark(HeapBlock* block);
+
+/** Memory for the virtual machine */
+typedef struct VmMemoryImpl_* VmMemory;
+
+/** Functions for working with the marks the garbage collector puts on
+ *  blocks.  The marks live in a bitmap in the VmMemory, with one bit for
+ *  every eight bytes of memory.
+ */
+int vmmBlockIsMarked(VmMemory memory, const HeapBlock* block);
+void clearVmmBlockMark(VmMemory memory, HeapBlock* block);
+void setVmmBlockMark(VmMemory memory, HeapBlock* block);
 
 /** Block type constants */
 #ifdef __cplusplus
 const int VmmFreeBlockType = 0;
 const int VmmCodeBlockType = 1;
 const int VmmStateBlockType = 2;
+const int VmmSlabBlockType = 3;
 #else
 const int VmmFreeBlockType;
 const int VmmCodeBlockType;
 const int VmmStateBlockType;
+const int VmmSlabBlockType;
 #endif
 
-/** Memory for the virtual machine */
-typedef struct VmMemoryImpl_* VmMemory;
-
 /** Create an new VmMemory instance
  *
  *  Arguments:
  *    initialSize    Initial size of the memory, in bytes
  *    maxSize        Maximum size of the memory, in bytes
  *
+ *  Both sizes are rounded down to a multiple of eight, so every block on
+ *  the heap starts on an eight-byte boundary.
+ *
+ *  The memory reserves address space for "maxSize" bytes, but only
+ *  commits the pages it needs for "initialSize" bytes.  The rest is
+ *  committed as the memory grows.
+ *
  *  Returns:
  *    A new VmMemory instance, or NULL if an error occurred
  */
@@ -124,9 +171,31 @@ uint64_t currentVmmSize(VmMemory memory);
 /** Return the maximum size of the memory, in bytes */
 uint64_t maxVmmSize(VmMemory memory);
 
-/** Return the number of bytes free on the heap */
+/** Return the number of bytes free on the heap
+ *
+ *  Doesn't count the free memory in the part of the heap a lazy sweep
+ *  hasn't swept yet (see vmmBytesUnswept()).
+ */
 uint64_t vmmBytesFree(VmMemory memory);
 
+/** Return the number of bytes allocated since the last full collection
+ *
+ *  Counts the memory taken from the free blocks since the last full
+ *  collection started marking the heap, headers and whole slabs
+ *  included.  Blocks in the nursery count once a minor collection
+ *  promotes them.  Unlike the drop in vmmBytesFree(), it doesn't depend
+ *  on how much of the heap a lazy sweep has swept.
+ */
+uint64_t vmmBytesAllocatedSinceGc(VmMemory memory);
+
+/** Return the number of bytes in the blocks the last full collection
+ *  found reachable, headers included
+ *
+ *  Blocks allocated while an incremental or concurrent collection marks
+ *  the heap survive it but aren't counted.
+ */
+uint64_t vmmBytesLive(VmMemory memory);
+
 /** Return the current heap size, in bytes */
 uint64_t vmmHeapSize(VmMemory memory);
 
@@ -206,7 +275,14 @@ HeapBlock* forEachVmmBlock(
     void* context
 );
 
-/** Return the first free block on the heap, or NULL if no free blocks */
+/** Return the first free block on the heap, or NULL if no free blocks
+ *
+ *  The heap keeps free blocks with up to 256 bytes on lists that each hold
+ *  blocks of one size, and larger blocks in a tree ordered by size, so it
+ *  can find the smallest block that satisfies a request without searching
+ *  the whole heap.  Iterating over the free blocks visits them in order of
+ *  increasing size, not in address order.
+ */
 FreeBlock* firstFreeBlockInVmm(VmMemory memory);
 
 /** Return the next free block after "block" or NULL if "block" is the last
@@ -242,6 +318,123 @@ FreeBlock* forEachFreeBlockInVmm(VmMemory memory,
  */
 CodeBlock* allocateVmmCodeBlock(VmMemory memory, uint64_t size);
 
+/** Allocate a small block for code from a slab
+ *
+ *  Takes a free cell from a slab of cells big enough for "size" bytes,
+ *  allocating a new slab from the heap when there are no free cells
+ *  left.  Falls back on allocateVmmCodeBlock() when "size" is too big
+ *  for a slab or the heap doesn't have room for a new slab.
+ *
+ *  Arguments:
+ *    memory   The memory to allocate from
+ *    size     The desired size of the block, in bytes
+ *
+ *  Returns:
+ *    A pointer to the allocated CodeBlock, or NULL if a block could not
+ *    be allocated.
+ */
+CodeBlock* allocateVmmCodeBlockFromSlab(VmMemory memory, uint64_t size);
+
+/** Allocate a block for code from the nursery
+ *
+ *  The nursery is a large block from the heap that new functions are
+ *  allocated from by bumping a pointer, since most of the functions an
+ *  Unlambda program creates become unreachable almost immediately.  The
+ *  first allocation allocates the nursery from the heap.  When the
+ *  nursery is full, this function fails with VmmNurseryFullError, and the
+ *  caller should call collectVmmNursery() and try again.  Falls back on
+ *  allocateVmmCodeBlockFromSlab() when the nursery is disabled, "size"
+ *  is too big for the nursery or the heap doesn't have room for a
+ *  nursery.
+ *
+ *  Blocks in the nursery have their own headers like any other block, so
+ *  the VM and the garbage collector can treat them like any other code
+ *  block.
+ *
+ *  Arguments:
+ *    memory   The memory to allocate from
+ *    size     The desired size of the block, in bytes
+ *
+ *  Returns:
+ *    A pointer to the allocated CodeBlock, or NULL if a block could not
+ *    be allocated.
+ */
+CodeBlock* allocateVmmCodeBlockFromNursery(VmMemory memory, uint64_t size);
+
+/** Return the size of the nursery, in bytes */
+uint64_t vmmNurserySize(VmMemory memory);
+
+/** Set the size of the nursery, in bytes
+ *
+ *  The new size takes effect the next time the memory allocates a
+ *  nursery.  A size of 0 disables the nursery.
+ */
+void setVmmNurserySize(VmMemory memory, uint64_t size);
+
+/** Return the number of threads that mark and sweep the heap in a full
+ *  collection
+ */
+uint32_t vmmGcThreads(VmMemory memory);
+
+/** Set the number of threads that mark and sweep the heap in a full
+ *  collection
+ *
+ *  With more than one thread, the threads mark the heap together,
+ *  stealing blocks to mark from each other when they run out, then each
+ *  sweeps its own part of the heap.  Heaps smaller than a megabyte are
+ *  always collected by one thread.  0 means 1.
+ */
+void setVmmGcThreads(VmMemory memory, uint32_t numThreads);
+
+/** Return nonzero if full collections sweep the heap lazily */
+int vmmLazySweepEnabled(VmMemory memory);
+
+/** Turn lazy sweeping on or off
+ *
+ *  With lazy sweeping, collectUnreachableVmmBlocks() only marks the
+ *  heap.  The blocks it marks stay marked, and the unmarked ones aren't
+ *  freed until the allocator runs out of free blocks, when it sweeps the
+ *  heap from front to back, a piece at a time, until it frees enough
+ *  memory to allocate the block it needs.  Programs that allocate a lot
+ *  pay for the sweep a little at a time, and parts of the heap the
+ *  program never needs again are never swept.
+ *
+ *  Incremental, concurrent and compacting collections always sweep the
+ *  whole heap themselves.  Starting an incremental or concurrent
+ *  collection, or increasing the memory size, finishes the lazy sweep
+ *  in progress first.  Off by default.
+ */
+void setVmmLazySweep(VmMemory memory, int enabled);
+
+/** Return nonzero if the memory asked the kernel for huge pages */
+int vmmHugePagesEnabled(VmMemory memory);
+
+/** Ask the kernel to back the memory with transparent huge pages, or to
+ *  stop doing so
+ *
+ *  Huge pages cut the TLB misses a large heap causes, at the price of
+ *  committing memory 2MB at a time.  The kernel may still use ordinary
+ *  pages, depending on its settings and how fragmented physical memory
+ *  is.  Memory a compacting collection copies the heap to gets the same
+ *  advice.
+ *
+ *  Returns:
+ *    0 if successful, or -1 if the system doesn't support transparent
+ *    huge pages, in which case the status is
+ *    VmmHugePagesNotSupportedError and the setting doesn't change.
+ */
+int setVmmHugePages(VmMemory memory, int enabled);
+
+/** Return the number of bytes on the heap that a lazy sweep hasn't
+ *  swept yet, including the blocks in use there
+ */
+uint64_t vmmBytesUnswept(VmMemory memory);
+
+/** Sweep whatever the last lazy sweep hasn't swept yet, so every
+ *  unreachable block is free and no block is marked
+ */
+void finishVmmSweep(VmMemory memory);
+
 /** Allocate a block to store the VM state
  *
  *  Arguments:
@@ -270,16 +463,49 @@ VmStateBlock* allocateVmmStateBlock(VmMemory memory, uint32_t callStackSize,
 typedef void (*GcErrorHandler)(VmMemory, uint64_t, HeapBlock*,
 			       const char*, void*);
 
+/** Function the collector calls to forget the blocks it is about to free
+ *
+ *  Lets a table that refers to blocks without keeping them alive, like
+ *  the VM's table of functions (see hashcons.h), drop the blocks that
+ *  become unreachable.  The collector calls it once it has marked the
+ *  reachable blocks and before it frees any of the rest, with the range
+ *  of addresses it collects: the whole heap for a full collection and the
+ *  nursery for a minor one.  The handler forgets every block in the range
+ *  vmmBlockIsMarked() says isn't marked.  collectAndCompactVmmBlocks()
+ *  calls it once the blocks have moved instead, when none of them are
+ *  marked, so the handler forgets the addresses they used to have.
+ *
+ *  The arguments are (in order):
+ *  * The VmMemory instance on which garbage collection is running
+ *  * The lowest address in the range
+ *  * One past the highest address in the range
+ *  * The context passed to setVmmWeakRefHandler()
+ */
+typedef void (*VmmWeakRefHandler)(VmMemory, uint64_t, uint64_t, void*);
+
+/** Set the function the collector calls to forget the blocks it is about
+ *  to free, or NULL if nothing refers to blocks without keeping them
+ *  alive
+ */
+void setVmmWeakRefHandler(VmMemory memory, VmmWeakRefHandler handler,
+			  void* context);
+
 /** Collect all unreachable blocks and return them to the heap
  *
  *  The current garbage collector is a simple mark/sweep algorithm that
  *  finds all blocks reachable from either the call stack or the address
  *  stack and then transforms all other blocks on the heap into free
  *  blocks, coalescing neighboring free blocks into single free blocks
- *  as it goes.  The collector is not compacting and it's implementation is
- *  not particularly suited to Unlambda's memory usage patterns, which
- *  allocate a lot of small blocks on the heap.  However, the current
- *  implementation is "good enough" for a proof of concept.
+ *  as it goes.  Unreachable cells in slabs go back on the lists of free
+ *  cells, and slabs with no reachable cells become free blocks like any
+ *  other unreachable block.  The collector is not compacting, but the
+ *  slabs keep the many small blocks Unlambda programs allocate from
+ *  fragmenting the rest of the heap.  A full collection also collects the
+ *  nursery, if there is one, and the blocks in it that survive become
+ *  ordinary heap blocks.  The collector marks and sweeps with as many
+ *  threads as setVmmGcThreads() allows.  If lazy sweeping is on (see
+ *  setVmmLazySweep()), the collection ends once the heap is marked, and
+ *  the allocator does the sweep.
  *
  *  Arguments:
  *    memory:
@@ -305,21 +531,188 @@ typedef void (*GcErrorHandler)(VmMemory, uint64_t, HeapBlock*,
  *    callers should not depend on this behavior in the future, since the
  *    GC algorithm may change.
  *
- *  TODO:
- *    Allow for multiple GC algorithms
+ *  See collectAndCompactVmmBlocks() for a collector that also compacts
+ *  the heap.
  */
 int collectUnreachableVmmBlocks(VmMemory memory, Stack callStack,
 				Stack addressStack,
 				GcErrorHandler errorHandler,
 				void* errorContext);
 
+/** Collect the unreachable blocks in the nursery
+ *
+ *  A minor collection.  Blocks never change after the VM writes them, so
+ *  the only blocks outside the nursery that can reference blocks in it
+ *  are the ones allocated after it, which the memory keeps in a
+ *  "remembered set."  The collector marks the blocks in the nursery
+ *  reachable from the stacks and the remembered set without looking at
+ *  the rest of the heap, then frees the unmarked blocks.  The blocks that
+ *  survive stay where they are and are promoted to the rest of the heap,
+ *  where only collectUnreachableVmmBlocks() collects them.  The next
+ *  allocation from the nursery allocates a new one.
+ *
+ *  Arguments and return value are the same as for
+ *  collectUnreachableVmmBlocks().
+ */
+int collectVmmNursery(VmMemory memory, Stack callStack, Stack addressStack,
+		      GcErrorHandler errorHandler, void* errorContext);
+
+/** Start an incremental collection
+ *
+ *  An incremental collection marks the heap a little at a time, between
+ *  calls to continueIncrementalVmmCollection(), so the program never
+ *  stops for long.  This function collects the nursery and promotes what
+ *  survives, then takes a snapshot of the blocks the stacks reference,
+ *  and the collection marks everything reachable from that snapshot.
+ *  Blocks never change once the VM writes them, so the program can't
+ *  hide a block from the collector by storing its address somewhere the
+ *  collector has already looked, and every block allocated while the
+ *  collection is marking the heap is marked when it is allocated.  The
+ *  nursery stays empty until the collection is over.
+ *
+ *  collectUnreachableVmmBlocks() and collectAndCompactVmmBlocks() abandon
+ *  the incremental collection in progress and start over.  Does nothing
+ *  if an incremental collection is already in progress.
+ *
+ *  Arguments and return value are the same as for
+ *  collectUnreachableVmmBlocks().
+ */
+int startIncrementalVmmCollection(VmMemory memory, Stack callStack,
+				  Stack addressStack,
+				  GcErrorHandler errorHandler,
+				  void* errorContext);
+
+/** Start a concurrent collection
+ *
+ *  A concurrent collection is an incremental collection whose marking
+ *  is done by a thread of its own while the program keeps running.  This
+ *  function takes the snapshot of the roots the same way
+ *  startIncrementalVmmCollection() does, which is the only time the
+ *  collector looks at the stacks, then starts the thread.  Blocks
+ *  allocated while the thread runs are marked when they are allocated.
+ *  Once the thread is done, vmmGcSafepointRequested() returns nonzero,
+ *  and the program should call finishIncrementalVmmCollection() at the
+ *  next point where it is safe to free memory.
+ *
+ *  While the thread runs, the memory must not be used from any other
+ *  thread but the one that started the collection, and the functions
+ *  that move the heap or look at the mark stack stop the thread first.
+ *  GC errors the thread finds are passed to the error handler given to
+ *  the function that finishes the collection.
+ *
+ *  Does nothing if an incremental or concurrent collection is already
+ *  in progress.  If the thread can't be started, the collection marks
+ *  the heap when it finishes instead.
+ *
+ *  Arguments and return value are the same as for
+ *  collectUnreachableVmmBlocks().
+ */
+int startConcurrentVmmCollection(VmMemory memory, Stack callStack,
+				 Stack addressStack,
+				 GcErrorHandler errorHandler,
+				 void* errorContext);
+
+/** Return nonzero if an incremental or concurrent collection is in
+ *  progress
+ */
+int vmmIncrementalCollectionInProgress(VmMemory memory);
+
+/** Return nonzero if a concurrent collection has finished marking the
+ *  heap and is waiting for the program to call
+ *  finishIncrementalVmmCollection()
+ *
+ *  Cheap enough to call between instructions.
+ */
+int vmmGcSafepointRequested(VmMemory memory);
+
+/** Mark more of the heap for the incremental collection in progress
+ *
+ *  Marks blocks until there are none left to mark or "budgetUsec"
+ *  microseconds have passed, whichever comes first.  The collector looks
+ *  at the clock after every few hundred blocks, so it always does some
+ *  work and can run a little past the budget.  Once everything reachable
+ *  is marked, frees the unmarked blocks like collectUnreachableVmmBlocks()
+ *  does, which ends the collection.  Does nothing if there is no
+ *  incremental collection in progress.
+ *
+ *  For a concurrent collection, the mark thread does the marking, so
+ *  this only finishes the collection if the thread is done.
+ *
+ *  Returns 0 if successful or a nonzero value if the collection failed.
+ *  Use vmmIncrementalCollectionInProgress() to find out if it is over.
+ */
+int continueIncrementalVmmCollection(VmMemory memory, uint64_t budgetUsec,
+				     GcErrorHandler errorHandler,
+				     void* errorContext);
+
+/** Mark the rest of the heap for the incremental collection in progress
+ *  and free the unmarked blocks
+ *
+ *  Stops the mark thread of a concurrent collection before marking what
+ *  it has left.  Does nothing if there is no incremental collection in
+ *  progress.
+ *  Returns 0 if successful or a nonzero value if the collection failed.
+ */
+int finishIncrementalVmmCollection(VmMemory memory,
+				   GcErrorHandler errorHandler,
+				   void* errorContext);
+
+/** Collect all unreachable blocks and compact the ones that remain
+ *
+ *  Marks the reachable blocks the same way collectUnreachableVmmBlocks()
+ *  does, then copies them to the start of the heap in depth-first order
+ *  from the roots, so a function ends up next to the functions it
+ *  references, and all the free memory ends up in a single block at the
+ *  end of the heap.  Slabs don't survive compaction.  The collector
+ *  copies the cells in use like any other block.
+ *
+ *  Since the blocks move, the collector rewrites every address that
+ *  refers to one: the operands of PUSH instructions in code blocks, the
+ *  addresses and return addresses on both stacks and in the stacks saved
+ *  in VmStateBlocks, and the VM's program counter.  The collector copies
+ *  the whole memory, so all pointers into the VM memory are invalid
+ *  afterwards, just like after increaseVmmSize().  If there isn't enough
+ *  memory for the copy, the collector frees the unreachable blocks
+ *  without moving the rest, like collectUnreachableVmmBlocks().
+ *
+ *  Arguments:
+ *    memory:
+ *      The VmMemory whose unreachable blocks should be collected
+ *
+ *    callStack:
+ *      The virtual machine's call stack.
+ *
+ *    addressStack:
+ *      The virtual machine's address stack.
+ *
+ *    pc:
+ *      The VM's program counter, which the collector updates if it
+ *      points into a block that moves.  May be NULL.
+ *
+ *    errorHandler:
+ *      A function the garbage collector will call when it encounters an
+ *      error.
+ *
+ *    errorContext:
+ *      Value passed as-is to the error handler.
+ *
+ *  Returns:
+ *    0 if collection was successful or a nonzero value if it failed.
+ */
+int collectAndCompactVmmBlocks(VmMemory memory, Stack callStack,
+			       Stack addressStack, uint64_t* pc,
+			       GcErrorHandler errorHandler,
+			       void* errorContext);
+
 /** Increase the size of the memory, up to its maximum size
  *
  *  This function is typically called after an allocation on the heap fails
- *  and garbage collection fails to allocate enough memory.  Note that
- *  this function may move the VM memory around in the emulator's own heap,
- *  so all pointers into the VM memory will be invalid after this function
- *  completes if it succeeds.
+ *  and garbage collection fails to allocate enough memory.  The memory
+ *  grows in place by committing more of the address space it reserved
+ *  when it was created, so pointers into it stay valid and growing it
+ *  costs no more than the page faults on the new pages.  The mark thread
+ *  of a concurrent collection is stopped while the mark bitmaps grow and
+ *  started again afterwards.
  *
  *  Arguments:
  *    memory   The memory whose size should be increased
@@ -331,6 +724,93 @@ int collectUnreachableVmmBlocks(VmMemory memory, Stack callStack,
  */
 int increaseVmmSize(VmMemory memory);
 
+/** Return the memory in the free blocks on the heap to the system
+ *
+ *  Releases the whole pages inside each free block of 64K or more, so
+ *  they no longer count towards the process' resident set.  The blocks
+ *  stay free, and the pages come back, filled with zeros, when the
+ *  program allocates blocks on them again.  The memory doesn't shrink.
+ *  Free memory a lazy sweep hasn't swept yet isn't in a free block and
+ *  isn't released.
+ *
+ *  Returns:
+ *    The number of bytes released
+ */
+uint64_t releaseVmmFreeMemory(VmMemory memory);
+
+/** Return the number of bytes releaseVmmFreeMemory() has released, in
+ *  total.  Pages released, used again and released again count twice.
+ */
+uint64_t vmmBytesReleased(VmMemory memory);
+
+/** Number of buckets in the histogram of collection pauses */
+#define VMM_GC_PAUSE_HISTOGRAM_SIZE 24
+
+/** Statistics on the collections a VmMemory has run and on its free
+ *  blocks, from getVmmGcStats()
+ */
+typedef struct VmmGcStats_ {
+  /** Number of full collections, whichever collector ran them */
+  uint64_t numCollections;
+
+  /** Number of collections of the nursery */
+  uint64_t numNurseryCollections;
+
+  /** Time all the collections spent clearing marks, marking and
+   *  sweeping, in microseconds.  Sweeping includes the sweeps the
+   *  allocator does when sweeping lazily and the copying a compacting
+   *  collection does instead of sweeping.  Marking doesn't include what
+   *  the mark thread of a concurrent collection does while the program
+   *  runs.
+   */
+  double clearUsec;
+  double markUsec;
+  double sweepUsec;
+
+  /** Number of bytes the collections freed, headers included.  A lazy
+   *  sweep counts what isn't live when the collection starts it.
+   */
+  uint64_t bytesReclaimed;
+
+  /** Number of blocks the last full collection kept.  A lazy sweep sets
+   *  it once it has swept the whole heap.
+   */
+  uint64_t blocksKept;
+
+  /** Number of free blocks on the heap, and the size of the largest */
+  uint64_t numFreeBlocks;
+  uint64_t largestFreeBlock;
+
+  /** Fraction of the bytes in free blocks outside the largest one, from
+   *  0 when all of them are in one block to almost 1 when they are split
+   *  into many small ones
+   */
+  double fragmentation;
+
+  /** Number of times a collection stopped the program, and for how long
+   *  in total and at most, in microseconds.  Each slice of an
+   *  incremental collection is a pause of its own.
+   */
+  uint64_t numPauses;
+  double totalPauseUsec;
+  double maxPauseUsec;
+
+  /** Pauses by length.  Bucket 0 counts the pauses shorter than 2 us,
+   *  bucket i counts the ones at least 2^i us long and shorter than
+   *  2^(i+1) us, and the last bucket counts all the longer ones too.
+   */
+  uint64_t pauseHistogram[VMM_GC_PAUSE_HISTOGRAM_SIZE];
+} VmmGcStats;
+
+/** Get the statistics on the collections so far and on the free blocks
+ *  on the heap right now
+ *
+ *  The collectors count as they go.  The free blocks are counted when
+ *  this function is called, which takes time proportional to their
+ *  number.
+ */
+void getVmmGcStats(VmMemory memory, VmmGcStats* stats);
+
 /** Error codes */
 
 #ifdef __cplusplus
@@ -359,6 +839,12 @@ const int VmmNotEnoughMemoryError = -5;
  */
 const int VmmHeapInUseError = -6;
 
+/** The nursery is full and needs to be collected */
+const int VmmNurseryFullError = -7;
+
+/** The system can't back the memory with huge pages */
+const int VmmHugePagesNotSupportedError = -8;
+
 #else
 
 /** One of the arguments to a function was invalid */
@@ -385,6 +871,12 @@ const int VmmNotEnoughMemoryError;
  */
 const int VmmHeapInUseError;
 
+/** The nursery is full and needs to be collected */
+const int VmmNurseryFullError;
+
+/** The system can't back the memory with huge pages */
+const int VmmHugePagesNotSupportedError;
+
 #endif
 
 #endif
@@ -626,6 +626,46 @@ TEST(asm_tests, parseMkcInstruction) {
   EXPECT_TRUE(verifyInstrctionWithoutOperand("MKC", MKC_INSTRUCTION));
 }
 
+TEST(asm_tests, parsePushPCallInstruction) {
+  AsmParseError* parseError = NULL;
+  AssemblyLine* asml = parseAssemblyLine("push_pcall 512", 200, 4,
+					 &parseError);
+  EXPECT_TRUE(verifySuccessfulParse(asml, parseError, ASM_LINE_TYPE_INSTRUCTION,
+				    200, 4, 0, NULL));
+  if (asml) {
+    EXPECT_EQ(asml->value.instruction.opcode, PUSH_PCALL_INSTRUCTION);
+    EXPECT_EQ(asml->value.instruction.operand.type, ASM_VALUE_TYPE_UINT64);
+    EXPECT_EQ(asml->value.instruction.operand.value.u64, 512);
+  }
+  destroyAssemblyLine(asml);
+}
+
+TEST(asm_tests, parsePushPCallRetInstruction) {
+  AsmParseError* parseError = NULL;
+  AssemblyLine* asml = parseAssemblyLine("PUSH_PCALL_RET I_IMPL", 200, 4,
+					 &parseError);
+  EXPECT_TRUE(verifySuccessfulParse(asml, parseError, ASM_LINE_TYPE_INSTRUCTION,
+				    200, 4, 0, NULL));
+  if (asml) {
+    EXPECT_EQ(asml->value.instruction.opcode, PUSH_PCALL_RET_INSTRUCTION);
+    EXPECT_EQ(asml->value.instruction.operand.type,
+	      ASM_VALUE_TYPE_SYMBOL_OFFSET);
+  }
+  destroyAssemblyLine(asml);
+}
+
+TEST(asm_tests, parsePCallRetInstruction) {
+  EXPECT_TRUE(verifyInstrctionWithoutOperand("PCALL_RET",
+					     PCALL_RET_INSTRUCTION));
+}
+
+TEST(asm_tests, parsePopPushRetWithoutOperand) {
+  AsmParseError* parseError = NULL;
+  AssemblyLine* asml = parseAssemblyLine("POP_PUSH_RET", 200, 4, &parseError);
+  EXPECT_TRUE(verifyParseError(asml, parseError, 12, "Operand missing"));
+  destroyAsmParseError(parseError);
+}
+
 TEST(asm_tests, parseSaveInstruction) {
   AsmParseError* parseError = NULL;
   AssemblyLine* asml = parseAssemblyLine("SAVE 2", 200, 4, &parseError);
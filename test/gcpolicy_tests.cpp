@@ -0,0 +1,190 @@
+extern "C" {
+#include <gcpolicy.h>
+}
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <stdint.h>
+#include <thread>
+
+TEST(gcpolicy_tests, createGcPolicy) {
+  GcPolicy policy = createGcPolicy(0.25, 5.0);
+
+  ASSERT_NE(policy, (void*)0);
+  EXPECT_EQ(gcPolicyTargetLiveFraction(policy), 0.25);
+  EXPECT_EQ(gcPolicyMaxGcTimePercent(policy), 5.0);
+  EXPECT_EQ(gcPolicyAllocationBudget(policy), UINT64_MAX);
+  EXPECT_EQ(gcPolicyBytesLive(policy), 0);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 0.0);
+  EXPECT_EQ(gcPolicyNumCollections(policy), 0);
+
+  /** Before the first collection, only a failed allocation collects */
+  EXPECT_FALSE(gcPolicyShouldCollect(policy, UINT64_MAX - 1));
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, createGcPolicyWithInvalidSettings) {
+  EXPECT_EQ(createGcPolicy(0.0, 10.0), (void*)0);
+  EXPECT_EQ(createGcPolicy(1.0, 10.0), (void*)0);
+  EXPECT_EQ(createGcPolicy(0.5, 0.0), (void*)0);
+  EXPECT_EQ(createGcPolicy(0.5, 100.5), (void*)0);
+}
+
+TEST(gcpolicy_tests, changeSettings) {
+  GcPolicy policy = createGcPolicy(DEFAULT_GC_TARGET_LIVE_FRACTION,
+				   DEFAULT_GC_MAX_TIME_PERCENT);
+  ASSERT_NE(policy, (void*)0);
+
+  EXPECT_EQ(setGcPolicyTargetLiveFraction(policy, 0.75), 0);
+  EXPECT_EQ(gcPolicyTargetLiveFraction(policy), 0.75);
+  EXPECT_NE(setGcPolicyTargetLiveFraction(policy, 1.5), 0);
+  EXPECT_EQ(gcPolicyTargetLiveFraction(policy), 0.75);
+
+  EXPECT_EQ(setGcPolicyMaxGcTimePercent(policy, 100.0), 0);
+  EXPECT_EQ(gcPolicyMaxGcTimePercent(policy), 100.0);
+  EXPECT_NE(setGcPolicyMaxGcTimePercent(policy, -1.0), 0);
+  EXPECT_EQ(gcPolicyMaxGcTimePercent(policy), 100.0);
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, growHeapWhenMostOfItIsLive) {
+  GcPolicy policy = createGcPolicy(0.5, 10.0);
+  ASSERT_NE(policy, (void*)0);
+
+  /** 3/4 of a 2MB heap is live, so the heap should grow to 3MB, leaving
+   *  room for 1.5MB of allocations
+   */
+  EXPECT_EQ(recordGcPolicyCollection(policy, 2048 * 1024, 1536 * 1024,
+				     100.0, 10000.0),
+	    3072 * 1024);
+  EXPECT_EQ(gcPolicyAllocationBudget(policy), 1536 * 1024);
+  EXPECT_EQ(gcPolicyBytesLive(policy), 1536 * 1024);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 1.0);
+  EXPECT_EQ(gcPolicyNumCollections(policy), 1);
+
+  EXPECT_FALSE(gcPolicyShouldCollect(policy, 1536 * 1024 - 1));
+  EXPECT_TRUE(gcPolicyShouldCollect(policy, 1536 * 1024));
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, collectEarlyWhenLittleOfTheHeapIsLive) {
+  GcPolicy policy = createGcPolicy(0.5, 10.0);
+  ASSERT_NE(policy, (void*)0);
+
+  /** Only 1MB of a 64MB heap is live, so the heap doesn't grow, and the
+   *  next collection comes after 1MB of allocations instead of 63MB
+   */
+  EXPECT_EQ(recordGcPolicyCollection(policy, 64 * 1024 * 1024, 1024 * 1024,
+				     100.0, 10000.0),
+	    2048 * 1024);
+  EXPECT_EQ(gcPolicyAllocationBudget(policy), 1024 * 1024);
+
+  /** Almost nothing live still leaves the program room to run */
+  recordGcPolicyCollection(policy, 64 * 1024 * 1024, 1024, 100.0, 10000.0);
+  EXPECT_EQ(gcPolicyAllocationBudget(policy), MIN_GC_ALLOCATION_BUDGET);
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, growHeapWhenCollectionsTakeTooLong) {
+  GcPolicy policy = createGcPolicy(0.5, 10.0);
+  ASSERT_NE(policy, (void*)0);
+
+  /** Half the time went to the collection, so double the heap even
+   *  though only a quarter of it is live
+   */
+  EXPECT_EQ(recordGcPolicyCollection(policy, 4096 * 1024, 1024 * 1024,
+				     5000.0, 10000.0),
+	    8192 * 1024);
+  EXPECT_EQ(gcPolicyAllocationBudget(policy), 7168 * 1024);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 50.0);
+
+  /** The average of the last few windows decides, so one fast
+   *  collection isn't enough to stop the growth
+   */
+  EXPECT_EQ(recordGcPolicyCollection(policy, 8192 * 1024, 1024 * 1024,
+				     0.0, 10000.0),
+	    16384 * 1024);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 25.0);
+
+  EXPECT_EQ(recordGcPolicyCollection(policy, 16384 * 1024, 1024 * 1024,
+				     0.0, 10000.0),
+	    32768 * 1024);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 12.5);
+
+  EXPECT_EQ(recordGcPolicyCollection(policy, 32768 * 1024, 1024 * 1024,
+				     0.0, 10000.0),
+	    2048 * 1024);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 6.25);
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, measureGcTimeOverWindows) {
+  GcPolicy policy = createGcPolicy(0.5, 10.0);
+  ASSERT_NE(policy, (void*)0);
+
+  /** Collections in quick succession don't say much about how much time
+   *  the program spends collecting, so the first window isn't over yet
+   */
+  EXPECT_EQ(recordGcPolicyCollection(policy, 4096 * 1024, 1024 * 1024,
+				     90.0, 100.0),
+	    2048 * 1024);
+  EXPECT_EQ(gcPolicyGcTimePercent(policy), 0.0);
+
+  /** This one ends the window, which spent 1090 of 10100 us collecting */
+  EXPECT_EQ(recordGcPolicyCollection(policy, 4096 * 1024, 1024 * 1024,
+				     1000.0, 10000.0),
+	    8192 * 1024);
+  EXPECT_NEAR(gcPolicyGcTimePercent(policy), 10.79, 0.01);
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, leaveSuspendedTimeOutOfCollections) {
+  GcPolicy policy = createGcPolicy(0.5, 10.0);
+  ASSERT_NE(policy, (void*)0);
+
+  /** An incremental collection whose slices take almost no time, with
+   *  long stretches of the program running in between
+   */
+  startGcPolicyCollection(policy, 1024 * 1024);
+  for (int i = 0; i < 3; ++i) {
+    suspendGcPolicyCollection(policy);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    resumeGcPolicyCollection(policy);
+  }
+  finishGcPolicyCollection(policy, 4096 * 1024, 1024 * 1024);
+
+  EXPECT_EQ(gcPolicyNumCollections(policy), 1);
+  EXPECT_LT(gcPolicyGcTimePercent(policy), 10.0);
+
+  destroyGcPolicy(policy);
+}
+
+TEST(gcpolicy_tests, releaseMemoryWellBelowHighWaterMark) {
+  GcPolicy policy = createGcPolicy(0.5, 10.0);
+  ASSERT_NE(policy, (void*)0);
+  EXPECT_EQ(gcPolicyHighWaterMark(policy), 0);
+
+  startGcPolicyCollection(policy, 64 * 1024 * 1024);
+  startGcPolicyCollection(policy, 16 * 1024 * 1024);
+  EXPECT_EQ(gcPolicyHighWaterMark(policy), 64 * 1024 * 1024);
+
+  /** More than half the high-water mark is still in use */
+  EXPECT_FALSE(gcPolicyShouldReleaseMemory(policy, 40 * 1024 * 1024));
+  EXPECT_TRUE(gcPolicyShouldReleaseMemory(policy, 32 * 1024 * 1024));
+
+  resetGcPolicyHighWaterMark(policy, 32 * 1024 * 1024);
+  EXPECT_EQ(gcPolicyHighWaterMark(policy), 32 * 1024 * 1024);
+  EXPECT_FALSE(gcPolicyShouldReleaseMemory(policy, 24 * 1024 * 1024));
+
+  /** Small heaps aren't worth the trouble */
+  resetGcPolicyHighWaterMark(policy, 2 * 1024 * 1024);
+  EXPECT_FALSE(gcPolicyShouldReleaseMemory(policy, 64 * 1024));
+
+  destroyGcPolicy(policy);
+}
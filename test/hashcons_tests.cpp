@@ -0,0 +1,94 @@
+extern "C" {
+#include <hashcons.h>
+#include <vm_instructions.h>
+}
+
+#include <gtest/gtest.h>
+#include <set>
+#include <stdint.h>
+
+namespace {
+  int isInLiveSet(uint64_t address, void* live) {
+    return ((std::set<uint64_t>*)live)->count(address) > 0;
+  }
+}
+
+TEST(hashcons_tests, createHashConsTable) {
+  HashConsTable table = createHashConsTable(1000);
+
+  ASSERT_NE(table, (void*)0);
+  EXPECT_EQ(hashConsTableNumSlots(table), 1024);
+  EXPECT_EQ(hashConsTableSize(table), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 100, 0), 0);
+
+  destroyHashConsTable(table);
+
+  EXPECT_EQ(createHashConsTable(0), (void*)0);
+}
+
+TEST(hashcons_tests, addAndFindFunctions) {
+  HashConsTable table = createHashConsTable(DEFAULT_HASH_CONS_TABLE_SIZE);
+  ASSERT_NE(table, (void*)0);
+
+  addToHashConsTable(table, MKK_INSTRUCTION, 100, 0, 1000);
+  addToHashConsTable(table, MKS1_INSTRUCTION, 100, 200, 1024);
+  EXPECT_EQ(hashConsTableSize(table), 2);
+
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 100, 0), 1000);
+  EXPECT_EQ(findInHashConsTable(table, MKS1_INSTRUCTION, 100, 200), 1024);
+
+  /** The instruction and both addresses have to match */
+  EXPECT_EQ(findInHashConsTable(table, MKS0_INSTRUCTION, 100, 0), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKS1_INSTRUCTION, 200, 100), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKS1_INSTRUCTION, 100, 0), 0);
+
+  /** A function made from the same addresses replaces the old one */
+  addToHashConsTable(table, MKK_INSTRUCTION, 100, 0, 2000);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 100, 0), 2000);
+  EXPECT_EQ(hashConsTableSize(table), 2);
+
+  clearHashConsTable(table);
+  EXPECT_EQ(hashConsTableSize(table), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 100, 0), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKS1_INSTRUCTION, 100, 200), 0);
+
+  destroyHashConsTable(table);
+}
+
+TEST(hashcons_tests, evictFunctionFromItsSlot) {
+  HashConsTable table = createHashConsTable(1);
+  ASSERT_NE(table, (void*)0);
+  EXPECT_EQ(hashConsTableNumSlots(table), 1);
+
+  addToHashConsTable(table, MKK_INSTRUCTION, 100, 0, 1000);
+  addToHashConsTable(table, MKD_INSTRUCTION, 300, 0, 1024);
+  EXPECT_EQ(hashConsTableSize(table), 1);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 100, 0), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKD_INSTRUCTION, 300, 0), 1024);
+
+  destroyHashConsTable(table);
+}
+
+TEST(hashcons_tests, pruneFunctionsThatArentLive) {
+  HashConsTable table = createHashConsTable(DEFAULT_HASH_CONS_TABLE_SIZE);
+  ASSERT_NE(table, (void*)0);
+
+  for (uint64_t i = 0; i < 4; ++i) {
+    addToHashConsTable(table, MKK_INSTRUCTION, 100 + i, 0, 1000 + 100 * i);
+  }
+  ASSERT_EQ(hashConsTableSize(table), 4);
+
+  /** Only the functions in [1000, 1250) can go, and of those, the one
+   *  at 1100 is still live
+   */
+  std::set<uint64_t> live{ 1100 };
+  pruneHashConsTable(table, 1000, 1250, isInLiveSet, &live);
+
+  EXPECT_EQ(hashConsTableSize(table), 2);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 100, 0), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 101, 0), 1100);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 102, 0), 0);
+  EXPECT_EQ(findInHashConsTable(table, MKK_INSTRUCTION, 103, 0), 1300);
+
+  destroyHashConsTable(table);
+}
@@ -933,3 +933,50 @@ TEST(stack_tests, setStackDataCausingOverflow) {
 
   destroyStack(s);
 }
+
+TEST(stack_tests, setStackTop) {
+  Stack s = createStack(24, 24);
+  uint64_t* p = (uint64_t*)bottomOfStack(s);
+
+  // Write two values directly into the stack's memory, then publish them
+  p[0] = 0x0123456789ABCDEF;
+  p[1] = 0xFEDCBA9876543210;
+  EXPECT_EQ(setStackTop(s, (uint8_t*)(p + 2)), 0);
+  EXPECT_EQ(getStackStatus(s), 0);
+  EXPECT_EQ(std::string(getStackStatusMsg(s)), "OK");
+
+  EXPECT_EQ(stackSize(s), 2 * sizeof(uint64_t));
+  EXPECT_EQ(stackAllocated(s), 24);
+
+  uint64_t value = 0;
+  ASSERT_EQ(popStack(s, &value, sizeof(value)), 0);
+  EXPECT_EQ(value, 0xFEDCBA9876543210);
+  EXPECT_EQ(stackSize(s), sizeof(uint64_t));
+
+  // The top can move all the way to the end of the allocated memory
+  EXPECT_EQ(setStackTop(s, bottomOfStack(s) + 24), 0);
+  EXPECT_EQ(stackSize(s), 24);
+
+  destroyStack(s);
+}
+
+TEST(stack_tests, setStackTopOutsideStack) {
+  Stack s = createStack(24, 24);
+  uint64_t value = 0x0123456789ABCDEF;
+
+  ASSERT_EQ(pushStack(s, &value, sizeof(value)), 0);
+
+  EXPECT_NE(setStackTop(s, bottomOfStack(s) + 32), 0);
+  EXPECT_EQ(getStackStatus(s), StackInvalidArgumentError);
+  EXPECT_EQ(std::string(getStackStatusMsg(s)),
+	    "\"top\" is outside the stack");
+
+  EXPECT_NE(setStackTop(s, bottomOfStack(s) - 8), 0);
+  EXPECT_EQ(getStackStatus(s), StackInvalidArgumentError);
+
+  // Stack should not change
+  EXPECT_EQ(stackSize(s), sizeof(value));
+  EXPECT_EQ(((uint64_t*)topOfStack(s))[-1], 0x0123456789ABCDEF);
+
+  destroyStack(s);
+}
@@ -4,6 +4,7 @@ extern "C" {
 
 #include "testing_utils.hpp"
 #include <assert.h>
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 
@@ -283,19 +284,21 @@ static bool freeBlockListIsCircular(VmMemory memory) {
 	   && (addresses.size() < truth.size())) {
     uint64_t addr = vmmAddressForPtr(memory, reinterpret_cast<uint8_t*>(pb));
     addresses.push_back(addr);
-    if (pb->next) {
-      pb = reinterpret_cast<FreeBlock*>(ptrToVmMemory(memory) + pb->next);
-    } else {
-      pb = NULL;
-    }
+    pb = nextFreeBlockInVmm(memory, pb);
   }
 
-  if (addresses != truth) {
+  // The free blocks come back in order of size, not address, so compare
+  // them in address order
+  std::vector<uint64_t> sortedTruth(truth);
+  std::sort(addresses.begin(), addresses.end());
+  std::sort(sortedTruth.begin(), sortedTruth.end());
+
+  if (addresses != sortedTruth) {
     auto result = ::testing::AssertionFailure();
     result << "Free list is incorrect (";
     writeList(result, addresses, pb != NULL);
     result << " vs. ";
-    writeList(result, truth);
+    writeList(result, sortedTruth);
     result << ")";
     return result;
   }
@@ -303,8 +306,8 @@ static bool freeBlockListIsCircular(VmMemory memory) {
   if (pb != NULL) {
     uint64_t addr = vmmAddressForPtr(memory, reinterpret_cast<uint8_t*>(pb));
     return ::testing::AssertionFailure()
-      << "Free list terminated incorrectly -- \"next\" points to "
-      << addr << " instead of 0";
+      << "Free list has more blocks than expected -- next block is at "
+      << addr;
   }
     
   return ::testing::AssertionSuccess();
@@ -186,6 +186,30 @@ TEST(vm_instructions_tests, disassembleSymbolicAddressPlusOffset) {
 				DISASSEMBLY));
 }
 
+TEST(vm_instructions_tests, disassembleSuperinstructions) {
+  const uint8_t PROGRAM[] = {
+    PUSH_PCALL_INSTRUCTION, 0x1C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    PCALL_RET_INSTRUCTION,
+    PUSH_PCALL_RET_INSTRUCTION, 0x1D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    POP_PUSH_RET_INSTRUCTION, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    PCALL_INSTRUCTION,
+    RET_INSTRUCTION,
+  };
+  const Symbol SYMBOLS[] = { { "MOO", 28 }, { NULL, 0 } };
+  const char DISASSEMBLY[] =
+    // "XXXXXXXXXXXXXXXXXXXXX  XX XX XX XX XX XX XX XX XX   XXXX"
+    "                    0  11 1C 00 00 00 00 00 00 00   PUSH_PCALL MOO\n"
+    "                    9  13                           PCALL_RET\n"
+    "                   10  12 1D 00 00 00 00 00 00 00   PUSH_PCALL_RET MOO+1\n"
+    "                   19  14 00 01 00 00 00 00 00 00   POP_PUSH_RET 256\n"
+    "                                                  MOO:\n"
+    "                   28  05                           PCALL\n"
+    "                   29  06                           RET\n";
+
+  EXPECT_TRUE(verifyDisassembly(PROGRAM, sizeof(PROGRAM), SYMBOLS,
+				DISASSEMBLY));
+}
+
 TEST(vm_instructions_tests, disassemblePushArgumentInHeap) {
   const uint8_t PROGRAM[] = {
     PUSH_INSTRUCTION, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -8,6 +8,7 @@ extern "C" {
 #include <gtest/gtest.h>
 #include <testing_utils.hpp>
 #include <assert.h>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <stdint.h>
@@ -654,6 +655,76 @@ TEST(vm_tests, executePCallToInvalidAddress) {
   destroyUnlambdaVM(vm);
 }
 
+// Execute a PCALL instruction followed by a RET, which makes a tail call
+TEST(vm_tests, executePCallFollowedByReturn) {
+  static const uint8_t PROGRAM[] = { PCALL_INSTRUCTION, RET_INSTRUCTION };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+
+  Stack addressStack = getVmAddressStack(vm);
+  const uint64_t address = 512 + sizeof(HeapBlock);
+  ASSERT_EQ(pushStack(addressStack, &address, sizeof(address)), 0);
+
+  Stack callStack = getVmCallStack(vm);
+  const uint64_t frame[] = { 722, 16 };
+  ASSERT_EQ(pushStack(callStack, frame, sizeof(frame)), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+
+  // The call reuses the current frame instead of pushing a new one
+  EXPECT_EQ(getVmPC(vm), address);
+  EXPECT_EQ(stackSize(addressStack), 0);
+
+  static const uint64_t callStackData[] = { 512 + sizeof(HeapBlock), 16 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", callStack, callStackData,
+				    ARRAY_SIZE(callStackData)));
+
+  destroyUnlambdaVM(vm);
+}
+
+// A breakpoint on the RET after a PCALL keeps PCALL from making a tail call
+TEST(vm_tests, executePCallFollowedByReturnAtBreakpoint) {
+  static const uint8_t PROGRAM[] = { PCALL_INSTRUCTION, RET_INSTRUCTION };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+  BreakpointList breakpoints = createBreakpointList(4);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(breakpoints, (void*)0);
+  ASSERT_EQ(addBreakpointToList(breakpoints, 1), 0);
+  setVmBreakpointLists(vm, breakpoints, NULL);
+
+  Stack addressStack = getVmAddressStack(vm);
+  const uint64_t address = 512 + sizeof(HeapBlock);
+  ASSERT_EQ(pushStack(addressStack, &address, sizeof(address)), 0);
+
+  Stack callStack = getVmCallStack(vm);
+  const uint64_t frame[] = { 722, 16 };
+  ASSERT_EQ(pushStack(callStack, frame, sizeof(frame)), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), address);
+
+  static const uint64_t callStackData[] = {
+    722, 16, 512 + sizeof(HeapBlock), 1
+  };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", callStack, callStackData,
+				    ARRAY_SIZE(callStackData)));
+
+  setVmBreakpointLists(vm, NULL, NULL);
+  destroyBreakpointList(breakpoints);
+  destroyUnlambdaVM(vm);
+}
+
 // Execute a RET instruction
 TEST(vm_tests, executeReturnInstruction) {
   static const uint8_t PROGRAM[] = { RET_INSTRUCTION };
@@ -708,6 +779,160 @@ TEST(vm_tests, executeReturnInstructionCausingUnderflow) {
   destroyUnlambdaVM(vm);
 }
 
+// Execute a PUSH_PCALL instruction
+TEST(vm_tests, executePushPCallInstruction) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_PCALL_INSTRUCTION, 0x08, 0x02, 0, 0, 0, 0, 0, 0
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+
+  // Calls the operand without touching the address stack
+  EXPECT_EQ(getVmPC(vm), 512 + sizeof(HeapBlock));
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 0);
+
+  static const uint64_t callStackData[] = { 512 + sizeof(HeapBlock), 9 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", getVmCallStack(vm),
+				    callStackData, ARRAY_SIZE(callStackData)));
+
+  destroyUnlambdaVM(vm);
+}
+
+// Execute a PUSH_PCALL_RET instruction
+TEST(vm_tests, executePushPCallRetInstruction) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_PCALL_RET_INSTRUCTION, 0x08, 0x02, 0, 0, 0, 0, 0, 0
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+
+  Stack callStack = getVmCallStack(vm);
+  const uint64_t frame[] = { 722, 16 };
+  ASSERT_EQ(pushStack(callStack, frame, sizeof(frame)), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+
+  // Replaces the block in the current frame but keeps its return address
+  EXPECT_EQ(getVmPC(vm), 512 + sizeof(HeapBlock));
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 0);
+
+  static const uint64_t callStackData[] = { 512 + sizeof(HeapBlock), 16 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", callStack, callStackData,
+				    ARRAY_SIZE(callStackData)));
+
+  destroyUnlambdaVM(vm);
+}
+
+// Execute a PCALL_RET instruction
+TEST(vm_tests, executePCallRetInstruction) {
+  static const uint8_t PROGRAM[] = { PCALL_RET_INSTRUCTION };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+
+  Stack addressStack = getVmAddressStack(vm);
+  const uint64_t addresses[] = { 33, 512 + sizeof(HeapBlock) };
+  ASSERT_EQ(pushStack(addressStack, addresses, sizeof(addresses)), 0);
+
+  Stack callStack = getVmCallStack(vm);
+  const uint64_t frame[] = { 722, 16 };
+  ASSERT_EQ(pushStack(callStack, frame, sizeof(frame)), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+
+  EXPECT_EQ(getVmPC(vm), 512 + sizeof(HeapBlock));
+
+  static const uint64_t addressStackData[] = { 33 };
+  static const uint64_t callStackData[] = { 512 + sizeof(HeapBlock), 16 };
+  EXPECT_TRUE(unl_test::verifyStack("address stack", addressStack,
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+  EXPECT_TRUE(unl_test::verifyStack("call stack", callStack, callStackData,
+				    ARRAY_SIZE(callStackData)));
+
+  destroyUnlambdaVM(vm);
+}
+
+// Execute a PCALL_RET instruction with no frame on the call stack to reuse
+TEST(vm_tests, executePCallRetOnEmptyCallStack) {
+  static const uint8_t PROGRAM[] = { PCALL_RET_INSTRUCTION };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+
+  Stack addressStack = getVmAddressStack(vm);
+  const uint64_t address = 512 + sizeof(HeapBlock);
+  ASSERT_EQ(pushStack(addressStack, &address, sizeof(address)), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_NE(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmCallStackUnderflowError);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "Call stack underflow");
+
+  // Nothing should have changed
+  EXPECT_EQ(getVmPC(vm), 0);
+  EXPECT_EQ(stackSize(getVmCallStack(vm)), 0);
+  EXPECT_TRUE(unl_test::verifyStack("address stack", addressStack,
+				    &address, 1));
+
+  destroyUnlambdaVM(vm);
+}
+
+// Execute a POP_PUSH_RET instruction
+TEST(vm_tests, executePopPushRetInstruction) {
+  static const uint8_t PROGRAM[] = {
+    POP_PUSH_RET_INSTRUCTION, 0x08, 0x02, 0, 0, 0, 0, 0, 0
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 8, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+
+  Stack addressStack = getVmAddressStack(vm);
+  const uint64_t addresses[] = { 33, 44 };
+  ASSERT_EQ(pushStack(addressStack, addresses, sizeof(addresses)), 0);
+
+  Stack callStack = getVmCallStack(vm);
+  const uint64_t frame[] = { 722, 16 };
+  ASSERT_EQ(pushStack(callStack, frame, sizeof(frame)), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+
+  EXPECT_EQ(getVmPC(vm), 16);
+  EXPECT_EQ(stackSize(callStack), 0);
+
+  static const uint64_t addressStackData[] = { 33, 512 + sizeof(HeapBlock) };
+  EXPECT_TRUE(unl_test::verifyStack("address stack", addressStack,
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+
+  destroyUnlambdaVM(vm);
+}
+
 // Execute an MKK instruction
 TEST(vm_tests, executeMkkInstruction) {
   static const uint8_t PROGRAM[] = { MKK_INSTRUCTION };
@@ -745,11 +970,10 @@ TEST(vm_tests, executeMkkInstruction) {
 			     getVmmHeapStart(memory)) + sizeof(HeapBlock));
 
   uint8_t mkkByteCode[] = {
-    PCALL_INSTRUCTION, POP_INSTRUCTION,
-    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
-    RET_INSTRUCTION
+    PCALL_INSTRUCTION,
+    POP_PUSH_RET_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0
   };
-  *(uint64_t*)(mkkByteCode + 3) = address;
+  *(uint64_t*)(mkkByteCode + 2) = address;
   ASSERT_TRUE(unl_test::verifyProgram(
     "MKK-generated code", ptrToVmmAddress(memory, addrStackTop[-1]),
     mkkByteCode, sizeof(mkkByteCode)
@@ -956,8 +1180,8 @@ TEST(vm_tests, executeMks1Instruction) {
     PCALL_INSTRUCTION, DUP_INSTRUCTION,
     PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
     MKS2_INSTRUCTION, SWAP_INSTRUCTION,
-    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
-    PCALL_INSTRUCTION, PCALL_INSTRUCTION, RET_INSTRUCTION
+    PUSH_PCALL_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+    PCALL_RET_INSTRUCTION
   };
   *(uint64_t*)(mks1ByteCode + 3) = arg2;
   *(uint64_t*)(mks1ByteCode + 14) = arg1;
@@ -968,13 +1192,13 @@ TEST(vm_tests, executeMks1Instruction) {
 
   // Verify heap structure
   static const std::vector<unl_test::BlockSpec> trueHeapStructure{
-    unl_test::BlockSpec(VmmCodeBlockType, 32, 8),
-    unl_test::BlockSpec(VmmFreeBlockType, 1024 - 48 - 8, 48)
+    unl_test::BlockSpec(VmmCodeBlockType, 24, 8),
+    unl_test::BlockSpec(VmmFreeBlockType, 1024 - 40 - 8, 40)
   };
-  static const std::vector<uint64_t> trueFreeBlocks{ 48 };
+  static const std::vector<uint64_t> trueFreeBlocks{ 40 };
 
   EXPECT_EQ(vmmHeapSize(memory), 1024 - 8);
-  EXPECT_EQ(vmmBytesFree(memory), 1024 - 48 - 8);
+  EXPECT_EQ(vmmBytesFree(memory), 1024 - 40 - 8);
   EXPECT_EQ(vmmAddressForPtr(memory, getVmmHeapStart(memory)), 8);
   EXPECT_TRUE(unl_test::verifyBlockStructure(memory, trueHeapStructure));
   EXPECT_TRUE(unl_test::verifyFreeBlockList(memory, trueFreeBlocks));
@@ -1104,8 +1328,7 @@ TEST(vm_tests, executeMks2Instruction) {
 
   uint8_t mks2ByteCode[] = {
     PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
-    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
-    PCALL_INSTRUCTION, RET_INSTRUCTION
+    PUSH_PCALL_RET_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0
   };
   *(uint64_t*)(mks2ByteCode + 1) = arg2;
   *(uint64_t*)(mks2ByteCode + 10) = arg1;
@@ -1249,11 +1472,10 @@ TEST(vm_tests, executeMkdInstruction) {
 			     getVmmHeapStart(memory)) + sizeof(HeapBlock));
 
   uint8_t mkdByteCode[] = {
-    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+    PUSH_PCALL_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+    SWAP_INSTRUCTION,
     PCALL_INSTRUCTION, SWAP_INSTRUCTION,
-    PCALL_INSTRUCTION, SWAP_INSTRUCTION,
-    PCALL_INSTRUCTION,
-    RET_INSTRUCTION
+    PCALL_RET_INSTRUCTION
   };
   *(uint64_t*)(mkdByteCode + 1) = arg;
   ASSERT_TRUE(unl_test::verifyProgram(
@@ -2330,6 +2552,72 @@ TEST(vm_tests, executeMks2ForcingGarbageCollection) {
   destroyUnlambdaVM(vm);
 }
 
+// Execute a MKS2 instruction forcing a compacting garbage collection
+TEST(vm_tests, executeMks2ForcingCompactingCollection) {
+  static const uint8_t PROGRAM[] = { MKS2_INSTRUCTION };
+  UnlambdaVM vm = createUnlambdaVMWithGc(16, 8, 1024, 4096, VmGcCompacting);
+
+  ASSERT_NE(vm, (void*)0);
+  EXPECT_EQ(getVmGcMode(vm), VmGcCompacting);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  // Same heap as executeMks2ForcingGarbageCollection, but the collector
+  // moves the fourth block and then the first to the start of the heap,
+  // since the fourth block is at the bottom of the address stack.
+  std::vector<unl_test::BlockSpec> blockStructure{
+    unl_test::BlockSpec(VmmCodeBlockType, 64),
+    unl_test::BlockSpec(VmmCodeBlockType, 400),
+    unl_test::BlockSpec(VmmCodeBlockType, 392),
+    unl_test::BlockSpec(VmmCodeBlockType, 128),
+  };
+
+  VmMemory memory = getVmMemory(vm);
+  layoutBlocks(memory, blockStructure);
+  unl_test::fillBlock(memory, blockStructure[0].address,
+		      blockStructure[0].blockSize, HALT_INSTRUCTION);
+  unl_test::fillBlock(memory, blockStructure[3].address,
+		      blockStructure[3].blockSize, HALT_INSTRUCTION);
+
+  Stack addressStack = getVmAddressStack(vm);
+  const uint64_t arg1 = blockStructure[0].address + sizeof(HeapBlock);
+  const uint64_t arg2 = blockStructure[3].address + sizeof(HeapBlock);
+  ASSERT_EQ(pushStack(addressStack, &arg2, sizeof(arg2)), 0);
+  ASSERT_EQ(pushStack(addressStack, &arg1, sizeof(arg1)), 0);
+
+  EXPECT_EQ(stepVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+  EXPECT_EQ(getVmPC(vm), 1);
+
+  static const std::vector<unl_test::BlockSpec> trueHeapStructure{
+    unl_test::BlockSpec(VmmCodeBlockType, 128, 8),
+    unl_test::BlockSpec(VmmCodeBlockType, 64, 144),
+    unl_test::BlockSpec(VmmCodeBlockType, 24, 216),
+    unl_test::BlockSpec(VmmFreeBlockType, 768, 248),
+  };
+  static const std::vector<uint64_t> trueFreeBlocks{ 248 };
+
+  EXPECT_TRUE(unl_test::verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(unl_test::verifyFreeBlockList(memory, trueFreeBlocks));
+  EXPECT_EQ(vmmBytesFree(memory), 768);
+
+  // The new function references the arguments at their new addresses
+  ASSERT_EQ(stackSize(addressStack), 8);
+  uint64_t* addressStackTop =
+    reinterpret_cast<uint64_t*>(topOfStack(addressStack));
+  EXPECT_EQ(addressStackTop[-1], 224);
+
+  const uint8_t* code = ptrToVmmAddress(memory, 224);
+  EXPECT_EQ(code[0], PUSH_INSTRUCTION);
+  EXPECT_EQ(*(const uint64_t*)(code + 1), 16);
+  EXPECT_EQ(code[9], PUSH_PCALL_RET_INSTRUCTION);
+  EXPECT_EQ(*(const uint64_t*)(code + 10), 152);
+
+  destroyUnlambdaVM(vm);
+}
+
 // Execute a MKS2 instruction forcing an increase in the size of the VM's memory
 TEST(vm_tests, executeMks2ForcingMemoryIncrease) {
   static const uint8_t PROGRAM[] = { MKS2_INSTRUCTION };
@@ -2471,7 +2759,7 @@ TEST(vm_tests, executeMks2ExceedingMaxSize) {
   EXPECT_NE(stepVm(vm), 0);
   EXPECT_EQ(getVmStatus(vm), VmOutOfMemoryError);
   EXPECT_EQ(std::string(getVmStatusMsg(vm)),
-	    "Could not allocate block of size 20 for MKS2 (Maximum memory "
+	    "Could not allocate block of size 18 for MKS2 (Maximum memory "
 	    "size exceeded)");
 
   EXPECT_EQ(getVmPC(vm), 0);
@@ -2771,3 +3059,1359 @@ TEST(vm_tests, executeSaveExceedingMaximumMemorySize) {
 
 // TODO:  Write a test that requires more than one increase in the VM memory
 //        size to accomodate a large state block or run out of memory.
+
+// Run "vm" one instruction at a time with stepVm() until it stops
+static void stepVmUntilStopped(UnlambdaVM vm) {
+  while (!stepVm(vm)) {
+    // Keep going
+  }
+}
+
+// Verify two VMs are in exactly the same state
+static void verifySameVmState(UnlambdaVM vm, UnlambdaVM trueVm) {
+  EXPECT_EQ(getVmStatus(vm), getVmStatus(trueVm));
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)),
+	    std::string(getVmStatusMsg(trueVm)));
+  EXPECT_EQ(getVmPC(vm), getVmPC(trueVm));
+
+  Stack callStack = getVmCallStack(vm);
+  Stack trueCallStack = getVmCallStack(trueVm);
+  ASSERT_EQ(stackSize(callStack), stackSize(trueCallStack));
+  EXPECT_FALSE(memcmp(bottomOfStack(callStack), bottomOfStack(trueCallStack),
+		      stackSize(callStack)));
+
+  Stack addressStack = getVmAddressStack(vm);
+  Stack trueAddressStack = getVmAddressStack(trueVm);
+  ASSERT_EQ(stackSize(addressStack), stackSize(trueAddressStack));
+  EXPECT_FALSE(memcmp(bottomOfStack(addressStack),
+		      bottomOfStack(trueAddressStack),
+		      stackSize(addressStack)));
+
+  VmMemory memory = getVmMemory(vm);
+  VmMemory trueMemory = getVmMemory(trueVm);
+  ASSERT_EQ(currentVmmSize(memory), currentVmmSize(trueMemory));
+  EXPECT_EQ(vmmBytesFree(memory), vmmBytesFree(trueMemory));
+
+  // The contents of free blocks are undefined, so compare the program area
+  // and the headers and content of allocated blocks only
+  ASSERT_EQ(getVmmProgramMemorySize(memory),
+	    getVmmProgramMemorySize(trueMemory));
+  EXPECT_FALSE(memcmp(ptrToVmMemory(memory), ptrToVmMemory(trueMemory),
+		      getVmmProgramMemorySize(memory)));
+
+  HeapBlock* block = firstHeapBlockInVmm(memory);
+  HeapBlock* trueBlock = firstHeapBlockInVmm(trueMemory);
+  while (block && trueBlock) {
+    const uint64_t address = vmmAddressForPtr(memory, (uint8_t*)block);
+    ASSERT_EQ(address, vmmAddressForPtr(trueMemory, (uint8_t*)trueBlock));
+    ASSERT_EQ(getVmmBlockType(block), getVmmBlockType(trueBlock))
+      << "Block at " << address << " has the wrong type";
+    ASSERT_EQ(getVmmBlockSize(block), getVmmBlockSize(trueBlock))
+      << "Block at " << address << " has the wrong size";
+    if (getVmmBlockType(block) != VmmFreeBlockType) {
+      EXPECT_FALSE(memcmp(block, trueBlock, getVmmBlockSize(block)))
+	<< "Block at " << address << " has the wrong content";
+    }
+    block = nextHeapBlockInVmm(memory, block);
+    trueBlock = nextHeapBlockInVmm(trueMemory, trueBlock);
+  }
+  EXPECT_EQ(block, (HeapBlock*)0);
+  EXPECT_EQ(trueBlock, (HeapBlock*)0);
+}
+
+// Run a program that creates and calls functions until it halts
+TEST(vm_tests, runVmUntilHalt) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 64, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH EZ
+    PUSH_INSTRUCTION, 54, 0, 0, 0, 0, 0, 0, 0,  //  9: PUSH EYI
+    PUSH_INSTRUCTION, 74, 0, 0, 0, 0, 0, 0, 0,  // 18: PUSH I_IMPL
+    MKS0_INSTRUCTION,                           // 27
+    PCALL_INSTRUCTION,                          // 28: ``s i EYI
+    PCALL_INSTRUCTION,                          // 29: ```s i EYI EZ
+    POP_INSTRUCTION,                            // 30
+    PUSH_INSTRUCTION, 54, 0, 0, 0, 0, 0, 0, 0,  // 31: PUSH EYI
+    PUSH_INSTRUCTION, 74, 0, 0, 0, 0, 0, 0, 0,  // 40: PUSH I_IMPL
+    MKK_INSTRUCTION,                            // 49
+    PCALL_INSTRUCTION,                          // 50: ``k i EYI
+    DUP_INSTRUCTION,                            // 51
+    SWAP_INSTRUCTION,                           // 52
+    HALT_INSTRUCTION,                           // 53
+    PUSH_INSTRUCTION, 74, 0, 0, 0, 0, 0, 0, 0,  // 54: EYI
+    RET_INSTRUCTION,                            // 63
+    PUSH_INSTRUCTION, 54, 0, 0, 0, 0, 0, 0, 0,  // 64: EZ
+    RET_INSTRUCTION,                            // 73
+    PCALL_INSTRUCTION,                          // 74: I_IMPL
+    RET_INSTRUCTION,                            // 75
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "VM halted");
+  EXPECT_EQ(getVmPC(vm), 53);
+
+  static const uint64_t addressStackData[] = { 74, 74 };
+  EXPECT_TRUE(unl_test::verifyStack("address stack", getVmAddressStack(vm),
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+  EXPECT_EQ(stackSize(getVmCallStack(vm)), 0);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  // Running a halted VM just reports that it has halted
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 53);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Run a program that stops because it calls an invalid address
+TEST(vm_tests, runVmUntilError) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH 11
+    PCALL_INSTRUCTION,                          //  9
+    HALT_INSTRUCTION,                           // 10
+    PUSH_INSTRUCTION, 0, 0x20, 0, 0, 0, 0, 0, 0,  // 11: PUSH 0x2000
+    PCALL_INSTRUCTION,                          // 20
+    RET_INSTRUCTION,                            // 21
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmIllegalAddressError);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)),
+	    "PCALL to invalid address 0x2000");
+  EXPECT_EQ(getVmPC(vm), 20);
+
+  static const uint64_t callStackData[] = { 11, 10 };
+  static const uint64_t addressStackData[] = { 0x2000 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", getVmCallStack(vm),
+				    callStackData, ARRAY_SIZE(callStackData)));
+  EXPECT_TRUE(unl_test::verifyStack("address stack", getVmAddressStack(vm),
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Run a program that has to grow both stacks and the VM's memory
+TEST(vm_tests, runVmGrowingStacksAndMemory) {
+  std::vector<uint8_t> program{
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0
+  };
+  for (int i = 0; i < 20; ++i) {
+    program.push_back(MKK_INSTRUCTION);
+  }
+  for (int i = 0; i < 1500; ++i) {
+    program.push_back(DUP_INSTRUCTION);
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  // Leave only 256 bytes for the heap, which isn't enough for 20 functions
+  UnlambdaVM vm = createUnlambdaVM(16, 2048, 1792, 8192);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 2048, 1792, 8192);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program.data(),
+				    program.size()), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", program.data(),
+				    program.size()), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), program.size() - 1);
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 1501 * 8);
+  EXPECT_GT(currentVmmSize(getVmMemory(vm)), 1792);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Run a program that fills the heap with a compacting collector
+TEST(vm_tests, runVmWithCompactingCollector) {
+  std::vector<uint8_t> program{
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+    DUP_INSTRUCTION, MKK_INSTRUCTION, POP_INSTRUCTION,
+    DUP_INSTRUCTION, MKK_INSTRUCTION
+  };
+  // All the functions but the second become garbage almost immediately,
+  // so the first collection moves the second to the start of the heap
+  for (int i = 0; i < 40; ++i) {
+    program.push_back(DUP_INSTRUCTION);
+    program.push_back(MKK_INSTRUCTION);
+    program.push_back(MKK_INSTRUCTION);
+    program.push_back(POP_INSTRUCTION);
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  UnlambdaVM vm = createUnlambdaVMWithGc(16, 16, 512, 512, VmGcCompacting);
+  UnlambdaVM trueVm = createUnlambdaVMWithGc(16, 16, 512, 512,
+					     VmGcCompacting);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program.data(),
+				    program.size()), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", program.data(),
+				    program.size()), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), program.size() - 1);
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 16);
+  VmMemory memory = getVmMemory(vm);
+  const uint64_t heapStart = vmmAddressForPtr(memory,
+					      getVmmHeapStart(memory));
+  EXPECT_EQ(((uint64_t*)topOfStack(getVmAddressStack(vm)))[-1],
+	    heapStart + sizeof(HeapBlock));
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Run a program that fills the heap with garbage many times over with the
+// incremental collector
+TEST(vm_tests, runVmWithIncrementalCollector) {
+  std::vector<uint8_t> program{
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+    DUP_INSTRUCTION, MKK_INSTRUCTION
+  };
+  for (int i = 0; i < 100; ++i) {
+    program.push_back(DUP_INSTRUCTION);
+    program.push_back(MKK_INSTRUCTION);
+    program.push_back(MKK_INSTRUCTION);
+    program.push_back(POP_INSTRUCTION);
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  UnlambdaVM vm = createUnlambdaVMWithGc(16, 16, 2048, 2048,
+					 VmGcIncremental);
+  UnlambdaVM trueVm = createUnlambdaVMWithGc(16, 16, 2048, 2048,
+					     VmGcIncremental);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  EXPECT_EQ(getVmGcMode(vm), VmGcIncremental);
+  setVmGcSliceBudget(vm, 0);
+  setVmGcSliceBudget(trueVm, 0);
+  EXPECT_EQ(getVmGcSliceBudget(vm), 0);
+
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program.data(),
+				    program.size()), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", program.data(),
+				    program.size()), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), program.size() - 1);
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 16);
+
+  // The function the program made first is still on the stack
+  const uint64_t first = ((uint64_t*)topOfStack(getVmAddressStack(vm)))[-1];
+  const HeapBlock* const block =
+    (const HeapBlock*)ptrToVmAddress(vm, first - sizeof(HeapBlock));
+  ASSERT_NE(block, (void*)0);
+  EXPECT_EQ(getVmmBlockType(block), VmmCodeBlockType);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// When the collector's thread finishes marking depends on how the threads
+// are scheduled, so the heap can't be compared with another VM's
+TEST(vm_tests, runVmWithConcurrentCollector) {
+  std::vector<uint8_t> program{
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+    DUP_INSTRUCTION, MKK_INSTRUCTION
+  };
+  for (int i = 0; i < 300; ++i) {
+    program.push_back(DUP_INSTRUCTION);
+    program.push_back(MKK_INSTRUCTION);
+    program.push_back(MKK_INSTRUCTION);
+    program.push_back(POP_INSTRUCTION);
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  UnlambdaVM vm = createUnlambdaVMWithGc(16, 16, 4096, 4096,
+					 VmGcConcurrent);
+
+  ASSERT_NE(vm, (void*)0);
+  EXPECT_EQ(getVmGcMode(vm), VmGcConcurrent);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program.data(),
+				    program.size()), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), program.size() - 1);
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 16);
+
+  // The function the program made first is still on the stack
+  const uint64_t first = ((uint64_t*)topOfStack(getVmAddressStack(vm)))[-1];
+  const HeapBlock* const block =
+    (const HeapBlock*)ptrToVmAddress(vm, first - sizeof(HeapBlock));
+  ASSERT_NE(block, (void*)0);
+  EXPECT_EQ(getVmmBlockType(block), VmmCodeBlockType);
+
+  destroyUnlambdaVM(vm);
+}
+
+// MKK and MKS1 share the functions they already created from the same
+// addresses
+TEST(vm_tests, runVmWithHashConsing) {
+  std::vector<uint8_t> program;
+  for (int i = 0; i < 10; ++i) {
+    program.insert(program.end(), {
+      PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+      MKK_INSTRUCTION,
+      PUSH_INSTRUCTION, 9, 0, 0, 0, 0, 0, 0, 0,
+      PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+      MKS1_INSTRUCTION
+    });
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  UnlambdaVM vm = createUnlambdaVM(16, 32, 4096, 4096);
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_EQ(enableVmHashConsing(vm, 64), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program.data(),
+				    program.size()), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  ASSERT_EQ(stackSize(getVmAddressStack(vm)), 20 * 8);
+
+  const uint64_t* const stack =
+    (const uint64_t*)bottomOfStack(getVmAddressStack(vm));
+  const CodeBlock* const k = (const CodeBlock*)ptrToVmAddress(
+    vm, stack[0] - sizeof(HeapBlock)
+  );
+  const CodeBlock* const s1 = (const CodeBlock*)ptrToVmAddress(
+    vm, stack[1] - sizeof(HeapBlock)
+  );
+  ASSERT_NE(k, (void*)0);
+  ASSERT_NE(s1, (void*)0);
+  EXPECT_NE(stack[0], stack[1]);
+  EXPECT_EQ(k->code[1], POP_PUSH_RET_INSTRUCTION);
+  EXPECT_EQ(s1->code[11], MKS2_INSTRUCTION);
+  for (int i = 1; i < 10; ++i) {
+    EXPECT_EQ(stack[2 * i], stack[0]);
+    EXPECT_EQ(stack[2 * i + 1], stack[1]);
+  }
+
+  VmHashConsStats stats;
+  getVmHashConsStats(vm, &stats);
+  EXPECT_EQ(stats.lookups, 20);
+  EXPECT_EQ(stats.hits, 18);
+  EXPECT_EQ(stats.tableSize, 2);
+
+  // Disabling hash-consing throws the table away
+  disableVmHashConsing(vm);
+  getVmHashConsStats(vm, &stats);
+  EXPECT_EQ(stats.tableSize, 0);
+
+  destroyUnlambdaVM(vm);
+}
+
+// The collectors remove the functions they free from the table of
+// functions to share, so the program never gets one that was freed
+TEST(vm_tests, runVmWithHashConsingAndCollections) {
+  static const int CHAIN_LENGTH = 20;
+  static const int NUM_ROUNDS = 30;
+
+  // Build the chain K(K(...K(0)...)) over and over, dropping it and
+  // making garbage in between, so the collectors free the chain and the
+  // next round has to build it again
+  std::vector<uint8_t> program{ PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0 };
+  for (int round = 0; round < NUM_ROUNDS; ++round) {
+    program.insert(program.end(), CHAIN_LENGTH, MKK_INSTRUCTION);
+    if (round < (NUM_ROUNDS - 1)) {
+      program.insert(program.end(), {
+        SAVE_INSTRUCTION, 0, POP_INSTRUCTION, POP_INSTRUCTION,
+	PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0
+      });
+    }
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  for (int gcMode : { VmGcMarkSweep, VmGcCompacting, VmGcIncremental,
+		      VmGcConcurrent }) {
+    UnlambdaVM vm = createUnlambdaVMWithGc(16, 16, 4096, 4096, gcMode);
+    ASSERT_NE(vm, (void*)0);
+    ASSERT_EQ(enableVmHashConsing(vm, 64), 0);
+    ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program.data(),
+				      program.size()), 0);
+
+    EXPECT_NE(runVm(vm), 0);
+    EXPECT_EQ(getVmStatus(vm), VmHalted);
+    ASSERT_EQ(stackSize(getVmAddressStack(vm)), 8);
+
+    // Every link in the chain is still a live function
+    uint64_t address = ((uint64_t*)topOfStack(getVmAddressStack(vm)))[-1];
+    for (int i = 0; i < CHAIN_LENGTH; ++i) {
+      const CodeBlock* const f = (const CodeBlock*)ptrToVmAddress(
+	vm, address - sizeof(HeapBlock)
+      );
+      ASSERT_NE(f, (void*)0);
+      ASSERT_EQ(getVmmBlockType(&f->header), VmmCodeBlockType);
+      ASSERT_EQ(f->code[0], PCALL_INSTRUCTION);
+      ASSERT_EQ(f->code[1], POP_PUSH_RET_INSTRUCTION);
+      address = *(const uint64_t*)(f->code + 2);
+    }
+    EXPECT_EQ(address, 0);
+
+    VmHashConsStats stats;
+    getVmHashConsStats(vm, &stats);
+    EXPECT_EQ(stats.lookups, CHAIN_LENGTH * NUM_ROUNDS);
+    EXPECT_GT(stats.hits, 0);
+
+    destroyUnlambdaVM(vm);
+  }
+}
+
+// Run a program for a limited number of instructions
+TEST(vm_tests, runVmUntilInstructionLimit) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 12, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH 12
+    PCALL_INSTRUCTION,                          //  9
+    POP_INSTRUCTION,                            // 10
+    HALT_INSTRUCTION,                           // 11
+    PUSH_INSTRUCTION, 20, 0, 0, 0, 0, 0, 0, 0,  // 12: PUSH 20
+    RET_INSTRUCTION,                            // 21
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(runVmUntil(vm, 3, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+  EXPECT_EQ(getVmPC(vm), 21);
+
+  static const uint64_t callStackData[] = { 12, 10 };
+  static const uint64_t addressStackData[] = { 20 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", getVmCallStack(vm),
+				    callStackData, ARRAY_SIZE(callStackData)));
+  EXPECT_TRUE(unl_test::verifyStack("address stack", getVmAddressStack(vm),
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+
+  EXPECT_EQ(runVmUntil(vm, 1, 0), 0);
+  EXPECT_EQ(getVmPC(vm), 10);
+  EXPECT_EQ(stackSize(getVmCallStack(vm)), 0);
+
+  // Not enough instructions left to use up the budget
+  EXPECT_NE(runVmUntil(vm, 100, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 11);
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 0);
+
+  destroyUnlambdaVM(vm);
+}
+
+// Call into the middle of an instruction
+TEST(vm_tests, runVmJumpingIntoInstructionOperands) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,   //  0: PUSH 0
+    PUSH_INSTRUCTION, 21, 0, 0, 0, 0, 0, 0, 0,  //  9: PUSH 21
+    PCALL_INSTRUCTION,                          // 18
+    HALT_INSTRUCTION,                           // 19
+    PUSH_INSTRUCTION, DUP_INSTRUCTION,          // 20: PUSH 0x0604
+    RET_INSTRUCTION, 0, 0, 0, 0, 0, 0,
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  // 21 is the DUP in the operand of the PUSH at 20
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 19);
+
+  static const uint64_t addressStackData[] = { 0, 0 };
+  EXPECT_TRUE(unl_test::verifyStack("address stack", getVmAddressStack(vm),
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Run a program that uses all of the superinstructions
+TEST(vm_tests, runVmWithSuperinstructions) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_PCALL_INSTRUCTION, 10, 0, 0, 0, 0, 0, 0, 0,      //  0: Call 10
+    HALT_INSTRUCTION,                                     //  9
+    PUSH_PCALL_RET_INSTRUCTION, 19, 0, 0, 0, 0, 0, 0, 0,  // 10: Jump to 19
+    PUSH_INSTRUCTION, 30, 0, 0, 0, 0, 0, 0, 0,            // 19: PUSH 30
+    PUSH_INSTRUCTION, 38, 0, 0, 0, 0, 0, 0, 0,            // 28: PUSH 38
+    PCALL_RET_INSTRUCTION,                                // 37: Jump to 38
+    POP_PUSH_RET_INSTRUCTION, 77, 0, 0, 0, 0, 0, 0, 0,    // 38: Return 77
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 9);
+
+  // Both jumps reused the frame pushed by the call at 0, so POP_PUSH_RET
+  // returned straight to 9
+  static const uint64_t addressStackData[] = { 77 };
+  EXPECT_TRUE(unl_test::verifyStack("address stack", getVmAddressStack(vm),
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+  EXPECT_EQ(stackSize(getVmCallStack(vm)), 0);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Run a loop that calls itself in tail position far more times than the
+// call stack could hold frames for
+TEST(vm_tests, runVmTailCallLoop) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH LOOP
+    PCALL_INSTRUCTION,                          //  9
+    HALT_INSTRUCTION,                           // 10
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  // 11: LOOP: PUSH LOOP
+    PCALL_INSTRUCTION,                          // 20
+    RET_INSTRUCTION,                            // 21
+  };
+  UnlambdaVM vm = createUnlambdaVM(4, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(4, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(runVmUntil(vm, 10000, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(std::string(getVmStatusMsg(vm)), "OK");
+  EXPECT_EQ(getVmPC(vm), 11);
+
+  static const uint64_t callStackData[] = { 11, 10 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", getVmCallStack(vm),
+				    callStackData, ARRAY_SIZE(callStackData)));
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 0);
+
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(stepVm(trueVm), 0);
+  }
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Applies k, v, d, .x, s and i to constant functions, the way compiled
+// code does.  Every primitive's body is one intrinsics replace.
+static const uint8_t PRIMITIVES_PROGRAM[] = {
+  PUSH_INSTRUCTION, 152, 0, 0, 0, 0, 0, 0, 0,  //   0: PUSH TI
+  PUSH_INSTRUCTION, 126, 0, 0, 0, 0, 0, 0, 0,  //   9: PUSH K
+  PCALL_INSTRUCTION,                           //  18: `ki
+  PUSH_INSTRUCTION, 162, 0, 0, 0, 0, 0, 0, 0,  //  19: PUSH TV
+  SWAP_INSTRUCTION,                            //  28
+  PCALL_INSTRUCTION,                           //  29: ``kiv
+  PUSH_INSTRUCTION, 152, 0, 0, 0, 0, 0, 0, 0,  //  30: PUSH TI
+  PUSH_INSTRUCTION, 134, 0, 0, 0, 0, 0, 0, 0,  //  39: PUSH V
+  PCALL_INSTRUCTION,                           //  48: `vi
+  PUSH_INSTRUCTION, 152, 0, 0, 0, 0, 0, 0, 0,  //  49: PUSH TI
+  PUSH_INSTRUCTION, 146, 0, 0, 0, 0, 0, 0, 0,  //  58: PUSH D
+  PCALL_INSTRUCTION,                           //  67: `di
+  PUSH_INSTRUCTION, 162, 0, 0, 0, 0, 0, 0, 0,  //  68: PUSH TV
+  PUSH_INSTRUCTION, 148, 0, 0, 0, 0, 0, 0, 0,  //  77: PUSH PX
+  PCALL_INSTRUCTION,                           //  86: `.xv
+  PUSH_INSTRUCTION, 152, 0, 0, 0, 0, 0, 0, 0,  //  87: PUSH TI
+  PUSH_INSTRUCTION, 129, 0, 0, 0, 0, 0, 0, 0,  //  96: PUSH S
+  PCALL_INSTRUCTION,                           // 105: `si
+  PUSH_INSTRUCTION, 162, 0, 0, 0, 0, 0, 0, 0,  // 106: PUSH TV
+  PUSH_INSTRUCTION, 132, 0, 0, 0, 0, 0, 0, 0,  // 115: PUSH I
+  PCALL_INSTRUCTION,                           // 124: `iv
+  HALT_INSTRUCTION,                            // 125
+  PCALL_INSTRUCTION,                           // 126: K
+  MKK_INSTRUCTION,                             // 127
+  RET_INSTRUCTION,                             // 128
+  PCALL_INSTRUCTION,                           // 129: S
+  MKS0_INSTRUCTION,                            // 130
+  RET_INSTRUCTION,                             // 131
+  PCALL_INSTRUCTION,                           // 132: I
+  RET_INSTRUCTION,                             // 133
+  PCALL_INSTRUCTION,                           // 134: V
+  POP_INSTRUCTION,                             // 135
+  PUSH_INSTRUCTION, 134, 0, 0, 0, 0, 0, 0, 0,  // 136: PUSH V
+  RET_INSTRUCTION,                             // 145
+  MKD_INSTRUCTION,                             // 146: D
+  RET_INSTRUCTION,                             // 147
+  PCALL_INSTRUCTION,                           // 148: PX
+  PRINT_INSTRUCTION, 'x',                      // 149
+  RET_INSTRUCTION,                             // 151
+  PUSH_INSTRUCTION, 132, 0, 0, 0, 0, 0, 0, 0,  // 152: TI: PUSH I
+  RET_INSTRUCTION,                             // 161
+  PUSH_INSTRUCTION, 134, 0, 0, 0, 0, 0, 0, 0,  // 162: TV: PUSH V
+  RET_INSTRUCTION,                             // 171
+};
+
+// Run a program that applies each of the primitives once
+TEST(vm_tests, runVmWithIntrinsics) {
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program",
+				    PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 125);
+
+  // Every primitive evaluated its argument natively except `kiv, whose
+  // argument was evaluated by code on the heap.  v and .x also returned
+  // natively, while k, s and d built their closures with MK*.
+  VmIntrinsicStats stats;
+  getVmIntrinsicStats(vm, &stats);
+  EXPECT_EQ(stats.intrinsicsExecuted, 7);
+  EXPECT_EQ(stats.instructionsReplaced, 20);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  getVmIntrinsicStats(trueVm, &stats);
+  EXPECT_EQ(stats.intrinsicsExecuted, 0);
+  EXPECT_EQ(stats.instructionsReplaced, 0);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+TEST(vm_tests, runVmWithIntrinsicsDisabled) {
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program",
+				    PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+
+  // Disabling intrinsics after runThreadedCode() has found them has to
+  // take them out again
+  EXPECT_EQ(runVmUntil(vm, 1, 0), 0);
+  ASSERT_EQ(stepVm(trueVm), 0);
+  setVmIntrinsicsEnabled(vm, 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+
+  VmIntrinsicStats stats;
+  getVmIntrinsicStats(vm, &stats);
+  EXPECT_EQ(stats.intrinsicsExecuted, 0);
+  EXPECT_EQ(stats.instructionsReplaced, 0);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Intrinsics count as all the instructions they replace, so they can't
+// run past the instruction limit
+TEST(vm_tests, runVmWithIntrinsicsUntilInstructionLimit) {
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program",
+				    PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+
+  for (uint64_t n = 1; !stepVm(trueVm); ++n) {
+    UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+
+    ASSERT_NE(vm, (void*)0);
+    ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				      sizeof(PRIMITIVES_PROGRAM)), 0);
+    EXPECT_EQ(runVmUntil(vm, n, 0), 0) << "Failed after " << n
+				       << " instructions";
+    verifySameVmState(vm, trueVm);
+    destroyUnlambdaVM(vm);
+  }
+
+  destroyUnlambdaVM(trueVm);
+}
+
+// c's body makes the continuation with SAVE 1; MKC; SWAP, which runs as
+// ordinary instructions
+TEST(vm_tests, runVmWithCallWithContinuation) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 7, 0, 0, 0, 0, 0, 0, 0,   //  0: PUSH 7
+    PUSH_INSTRUCTION, 20, 0, 0, 0, 0, 0, 0, 0,  //  9: PUSH C
+    PCALL_INSTRUCTION,                          // 18
+    HALT_INSTRUCTION,                           // 19
+    SAVE_INSTRUCTION, 1,                        // 20: C
+    MKC_INSTRUCTION,                            // 22
+    SWAP_INSTRUCTION,                           // 23
+    RET_INSTRUCTION,                            // 24
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 19);
+  EXPECT_EQ(stackSize(getVmAddressStack(vm)), 2 * sizeof(uint64_t));
+
+  VmIntrinsicStats stats;
+  getVmIntrinsicStats(vm, &stats);
+  EXPECT_EQ(stats.intrinsicsExecuted, 0);
+  EXPECT_EQ(stats.instructionsReplaced, 0);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Intrinsics don't run while there are breakpoints to stop at
+TEST(vm_tests, runVmWithIntrinsicsAndBreakpoints) {
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  BreakpointList breakpoints = createBreakpointList(4);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(breakpoints, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+  ASSERT_EQ(addBreakpointToList(breakpoints, 136), 0);
+  setVmBreakpointLists(vm, breakpoints, NULL);
+
+  // Stops at the PUSH in v, which its intrinsic would skip over
+  EXPECT_EQ(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), 136);
+
+  VmIntrinsicStats stats;
+  getVmIntrinsicStats(vm, &stats);
+  EXPECT_EQ(stats.intrinsicsExecuted, 0);
+
+  EXPECT_NE(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 125);
+
+  setVmBreakpointLists(vm, NULL, NULL);
+  destroyBreakpointList(breakpoints);
+  destroyUnlambdaVM(vm);
+}
+
+// Runs "program" to completion on a VM with the JIT enabled and on one
+// that steps through it, then checks both VMs end up in the same state.
+// Returns the JIT's counters, or skips the test if the JIT is unavailable.
+static void runVmWithJit(const uint8_t* program, uint64_t programSize,
+			 uint32_t hotClosureThreshold, VmJitStats* stats) {
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  if (enableVmJit(vm, hotClosureThreshold)) {
+    EXPECT_EQ(getVmStatus(vm), VmJitUnavailableError);
+    destroyUnlambdaVM(trueVm);
+    destroyUnlambdaVM(vm);
+    GTEST_SKIP() << "JIT is not available on this platform";
+  }
+  ASSERT_NE(getVmJit(vm), (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", program,
+				    programSize), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", program,
+				    programSize), 0);
+
+  EXPECT_NE(runVm(vm), 0);
+  getVmJitStats(getVmJit(vm), stats);
+
+  stepVmUntilStopped(trueVm);
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+TEST(vm_tests, runVmWithJit) {
+  VmJitStats stats;
+
+  runVmWithJit(PRIMITIVES_PROGRAM, sizeof(PRIMITIVES_PROGRAM), 64, &stats);
+  if (IsSkipped()) {
+    return;
+  }
+  EXPECT_GT(stats.blocksCompiled, 0);
+  EXPECT_GT(stats.codeEntries, 0);
+  EXPECT_EQ(stats.closuresCompiled, 0);
+  EXPECT_EQ(stats.codeBufferFlushes, 0);
+}
+
+#ifdef __linux__
+// The JIT's code buffer must never be writable and executable at once
+TEST(vm_tests, runVmWithJitNeverMapsWritableCode) {
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  if (enableVmJit(vm, 64)) {
+    destroyUnlambdaVM(vm);
+    GTEST_SKIP() << "JIT is not available on this platform";
+  }
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+  EXPECT_NE(runVm(vm), 0);
+
+  VmJitStats stats;
+  getVmJitStats(getVmJit(vm), &stats);
+  EXPECT_GT(stats.blocksCompiled, 0);
+
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+
+  ASSERT_TRUE(maps.good());
+  while (std::getline(maps, line)) {
+    // Permissions are the second field, e.g. "r-xp"
+    const size_t perms = line.find(' ') + 1;
+    EXPECT_NE(line.substr(perms, 3), "rwx") << line;
+  }
+
+  destroyUnlambdaVM(vm);
+}
+#endif
+
+// Calls the same function on the heap over and over, so the JIT compiles it
+TEST(vm_tests, runVmWithJitCompilingHotClosures) {
+  std::vector<uint8_t> program{
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH I (patched below)
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,  //  9: PUSH K (patched below)
+    PCALL_INSTRUCTION,                         // 18: `ki
+  };
+  for (int i = 0; i < 16; ++i) {
+    // ``kiv
+    static const uint8_t APPLY_KI[] = {
+      DUP_INSTRUCTION, PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0,
+      SWAP_INSTRUCTION, PCALL_INSTRUCTION, POP_INSTRUCTION
+    };
+    program.insert(program.end(), APPLY_KI, APPLY_KI + sizeof(APPLY_KI));
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  const uint8_t k = program.size();
+  program.push_back(PCALL_INSTRUCTION);
+  program.push_back(MKK_INSTRUCTION);
+  program.push_back(RET_INSTRUCTION);
+
+  const uint8_t i = program.size();
+  program.push_back(PCALL_INSTRUCTION);
+  program.push_back(RET_INSTRUCTION);
+
+  const uint8_t ti = program.size();
+  static const uint8_t PUSH_I_RET[] = {
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0, RET_INSTRUCTION
+  };
+  program.insert(program.end(), PUSH_I_RET, PUSH_I_RET + sizeof(PUSH_I_RET));
+  program[ti + 1] = i;
+
+  program[1] = ti;
+  program[10] = k;
+  for (uint64_t p = 19; p < k - 1; p += 13) {
+    program[p + 2] = ti;
+  }
+
+  VmJitStats stats;
+
+  runVmWithJit(program.data(), program.size(), 1, &stats);
+  if (IsSkipped()) {
+    return;
+  }
+  EXPECT_GT(stats.closuresCompiled, 0);
+}
+
+// Compiled code has to stop exactly where stepVm() would, whether it runs
+// out of instructions or hits an error
+TEST(vm_tests, runVmWithJitUntilInstructionLimit) {
+  UnlambdaVM trueVm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program",
+				    PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+
+  for (uint64_t n = 1; !stepVm(trueVm); ++n) {
+    UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+
+    ASSERT_NE(vm, (void*)0);
+    if (enableVmJit(vm, 1)) {
+      destroyUnlambdaVM(vm);
+      destroyUnlambdaVM(trueVm);
+      GTEST_SKIP() << "JIT is not available on this platform";
+    }
+    ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				      sizeof(PRIMITIVES_PROGRAM)), 0);
+    EXPECT_EQ(runVmUntil(vm, n, 0), 0) << "Failed after " << n
+				       << " instructions";
+    verifySameVmState(vm, trueVm);
+    destroyUnlambdaVM(vm);
+  }
+
+  destroyUnlambdaVM(trueVm);
+}
+
+TEST(vm_tests, runVmWithJitUntilStackOverflow) {
+  std::vector<uint8_t> program{
+    PUSH_INSTRUCTION, 0, 0, 0, 0, 0, 0, 0, 0
+  };
+  for (int i = 0; i < 20; ++i) {
+    program.push_back(DUP_INSTRUCTION);
+  }
+  program.push_back(HALT_INSTRUCTION);
+
+  // The address stack can't grow past 16 addresses
+  VmJitStats stats;
+
+  runVmWithJit(program.data(), program.size(), 64, &stats);
+  if (IsSkipped()) {
+    return;
+  }
+  EXPECT_GT(stats.blocksCompiled, 0);
+}
+
+TEST(vm_tests, runVmWithJitTailCallLoop) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH LOOP
+    PCALL_INSTRUCTION,                          //  9
+    HALT_INSTRUCTION,                           // 10
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  // 11: LOOP: PUSH LOOP
+    PCALL_INSTRUCTION,                          // 20
+    RET_INSTRUCTION,                            // 21
+  };
+  UnlambdaVM vm = createUnlambdaVM(4, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(4, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  if (enableVmJit(vm, 64)) {
+    destroyUnlambdaVM(trueVm);
+    destroyUnlambdaVM(vm);
+    GTEST_SKIP() << "JIT is not available on this platform";
+  }
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(runVmUntil(vm, 10001, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+
+  for (int i = 0; i < 10001; ++i) {
+    ASSERT_EQ(stepVm(trueVm), 0);
+  }
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Compiled code doesn't run while there are breakpoints to stop at
+TEST(vm_tests, runVmWithJitAndBreakpoints) {
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  BreakpointList breakpoints = createBreakpointList(4);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(breakpoints, (void*)0);
+  if (enableVmJit(vm, 64)) {
+    destroyBreakpointList(breakpoints);
+    destroyUnlambdaVM(vm);
+    GTEST_SKIP() << "JIT is not available on this platform";
+  }
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PRIMITIVES_PROGRAM,
+				    sizeof(PRIMITIVES_PROGRAM)), 0);
+  ASSERT_EQ(addBreakpointToList(breakpoints, 136), 0);
+  setVmBreakpointLists(vm, breakpoints, NULL);
+
+  EXPECT_EQ(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), 136);
+
+  VmJitStats stats;
+  getVmJitStats(getVmJit(vm), &stats);
+  EXPECT_EQ(stats.codeEntries, 0);
+
+  EXPECT_NE(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 125);
+
+  setVmBreakpointLists(vm, NULL, NULL);
+  destroyBreakpointList(breakpoints);
+  destroyUnlambdaVM(vm);
+}
+
+// With a breakpoint set, the program area runs without compiled code, but
+// PCALL followed by RET still makes a tail call
+TEST(vm_tests, runVmWithJitTailCallLoopAndBreakpoints) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH LOOP
+    PCALL_INSTRUCTION,                          //  9
+    HALT_INSTRUCTION,                           // 10
+    PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  // 11: LOOP: PUSH LOOP
+    PCALL_INSTRUCTION,                          // 20
+    RET_INSTRUCTION,                            // 21
+  };
+  UnlambdaVM vm = createUnlambdaVM(4, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(4, 16, 1024, 4096);
+  BreakpointList breakpoints = createBreakpointList(4);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_NE(breakpoints, (void*)0);
+  if (enableVmJit(vm, 64)) {
+    destroyBreakpointList(breakpoints);
+    destroyUnlambdaVM(trueVm);
+    destroyUnlambdaVM(vm);
+    GTEST_SKIP() << "JIT is not available on this platform";
+  }
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(addBreakpointToList(breakpoints, 10), 0);
+  setVmBreakpointLists(vm, breakpoints, NULL);
+
+  EXPECT_EQ(runVmUntil(vm, 10000, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), 11);
+
+  static const uint64_t callStackData[] = { 11, 10 };
+  EXPECT_TRUE(unl_test::verifyStack("call stack", getVmCallStack(vm),
+				    callStackData, ARRAY_SIZE(callStackData)));
+
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(stepVm(trueVm), 0);
+  }
+  EXPECT_EQ(stackSize(getVmCallStack(vm)),
+	    stackSize(getVmCallStack(trueVm)));
+  verifySameVmState(vm, trueVm);
+
+  setVmBreakpointLists(vm, NULL, NULL);
+  destroyBreakpointList(breakpoints);
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Program for the native code tests: a loop that calls itself in tail
+// position, followed by a function native code leaves to the VM
+static const uint8_t NATIVE_PROGRAM[] = {
+  PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH LOOP
+  PCALL_INSTRUCTION,                          //  9
+  HALT_INSTRUCTION,                           // 10
+  PUSH_INSTRUCTION, 11, 0, 0, 0, 0, 0, 0, 0,  // 11: LOOP: PUSH LOOP
+  PCALL_INSTRUCTION,                          // 20
+  RET_INSTRUCTION,                            // 21
+};
+
+static uint64_t nativeBlocksExecuted = 0;
+
+// Native code for the block at address 0, written the way unl2c writes it
+static int nativeStart(VmNativeState* s) {
+  if (s->remaining < 2) {
+    s->pc = 0;
+    return VmNativeExitInterpret;
+  }
+  if ((s->addressStackTop == s->addressStackLimit)
+        || ((s->callStackLimit - s->callStackTop) < 2)) {
+    s->pc = 0;
+    return VmNativeExitInterpret;
+  }
+  s->remaining -= 2;
+  s->callStackTop[0] = 11;
+  s->callStackTop[1] = 10;
+  s->callStackTop += 2;
+  s->pc = 11;
+  ++nativeBlocksExecuted;
+  return VmNativeExitJump;
+}
+
+// Native code for the loop at address 11
+static int nativeLoop(VmNativeState* s) {
+  if ((s->remaining < 2) || (s->addressStackTop == s->addressStackLimit)) {
+    s->pc = 11;
+    return VmNativeExitInterpret;
+  }
+  s->remaining -= 2;
+  if ((s->callStackTop - s->callStackBottom) >= 2) {
+    s->callStackTop[-2] = 11;
+  } else if ((s->callStackLimit - s->callStackTop) >= 2) {
+    s->callStackTop[0] = 11;
+    s->callStackTop[1] = 21;
+    s->callStackTop += 2;
+  } else {
+    // Let the VM report the overflow at the PCALL
+    *s->addressStackTop++ = 11;
+    ++s->remaining;
+    s->pc = 20;
+    return VmNativeExitInterpret;
+  }
+  s->pc = 11;
+  ++nativeBlocksExecuted;
+  return VmNativeExitJump;
+}
+
+static const VmNativeBlock NATIVE_BLOCKS[] = {
+  { 0, nativeStart },
+  { 11, nativeLoop },
+  { 4096, nativeLoop },  // Outside the program area, so the VM ignores it
+};
+
+TEST(vm_tests, runVmWithNativeCode) {
+  UnlambdaVM vm = createUnlambdaVM(4, 16, 1024, 4096);
+  UnlambdaVM trueVm = createUnlambdaVM(4, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", NATIVE_PROGRAM,
+				    sizeof(NATIVE_PROGRAM)), 0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", NATIVE_PROGRAM,
+				    sizeof(NATIVE_PROGRAM)), 0);
+  setVmNativeCode(vm, NATIVE_BLOCKS, ARRAY_SIZE(NATIVE_BLOCKS));
+
+  nativeBlocksExecuted = 0;
+  EXPECT_EQ(runVmUntil(vm, 10001, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(nativeBlocksExecuted, 5000);
+
+  for (int i = 0; i < 10001; ++i) {
+    ASSERT_EQ(stepVm(trueVm), 0);
+  }
+  verifySameVmState(vm, trueVm);
+
+  // Back to interpreting the whole program
+  setVmNativeCode(vm, NULL, 0);
+  nativeBlocksExecuted = 0;
+  EXPECT_EQ(runVmUntil(vm, 1000, 0), 0);
+  EXPECT_EQ(nativeBlocksExecuted, 0);
+
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ(stepVm(trueVm), 0);
+  }
+  verifySameVmState(vm, trueVm);
+
+  destroyUnlambdaVM(trueVm);
+  destroyUnlambdaVM(vm);
+}
+
+// Native code has to stop exactly where stepVm() would
+TEST(vm_tests, runVmWithNativeCodeUntilInstructionLimit) {
+  UnlambdaVM trueVm = createUnlambdaVM(4, 16, 1024, 4096);
+
+  ASSERT_NE(trueVm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(trueVm, "test_program", NATIVE_PROGRAM,
+				    sizeof(NATIVE_PROGRAM)), 0);
+
+  for (uint64_t n = 1; n < 32; ++n) {
+    UnlambdaVM vm = createUnlambdaVM(4, 16, 1024, 4096);
+
+    ASSERT_NE(vm, (void*)0);
+    ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", NATIVE_PROGRAM,
+				      sizeof(NATIVE_PROGRAM)), 0);
+    setVmNativeCode(vm, NATIVE_BLOCKS, ARRAY_SIZE(NATIVE_BLOCKS));
+
+    ASSERT_EQ(stepVm(trueVm), 0);
+    EXPECT_EQ(runVmUntil(vm, n, 0), 0) << "Failed after " << n
+				       << " instructions";
+    verifySameVmState(vm, trueVm);
+    destroyUnlambdaVM(vm);
+  }
+
+  destroyUnlambdaVM(trueVm);
+}
+
+// Native code doesn't run while there are breakpoints to stop at
+TEST(vm_tests, runVmWithNativeCodeAndBreakpoints) {
+  UnlambdaVM vm = createUnlambdaVM(4, 16, 1024, 4096);
+  BreakpointList breakpoints = createBreakpointList(4);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(breakpoints, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", NATIVE_PROGRAM,
+				    sizeof(NATIVE_PROGRAM)), 0);
+  setVmNativeCode(vm, NATIVE_BLOCKS, ARRAY_SIZE(NATIVE_BLOCKS));
+  ASSERT_EQ(addBreakpointToList(breakpoints, 20), 0);
+  setVmBreakpointLists(vm, breakpoints, NULL);
+
+  nativeBlocksExecuted = 0;
+  EXPECT_EQ(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), 20);
+  EXPECT_EQ(nativeBlocksExecuted, 0);
+
+  setVmBreakpointLists(vm, NULL, NULL);
+  destroyBreakpointList(breakpoints);
+  destroyUnlambdaVM(vm);
+}
+
+// Change the stacks through the Stack API while the VM is stopped.  The
+// VM must pick up the changes when it resumes.
+TEST(vm_tests, runVmAfterChangingStacks) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 12, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH 12
+    PCALL_INSTRUCTION,                          //  9
+    POP_INSTRUCTION,                            // 10
+    HALT_INSTRUCTION,                           // 11
+    PUSH_INSTRUCTION, 20, 0, 0, 0, 0, 0, 0, 0,  // 12: PUSH 20
+    RET_INSTRUCTION,                            // 21
+    DUP_INSTRUCTION,                            // 22
+    RET_INSTRUCTION,                            // 23
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+
+  EXPECT_EQ(runVmUntil(vm, 1, 0), 0);
+  EXPECT_EQ(getVmPC(vm), 9);
+
+  // Call 22 instead of 12
+  const uint64_t target = 22;
+  const uint64_t extra = 7;
+  Stack addressStack = getVmAddressStack(vm);
+  ASSERT_EQ(popStack(addressStack, NULL, sizeof(uint64_t)), 0);
+  ASSERT_EQ(pushStack(addressStack, &extra, sizeof(extra)), 0);
+  ASSERT_EQ(pushStack(addressStack, &target, sizeof(target)), 0);
+
+  EXPECT_EQ(runVmUntil(vm, 3, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), 10);
+
+  static const uint64_t addressStackData[] = { 7, 7 };
+  EXPECT_EQ(stackSize(getVmCallStack(vm)), 0);
+  EXPECT_TRUE(unl_test::verifyStack("address stack", addressStack,
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+
+  // Empty the address stack, so POP underflows
+  clearStack(addressStack);
+  EXPECT_NE(runVmUntil(vm, 100, 0), 0);
+  EXPECT_EQ(getVmStatus(vm), VmAddressStackUnderflowError);
+  EXPECT_EQ(getVmPC(vm), 10);
+
+  destroyUnlambdaVM(vm);
+}
+
+// Run a program until it reaches a breakpoint, then resume execution
+TEST(vm_tests, runVmUntilBreakpoint) {
+  static const uint8_t PROGRAM[] = {
+    PUSH_INSTRUCTION, 12, 0, 0, 0, 0, 0, 0, 0,  //  0: PUSH 12
+    PCALL_INSTRUCTION,                          //  9
+    POP_INSTRUCTION,                            // 10
+    HALT_INSTRUCTION,                           // 11
+    PUSH_INSTRUCTION, 20, 0, 0, 0, 0, 0, 0, 0,  // 12: PUSH 20
+    RET_INSTRUCTION,                            // 21
+  };
+  UnlambdaVM vm = createUnlambdaVM(16, 16, 1024, 4096);
+  BreakpointList persistent = createBreakpointList(4);
+  BreakpointList transient = createBreakpointList(4);
+
+  ASSERT_NE(vm, (void*)0);
+  ASSERT_NE(persistent, (void*)0);
+  ASSERT_NE(transient, (void*)0);
+  ASSERT_EQ(loadVmProgramFromMemory(vm, "test_program", PROGRAM,
+				    sizeof(PROGRAM)), 0);
+  ASSERT_EQ(addBreakpointToList(persistent, 0), 0);
+  ASSERT_EQ(addBreakpointToList(persistent, 12), 0);
+  ASSERT_EQ(addBreakpointToList(transient, 10), 0);
+  setVmBreakpointLists(vm, persistent, transient);
+
+  // Breakpoints are ignored unless the stop mask says otherwise
+  EXPECT_EQ(runVmUntil(vm, 2, 0), 0);
+  EXPECT_EQ(getVmPC(vm), 12);
+
+  // Resuming from a breakpoint executes the instruction at the breakpoint
+  EXPECT_EQ(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), 0);
+  EXPECT_EQ(getVmPC(vm), 10);
+  EXPECT_EQ(stackSize(getVmCallStack(vm)), 0);
+
+  static const uint64_t addressStackData[] = { 20 };
+  EXPECT_TRUE(unl_test::verifyStack("address stack", getVmAddressStack(vm),
+				    addressStackData,
+				    ARRAY_SIZE(addressStackData)));
+
+  EXPECT_NE(runVmUntil(vm, 0, VmStopAtBreakpoint), 0);
+  EXPECT_EQ(getVmStatus(vm), VmHalted);
+  EXPECT_EQ(getVmPC(vm), 11);
+
+  setVmBreakpointLists(vm, NULL, NULL);
+  destroyBreakpointList(transient);
+  destroyBreakpointList(persistent);
+  destroyUnlambdaVM(vm);
+}
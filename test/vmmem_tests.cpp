@@ -8,8 +8,10 @@ extern "C" {
 #include <testing_utils.hpp>
 #include <gtest/gtest.h>
 #include <assert.h>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 // TODO: Prefix all calls to testing utilities
@@ -35,11 +37,22 @@ TEST(vmmem_tests, createVmMemory) {
   HeapBlock* p = (HeapBlock*)ptrToVmMemory(memory);
   EXPECT_EQ(getVmmBlockType(p), VmmFreeBlockType);
   EXPECT_EQ(getVmmBlockSize(p), 1024 - sizeof(HeapBlock));
-  EXPECT_FALSE(vmmBlockIsMarked(p));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, p));
   
   destroyVmMemory(memory);
 }
 
+TEST(vmmem_tests, createVmMemoryRoundsSizesToMultipleOfEight) {
+  VmMemory memory = createVmMemory(1029, 2055);
+
+  ASSERT_NE(memory, (void*)0);
+  EXPECT_EQ(currentVmmSize(memory), 1024);
+  EXPECT_EQ(maxVmmSize(memory), 2048);
+  EXPECT_EQ(vmmBytesFree(memory), 1024 - sizeof(HeapBlock));
+
+  destroyVmMemory(memory);
+}
+
 TEST(vmmem_tests, reserveMemoryForProgram) {
   VmMemory memory = createVmMemory(1024, 4096);
   ASSERT_NE(memory, (void*)0);
@@ -64,7 +77,7 @@ TEST(vmmem_tests, reserveMemoryForProgram) {
   HeapBlock* p = (HeapBlock*)getVmmHeapStart(memory);
   EXPECT_EQ(getVmmBlockType(p), VmmFreeBlockType);
   EXPECT_EQ(getVmmBlockSize(p), 512 - sizeof(HeapBlock));
-  EXPECT_FALSE(vmmBlockIsMarked(p));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, p));
   
   destroyVmMemory(memory);
 }
@@ -93,7 +106,7 @@ TEST(vmmem_tests, reserveVmMemoryForProgramIncreasingMemorySize) {
   HeapBlock* p = (HeapBlock*)getVmmHeapStart(memory);
   EXPECT_EQ(getVmmBlockType(p), VmmFreeBlockType);
   EXPECT_EQ(getVmmBlockSize(p), 1024 - sizeof(HeapBlock));
-  EXPECT_FALSE(vmmBlockIsMarked(p));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, p));
   
   destroyVmMemory(memory);
 }
@@ -149,7 +162,7 @@ TEST(vmmem_tests, reserveTooMuchMemoryForProgram) {
   HeapBlock* p = (HeapBlock*)getVmmHeapStart(memory);
   EXPECT_EQ(getVmmBlockType(p), VmmFreeBlockType);
   EXPECT_EQ(getVmmBlockSize(p), 4096 - sizeof(HeapBlock));
-  EXPECT_FALSE(vmmBlockIsMarked(p));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, p));
   
   destroyVmMemory(memory);
 }
@@ -519,7 +532,8 @@ TEST(vmmem_tests, splitFirstOfThreeBlocks) {
 
   layoutBlocks(memory, blockStructure);
 
-  CodeBlock* cb = allocateVmmCodeBlock(memory, 1);
+  // The first free block is the smallest that can hold 32 bytes
+  CodeBlock* cb = allocateVmmCodeBlock(memory, 32);
   ASSERT_NE(cb, (void*)0);
   EXPECT_EQ(getVmmStatus(memory), 0);
   EXPECT_EQ(std::string(getVmmStatusMsg(memory)), "OK");
@@ -527,7 +541,7 @@ TEST(vmmem_tests, splitFirstOfThreeBlocks) {
   EXPECT_EQ(currentVmmSize(memory), 1024);
   EXPECT_EQ(maxVmmSize(memory), 4096);
   EXPECT_EQ(vmmHeapSize(memory), 512);
-  EXPECT_EQ(vmmBytesFree(memory), 32 + 120 + 24);
+  EXPECT_EQ(vmmBytesFree(memory), 8 + 120 + 24);
   EXPECT_NE(ptrToVmMemory(memory), (void*)0);
   EXPECT_EQ(ptrToVmMemoryEnd(memory) - ptrToVmMemory(memory), 1024);
   EXPECT_EQ(getVmmProgramMemorySize(memory), 512);
@@ -539,8 +553,8 @@ TEST(vmmem_tests, splitFirstOfThreeBlocks) {
 
   // Layout should be:
   // * Code block (72 = 64 + 8 bytes for header)
-  // * Code block (16 = 8 + 8)
-  // * Free block (40 = 32 + 8)
+  // * Code block (40 = 32 + 8)
+  // * Free block (16 = 8 + 8)
   // * Code block (64 = 56 + 8)
   // * Code block (40 = 32 + 8)
   // * Free block (128 = 120 + 8)
@@ -548,8 +562,8 @@ TEST(vmmem_tests, splitFirstOfThreeBlocks) {
   // * Free block (32 = 24 + 8)
   const std::vector<BlockSpec> structAfterSplit{
     BlockSpec(VmmCodeBlockType, 64, 512),
-    BlockSpec(VmmCodeBlockType,  8, 584),
-    BlockSpec(VmmFreeBlockType, 32, 600),
+    BlockSpec(VmmCodeBlockType, 32, 584),
+    BlockSpec(VmmFreeBlockType,  8, 624),
     BlockSpec(VmmCodeBlockType, 56, 640),
     BlockSpec(VmmCodeBlockType, 32, 704),
     BlockSpec(VmmFreeBlockType, 120, 744),
@@ -558,7 +572,7 @@ TEST(vmmem_tests, splitFirstOfThreeBlocks) {
   };
   EXPECT_TRUE(verifyBlockStructure(memory, structAfterSplit));
 
-  const std::vector<uint64_t> freeBlockAddresses{ 600, 744, 992 };
+  const std::vector<uint64_t> freeBlockAddresses{ 624, 744, 992 };
   EXPECT_TRUE(verifyFreeBlockList(memory, freeBlockAddresses));
   
   destroyVmMemory(memory);
@@ -650,21 +664,21 @@ TEST(vmmem_tests, allocateTwiceFromFirstBlock) {
 
   layoutBlocks(memory, blockStructure);
 
-  // Split the second block into 8 and 32 bytes
-  CodeBlock* cb1 = allocateVmmCodeBlock(memory, 8);
+  // Split the second block into 32 and 8 bytes
+  CodeBlock* cb1 = allocateVmmCodeBlock(memory, 32);
   ASSERT_NE(cb1, (void*)0);
   EXPECT_EQ(getVmmStatus(memory), 0);
   EXPECT_EQ(std::string(getVmmStatusMsg(memory)), "OK");
   EXPECT_EQ(reinterpret_cast<uint8_t*>(cb1),
 	    ptrToVmMemory(memory) + blockStructure[1].address);
 
-  // Consume what's left of the first block
-  CodeBlock* cb2 = allocateVmmCodeBlock(memory, 32);
+  // Consume what's left of the first block, which is now the smallest
+  CodeBlock* cb2 = allocateVmmCodeBlock(memory, 8);
   ASSERT_NE(cb2, (void*)0);
   EXPECT_EQ(getVmmStatus(memory), 0);
   EXPECT_EQ(std::string(getVmmStatusMsg(memory)), "OK");
   EXPECT_EQ(reinterpret_cast<uint8_t*>(cb2),
-	    ptrToVmMemory(memory) + blockStructure[1].address + 16);
+	    ptrToVmMemory(memory) + blockStructure[1].address + 40);
 
   EXPECT_EQ(currentVmmSize(memory), 1024);
   EXPECT_EQ(maxVmmSize(memory), 4096);
@@ -678,8 +692,8 @@ TEST(vmmem_tests, allocateTwiceFromFirstBlock) {
 
   // Layout should be:
   // * Code block (72 = 64 + 8 bytes for header)
-  // * Code block (16 =  8 + 8)
   // * Code block (40 = 32 + 8)
+  // * Code block (16 =  8 + 8)
   // * Code block (64 = 56 + 8)
   // * Code block (40 = 32 + 8)
   // * Free block (128 = 120 + 8)
@@ -687,8 +701,8 @@ TEST(vmmem_tests, allocateTwiceFromFirstBlock) {
   // * Free block (32 = 24 + 8)
   const std::vector<BlockSpec> structAfterSplit{
     BlockSpec(VmmCodeBlockType, 64, 512),
-    BlockSpec(VmmCodeBlockType,  8, 584),
-    BlockSpec(VmmCodeBlockType, 32, 600),
+    BlockSpec(VmmCodeBlockType, 32, 584),
+    BlockSpec(VmmCodeBlockType,  8, 624),
     BlockSpec(VmmCodeBlockType, 56, 640),
     BlockSpec(VmmCodeBlockType, 32, 704),
     BlockSpec(VmmFreeBlockType, 120, 744),
@@ -886,21 +900,21 @@ TEST(vmmem_tests, allocateOneFromEachFreeBlock) {
   EXPECT_EQ(reinterpret_cast<uint8_t*>(cb1),
 	    ptrToVmMemory(memory) + blockStructure[4].address);
 
-  // Allocate 32 bytes from the first free block, leaving 8
-  CodeBlock* cb2 = allocateVmmCodeBlock(memory, 32);
+  // Allocate 16 bytes from the third free block, leaving 8
+  CodeBlock* cb2 = allocateVmmCodeBlock(memory, 16);
   ASSERT_NE(cb2, (void*)0);
   EXPECT_EQ(getVmmStatus(memory), 0);
   EXPECT_EQ(std::string(getVmmStatusMsg(memory)), "OK");
   EXPECT_EQ(reinterpret_cast<uint8_t*>(cb2),
-	    ptrToVmMemory(memory) + blockStructure[1].address);
+	    ptrToVmMemory(memory) + blockStructure[6].address);
 
-  // Allocate 16 bytes from the third free block, leaving 8
-  CodeBlock* cb3 = allocateVmmCodeBlock(memory, 16);
+  // Allocate 32 bytes from the first free block, leaving 8
+  CodeBlock* cb3 = allocateVmmCodeBlock(memory, 32);
   ASSERT_NE(cb3, (void*)0);
   EXPECT_EQ(getVmmStatus(memory), 0);
   EXPECT_EQ(std::string(getVmmStatusMsg(memory)), "OK");
   EXPECT_EQ(reinterpret_cast<uint8_t*>(cb3),
-	    ptrToVmMemory(memory) + blockStructure[6].address);
+	    ptrToVmMemory(memory) + blockStructure[1].address);
 
   EXPECT_EQ(currentVmmSize(memory), 1024);
   EXPECT_EQ(maxVmmSize(memory), 4096);
@@ -974,7 +988,7 @@ TEST(vmmem_tests, allocateVmmStateBlock) {
 
   EXPECT_EQ(getVmmBlockType(&(sb->header)), VmmStateBlockType);
   EXPECT_EQ(getVmmBlockSize(&(sb->header)), 16 + 10 * 16 + 24 * 8);
-  EXPECT_FALSE(vmmBlockIsMarked(&(sb->header)));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, &(sb->header)));
 
   for (int i = 0; i < 8; ++i) {
     EXPECT_EQ(sb->guard[i], PANIC_INSTRUCTION)
@@ -1000,6 +1014,38 @@ TEST(vmmem_tests, allocateVmmStateBlock) {
   destroyVmMemory(memory);
 }
 
+TEST(vmmem_tests, markBlocksWithoutChangingHeaders) {
+  VmMemory memory = createVmMemory(1024, 4096);
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 0);
+
+  CodeBlock* first = allocateVmmCodeBlock(memory, 16);
+  CodeBlock* second = allocateVmmCodeBlock(memory, 16);
+  ASSERT_NE(first, (void*)0);
+  ASSERT_NE(second, (void*)0);
+  const uint64_t header = first->header.typeAndSize;
+
+  // The marks live in a bitmap, so neither the header nor the mark on
+  // the block next to it change
+  setVmmBlockMark(memory, &(first->header));
+  EXPECT_TRUE(vmmBlockIsMarked(memory, &(first->header)));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, &(second->header)));
+  EXPECT_EQ(first->header.typeAndSize, header);
+
+  setVmmBlockMark(memory, &(second->header));
+  clearVmmBlockMark(memory, &(first->header));
+  EXPECT_FALSE(vmmBlockIsMarked(memory, &(first->header)));
+  EXPECT_TRUE(vmmBlockIsMarked(memory, &(second->header)));
+
+  // The marks survive the memory growing
+  ASSERT_EQ(increaseVmmSize(memory), 0);
+  second = (CodeBlock*)(getVmmHeapStart(memory) + sizeof(HeapBlock) + 16);
+  EXPECT_TRUE(vmmBlockIsMarked(memory, &(second->header)));
+
+  destroyVmMemory(memory);
+}
+
 // Garbage collector tests
 
 // Collect heap with no allocated blocks
@@ -1321,15 +1367,16 @@ TEST(vmmem_tests, collectMultipleBlocksWithIndirectCodeBlockReferences) {
   blockPtr[12] =  65;
   blockPtr[13] =  RET_INSTRUCTION;
   
-  // Write PUSH instructions to block 1 to reference blocks 5 and 7
+  // Write superinstructions with address operands to block 1 to reference
+  // blocks 5 and 7
   blockPtr = ptrToVmmAddress(memory, blockStructure[1].address
 			               + sizeof(HeapBlock));
   blockPtr[0] = RESTORE_INSTRUCTION;
   blockPtr[1] = 1;
   blockPtr[2] = POP_INSTRUCTION;
-  blockPtr[3] = PUSH_INSTRUCTION;
+  blockPtr[3] = PUSH_PCALL_INSTRUCTION;
   *(uint64_t*)(blockPtr + 4) = blockStructure[7].address + sizeof(HeapBlock);
-  blockPtr[12] = PUSH_INSTRUCTION;
+  blockPtr[12] = POP_PUSH_RET_INSTRUCTION;
   *(uint64_t*)(blockPtr + 13) = blockStructure[5].address + sizeof(HeapBlock);
   blockPtr[21] = PCALL_INSTRUCTION;
   blockPtr[22] = PCALL_INSTRUCTION;
@@ -1914,6 +1961,269 @@ TEST(vmmem_tests, increaseVmmSizeBeyondMax) {
   destroyVmMemory(memory);
 }
 
+TEST(vmmem_tests, increaseVmmSizeWithoutMovingMemory) {
+  VmMemory memory = createVmMemory(4096, 64 * 1024 * 1024);
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  uint8_t* const start = ptrToVmMemory(memory);
+  CodeBlock* block = allocateVmmCodeBlock(memory, 64);
+  ASSERT_NE(block, (void*)0);
+  fillBlock(memory, 512, 64, HALT_INSTRUCTION);
+
+  /** The memory grows in place, so the pointers into it stay valid */
+  for (uint64_t size = 8192; size <= 64 * 1024 * 1024; size *= 2) {
+    ASSERT_EQ(increaseVmmSize(memory), 0);
+    ASSERT_EQ(currentVmmSize(memory), size);
+    EXPECT_EQ(ptrToVmMemory(memory), start);
+  }
+  EXPECT_EQ(block->code[0], HALT_INSTRUCTION);
+  EXPECT_EQ(vmmBytesFree(memory), 64 * 1024 * 1024 - 512 - 72 - 8);
+
+  /** The new memory is usable all the way to the end */
+  uint8_t* const last = ptrToVmMemoryEnd(memory) - 8;
+  *(uint64_t*)last = 0;
+  EXPECT_EQ(*(uint64_t*)last, 0);
+
+  const std::vector<BlockSpec> blocks{
+    BlockSpec(VmmCodeBlockType, 64, 512),
+    BlockSpec(VmmFreeBlockType, 64 * 1024 * 1024 - 512 - 72 - 8, 512 + 72),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, blocks));
+
+  destroyVmMemory(memory);
+}
+
+TEST(vmmem_tests, askForHugePages) {
+  VmMemory memory = createVmMemory(4 * 1024 * 1024, 16 * 1024 * 1024);
+  ASSERT_NE(memory, (void*)0);
+  EXPECT_FALSE(vmmHugePagesEnabled(memory));
+
+  /** Not every kernel supports transparent huge pages, but the memory
+   *  has to work either way
+   */
+  if (setVmmHugePages(memory, 1)) {
+    EXPECT_EQ(getVmmStatus(memory), VmmHugePagesNotSupportedError);
+    EXPECT_FALSE(vmmHugePagesEnabled(memory));
+  } else {
+    EXPECT_TRUE(vmmHugePagesEnabled(memory));
+  }
+
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  ASSERT_EQ(increaseVmmSize(memory), 0);
+  EXPECT_EQ(currentVmmSize(memory), 8 * 1024 * 1024);
+  ASSERT_NE(allocateVmmCodeBlock(memory, 6 * 1024 * 1024), (void*)0);
+
+  destroyVmMemory(memory);
+}
+
+TEST(vmmem_tests, releaseFreeMemory) {
+  VmMemory memory = createVmMemory(1024 * 1024, 1024 * 1024);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  /** A big block that becomes garbage, followed by one that stays live */
+  const uint64_t garbageSize = 512 * 1024;
+  CodeBlock* garbage = allocateVmmCodeBlock(memory, garbageSize);
+  ASSERT_NE(garbage, (void*)0);
+  memset(garbage->code, 0xFF, garbageSize);
+
+  CodeBlock* live = allocateVmmCodeBlock(memory, 16);
+  ASSERT_NE(live, (void*)0);
+  const uint64_t liveAddress = 512 + 8 + garbageSize;
+  fillBlock(memory, liveAddress, 16, HALT_INSTRUCTION);
+  ASSERT_TRUE(assertPushAddress(addressStack, liveAddress + 8));
+
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(vmmBytesReleased(memory), 0);
+
+  /** The free pages read as zeros once they go back to the system, but
+   *  the free blocks stay where they are
+   */
+  const uint64_t bytesReleased = releaseVmmFreeMemory(memory);
+  EXPECT_GT(bytesReleased, garbageSize / 2);
+  EXPECT_EQ(vmmBytesReleased(memory), bytesReleased);
+  EXPECT_EQ(garbage->code[garbageSize / 2], 0);
+  EXPECT_EQ(live->code[0], HALT_INSTRUCTION);
+
+  const std::vector<BlockSpec> blocks{
+    BlockSpec(VmmFreeBlockType, garbageSize, 512),
+    BlockSpec(VmmCodeBlockType, 16, liveAddress),
+    BlockSpec(VmmFreeBlockType, 1024 * 1024 - liveAddress - 24 - 8,
+	      liveAddress + 24),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, blocks));
+  EXPECT_EQ(vmmBytesFree(memory), 1024 * 1024 - 512 - 24 - 16);
+
+  /** The program can use the memory again */
+  ASSERT_NE(allocateVmmCodeBlock(memory, garbageSize), (void*)0);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+TEST(vmmem_tests, collectGcStats) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+  VmmGcStats stats;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  getVmmGcStats(memory, &stats);
+  EXPECT_EQ(stats.numCollections, 0);
+  EXPECT_EQ(stats.numNurseryCollections, 0);
+  EXPECT_EQ(stats.numPauses, 0);
+  EXPECT_EQ(stats.numFreeBlocks, 1);
+  EXPECT_EQ(stats.largestFreeBlock, 8192 - 512 - 8);
+  EXPECT_EQ(stats.fragmentation, 0.0);
+
+  /** Three blocks too big for slabs, of which only the middle one is
+   *  reachable
+   */
+  CodeBlock* blocks[3];
+  for (int i = 0; i < 3; ++i) {
+    blocks[i] = allocateVmmCodeBlock(memory, 64);
+    ASSERT_NE(blocks[i], (void*)0);
+    fillBlock(memory, 512 + 72 * i, 64, HALT_INSTRUCTION);
+  }
+  ASSERT_TRUE(assertPushAddress(addressStack,
+				vmmAddressForPtr(memory, blocks[1]->code)));
+
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  getVmmGcStats(memory, &stats);
+  EXPECT_EQ(stats.numCollections, 1);
+  EXPECT_EQ(stats.numNurseryCollections, 0);
+  /** The first block becomes a free block, whose header is still in
+   *  use
+   */
+  EXPECT_EQ(stats.bytesReclaimed, 2 * 72 - 8);
+  EXPECT_EQ(stats.blocksKept, 1);
+  EXPECT_GE(stats.markUsec, 0.0);
+  EXPECT_GE(stats.sweepUsec, 0.0);
+
+  /** The block kept splits the free memory in two */
+  EXPECT_EQ(stats.numFreeBlocks, 2);
+  EXPECT_EQ(stats.largestFreeBlock, 8192 - 512 - 2 * 72 - 8);
+  EXPECT_NEAR(stats.fragmentation, 64.0 / (8192 - 512 - 2 * 72 - 8 + 64),
+	      1e-9);
+
+  EXPECT_EQ(stats.numPauses, 1);
+  EXPECT_EQ(stats.totalPauseUsec, stats.maxPauseUsec);
+  uint64_t numPauses = 0;
+  for (int i = 0; i < VMM_GC_PAUSE_HISTOGRAM_SIZE; ++i) {
+    numPauses += stats.pauseHistogram[i];
+  }
+  EXPECT_EQ(numPauses, 1);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+namespace {
+  struct WeakRefCall {
+    uint64_t low;
+    uint64_t high;
+    std::vector<uint64_t> marked;
+  };
+
+  struct WeakRefTable {
+    std::vector<uint64_t> addresses;
+    std::vector<WeakRefCall> calls;
+  };
+
+  // Record the range and which of the table's blocks are marked
+  void forgetBlocks(VmMemory memory, uint64_t low, uint64_t high,
+		    void* context) {
+    WeakRefTable& table = *(WeakRefTable*)context;
+    WeakRefCall call{ low, high, std::vector<uint64_t>() };
+    for (uint64_t address : table.addresses) {
+      if (vmmBlockIsMarked(memory,
+			   (const HeapBlock*)ptrToVmmAddress(memory, address))) {
+	call.marked.push_back(address);
+      }
+    }
+    table.calls.push_back(call);
+  }
+}
+
+// The collectors tell the weak reference handler which blocks they are
+// about to free
+TEST(vmmem_tests, forgetUnreachableBlocks) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+  WeakRefTable table;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 128);
+  setVmmWeakRefHandler(memory, forgetBlocks, &table);
+
+  // The nursery has room for four blocks of 16 bytes, and only
+  // blocks[1] is reachable
+  CodeBlock* blocks[4];
+  for (int i = 0; i < 4; ++i) {
+    blocks[i] = allocateVmmCodeBlockFromNursery(memory, 16);
+    ASSERT_NE(blocks[i], (void*)0);
+    fillBlock(memory, 512 + 24 * i, 16, HALT_INSTRUCTION);
+    table.addresses.push_back(512 + 24 * i);
+  }
+  ASSERT_TRUE(assertPushAddress(addressStack,
+				vmmAddressForPtr(memory, blocks[1]->code)));
+
+  EXPECT_EQ(collectVmmNursery(memory, callStack, addressStack,
+			      handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  ASSERT_EQ(table.calls.size(), 1);
+  EXPECT_EQ(table.calls[0].low, 512);
+  EXPECT_EQ(table.calls[0].high, 640);
+  EXPECT_EQ(table.calls[0].marked, std::vector<uint64_t>{ 536 });
+
+  // A full collection covers the whole heap
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  ASSERT_EQ(table.calls.size(), 2);
+  EXPECT_EQ(table.calls[1].low, 512);
+  EXPECT_EQ(table.calls[1].high, 8192);
+  EXPECT_EQ(table.calls[1].marked, std::vector<uint64_t>{ 536 });
+
+  // Compaction moves the blocks, so none of them are marked anymore
+  EXPECT_EQ(collectAndCompactVmmBlocks(memory, callStack, addressStack, NULL,
+				       handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  ASSERT_EQ(table.calls.size(), 3);
+  EXPECT_EQ(table.calls[2].low, 512);
+  EXPECT_EQ(table.calls[2].high, 8192);
+  EXPECT_EQ(table.calls[2].marked.size(), 0);
+
+  // Without a handler, the collector doesn't call one
+  setVmmWeakRefHandler(memory, NULL, NULL);
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(table.calls.size(), 3);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
 namespace {
   HeapBlock* saveVisitedBlock(VmMemory memory, HeapBlock* block,
 			      void* context) {
@@ -2009,5 +2319,997 @@ TEST(vmmem_tests, iterateOverAllFreeBlocks) {
   destroyVmMemory(memory);
 }
 
+// Allocate small code blocks from slabs
+TEST(vmmem_tests, allocateCodeBlocksFromSlabs) {
+  VmMemory memory = createVmMemory(8192, 8192);
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  // Code blocks of 10 and 13 bytes share a slab of 16-byte cells, which
+  // starts at 512 and has its first cell at 528.  The 23-byte block
+  // gets a slab of 24-byte cells of its own.
+  CodeBlock* a = allocateVmmCodeBlockFromSlab(memory, 10);
+  CodeBlock* b = allocateVmmCodeBlockFromSlab(memory, 13);
+  CodeBlock* c = allocateVmmCodeBlockFromSlab(memory, 23);
+
+  ASSERT_NE(a, (void*)0);
+  ASSERT_NE(b, (void*)0);
+  ASSERT_NE(c, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)a), 528);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)b), 552);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)c), 2080);
+  EXPECT_EQ(getVmmBlockType((HeapBlock*)a), VmmCodeBlockType);
+  EXPECT_EQ(getVmmBlockSize((HeapBlock*)a), 16);
+  EXPECT_EQ(getVmmBlockSize((HeapBlock*)c), 24);
+
+  // Space past the end of the code is filled with PANIC instructions
+  for (int i = 10; i < 16; ++i) {
+    EXPECT_EQ(a->code[i], PANIC_INSTRUCTION) << "at offset " << i;
+  }
+
+  const VmmSlab* slab =
+    reinterpret_cast<const VmmSlab*>(ptrToVmmAddress(memory, 512));
+  EXPECT_EQ(slab->cellSize, 16);
+  EXPECT_EQ(slab->numCells, 64);
+
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmSlabBlockType, 8 + 64 * 24, 512),
+    BlockSpec(VmmSlabBlockType, 8 + 64 * 32, 2064),
+    BlockSpec(VmmFreeBlockType, 8192 - 4136, 4128),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(memory, std::vector<uint64_t>{ 4128 }));
+  EXPECT_EQ(vmmBytesFree(memory), 8192 - 4136);
+
+  // Blocks too big for a slab come from the heap
+  CodeBlock* d = allocateVmmCodeBlockFromSlab(memory, 40);
+  ASSERT_NE(d, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)d), 4128);
+  EXPECT_EQ(getVmmBlockSize((HeapBlock*)d), 40);
+
+  destroyVmMemory(memory);
+}
+
+// Small code blocks get blocks of their own when a slab won't fit
+TEST(vmmem_tests, allocateCodeBlockFromSlabInSmallHeap) {
+  VmMemory memory = createVmMemory(1024, 1024);
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  CodeBlock* a = allocateVmmCodeBlockFromSlab(memory, 10);
+  ASSERT_NE(a, (void*)0);
+  EXPECT_EQ(getVmmStatus(memory), 0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)a), 512);
+
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmCodeBlockType, 16, 512),
+    BlockSpec(VmmFreeBlockType, 512 - 32, 536),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+
+  destroyVmMemory(memory);
+}
+
+// The collector frees unreachable cells and slabs with no reachable cells
+TEST(vmmem_tests, collectCellsInSlabs) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  CodeBlock* a = allocateVmmCodeBlockFromSlab(memory, 10);
+  CodeBlock* b = allocateVmmCodeBlockFromSlab(memory, 13);
+  CodeBlock* c = allocateVmmCodeBlockFromSlab(memory, 23);
+  ASSERT_NE(a, (void*)0);
+  ASSERT_NE(b, (void*)0);
+  ASSERT_NE(c, (void*)0);
+  fillBlock(memory, vmmAddressForPtr(memory, (uint8_t*)a), 10,
+	    HALT_INSTRUCTION);
+  fillBlock(memory, vmmAddressForPtr(memory, (uint8_t*)b), 13,
+	    HALT_INSTRUCTION);
+  fillBlock(memory, vmmAddressForPtr(memory, (uint8_t*)c), 23,
+	    HALT_INSTRUCTION);
+
+  ASSERT_TRUE(assertPushAddress(addressStack,
+				vmmAddressForPtr(memory, b->code)));
+
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  // The first slab keeps b, and the second goes back to the heap
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmSlabBlockType, 8 + 64 * 24, 512),
+    BlockSpec(VmmFreeBlockType, 8192 - 2072, 2064),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(memory, std::vector<uint64_t>{ 2064 }));
+  EXPECT_EQ(vmmBytesFree(memory), 8192 - 2072);
+  EXPECT_EQ(getVmmBlockType((HeapBlock*)b), VmmCodeBlockType);
+  EXPECT_FALSE(vmmBlockIsMarked(memory, (HeapBlock*)b));
+  EXPECT_EQ(getVmmBlockType((HeapBlock*)a), VmmFreeBlockType);
+
+  // a's cell is the first free one
+  EXPECT_EQ(allocateVmmCodeBlockFromSlab(memory, 12), a);
+  EXPECT_EQ(vmmAddressForPtr(memory,
+			     (uint8_t*)allocateVmmCodeBlockFromSlab(memory, 9)),
+	    576);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+// Allocate the smallest free block that fits from several small blocks
+TEST(vmmem_tests, allocateBestFitFromSmallFreeBlocks) {
+  VmMemory memory = createVmMemory(1024, 4096);
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  std::vector<BlockSpec> blockStructure{
+    BlockSpec(VmmCodeBlockType, 16),
+    BlockSpec(VmmFreeBlockType, 64),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 24),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 40),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 280),
+  };
+  layoutBlocks(memory, blockStructure);
+
+  // Free blocks come back smallest first
+  std::vector<BlockSpec> blocks;
+  EXPECT_EQ(forEachFreeBlockInVmm(memory, saveVisitedFreeBlock, &blocks),
+	    (void*)0);
+  const std::vector<BlockSpec> trueBlocks{
+    BlockSpec(VmmFreeBlockType, 24, 624),
+    BlockSpec(VmmFreeBlockType, 40, 672),
+    BlockSpec(VmmFreeBlockType, 64, 536),
+    BlockSpec(VmmFreeBlockType, 280, 736),
+  };
+  EXPECT_EQ(blocks, trueBlocks);
+
+  // The 40-byte block is the smallest that can hold 32 bytes
+  CodeBlock* cb = allocateVmmCodeBlock(memory, 32);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 672);
+
+  // Only the 280-byte block can hold 100 bytes
+  cb = allocateVmmCodeBlock(memory, 100);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 736);
+
+  // 20 bytes rounds up to 24, which fits the 24-byte block exactly
+  cb = allocateVmmCodeBlock(memory, 20);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 624);
+
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmCodeBlockType, 16, 512),
+    BlockSpec(VmmFreeBlockType, 64, 536),
+    BlockSpec(VmmCodeBlockType, 8, 608),
+    BlockSpec(VmmCodeBlockType, 24, 624),
+    BlockSpec(VmmCodeBlockType, 8, 656),
+    BlockSpec(VmmCodeBlockType, 40, 672),
+    BlockSpec(VmmCodeBlockType, 8, 720),
+    BlockSpec(VmmCodeBlockType, 104, 736),
+    BlockSpec(VmmFreeBlockType, 168, 848),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(memory,
+				  std::vector<uint64_t>{ 536, 848 }));
+  EXPECT_EQ(vmmBytesFree(memory), 64 + 168);
+
+  destroyVmMemory(memory);
+}
+
+// Allocate the smallest free block that fits from several large blocks
+TEST(vmmem_tests, allocateBestFitFromLargeFreeBlocks) {
+  VmMemory memory = createVmMemory(4096, 4096);
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  std::vector<BlockSpec> blockStructure{
+    BlockSpec(VmmFreeBlockType, 512),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 304),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 1000),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 400),
+    BlockSpec(VmmCodeBlockType, 8),
+    BlockSpec(VmmFreeBlockType, 1264),
+  };
+  layoutBlocks(memory, blockStructure);
+
+  std::vector<BlockSpec> blocks;
+  EXPECT_EQ(forEachFreeBlockInVmm(memory, saveVisitedFreeBlock, &blocks),
+	    (void*)0);
+  const std::vector<BlockSpec> trueBlocks{
+    BlockSpec(VmmFreeBlockType, 304, 1048),
+    BlockSpec(VmmFreeBlockType, 400, 2400),
+    BlockSpec(VmmFreeBlockType, 512, 512),
+    BlockSpec(VmmFreeBlockType, 1000, 1376),
+    BlockSpec(VmmFreeBlockType, 1264, 2824),
+  };
+  EXPECT_EQ(blocks, trueBlocks);
+
+  // 300 rounds up to 304, which consumes the 304-byte block
+  CodeBlock* cb = allocateVmmCodeBlock(memory, 300);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 1048);
+
+  // Split the 512-byte block, leaving 48 bytes in a small free block
+  cb = allocateVmmCodeBlock(memory, 456);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 512);
+
+  // Split the 1264-byte block, leaving 152 bytes
+  cb = allocateVmmCodeBlock(memory, 1104);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 2824);
+
+  // There are enough free bytes, but no block is big enough
+  EXPECT_EQ(allocateVmmCodeBlock(memory, 1200), (void*)0);
+  EXPECT_EQ(getVmmStatus(memory), VmmNotEnoughMemoryError);
+
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmCodeBlockType, 456, 512),
+    BlockSpec(VmmFreeBlockType, 48, 976),
+    BlockSpec(VmmCodeBlockType, 8, 1032),
+    BlockSpec(VmmCodeBlockType, 304, 1048),
+    BlockSpec(VmmCodeBlockType, 8, 1360),
+    BlockSpec(VmmFreeBlockType, 1000, 1376),
+    BlockSpec(VmmCodeBlockType, 8, 2384),
+    BlockSpec(VmmFreeBlockType, 400, 2400),
+    BlockSpec(VmmCodeBlockType, 8, 2808),
+    BlockSpec(VmmCodeBlockType, 1104, 2824),
+    BlockSpec(VmmFreeBlockType, 152, 3936),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(
+      memory, std::vector<uint64_t>{ 976, 1376, 2400, 3936 }
+  ));
+  EXPECT_EQ(vmmBytesFree(memory), 48 + 1000 + 400 + 152);
+
+  destroyVmMemory(memory);
+}
+
+// Allocate every one of many large free blocks in a scrambled order, which
+// rotates nodes throughout the tree of large free blocks
+TEST(vmmem_tests, allocateManyLargeFreeBlocks) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  const uint64_t sizeOrder[] = { 5, 12, 0, 9, 14, 3, 7, 1,
+				 15, 10, 4, 8, 2, 13, 6, 11 };
+  std::vector<BlockSpec> blockStructure;
+  for (int i = 0; i < 16; ++i) {
+    blockStructure.push_back(BlockSpec(VmmFreeBlockType,
+				       264 + 16 * sizeOrder[i]));
+    blockStructure.push_back(BlockSpec(VmmCodeBlockType, 8));
+  }
+  blockStructure.push_back(BlockSpec(VmmFreeBlockType, 1144));
+  layoutBlocks(memory, blockStructure);
+
+  for (int i = 0; i < 16; ++i) {
+    const int j = (7 * i) % 16;
+    CodeBlock* cb = allocateVmmCodeBlock(memory, 264 + 16 * sizeOrder[j]);
+    ASSERT_NE(cb, (void*)0);
+    EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb),
+	      blockStructure[2 * j].address);
+  }
+
+  EXPECT_TRUE(verifyFreeBlockList(
+      memory, std::vector<uint64_t>{ blockStructure[32].address }
+  ));
+  EXPECT_EQ(vmmBytesFree(memory), 1144);
+
+  destroyVmMemory(memory);
+}
+
+// Allocate code blocks from the nursery
+TEST(vmmem_tests, allocateCodeBlocksFromNursery) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 1024);
+  EXPECT_EQ(vmmNurserySize(memory), 1024);
+
+  CodeBlock* a = allocateVmmCodeBlockFromNursery(memory, 10);
+  CodeBlock* b = allocateVmmCodeBlockFromNursery(memory, 23);
+  ASSERT_NE(a, (void*)0);
+  ASSERT_NE(b, (void*)0);
+  EXPECT_EQ(getVmmStatus(memory), 0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)a), 512);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)b), 536);
+
+  // The rest of the nursery is a free block, but isn't on the free list
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmCodeBlockType, 16, 512),
+    BlockSpec(VmmCodeBlockType, 24, 536),
+    BlockSpec(VmmFreeBlockType, 1536 - 576, 568),
+    BlockSpec(VmmFreeBlockType, 8192 - 1544, 1536),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(memory, std::vector<uint64_t>{ 1536 }));
+  EXPECT_EQ(vmmBytesFree(memory), 8192 - 1544);
+
+  // Blocks too big for the nursery come from the rest of the heap
+  CodeBlock* c = allocateVmmCodeBlockFromNursery(memory, 1020);
+  ASSERT_NE(c, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)c), 1536);
+
+  destroyVmMemory(memory);
+}
+
+// Collect the nursery when it fills up
+TEST(vmmem_tests, collectNursery) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 128);
+
+  // The nursery has room for four blocks of 16 bytes
+  CodeBlock* blocks[4];
+  for (int i = 0; i < 4; ++i) {
+    blocks[i] = allocateVmmCodeBlockFromNursery(memory, 16);
+    ASSERT_NE(blocks[i], (void*)0);
+    EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)blocks[i]), 512 + 24 * i);
+    fillBlock(memory, 512 + 24 * i, 16, HALT_INSTRUCTION);
+  }
+  EXPECT_EQ(allocateVmmCodeBlockFromNursery(memory, 16), (void*)0);
+  EXPECT_EQ(getVmmStatus(memory), VmmNurseryFullError);
+
+  // blocks[1] is on the address stack and references blocks[3]
+  blocks[1]->code[0] = PUSH_INSTRUCTION;
+  *(uint64_t*)(blocks[1]->code + 1) = vmmAddressForPtr(memory,
+						       blocks[3]->code);
+  ASSERT_TRUE(assertPushAddress(addressStack,
+				vmmAddressForPtr(memory, blocks[1]->code)));
+
+  EXPECT_EQ(collectVmmNursery(memory, callStack, addressStack,
+			      handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmFreeBlockType, 16, 512),
+    BlockSpec(VmmCodeBlockType, 16, 536),
+    BlockSpec(VmmFreeBlockType, 16, 560),
+    BlockSpec(VmmCodeBlockType, 16, 584),
+    BlockSpec(VmmFreeBlockType, 24, 608),
+    BlockSpec(VmmFreeBlockType, 8192 - 648, 640),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(
+      memory, std::vector<uint64_t>{ 512, 560, 608, 640 }
+  ));
+  EXPECT_EQ(vmmBytesFree(memory), 16 + 16 + 24 + 8192 - 648);
+
+  // The next allocation allocates a new nursery
+  CodeBlock* cb = allocateVmmCodeBlockFromNursery(memory, 16);
+  ASSERT_NE(cb, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb), 640);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+// The memory counts the bytes allocated since the last full collection
+// and the bytes the collection found live
+TEST(vmmem_tests, countBytesAllocatedAndLive) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 128);
+  EXPECT_EQ(vmmBytesAllocatedSinceGc(memory), 0);
+  EXPECT_EQ(vmmBytesLive(memory), 0);
+
+  // Blocks in the nursery don't count until they survive a minor
+  // collection
+  CodeBlock* blocks[4];
+  for (int i = 0; i < 4; ++i) {
+    blocks[i] = allocateVmmCodeBlockFromNursery(memory, 16);
+    ASSERT_NE(blocks[i], (void*)0);
+    fillBlock(memory, 512 + 24 * i, 16, HALT_INSTRUCTION);
+  }
+  EXPECT_EQ(vmmBytesAllocatedSinceGc(memory), 0);
+
+  // blocks[1] is on the address stack and references blocks[3]
+  blocks[1]->code[0] = PUSH_INSTRUCTION;
+  *(uint64_t*)(blocks[1]->code + 1) = vmmAddressForPtr(memory,
+						       blocks[3]->code);
+  ASSERT_TRUE(assertPushAddress(addressStack,
+				vmmAddressForPtr(memory, blocks[1]->code)));
+
+  EXPECT_EQ(collectVmmNursery(memory, callStack, addressStack,
+			      handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(vmmBytesAllocatedSinceGc(memory), 48);
+
+  // Blocks outside the nursery count as soon as they are allocated
+  CodeBlock* garbage = allocateVmmCodeBlock(memory, 32);
+  ASSERT_NE(garbage, (void*)0);
+  fillBlock(memory, vmmAddressForPtr(memory, (uint8_t*)garbage), 32,
+	    HALT_INSTRUCTION);
+  EXPECT_EQ(vmmBytesAllocatedSinceGc(memory), 88);
+
+  // A full collection starts the count over and finds blocks[1] and
+  // blocks[3] live
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(vmmBytesAllocatedSinceGc(memory), 0);
+  EXPECT_EQ(vmmBytesLive(memory), 48);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+// Blocks allocated outside the nursery keep the blocks in the nursery
+// they reference alive
+TEST(vmmem_tests, collectNurseryWithRememberedBlocks) {
+  VmMemory memory = createVmMemory(8192, 8192);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 128);
+
+  CodeBlock* a = allocateVmmCodeBlockFromNursery(memory, 16);
+  CodeBlock* b = allocateVmmCodeBlockFromNursery(memory, 16);
+  CodeBlock* c = allocateVmmCodeBlockFromNursery(memory, 16);
+  ASSERT_NE(a, (void*)0);
+  ASSERT_NE(b, (void*)0);
+  ASSERT_NE(c, (void*)0);
+  fillBlock(memory, 512, 16, HALT_INSTRUCTION);
+  fillBlock(memory, 536, 16, HALT_INSTRUCTION);
+  fillBlock(memory, 560, 16, HALT_INSTRUCTION);
+
+  // A saved state outside the nursery references a
+  VmStateBlock* state = allocateVmmStateBlock(memory, 0, 1);
+  ASSERT_NE(state, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)state), 640);
+  *(uint64_t*)state->stacks = vmmAddressForPtr(memory, a->code);
+
+  // A code block outside the nursery references c
+  CodeBlock* d = allocateVmmCodeBlock(memory, 9);
+  ASSERT_NE(d, (void*)0);
+  EXPECT_EQ(vmmAddressForPtr(memory, (uint8_t*)d), 672);
+  d->code[0] = PUSH_INSTRUCTION;
+  *(uint64_t*)(d->code + 1) = vmmAddressForPtr(memory, c->code);
+
+  EXPECT_EQ(collectVmmNursery(memory, callStack, addressStack,
+			      handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmCodeBlockType, 16, 512),
+    BlockSpec(VmmFreeBlockType, 16, 536),
+    BlockSpec(VmmCodeBlockType, 16, 560),
+    BlockSpec(VmmFreeBlockType, 640 - 592, 584),
+    BlockSpec(VmmStateBlockType, 24, 640),
+    BlockSpec(VmmCodeBlockType, 16, 672),
+    BlockSpec(VmmFreeBlockType, 8192 - 704, 696),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(
+      memory, std::vector<uint64_t>{ 536, 584, 696 }
+  ));
+
+  // A full collection doesn't see the remembered blocks as roots
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  const std::vector<BlockSpec> heapAfterFullCollection{
+    BlockSpec(VmmFreeBlockType, 8192 - 520, 512),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, heapAfterFullCollection));
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+// Mark a chain of functions too long to mark recursively on the C stack
+TEST(vmmem_tests, collectLongChainOfBlocks) {
+  static const uint64_t CHAIN_LENGTH = 500000;
+  const uint64_t memorySize = 512 + 24 * (CHAIN_LENGTH + 1) + 24;
+  VmMemory memory = createVmMemory(memorySize, memorySize);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 0);
+
+  // An unreachable block, then a chain where each block references the
+  // block allocated before it
+  CodeBlock* garbage = allocateVmmCodeBlock(memory, 16);
+  ASSERT_NE(garbage, (void*)0);
+  fillBlock(memory, 512, 16, HALT_INSTRUCTION);
+
+  uint64_t previous = 0;
+  for (uint64_t i = 0; i < CHAIN_LENGTH; ++i) {
+    CodeBlock* cb = allocateVmmCodeBlock(memory, 16);
+    ASSERT_NE(cb, (void*)0);
+    cb->code[0] = PUSH_INSTRUCTION;
+    *(uint64_t*)(cb->code + 1) = previous;
+    for (int j = 9; j < 16; ++j) {
+      cb->code[j] = HALT_INSTRUCTION;
+    }
+    previous = vmmAddressForPtr(memory, cb->code);
+  }
+  ASSERT_TRUE(assertPushAddress(addressStack, previous));
+
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  // Only the unreachable block and the free block at the end are free
+  EXPECT_TRUE(verifyFreeBlockList(
+      memory, std::vector<uint64_t>{ 512, memorySize - 24 }
+  ));
+  EXPECT_EQ(vmmBytesFree(memory), 16 + 16);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+// Compact the heap, moving the reachable blocks to the start of the heap
+// in depth-first order from the roots
+TEST(vmmem_tests, collectAndCompactBlocks) {
+  VmMemory memory = createVmMemory(2048, 2048);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+
+  std::vector<BlockSpec> blockStructure{
+    BlockSpec(VmmCodeBlockType, 16),        // 512: Unreachable
+    BlockSpec(VmmCodeBlockType, 16),        // 536: Referenced by 592
+    BlockSpec(VmmFreeBlockType, 24),        // 560
+    BlockSpec(VmmCodeBlockType, 16),        // 592: On the address stack
+    BlockSpec(VmmStateBlockType, 40),       // 616: On the address stack
+    BlockSpec(VmmCodeBlockType, 16),        // 664: On the call stack
+    BlockSpec(VmmCodeBlockType, 16),        // 688: Unreachable
+    BlockSpec(VmmFreeBlockType, 2048 - 720),
+  };
+  layoutBlocks(memory, blockStructure);
+  for (int i : { 0, 1, 3, 5, 6 }) {
+    fillBlock(memory, blockStructure[i].address, blockStructure[i].blockSize,
+	      HALT_INSTRUCTION);
+  }
+
+  uint8_t* const code = ptrToVmmAddress(memory, 600);
+  code[0] = PUSH_INSTRUCTION;
+  *(uint64_t*)(code + 1) = 544;
+
+  // The saved state called 600 from 674 and has 544 on its address stack
+  const uint64_t stateBlockCallStack[] = { 600, 674 };
+  const uint64_t stateBlockAddressStack[] = { 544 };
+  writeStateBlock(ptrToVmmAddress(memory, 616), 1, stateBlockCallStack,
+		  1, stateBlockAddressStack);
+
+  const uint64_t callStackData[] = { 672, 100 };
+  const uint64_t addressStackData[] = { 600, 624 };
+  ASSERT_TRUE(pushOntoStack(callStack, callStackData, 2));
+  ASSERT_TRUE(pushOntoStack(addressStack, addressStackData, 2));
+  uint64_t pc = 677;
+
+  EXPECT_EQ(collectAndCompactVmmBlocks(memory, callStack, addressStack, &pc,
+				       handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  // The block on the call stack moves first, then the blocks on the
+  // address stack, each followed by the blocks it references
+  const std::vector<BlockSpec> trueHeapStructure{
+    BlockSpec(VmmCodeBlockType, 16, 512),
+    BlockSpec(VmmCodeBlockType, 16, 536),
+    BlockSpec(VmmCodeBlockType, 16, 560),
+    BlockSpec(VmmStateBlockType, 40, 584),
+    BlockSpec(VmmFreeBlockType, 2048 - 640, 632),
+  };
+  EXPECT_TRUE(verifyBlockStructure(memory, trueHeapStructure));
+  EXPECT_TRUE(verifyFreeBlockList(memory, std::vector<uint64_t>{ 632 }));
+  EXPECT_EQ(vmmBytesFree(memory), 2048 - 640);
+
+  const uint64_t trueCallStack[] = { 520, 100 };
+  const uint64_t trueAddressStack[] = { 544, 592 };
+  EXPECT_TRUE(verifyStack("call stack", callStack, trueCallStack, 2));
+  EXPECT_TRUE(verifyStack("address stack", addressStack, trueAddressStack,
+			  2));
+  EXPECT_EQ(pc, 525);
+
+  const uint8_t* const movedCode = ptrToVmmAddress(memory, 544);
+  EXPECT_EQ(movedCode[0], PUSH_INSTRUCTION);
+  EXPECT_EQ(*(const uint64_t*)(movedCode + 1), 568);
+
+  const VmStateBlock* const state =
+    (const VmStateBlock*)ptrToVmmAddress(memory, 584);
+  const uint64_t* const savedStacks = (const uint64_t*)state->stacks;
+  EXPECT_EQ(savedStacks[0], 544);
+  EXPECT_EQ(savedStacks[1], 522);
+  EXPECT_EQ(savedStacks[2], 568);
+
+  // Blocks on the heap get their marks cleared
+  for (HeapBlock* p = firstHeapBlockInVmm(memory); p;
+       p = nextHeapBlockInVmm(memory, p)) {
+    EXPECT_FALSE(vmmBlockIsMarked(memory, p));
+  }
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+// Mark a chain of blocks a slice at a time, allocating a block in the
+// middle of the collection
+TEST(vmmem_tests, collectIncrementally) {
+  static const uint64_t CHAIN_LENGTH = 1000;
+  const uint64_t memorySize = 512 + 24 * (CHAIN_LENGTH + 1) + 24;
+  VmMemory memory = createVmMemory(memorySize, memorySize);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 0);
+
+  CodeBlock* garbage = allocateVmmCodeBlock(memory, 16);
+  ASSERT_NE(garbage, (void*)0);
+  fillBlock(memory, 512, 16, HALT_INSTRUCTION);
+
+  uint64_t previous = 0;
+  for (uint64_t i = 0; i < CHAIN_LENGTH; ++i) {
+    CodeBlock* cb = allocateVmmCodeBlock(memory, 16);
+    ASSERT_NE(cb, (void*)0);
+    cb->code[0] = PUSH_INSTRUCTION;
+    *(uint64_t*)(cb->code + 1) = previous;
+    for (int j = 9; j < 16; ++j) {
+      cb->code[j] = HALT_INSTRUCTION;
+    }
+    previous = vmmAddressForPtr(memory, cb->code);
+  }
+  ASSERT_TRUE(assertPushAddress(addressStack, previous));
+
+  EXPECT_EQ(startIncrementalVmmCollection(memory, callStack, addressStack,
+					  handleCollectorError, &gcErrors), 0);
+  EXPECT_TRUE(vmmIncrementalCollectionInProgress(memory));
+  EXPECT_FALSE(vmmBlockIsMarked(
+      memory, (HeapBlock*)ptrToVmmAddress(memory, previous - 8)
+  ));
+
+  // A slice with no time budget still marks a few hundred blocks
+  EXPECT_EQ(continueIncrementalVmmCollection(memory, 0, handleCollectorError,
+					     &gcErrors), 0);
+  EXPECT_TRUE(vmmIncrementalCollectionInProgress(memory));
+  EXPECT_TRUE(vmmBlockIsMarked(
+      memory, (HeapBlock*)ptrToVmmAddress(memory, previous - 8)
+  ));
+
+  // Blocks allocated during the collection survive it
+  CodeBlock* newBlock = allocateVmmCodeBlock(memory, 16);
+  ASSERT_NE(newBlock, (void*)0);
+  const uint64_t newBlockAddress = vmmAddressForPtr(memory,
+						    (uint8_t*)newBlock);
+  fillBlock(memory, newBlockAddress, 16, HALT_INSTRUCTION);
+  EXPECT_TRUE(vmmBlockIsMarked(memory, (HeapBlock*)newBlock));
+
+  int numSlices = 1;
+  while (vmmIncrementalCollectionInProgress(memory) && (numSlices < 100)) {
+    EXPECT_EQ(continueIncrementalVmmCollection(memory, 0,
+					       handleCollectorError,
+					       &gcErrors), 0);
+    ++numSlices;
+  }
+  EXPECT_FALSE(vmmIncrementalCollectionInProgress(memory));
+  EXPECT_GT(numSlices, 2);
+  EXPECT_EQ(gcErrors.size(), 0);
+
+  EXPECT_TRUE(verifyFreeBlockList(memory, std::vector<uint64_t>{ 512 }));
+  EXPECT_EQ(vmmBytesFree(memory), 16);
+  EXPECT_EQ(getVmmBlockType((HeapBlock*)ptrToVmmAddress(memory,
+							 newBlockAddress)),
+	    VmmCodeBlockType);
+  for (HeapBlock* p = firstHeapBlockInVmm(memory); p;
+       p = nextHeapBlockInVmm(memory, p)) {
+    EXPECT_FALSE(vmmBlockIsMarked(memory, p));
+  }
+
+  // A full collection abandons the incremental collection in progress
+  // and collects the block allocated during the last one
+  EXPECT_EQ(startIncrementalVmmCollection(memory, callStack, addressStack,
+					  handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_FALSE(vmmIncrementalCollectionInProgress(memory));
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(getVmmBlockType((HeapBlock*)ptrToVmmAddress(memory,
+							 newBlockAddress)),
+	    VmmFreeBlockType);
+  EXPECT_EQ(vmmBytesFree(memory), 16 + 16);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+namespace {
+  // Allocate a chain of code blocks where each block pushes the address of
+  // the block before it, with an unreachable block after every two blocks
+  // in the chain.  Every other block comes from a slab.  Returns the
+  // address of the last block in the chain, or 0 if the memory is full.
+  uint64_t buildChainWithGarbage(VmMemory memory, uint64_t length) {
+    uint64_t previous = 0;
+    for (uint64_t i = 0; i < length; ++i) {
+      const uint64_t size = (i % 2) ? 16 : 24;
+      CodeBlock* cb = (i % 2) ? allocateVmmCodeBlockFromSlab(memory, size)
+	                      : allocateVmmCodeBlock(memory, size);
+      if (!cb) {
+	return 0;
+      }
+      cb->code[0] = PUSH_INSTRUCTION;
+      *(uint64_t*)(cb->code + 1) = previous;
+      for (uint64_t j = 9; j < size; ++j) {
+	cb->code[j] = HALT_INSTRUCTION;
+      }
+      if (i % 3) {
+	previous = vmmAddressForPtr(memory, cb->code);
+      }
+    }
+    return previous;
+  }
+}
+
+// Collect a heap with four threads and check it ends up the same as it
+// does when one thread collects it
+TEST(vmmem_tests, collectBlocksInParallel) {
+  static const uint64_t MEMORY_SIZE = 8 * 1024 * 1024;
+  static const uint64_t CHAIN_LENGTH = 150000;
+  VmMemory memory = createVmMemory(MEMORY_SIZE, MEMORY_SIZE);
+  VmMemory trueMemory = createVmMemory(MEMORY_SIZE, MEMORY_SIZE);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_NE(trueMemory, (void*)0);
+  for (VmMemory m : { memory, trueMemory }) {
+    ASSERT_EQ(reserveVmMemoryForProgram(m, 512), 0);
+    setVmmNurserySize(m, 0);
+  }
+
+  const uint64_t head = buildChainWithGarbage(memory, CHAIN_LENGTH);
+  ASSERT_NE(head, 0);
+  ASSERT_EQ(buildChainWithGarbage(trueMemory, CHAIN_LENGTH), head);
+  ASSERT_TRUE(assertPushAddress(addressStack, head));
+
+  EXPECT_EQ(vmmGcThreads(memory), 1);
+  setVmmGcThreads(memory, 4);
+  EXPECT_EQ(vmmGcThreads(memory), 4);
+
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(collectUnreachableVmmBlocks(trueMemory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_GT(vmmBytesFree(memory), 0);
+  EXPECT_EQ(vmmBytesFree(memory), vmmBytesFree(trueMemory));
+
+  // Same blocks in the same places, none of them marked
+  HeapBlock* p = firstHeapBlockInVmm(memory);
+  HeapBlock* q = firstHeapBlockInVmm(trueMemory);
+  uint64_t numBlocks = 0;
+  while (p && q) {
+    const uint64_t address = vmmAddressForPtr(memory, (uint8_t*)p);
+    ASSERT_EQ(address, vmmAddressForPtr(trueMemory, (uint8_t*)q));
+    ASSERT_EQ(p->typeAndSize, q->typeAndSize) << "at address " << address;
+    ASSERT_FALSE(vmmBlockIsMarked(memory, p)) << "at address " << address;
+    p = nextHeapBlockInVmm(memory, p);
+    q = nextHeapBlockInVmm(trueMemory, q);
+    ++numBlocks;
+  }
+  EXPECT_EQ(p, (void*)0);
+  EXPECT_EQ(q, (void*)0);
+  EXPECT_GT(numBlocks, 1000);
+
+  // Same free blocks in the same order
+  FreeBlock* f = firstFreeBlockInVmm(memory);
+  FreeBlock* g = firstFreeBlockInVmm(trueMemory);
+  while (f && g) {
+    ASSERT_EQ(vmmAddressForPtr(memory, (uint8_t*)f),
+	      vmmAddressForPtr(trueMemory, (uint8_t*)g));
+    f = nextFreeBlockInVmm(memory, f);
+    g = nextFreeBlockInVmm(trueMemory, g);
+  }
+  EXPECT_EQ(f, (void*)0);
+  EXPECT_EQ(g, (void*)0);
+
+  // Same free cells in the same order
+  for (int i = 0; i < 1000; ++i) {
+    CodeBlock* cb = allocateVmmCodeBlockFromSlab(memory, 16);
+    CodeBlock* trueCb = allocateVmmCodeBlockFromSlab(trueMemory, 16);
+    ASSERT_NE(cb, (void*)0);
+    ASSERT_NE(trueCb, (void*)0);
+    ASSERT_EQ(vmmAddressForPtr(memory, (uint8_t*)cb),
+	      vmmAddressForPtr(trueMemory, (uint8_t*)trueCb));
+  }
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(trueMemory);
+  destroyVmMemory(memory);
+}
+
+// Mark a heap with a background thread while allocating blocks and
+// growing the memory
+TEST(vmmem_tests, collectConcurrently) {
+  static const uint64_t MEMORY_SIZE = 1024 * 1024;
+  static const uint64_t CHAIN_LENGTH = 20000;
+  static const uint64_t NUM_NEW_BLOCKS = 100;
+  VmMemory memory = createVmMemory(MEMORY_SIZE, 2 * MEMORY_SIZE);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 128, 8 * 128);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 0);
+
+  const uint64_t head = buildChainWithGarbage(memory, CHAIN_LENGTH);
+  ASSERT_NE(head, 0);
+  ASSERT_TRUE(assertPushAddress(addressStack, head));
+  const uint64_t bytesFreeBefore = vmmBytesFree(memory);
+
+  EXPECT_EQ(startConcurrentVmmCollection(memory, callStack, addressStack,
+					 handleCollectorError, &gcErrors), 0);
+  EXPECT_TRUE(vmmIncrementalCollectionInProgress(memory));
+
+  // Blocks allocated while the thread marks the heap are marked already
+  std::vector<uint64_t> newBlocks;
+  for (uint64_t i = 0; i < NUM_NEW_BLOCKS; ++i) {
+    CodeBlock* cb = allocateVmmCodeBlock(memory, 16);
+    ASSERT_NE(cb, (void*)0);
+    EXPECT_TRUE(vmmBlockIsMarked(memory, (HeapBlock*)cb));
+    const uint64_t address = vmmAddressForPtr(memory, (uint8_t*)cb);
+    fillBlock(memory, address, 16, HALT_INSTRUCTION);
+    newBlocks.push_back(address + sizeof(HeapBlock));
+  }
+
+  // The thread keeps marking after the memory grows
+  EXPECT_EQ(increaseVmmSize(memory), 0);
+  EXPECT_EQ(currentVmmSize(memory), 2 * MEMORY_SIZE);
+
+  const auto deadline =
+    std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!vmmGcSafepointRequested(memory)
+	   && (std::chrono::steady_clock::now() < deadline)) {
+    std::this_thread::yield();
+  }
+  EXPECT_TRUE(vmmGcSafepointRequested(memory));
+
+  EXPECT_EQ(finishIncrementalVmmCollection(memory, handleCollectorError,
+					   &gcErrors), 0);
+  EXPECT_FALSE(vmmIncrementalCollectionInProgress(memory));
+  EXPECT_FALSE(vmmGcSafepointRequested(memory));
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_GT(vmmBytesFree(memory), bytesFreeBefore + MEMORY_SIZE);
+
+  for (uint64_t address : newBlocks) {
+    EXPECT_EQ(getVmmBlockType((HeapBlock*)ptrToVmmAddress(
+		  memory, address - sizeof(HeapBlock))),
+	      VmmCodeBlockType);
+  }
+  for (HeapBlock* p = firstHeapBlockInVmm(memory); p;
+       p = nextHeapBlockInVmm(memory, p)) {
+    ASSERT_FALSE(vmmBlockIsMarked(memory, p));
+  }
+
+  // A full collection finds nothing else to free once the blocks
+  // allocated during the collection are reachable too
+  for (uint64_t address : newBlocks) {
+    ASSERT_TRUE(assertPushAddress(addressStack, address));
+  }
+  const uint64_t bytesFreeAfter = vmmBytesFree(memory);
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(vmmBytesFree(memory), bytesFreeAfter);
+
+  // Destroying the memory stops a collection in progress
+  EXPECT_EQ(startConcurrentVmmCollection(memory, callStack, addressStack,
+					 handleCollectorError, &gcErrors), 0);
+  EXPECT_TRUE(vmmIncrementalCollectionInProgress(memory));
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
+TEST(vmmem_tests, sweepLazily) {
+  static const uint64_t MEMORY_SIZE = 1024 * 1024;
+  static const uint64_t CHAIN_LENGTH = 20000;
+  VmMemory memory = createVmMemory(MEMORY_SIZE, MEMORY_SIZE);
+  Stack callStack = createStack(8 * 16, 8 * 16);
+  Stack addressStack = createStack(8 * 8, 8 * 8);
+  std::vector<std::string> gcErrors;
+
+  ASSERT_NE(memory, (void*)0);
+  ASSERT_EQ(reserveVmMemoryForProgram(memory, 512), 0);
+  setVmmNurserySize(memory, 0);
+  EXPECT_FALSE(vmmLazySweepEnabled(memory));
+  setVmmLazySweep(memory, 1);
+  EXPECT_TRUE(vmmLazySweepEnabled(memory));
+
+  const uint64_t head = buildChainWithGarbage(memory, CHAIN_LENGTH);
+  ASSERT_NE(head, 0);
+  ASSERT_TRUE(assertPushAddress(addressStack, head));
+
+  // The collection only marks the heap and leaves the sweep to the
+  // allocator
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(vmmBytesFree(memory), 0);
+  const uint64_t bytesUnswept = vmmBytesUnswept(memory);
+  EXPECT_EQ(bytesUnswept, vmmHeapSize(memory));
+
+  // Allocating sweeps only as much of the heap as it needs to
+  CodeBlock* cb = allocateVmmCodeBlock(memory, 16);
+  ASSERT_NE(cb, (void*)0);
+  const uint64_t address = vmmAddressForPtr(memory, (uint8_t*)cb);
+  fillBlock(memory, address, 16, HALT_INSTRUCTION);
+  EXPECT_GT(vmmBytesFree(memory), 0);
+  EXPECT_GT(vmmBytesUnswept(memory), 0);
+  EXPECT_LT(vmmBytesUnswept(memory), bytesUnswept);
+
+  finishVmmSweep(memory);
+  EXPECT_EQ(vmmBytesUnswept(memory), 0);
+  for (HeapBlock* p = firstHeapBlockInVmm(memory); p;
+       p = nextHeapBlockInVmm(memory, p)) {
+    ASSERT_FALSE(vmmBlockIsMarked(memory, p));
+  }
+
+  // An eager collection finds nothing else to free
+  ASSERT_TRUE(assertPushAddress(addressStack, address + sizeof(HeapBlock)));
+  setVmmLazySweep(memory, 0);
+  const uint64_t bytesFreeAfter = vmmBytesFree(memory);
+  EXPECT_EQ(collectUnreachableVmmBlocks(memory, callStack, addressStack,
+					handleCollectorError, &gcErrors), 0);
+  EXPECT_EQ(gcErrors.size(), 0);
+  EXPECT_EQ(vmmBytesFree(memory), bytesFreeAfter);
+  EXPECT_EQ(vmmBytesUnswept(memory), 0);
+
+  destroyStack(callStack);
+  destroyStack(addressStack);
+  destroyVmMemory(memory);
+}
+
 // TODO: Test early-stopping in forEachVmmBlock and forEachFreeBlockInVmm
 //       by returning a non-NULL value from f.